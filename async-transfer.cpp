@@ -0,0 +1,252 @@
+#include "async-transfer.h"
+#include "latency.h"
+#include "logger.h"
+
+static void LIBUSB_CALL async_in_complete(struct libusb_transfer *transfer) {
+	struct async_in_stream *stream = (struct async_in_stream *)transfer->user_data;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		if (logger_on(3))
+			logger_record(LOGGER_RECEIVED_DEVICE, stream->endpoint, transfer->actual_length,
+				NULL, 0);
+		stream->handler(stream->user_data, transfer->buffer, transfer->actual_length);
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		stream->in_flight--;
+		return;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		stream->error = LIBUSB_ERROR_NO_DEVICE;
+		stream->in_flight--;
+		return;
+	case LIBUSB_TRANSFER_STALL:
+		// A halted endpoint fails every transfer until the halt is cleared,
+		// which the owner does once it stopped the stream: a synchronous
+		// control transfer cannot complete from within event handling.
+		if (verbose_level)
+			printf("EP%02x: stalled\n", stream->endpoint);
+		stream->error = LIBUSB_ERROR_PIPE;
+		stream->in_flight--;
+		return;
+	default:
+		// Resubmitting would most likely fail the same way right away.
+		fprintf(stderr, "Transfer error receiving on EP%02x: status %d\n",
+				stream->endpoint, transfer->status);
+		stream->error = transfer->status == LIBUSB_TRANSFER_OVERFLOW ?
+				LIBUSB_ERROR_OVERFLOW : LIBUSB_ERROR_IO;
+		stream->in_flight--;
+		return;
+	}
+
+	if (stream->stopping) {
+		stream->in_flight--;
+		return;
+	}
+
+	int result = libusb_submit_transfer(transfer);
+	if (result != LIBUSB_SUCCESS) {
+		fprintf(stderr, "Error resubmitting transfer on EP%02x: %s\n",
+				stream->endpoint, libusb_strerror((libusb_error)result));
+		stream->error = result;
+		stream->in_flight--;
+	}
+}
+
+int async_in_start(struct async_in_stream *stream) {
+	stream->transfers = new struct libusb_transfer *[stream->n_transfers]();
+	stream->buffers = new unsigned char[stream->n_transfers * stream->max_packet_size];
+	stream->in_flight = 0;
+	stream->stopping = false;
+	stream->error = LIBUSB_SUCCESS;
+
+	for (int i = 0; i < stream->n_transfers; i++) {
+		struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+		if (!transfer) {
+			stream->error = LIBUSB_ERROR_NO_MEM;
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		unsigned char *buffer = &stream->buffers[i * stream->max_packet_size];
+		stream->transfers[i] = transfer;
+
+		if ((stream->attributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_BULK)
+			libusb_fill_bulk_transfer(transfer, stream->dev_handle, stream->endpoint,
+				buffer, stream->max_packet_size, async_in_complete, stream, 0);
+		else
+			libusb_fill_interrupt_transfer(transfer, stream->dev_handle, stream->endpoint,
+				buffer, stream->max_packet_size, async_in_complete, stream, 0);
+
+		int result = libusb_submit_transfer(transfer);
+		if (result != LIBUSB_SUCCESS) {
+			fprintf(stderr, "Error submitting transfer on EP%02x: %s\n",
+					stream->endpoint, libusb_strerror((libusb_error)result));
+			stream->error = result;
+			return result;
+		}
+		stream->in_flight++;
+	}
+
+	if (verbose_level)
+		printf("EP%02x: %d transfers in flight\n", stream->endpoint, stream->n_transfers);
+	return LIBUSB_SUCCESS;
+}
+
+void async_in_stop(struct async_in_stream *stream, libusb_context *ctx) {
+	if (!stream->transfers)
+		return;
+
+	stream->stopping = true;
+	for (int i = 0; i < stream->n_transfers; i++) {
+		if (stream->transfers[i])
+			libusb_cancel_transfer(stream->transfers[i]);
+	}
+
+	// Cancellation completes asynchronously, so keep handling events until
+	// every transfer has called back.
+	while (stream->in_flight > 0) {
+		struct timeval tv = { .tv_sec = 0, .tv_usec = 100 * 1000 };
+		libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+	}
+
+	for (int i = 0; i < stream->n_transfers; i++) {
+		if (stream->transfers[i])
+			libusb_free_transfer(stream->transfers[i]);
+	}
+	delete[] stream->transfers;
+	delete[] stream->buffers;
+	stream->transfers = NULL;
+	stream->buffers = NULL;
+}
+
+int async_in_clear_halt(struct async_in_stream *stream) {
+	if (stream->error != LIBUSB_ERROR_PIPE)
+		return LIBUSB_SUCCESS;
+
+	int result = libusb_clear_halt(stream->dev_handle, stream->endpoint);
+	if (result != LIBUSB_SUCCESS)
+		fprintf(stderr, "Error clearing halt on EP%02x: %s\n",
+				stream->endpoint, libusb_strerror((libusb_error)result));
+	else if (verbose_level)
+		printf("EP%02x: halt cleared\n", stream->endpoint);
+	return result;
+}
+
+static void LIBUSB_CALL async_out_complete(struct libusb_transfer *transfer) {
+	struct async_out_stream *stream = (struct async_out_stream *)transfer->user_data;
+
+	int i = 0;
+	while (stream->transfers[i] != transfer)
+		i++;
+	stream->completed_ns[i] = latency_now();
+	stream->status[i] = transfer->status;
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED && logger_on(3))
+		logger_record(LOGGER_SENT_DEVICE, stream->endpoint, transfer->actual_length, NULL, 0);
+	stream->state[i].store(ASYNC_OUT_DONE, std::memory_order_release);
+	stream->completed = 1;
+	stream->handler(stream->user_data);
+	// Last, async_out_stop() may return as soon as this drops to 0.
+	stream->in_flight--;
+}
+
+int async_out_start(struct async_out_stream *stream) {
+	stream->buffers = new unsigned char[stream->n_transfers * stream->max_packet_size];
+	stream->in_flight = 0;
+	stream->completed = 0;
+
+	for (int i = 0; i < ASYNC_OUT_MAX_TRANSFERS; i++) {
+		stream->state[i] = ASYNC_OUT_IDLE;
+		stream->transfers[i] = NULL;
+	}
+
+	for (int i = 0; i < stream->n_transfers; i++) {
+		stream->transfers[i] = libusb_alloc_transfer(0);
+		if (!stream->transfers[i])
+			return LIBUSB_ERROR_NO_MEM;
+		unsigned char *buffer = &stream->buffers[i * stream->max_packet_size];
+
+		if ((stream->attributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_BULK)
+			libusb_fill_bulk_transfer(stream->transfers[i], stream->dev_handle,
+				stream->endpoint, buffer, 0, async_out_complete, stream, 0);
+		else
+			libusb_fill_interrupt_transfer(stream->transfers[i], stream->dev_handle,
+				stream->endpoint, buffer, 0, async_out_complete, stream, 0);
+	}
+
+	if (verbose_level)
+		printf("EP%02x: up to %d transfers in flight\n", stream->endpoint, stream->n_transfers);
+	return LIBUSB_SUCCESS;
+}
+
+void async_out_stop(struct async_out_stream *stream, libusb_context *ctx) {
+	if (!stream->buffers)
+		return;
+
+	for (int i = 0; i < stream->n_transfers; i++) {
+		if (stream->transfers[i] && stream->state[i] == ASYNC_OUT_BUSY)
+			libusb_cancel_transfer(stream->transfers[i]);
+	}
+	while (stream->in_flight > 0) {
+		struct timeval tv = { .tv_sec = 0, .tv_usec = 100 * 1000 };
+		libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+	}
+
+	for (int i = 0; i < stream->n_transfers; i++) {
+		if (stream->transfers[i])
+			libusb_free_transfer(stream->transfers[i]);
+		stream->transfers[i] = NULL;
+	}
+	delete[] stream->buffers;
+	stream->buffers = NULL;
+}
+
+int async_out_submit(struct async_out_stream *stream, const uint8_t *data, int length) {
+	int i = 0;
+	while (i < stream->n_transfers && stream->state[i] != ASYNC_OUT_IDLE)
+		i++;
+	if (i == stream->n_transfers)
+		return LIBUSB_ERROR_BUSY;
+	if (length > stream->max_packet_size)
+		return LIBUSB_ERROR_OVERFLOW;
+
+	struct libusb_transfer *transfer = stream->transfers[i];
+	memcpy(transfer->buffer, data, length);
+	transfer->length = length;
+	stream->state[i] = ASYNC_OUT_BUSY;
+	stream->in_flight++;
+	int result = libusb_submit_transfer(transfer);
+	if (result != LIBUSB_SUCCESS) {
+		stream->in_flight--;
+		stream->state[i] = ASYNC_OUT_IDLE;
+		return result;
+	}
+	return i;
+}
+
+int async_out_reap(struct async_out_stream *stream, int *status, uint64_t *completed_ns) {
+	for (int i = 0; i < stream->n_transfers; i++) {
+		if (stream->state[i].load(std::memory_order_acquire) == ASYNC_OUT_DONE) {
+			*status = stream->status[i];
+			*completed_ns = stream->completed_ns[i];
+			stream->state[i] = ASYNC_OUT_IDLE;
+			return i;
+		}
+	}
+	return -1;
+}
+
+bool async_out_available(struct async_out_stream *stream) {
+	for (int i = 0; i < stream->n_transfers; i++) {
+		if (stream->state[i].load(std::memory_order_acquire) != ASYNC_OUT_BUSY)
+			return true;
+	}
+	return false;
+}
+
+void async_out_wait(struct async_out_stream *stream, libusb_context *ctx, int timeout_ms) {
+	stream->completed = 0;
+	if (async_out_available(stream))
+		return;
+	struct timeval tv = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+	libusb_handle_events_timeout_completed(ctx, &tv, &stream->completed);
+}
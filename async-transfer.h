@@ -0,0 +1,93 @@
+#ifndef ASYNC_TRANSFER_H
+#define ASYNC_TRANSFER_H
+#include <atomic>
+#include <libusb-1.0/libusb.h>
+
+#include "misc.h"
+
+/*
+ * Keeps n_transfers interrupt/bulk IN transfers queued on one endpoint so
+ * that the host controller always has a URB to complete when the device is
+ * polled. Each completed transfer is handed to handler() and resubmitted
+ * right away from the libusb event handling thread. Any failure, a stall
+ * included, drops the transfer and leaves its libusb_error in error for the
+ * owner to stop the stream and, after ASYNC_IN_RETRY_MS, to start it again.
+ */
+
+#define ASYNC_IN_RETRY_MS	10
+
+typedef void (*async_in_handler)(void *user_data, const uint8_t *data, int length);
+
+struct async_in_stream {
+	libusb_device_handle	*dev_handle;
+	uint8_t			endpoint;
+	uint8_t			attributes;
+	uint16_t		max_packet_size;
+	int			n_transfers;
+	async_in_handler	handler;
+	void			*user_data;
+	int			source;		// for the metrics: 0 the wheel, 1 + n trim n
+
+	struct libusb_transfer	**transfers;
+	unsigned char		*buffers;
+	std::atomic<int>	in_flight;
+	volatile bool		stopping;
+	volatile int		error;
+};
+
+int async_in_start(struct async_in_stream *stream);
+void async_in_stop(struct async_in_stream *stream, libusb_context *ctx);
+// Clear the halt of a stream that stopped on a stall (LIBUSB_ERROR_PIPE),
+// once it is stopped. Not from a transfer callback: the control transfer
+// waits for events that cannot be handled from within event handling.
+int async_in_clear_halt(struct async_in_stream *stream);
+
+/*
+ * Keeps up to n_transfers interrupt/bulk OUT transfers in flight on one
+ * endpoint. One thread submits and reaps them; they complete on whichever
+ * thread handles the events of the context, which only marks them done and
+ * calls handler() so that the submitting thread can be woken.
+ */
+
+#define ASYNC_OUT_MAX_TRANSFERS	8
+
+enum async_out_state {
+	ASYNC_OUT_IDLE,
+	ASYNC_OUT_BUSY,
+	ASYNC_OUT_DONE,
+};
+
+typedef void (*async_out_handler)(void *user_data);
+
+struct async_out_stream {
+	libusb_device_handle	*dev_handle;
+	uint8_t			endpoint;
+	uint8_t			attributes;
+	uint16_t		max_packet_size;
+	int			n_transfers;
+	async_out_handler	handler;
+	void			*user_data;
+
+	struct libusb_transfer	*transfers[ASYNC_OUT_MAX_TRANSFERS];
+	unsigned char		*buffers;
+	std::atomic<int>	state[ASYNC_OUT_MAX_TRANSFERS];
+	int			status[ASYNC_OUT_MAX_TRANSFERS];
+	uint64_t		completed_ns[ASYNC_OUT_MAX_TRANSFERS];
+	std::atomic<int>	in_flight;
+	int			completed;	// set by each completion, see async_out_wait()
+};
+
+int async_out_start(struct async_out_stream *stream);
+void async_out_stop(struct async_out_stream *stream, libusb_context *ctx);
+// Copy data into an idle transfer and submit it. Returns the index of the
+// transfer, LIBUSB_ERROR_BUSY if none is idle or another libusb error.
+int async_out_submit(struct async_out_stream *stream, const uint8_t *data, int length);
+// Make a completed transfer idle again. Returns its index with its
+// libusb_transfer_status and completion time (CLOCK_MONOTONIC) in status
+// and completed_ns, or -1 if none has completed.
+int async_out_reap(struct async_out_stream *stream, int *status, uint64_t *completed_ns);
+// Whether a transfer is idle or can be reaped.
+bool async_out_available(struct async_out_stream *stream);
+// Handle the events of ctx until a transfer completes or timeout_ms passed.
+void async_out_wait(struct async_out_stream *stream, libusb_context *ctx, int timeout_ms);
+#endif
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backpressure.h"
+
+static bool configured[256];
+static struct backpressure_config configs[256];
+static struct backpressure_counters counters[256];
+
+static const char *policy_names[] = { "latest", "age", "lossless" };
+
+int backpressure_parse(const char *spec) {
+	char buffer[256];
+	if (strlen(spec) >= sizeof(buffer)) {
+		fprintf(stderr, "Backpressure policies too long: %s\n", spec);
+		return -1;
+	}
+	strcpy(buffer, spec);
+
+	char *saveptr;
+	for (char *item = strtok_r(buffer, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+		char *end;
+		unsigned long endpoint = strtoul(item, &end, 16);
+		if (end == item || *end != '=' || endpoint > 0xff)
+			goto invalid;
+
+		char *name = end + 1;
+		char *age = strchr(name, ':');
+		if (age)
+			*age++ = '\0';
+
+		struct backpressure_config config;
+		config.max_age_us = BACKPRESSURE_DEFAULT_AGE_US;
+		int policy = -1;
+		for (int i = 0; i < (int)(sizeof(policy_names) / sizeof(policy_names[0])); i++) {
+			if (!strcmp(policy_names[i], name))
+				policy = i;
+		}
+		if (policy < 0 || (age && policy != BACKPRESSURE_AGE))
+			goto invalid;
+		config.policy = (enum backpressure_policy)policy;
+		if (age) {
+			config.max_age_us = strtoul(age, &end, 10);
+			if (end == age || *end || config.max_age_us == 0)
+				goto invalid;
+		}
+
+		configs[endpoint] = config;
+		configured[endpoint] = true;
+	}
+	return 0;
+
+invalid:
+	fprintf(stderr, "Invalid backpressure policies: %s\n", spec);
+	return -1;
+}
+
+struct backpressure_config backpressure_config_for(const struct usb_endpoint_descriptor *ep) {
+	if (configured[ep->bEndpointAddress])
+		return configs[ep->bEndpointAddress];
+
+	struct backpressure_config config;
+	config.max_age_us = BACKPRESSURE_DEFAULT_AGE_US;
+	if (usb_endpoint_type(ep) == USB_ENDPOINT_XFER_INT && usb_endpoint_dir_in(ep))
+		config.policy = BACKPRESSURE_LATEST;
+	else
+		config.policy = BACKPRESSURE_LOSSLESS;
+	return config;
+}
+
+struct backpressure_counters *backpressure_counters_for(uint8_t endpoint) {
+	return &counters[endpoint];
+}
+
+struct ep_flow *ep_flow_create(const struct usb_endpoint_descriptor *ep, size_t capacity,
+			bool mixed) {
+	struct ep_flow *flow = new struct ep_flow;
+	flow->config = backpressure_config_for(ep);
+	flow->counters = backpressure_counters_for(ep->bEndpointAddress);
+	flow->mailbox = NULL;
+	if (flow->config.policy == BACKPRESSURE_LATEST && !mixed)
+		flow->mailbox = mailbox_create(capacity);
+	flow->doorbell.store(false, std::memory_order_relaxed);
+	return flow;
+}
+
+void ep_flow_destroy(struct ep_flow *flow) {
+	if (flow->mailbox)
+		mailbox_destroy(flow->mailbox);
+	delete flow;
+}
+
+bool ep_flow_ring(struct ep_flow *flow, struct packet_queue *queue,
+			const struct usb_raw_ep_io *io, const struct packet_stamp *stamp) {
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (flow->doorbell.exchange(true, std::memory_order_seq_cst)) {
+		flow->counters->superseded.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+	if (packet_queue_push(queue, io, stamp))
+		return true;
+	flow->doorbell.store(false, std::memory_order_relaxed);
+	flow->counters->overflow.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+void backpressure_print() {
+	for (int endpoint = 0; endpoint < 256; endpoint++) {
+		struct backpressure_counters *c = &counters[endpoint];
+		uint64_t superseded = c->superseded.load(std::memory_order_relaxed);
+		uint64_t expired = c->expired.load(std::memory_order_relaxed);
+		uint64_t overflow = c->overflow.load(std::memory_order_relaxed);
+		if (superseded || expired || overflow)
+			printf("EP%02x: superseded %llu, expired %llu, overflow %llu\n", endpoint,
+				(unsigned long long)superseded, (unsigned long long)expired,
+				(unsigned long long)overflow);
+	}
+}
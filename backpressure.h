@@ -0,0 +1,86 @@
+#ifndef BACKPRESSURE_H
+#define BACKPRESSURE_H
+#include <atomic>
+#include <stdint.h>
+#include <linux/usb/ch9.h>
+
+#include "mailbox.h"
+#include "packet-queue.h"
+
+/*
+ * What an endpoint does when its writer falls behind.
+ *
+ *  - latest:   only the newest transfer matters (HID input state). A new
+ *              transfer overwrites the pending one and the writer is woken
+ *              by a single queued doorbell. The wheel IN endpoint always
+ *              works this way for its mixed report, the mixer being the
+ *              mailbox; other endpoints get a mailbox of their own.
+ *  - age:      transfers are queued, but the writer drops those that were
+ *              received more than max_age_us ago.
+ *  - lossless: transfers are queued and never dropped; the reader waits for
+ *              room in the queue before it reads the next one.
+ *
+ * Readers never wait while holding a transfer, except a lossless reader
+ * sharing its queue (the wheel IN endpoint) and finding it full.
+ *
+ * By default interrupt IN endpoints are latest, everything else lossless;
+ * --backpressure overrides this per endpoint address, e.g.
+ * "81=latest,01=age:20000,02=lossless".
+ */
+
+enum backpressure_policy {
+	BACKPRESSURE_LATEST,
+	BACKPRESSURE_AGE,
+	BACKPRESSURE_LOSSLESS,
+};
+
+struct backpressure_config {
+	enum backpressure_policy	policy;
+	uint32_t			max_age_us;
+};
+
+#define BACKPRESSURE_DEFAULT_AGE_US	20000
+
+struct backpressure_counters {
+	std::atomic<uint64_t>	superseded;	// overwritten before being written
+	std::atomic<uint64_t>	expired;	// too old when dequeued
+	std::atomic<uint64_t>	overflow;	// queue full, not enqueued
+};
+
+// Shared by the reader(s) and the writer of an endpoint.
+struct ep_flow {
+	struct backpressure_config	config;
+	struct backpressure_counters	*counters;
+	struct mailbox			*mailbox;	// latest, except on the mixed wheel IN
+	alignas(64) std::atomic<bool>	doorbell;	// a wake-up is queued for the writer
+};
+
+int backpressure_parse(const char *spec);
+struct backpressure_config backpressure_config_for(const struct usb_endpoint_descriptor *ep);
+struct backpressure_counters *backpressure_counters_for(uint8_t endpoint);
+
+// mixed: the endpoint carries the mixer report, which is its own mailbox.
+struct ep_flow *ep_flow_create(const struct usb_endpoint_descriptor *ep, size_t capacity,
+			bool mixed);
+void ep_flow_destroy(struct ep_flow *flow);
+
+// Queue io as the doorbell of a latest endpoint unless one is pending.
+// Returns false if the queue was full.
+bool ep_flow_ring(struct ep_flow *flow, struct packet_queue *queue,
+			const struct usb_raw_ep_io *io, const struct packet_stamp *stamp);
+
+// Called by the writer before it reads the latest state, so that anything
+// published afterwards rings again.
+static inline void ep_flow_answer(struct ep_flow *flow) {
+	flow->doorbell.exchange(false, std::memory_order_seq_cst);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+static inline bool ep_flow_expired(const struct ep_flow *flow, const struct packet_stamp *stamp,
+			uint64_t now_ns) {
+	return flow->config.policy == BACKPRESSURE_AGE && stamp->received_ns &&
+		now_ns - stamp->received_ns > flow->config.max_age_us * 1000ull;
+}
+
+void backpressure_print();
+#endif
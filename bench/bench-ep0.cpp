@@ -0,0 +1,313 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../host-raw-gadget.h"
+#include "../device-libusb.h"
+#include "../proxy.h"
+#include "../mixer.h"
+#include "../mix-rules.h"
+#include "../hid-report.h"
+#include "../snapshot.h"
+#include "replay.h"
+#include "bench.h"
+
+/*
+ * Enumeration time and ep0 latency of ep0_loop(), with every control
+ * request forwarded to the wheel (--proxy_ep0, as before the local
+ * responder) and with the responder answering from the control cache.
+ *
+ * The host side plays what Linux sends to a G29: the descriptor reads of an
+ * enumeration up to SET_CONFIGURATION, SET_IDLE and the HID report descriptor, then
+ * GET_REPORT and GET_STATUS requests. The wheel answers forwarded requests
+ * after WHEEL_CONTROL_US, about what a full-speed control read takes on the
+ * bus. Enumeration runs from the connect event until the report descriptor
+ * is answered, latencies from handing a request to ep0_loop() until it
+ * fetches the next event.
+ */
+
+#define WHEEL_CONTROL_US	1000
+#define STEADY_REQUESTS		200
+
+int verbose_level = 0;
+bool please_stop_ep0 = false;
+volatile bool please_stop_eps = false;
+bool bmaxpacketsize0_must_greater_than_64 = true;
+int async_transfers = 0;
+int ffb_transfers = 0;
+bool reactor_enabled = false;
+bool latency_enabled = false;
+bool local_ep0_enabled = true;
+bool scheduled_reports = false;
+bool injection_enabled = false;
+
+std::vector<InputDevice *> replay_trims;
+
+struct scripted_event {
+	uint32_t		type;
+	struct usb_ctrlrequest	ctrl;
+};
+
+static std::vector<struct scripted_event> script;
+static size_t next_event;
+static std::vector<uint64_t> handed_ns;
+static int forwarded;
+
+static const uint8_t device_desc[USB_DT_DEVICE_SIZE] = {
+	0x12, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x08,
+	0x6d, 0x04, 0x4f, 0xc2, 0x00, 0x01, 0x01, 0x02, 0x00, 0x01,
+};
+
+// One HID interface with an interrupt IN and OUT endpoint, as on a G29.
+static const uint8_t config_desc[41] = {
+	0x09, 0x02, 0x29, 0x00, 0x01, 0x01, 0x00, 0x80, 0x32,
+	0x09, 0x04, 0x00, 0x00, 0x02, 0x03, 0x00, 0x00, 0x00,
+	0x09, 0x21, 0x11, 0x01, 0x21, 0x01, 0x22, 0x89, 0x00,
+	0x07, 0x05, 0x81, 0x03, 0x40, 0x00, 0x0a,
+	0x07, 0x05, 0x01, 0x03, 0x40, 0x00, 0x0a,
+};
+
+#define REPORT_DESC_LENGTH	0x89
+
+static const uint8_t langids[4] = { 0x04, 0x03, 0x09, 0x04 };
+
+// ep0_loop() and the endpoint threads it spawns poll the replay until the
+// script resets the device.
+int replay_next(int source __attribute__((unused)), uint8_t endpoint __attribute__((unused)),
+		uint8_t *data __attribute__((unused)), int max_length __attribute__((unused))) {
+	usleep(1000);
+	return -1;
+}
+
+void replay_written(uint8_t endpoint __attribute__((unused)), const uint8_t *data __attribute__((unused)),
+		int length __attribute__((unused))) {
+}
+
+bool replay_event(struct usb_raw_control_event *event) {
+	handed_ns.push_back(bench_now_ns());
+	if (next_event == script.size()) {
+		event->inner.type = USB_RAW_EVENT_INVALID;
+		event->inner.length = 4294967295;	// ends ep0_loop()
+		return true;
+	}
+	const struct scripted_event *scripted = &script[next_event++];
+	event->inner.type = scripted->type;
+	event->inner.length = sizeof(event->ctrl);
+	event->ctrl = scripted->ctrl;
+	return true;
+}
+
+static int answer(const uint8_t *desc, int length, const struct usb_ctrlrequest *ctrl, uint8_t *data) {
+	length = std::min<int>(length, ctrl->wLength);
+	memcpy(data, desc, length);
+	return length;
+}
+
+static int string_desc(const char *string, const struct usb_ctrlrequest *ctrl, uint8_t *data) {
+	uint8_t desc[2 + 2 * 64];
+	int n = strlen(string);
+	desc[0] = 2 + 2 * n;
+	desc[1] = USB_DT_STRING;
+	for (int i = 0; i < n; i++) {
+		desc[2 + 2 * i] = string[i];
+		desc[3 + 2 * i] = 0;
+	}
+	return answer(desc, desc[0], ctrl, data);
+}
+
+int replay_control(const struct usb_ctrlrequest *ctrl, uint8_t *data) {
+	usleep(WHEEL_CONTROL_US);
+	forwarded++;
+
+	uint8_t type = ctrl->bRequestType & USB_TYPE_MASK;
+	if (type == USB_TYPE_CLASS && ctrl->bRequest == HID_REQ_GET_REPORT) {
+		memset(data, 0, 12);
+		data[0] = 0x08;
+		return std::min<int>(12, ctrl->wLength);
+	}
+	if (type != USB_TYPE_STANDARD)
+		return 0;
+
+	switch (ctrl->bRequest) {
+	case USB_REQ_GET_STATUS:
+		memset(data, 0, 2);
+		return 2;
+	case USB_REQ_GET_CONFIGURATION:
+		data[0] = 1;
+		return 1;
+	case USB_REQ_GET_DESCRIPTOR:
+		switch (ctrl->wValue >> 8) {
+		case USB_DT_DEVICE:
+			return answer(device_desc, sizeof(device_desc), ctrl, data);
+		case USB_DT_CONFIG:
+			return answer(config_desc, sizeof(config_desc), ctrl, data);
+		case USB_DT_STRING:
+			if ((ctrl->wValue & 0xff) == 0)
+				return answer(langids, sizeof(langids), ctrl, data);
+			return string_desc((ctrl->wValue & 0xff) == 1 ? "Logitech" :
+				"G29 Driving Force Racing Wheel", ctrl, data);
+		case HID_DT_REPORT: {
+			uint8_t report_desc[REPORT_DESC_LENGTH];
+			memset(report_desc, 0, sizeof(report_desc));
+			return answer(report_desc, sizeof(report_desc), ctrl, data);
+		}
+		}
+		return -1;	// the device qualifier of a full-speed device
+	}
+	return 0;
+}
+
+static void add(uint32_t type, uint8_t request_type, uint8_t request, uint16_t value,
+		uint16_t index, uint16_t length) {
+	struct scripted_event event;
+	memset(&event, 0, sizeof(event));
+	event.type = type;
+	event.ctrl.bRequestType = request_type;
+	event.ctrl.bRequest = request;
+	event.ctrl.wValue = value;
+	event.ctrl.wIndex = index;
+	event.ctrl.wLength = length;
+	script.push_back(event);
+}
+
+static void add_get_descriptor(uint8_t recipient, uint16_t value, uint16_t index, uint16_t length) {
+	add(USB_RAW_EVENT_CONTROL, USB_DIR_IN | USB_TYPE_STANDARD | recipient,
+		USB_REQ_GET_DESCRIPTOR, value, index, length);
+}
+
+// Returns the index of the event that completes the enumeration and that of
+// the first request after it.
+static void build_script(size_t *enumerated, size_t *first_report) {
+	add(USB_RAW_EVENT_CONNECT, 0, 0, 0, 0, 0);
+	add_get_descriptor(USB_RECIP_DEVICE, USB_DT_DEVICE << 8, 0, 64);
+	add_get_descriptor(USB_RECIP_DEVICE, USB_DT_DEVICE << 8, 0, USB_DT_DEVICE_SIZE);
+	add_get_descriptor(USB_RECIP_DEVICE, USB_DT_DEVICE_QUALIFIER << 8, 0, 10);
+	add_get_descriptor(USB_RECIP_DEVICE, USB_DT_CONFIG << 8, 0, USB_DT_CONFIG_SIZE);
+	add_get_descriptor(USB_RECIP_DEVICE, USB_DT_CONFIG << 8, 0, sizeof(config_desc));
+	add_get_descriptor(USB_RECIP_DEVICE, USB_DT_STRING << 8, 0, 255);
+	add_get_descriptor(USB_RECIP_DEVICE, USB_DT_STRING << 8 | 2, 0x0409, 255);
+	add_get_descriptor(USB_RECIP_DEVICE, USB_DT_STRING << 8 | 1, 0x0409, 255);
+	add(USB_RAW_EVENT_CONTROL, USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_DEVICE,
+		USB_REQ_SET_CONFIGURATION, 1, 0, 0);
+	add(USB_RAW_EVENT_CONTROL, USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+		HID_REQ_SET_IDLE, 0, 0, 0);
+	add_get_descriptor(USB_RECIP_INTERFACE, HID_DT_REPORT << 8, 0, REPORT_DESC_LENGTH);
+	*enumerated = script.size() - 1;
+
+	*first_report = script.size();
+	for (int i = 0; i < STEADY_REQUESTS; i++) {
+		if (i % 4 == 3)
+			add(USB_RAW_EVENT_CONTROL, USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE,
+				USB_REQ_GET_STATUS, 0, 0, 2);
+		else
+			add(USB_RAW_EVENT_CONTROL, USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+				HID_REQ_GET_REPORT, HID_REPORT_TYPE_INPUT << 8, 0, 64);
+	}
+	add(USB_RAW_EVENT_RESET, 0, 0, 0, 0, 0);
+}
+
+static void fake_device() {
+	static struct libusb_endpoint_descriptor endpoints[2];
+	static struct libusb_interface_descriptor altsetting;
+	static struct libusb_interface interface;
+	static struct libusb_config_descriptor config;
+	static struct libusb_config_descriptor *configs[1] = { &config };
+
+	memcpy(&device_device_desc, device_desc, sizeof(device_desc));
+
+	for (int i = 0; i < 2; i++) {
+		const uint8_t *raw = &config_desc[27 + 7 * i];
+		endpoints[i].bLength = raw[0];
+		endpoints[i].bDescriptorType = raw[1];
+		endpoints[i].bEndpointAddress = raw[2];
+		endpoints[i].bmAttributes = raw[3];
+		endpoints[i].wMaxPacketSize = raw[4] | raw[5] << 8;
+		endpoints[i].bInterval = raw[6];
+	}
+
+	altsetting.bLength = USB_DT_INTERFACE_SIZE;
+	altsetting.bDescriptorType = USB_DT_INTERFACE;
+	altsetting.bNumEndpoints = 2;
+	altsetting.bInterfaceClass = USB_CLASS_HID;
+	altsetting.endpoint = endpoints;
+	altsetting.extra = &config_desc[18];
+	altsetting.extra_length = 9;
+	interface.altsetting = &altsetting;
+	interface.num_altsetting = 1;
+
+	config.bLength = USB_DT_CONFIG_SIZE;
+	config.bDescriptorType = USB_DT_CONFIG;
+	config.wTotalLength = sizeof(config_desc);
+	config.bNumInterfaces = 1;
+	config.bConfigurationValue = 1;
+	config.bmAttributes = config_desc[7];
+	config.MaxPower = config_desc[8];
+	config.interface = &interface;
+	device_config_desc = configs;
+}
+
+static void run(const char *mode, size_t enumerated, size_t first_report) {
+	char label[64];
+	next_event = 0;
+	handed_ns.clear();
+	forwarded = 0;
+
+	// ep0_loop() prints what it does, stdout is pointed at /dev/null meanwhile.
+	fflush(stdout);
+	int saved_stdout = dup(STDOUT_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY);
+	dup2(null_fd, STDOUT_FILENO);
+	ep0_loop(0, &replay_trims);
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(null_fd);
+	close(saved_stdout);
+
+	std::vector<uint64_t> reports, statuses;
+	for (size_t i = first_report; i + 1 < script.size(); i++) {
+		uint64_t ns = handed_ns[i + 1] - handed_ns[i];
+		if (script[i].ctrl.bRequest == HID_REQ_GET_REPORT)
+			reports.push_back(ns);
+		else
+			statuses.push_back(ns);
+	}
+	struct bench_stats report_stats = bench_summarize(reports);
+	struct bench_stats status_stats = bench_summarize(statuses);
+
+	snprintf(label, sizeof(label), "ep0/%s/enumeration", mode);
+	bench_report(label, (handed_ns[enumerated + 1] - handed_ns[0]) / 1e6, "ms");
+	snprintf(label, sizeof(label), "ep0/%s/get_report_p50", mode);
+	bench_report(label, report_stats.p50 / 1e3, "us");
+	snprintf(label, sizeof(label), "ep0/%s/get_report_p99", mode);
+	bench_report(label, report_stats.p99 / 1e3, "us");
+	snprintf(label, sizeof(label), "ep0/%s/get_status_p50", mode);
+	bench_report(label, status_stats.p50 / 1e3, "us");
+	snprintf(label, sizeof(label), "ep0/%s/forwarded", mode);
+	bench_report(label, forwarded, "");
+}
+
+int main() {
+	size_t enumerated, first_report;
+	build_script(&enumerated, &first_report);
+
+	fake_device();
+	for (int i = 0; i < MIX_RULES_MAX_SOURCES; i++)
+		mixer_set_layout(&wheel_mixer, i, NULL);
+	struct mix_rules rules;
+	mix_rules_default(&rules, 0);
+	mixer_set_rules(&wheel_mixer, &rules);
+	uint8_t report[12] = { 0x08 };
+	mixer_update_wheel(&wheel_mixer, report, sizeof(report));
+	setup_host_usb_desc();
+
+	local_ep0_enabled = false;
+	run("proxied", enumerated, first_report);
+
+	// As at start-up: the descriptors are read once when the wheel opens.
+	local_ep0_enabled = true;
+	snapshot_fetch_descriptors();
+	run("local", enumerated, first_report);
+
+	free_host_usb_desc();
+	return 0;
+}
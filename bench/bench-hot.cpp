@@ -0,0 +1,191 @@
+#include <fcntl.h>
+#include <string.h>
+
+#include "../host-raw-gadget.h"
+#include "../device-libusb.h"
+#include "../proxy.h"
+#include "../packet-queue.h"
+#include "../logger.h"
+#include "replay.h"
+#include "bench.h"
+
+/*
+ * ns/op of the helpers around the hot paths of proxy.cpp and misc.cpp that
+ * are not covered by bench-queue and bench-mix: printData() formatting into
+ * /dev/null, the logger with the data path lines off and recording one with
+ * its first bytes for the logger thread to print, hexToAscii(),
+ * hexToDecimal(), building and freeing the gadget descriptors of a G29-like
+ * device, the thread_info copy every endpoint thread starts with and an
+ * uncontended queue push + pop, with cells sized for 1 KB and for 64 byte
+ * packets.
+ */
+
+#define ITERATIONS		200000
+#define FAST_ITERATIONS		2000000
+// Records timed between drains of the logger thread, below the ring depth.
+#define LOGGER_BATCH		(LOGGER_RING_DEPTH / 2)
+#define LOGGER_BATCHES		20
+
+int verbose_level = 0;
+bool please_stop_ep0 = false;
+volatile bool please_stop_eps = false;
+bool bmaxpacketsize0_must_greater_than_64 = false;
+int async_transfers = 0;
+int ffb_transfers = 0;
+bool reactor_enabled = false;
+bool latency_enabled = false;
+bool local_ep0_enabled = true;
+bool scheduled_reports = false;
+bool injection_enabled = false;
+
+// proxy.o is linked against the replay mocks, but nothing is replayed here.
+std::vector<InputDevice *> replay_trims;
+
+int replay_next(int source __attribute__((unused)), uint8_t endpoint __attribute__((unused)),
+		uint8_t *data __attribute__((unused)), int max_length __attribute__((unused))) {
+	return -1;
+}
+
+void replay_written(uint8_t endpoint __attribute__((unused)), const uint8_t *data __attribute__((unused)),
+		int length __attribute__((unused))) {
+}
+
+bool replay_event(struct usb_raw_control_event *event __attribute__((unused))) {
+	return false;
+}
+
+int replay_control(const struct usb_ctrlrequest *ctrl __attribute__((unused)),
+		uint8_t *data __attribute__((unused))) {
+	return 0;
+}
+
+void printData(const struct usb_raw_ep_io *io, __u8 bEndpointAddress,
+		std::string transfer_type, std::string dir);
+
+// A G29 in PS3 mode: one HID interface with an interrupt IN and OUT endpoint.
+static void fake_device() {
+	static struct libusb_endpoint_descriptor endpoints[2];
+	static struct libusb_interface_descriptor altsetting;
+	static struct libusb_interface interface;
+	static struct libusb_config_descriptor config;
+	static struct libusb_config_descriptor *configs[1] = { &config };
+
+	endpoints[0].bLength = USB_DT_ENDPOINT_SIZE;
+	endpoints[0].bDescriptorType = USB_DT_ENDPOINT;
+	endpoints[0].bEndpointAddress = 0x81;
+	endpoints[0].bmAttributes = USB_ENDPOINT_XFER_INT;
+	endpoints[0].wMaxPacketSize = 64;
+	endpoints[0].bInterval = 10;
+	endpoints[1] = endpoints[0];
+	endpoints[1].bEndpointAddress = 0x01;
+
+	altsetting.bLength = USB_DT_INTERFACE_SIZE;
+	altsetting.bDescriptorType = USB_DT_INTERFACE;
+	altsetting.bNumEndpoints = 2;
+	altsetting.bInterfaceClass = USB_CLASS_HID;
+	altsetting.endpoint = endpoints;
+	interface.altsetting = &altsetting;
+	interface.num_altsetting = 1;
+
+	config.bLength = USB_DT_CONFIG_SIZE;
+	config.bDescriptorType = USB_DT_CONFIG;
+	config.bNumInterfaces = 1;
+	config.bConfigurationValue = 1;
+	config.interface = &interface;
+
+	device_device_desc.bLength = USB_DT_DEVICE_SIZE;
+	device_device_desc.bDescriptorType = USB_DT_DEVICE;
+	device_device_desc.idVendor = 0x046d;
+	device_device_desc.idProduct = 0xc24f;
+	device_device_desc.bNumConfigurations = 1;
+	device_config_desc = configs;
+}
+
+int main() {
+	struct usb_raw_transfer_io io;
+	io.inner.ep = 1;
+	io.inner.flags = 0;
+	io.inner.length = 12;
+	memset(io.data, 0x5a, io.inner.length);
+
+	// printData() writes to stdout, which is pointed at /dev/null meanwhile.
+	fflush(stdout);
+	int saved_stdout = dup(STDOUT_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY);
+	dup2(null_fd, STDOUT_FILENO);
+	double print_data = bench_ns_per_op(ITERATIONS, [&](int) {
+		printData((struct usb_raw_ep_io *)&io, 0x81, "int", "in");
+	});
+
+	double logger_off = bench_ns_per_op(FAST_ITERATIONS, [&](int) {
+		if (logger_on(1))
+			logger_record(LOGGER_WROTE_HOST, 0x81, 12, io.data, 12);
+		bench_keep(io.data);
+	});
+	logger_level = 1;
+	logger_rate = 0;
+	logger_start();
+	uint64_t logger_ns = 0;
+	// The first batch claims the ring and touches its pages, untimed.
+	for (int batch = -1; batch < LOGGER_BATCHES; batch++) {
+		uint64_t start = bench_now_ns();
+		for (int i = 0; i < LOGGER_BATCH; i++) {
+			if (logger_on(1))
+				logger_record(LOGGER_WROTE_HOST, 0x81, 12, io.data, 12);
+		}
+		if (batch >= 0)
+			logger_ns += bench_now_ns() - start;
+		usleep(2 * LOGGER_FLUSH_MS * 1000);
+	}
+	logger_stop();
+	logger_level = 0;
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(null_fd);
+	close(saved_stdout);
+	bench_report("hot/printData_12_bytes", print_data, "ns/op");
+	bench_report("hot/logger_off", logger_off, "ns/op");
+	bench_report("hot/logger_record_12_bytes",
+		(double)logger_ns / (LOGGER_BATCH * LOGGER_BATCHES), "ns/op");
+
+	std::string escaped = "\\x01\\x02\\x03\\x04\\x05\\x06\\x07\\x08";
+	bench_report("hot/hexToAscii_8_escapes", bench_ns_per_op(ITERATIONS, [&](int) {
+		bench_keep(hexToAscii(escaped));
+	}), "ns/op");
+
+	bench_report("hot/hexToDecimal", bench_ns_per_op(FAST_ITERATIONS, [&](int i) {
+		bench_keep(hexToDecimal(1000 + (i & 0xff)));
+	}), "ns/op");
+
+	fake_device();
+	bench_report("hot/setup_free_host_usb_desc", bench_ns_per_op(ITERATIONS, [&](int) {
+		setup_host_usb_desc();
+		bench_keep(host_device_desc.configs);
+		free_host_usb_desc();
+	}), "ns/op");
+
+	struct thread_info source = thread_info();
+	source.ep_num = 1;
+	source.transfer_type = "int";
+	source.dir = "in";
+	bench_report("hot/thread_info_copy", bench_ns_per_op(FAST_ITERATIONS, [&](int) {
+		struct thread_info copy = source;
+		bench_keep(copy.ep_num);
+	}), "ns/op");
+
+	// Cells sized for a 1 KB transfer as before, and for a 64 byte endpoint.
+	size_t capacities[] = { PACKET_QUEUE_MAX_PAYLOAD, 64 };
+	for (size_t capacity : capacities) {
+		char label[64];
+		struct packet_queue *queue = packet_queue_create(PACKET_QUEUE_DEPTH, true, capacity);
+		snprintf(label, sizeof(label), "hot/queue_%zu/push_pop", capacity);
+		bench_report(label, bench_ns_per_op(FAST_ITERATIONS, [&](int) {
+			packet_queue_push(queue, &io);
+			packet_queue_pop(queue, &io);
+		}), "ns/op");
+		snprintf(label, sizeof(label), "hot/queue_%zu/ring_bytes", capacity);
+		bench_report(label, (queue->mask + 1) * queue->stride, "B");
+		packet_queue_destroy(queue);
+	}
+	return 0;
+}
@@ -0,0 +1,131 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "../injection.h"
+#include "../misc.h"
+#include "bench.h"
+
+/*
+ * Per-report cost of the compiled injection rules on a 12 byte wheel report,
+ * compared with rewriting it with std::string find/replace for every
+ * pattern, as a rule file was applied before.
+ */
+
+#define ITERATIONS	1000000
+#define REPORT_LENGTH	12
+
+int verbose_level = 0;
+
+static const struct usb_endpoint_descriptor wheel_in = {
+	USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, 0x81, USB_ENDPOINT_XFER_INT, 64, 4, 0, 0
+};
+
+static std::string write_rules(const char *rules) {
+	char path[] = "/tmp/bench-inject-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0 || write(fd, rules, strlen(rules)) != (ssize_t)strlen(rules)) {
+		perror("rule file");
+		exit(1);
+	}
+	close(fd);
+	return path;
+}
+
+static const struct injection_matcher *load(const char *rules) {
+	std::string path = write_rules(rules);
+	int result = injection_load(path.c_str());
+	unlink(path.c_str());
+	if (result) {
+		fprintf(stderr, "Failed to load the injection rules\n");
+		exit(1);
+	}
+	return injection_endpoint(&wheel_in);
+}
+
+// Rules swapping two byte values anywhere in the report, n_pairs times.
+static std::string swap_rules(int n_pairs, bool grow) {
+	std::string rules = "{\"int\": [";
+	for (int i = 0; i < n_pairs; i++) {
+		char rule[256];
+		snprintf(rule, sizeof(rule),
+			"%s{\"ep_address\": 81, \"enable\": true, \"content_pattern\": [\"\\\\x%02x\\\\x00\"],"
+			" \"replacement\": \"\\\\x%02x\\\\x00%s\"},"
+			"{\"ep_address\": 81, \"enable\": true, \"content_pattern\": [\"\\\\x%02x\\\\x00\"],"
+			" \"replacement\": \"\\\\x%02x\\\\x00\"}",
+			i ? "," : "", 0x10 + 2 * i, 0x11 + 2 * i, grow ? "\\\\x00" : "",
+			0x11 + 2 * i, 0x10 + 2 * i);
+		rules += rule;
+	}
+	return rules + "]}";
+}
+
+__attribute__((noinline))
+static int apply(const struct injection_matcher *matcher, uint8_t *report, int capacity) {
+	int length = REPORT_LENGTH;
+	injection_apply(matcher, report, &length, capacity);
+	return length;
+}
+
+__attribute__((noinline))
+static void apply_strings(std::vector<std::pair<std::string, std::string>> &rules,
+			uint8_t *report) {
+	std::string data((char *)report, REPORT_LENGTH);
+	for (auto &rule : rules) {
+		size_t pos = data.find(rule.first);
+		while (pos != std::string::npos) {
+			data.replace(pos, rule.first.size(), rule.second);
+			pos = data.find(rule.first, pos + rule.second.size());
+		}
+	}
+	memcpy(report, data.data(), REPORT_LENGTH);
+}
+
+static void run(const char *name, const struct injection_matcher *matcher, bool matching) {
+	uint8_t report[64] = { 0x08, 0x00, 0x00, 0x00, 0x7f, 0x80, 0xff, 0xff, 0xff, 0xff, 0x00, 0x00 };
+	bench_report(name, bench_ns_per_op(ITERATIONS, [&](int i) {
+		// Every other report has a value to swap when matching.
+		report[1] = matching && (i & 1) ? 0x10 : 0x01;
+		bench_keep(apply(matcher, report, sizeof(report)));
+		bench_keep(report);
+	}), "ns/op");
+}
+
+int main() {
+	// The swap of the README mouse example, on the wheel report.
+	const struct injection_matcher *matcher = load(swap_rules(1, false).c_str());
+	uint8_t report[REPORT_LENGTH] = { 0x08, 0x10, 0x00, 0x11, 0x00, 0x10 };
+	int length = REPORT_LENGTH;
+	injection_apply(matcher, report, &length, sizeof(report));
+	if (length != REPORT_LENGTH || report[1] != 0x11 || report[3] != 0x10 || report[5] != 0x11) {
+		fprintf(stderr, "injection did not swap the values\n");
+		return 1;
+	}
+
+	run("inject/1_pair/no_match", matcher, false);
+	run("inject/1_pair/match", matcher, true);
+
+	matcher = load(swap_rules(16, false).c_str());
+	bench_report("inject/16_pairs/states", matcher->n_states, "states");
+	run("inject/16_pairs/no_match", matcher, false);
+	run("inject/16_pairs/match", matcher, true);
+
+	matcher = load(swap_rules(16, true).c_str());
+	run("inject/16_pairs_growing/match", matcher, true);
+
+	// The same 16 pairs with std::string, one find/replace pass per pattern.
+	std::vector<std::pair<std::string, std::string>> rules;
+	for (int i = 0; i < 16; i++) {
+		char a[] = { (char)(0x10 + 2 * i), 0 }, b[] = { (char)(0x11 + 2 * i), 0 };
+		rules.push_back({ std::string(a, 2), std::string(b, 2) });
+		rules.push_back({ std::string(b, 2), std::string(a, 2) });
+	}
+	uint8_t wheel[REPORT_LENGTH] = { 0x08, 0x00, 0x00, 0x00, 0x7f, 0x80, 0xff, 0xff, 0xff, 0xff };
+	bench_report("inject/16_pairs/strings", bench_ns_per_op(ITERATIONS, [&](int i) {
+		wheel[1] = i & 1 ? 0x10 : 0x01;
+		apply_strings(rules, wheel);
+		bench_keep(wheel);
+	}), "ns/op");
+
+	injection_free();
+	return 0;
+}
@@ -0,0 +1,134 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "../mixer.h"
+#include "bench.h"
+
+/*
+ * Per-report cost of mix rules loaded from a file compared with the former
+ * hand-written mix() they replace, and of a complete mixer_read().
+ */
+
+#define ITERATIONS	2000000
+
+int verbose_level = 0;
+
+// The hand-written mapping that the default rules replace.
+__attribute__((noinline))
+static void mix(unsigned char *w, unsigned char *t)
+{
+	w[1] = (w[1] & 0xfc) | ((t[1] & 0x04) >> 1) | ((t[1] & 0x08) >> 3);
+	w[2] = (w[2] & 0x7f) | ((t[1] & 0x01) << 7);
+	w[3] = (w[3] & 0xfe) | ((t[1] & 0x02) >> 1);
+}
+
+// The default mapping as a rule file, as given to --mix_rules.
+static const char trim_box_rules[] =
+	"trim 1.2 1.1\n"
+	"trim 1.3 1.0\n"
+	"trim 1.0 2.7\n"
+	"trim 1.1 3.0\n";
+
+static int load_rules(struct mix_rules *rules) {
+	char path[] = "/tmp/bench-mix-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp()");
+		return -1;
+	}
+	int written = write(fd, trim_box_rules, sizeof(trim_box_rules) - 1);
+	close(fd);
+
+	const struct hid_report_layout *layouts[MIX_RULES_MAX_SOURCES] = { NULL };
+	int result = written == sizeof(trim_box_rules) - 1 ?
+		mix_rules_load(path, 1, layouts, rules) : -1;
+	unlink(path);
+	return result;
+}
+
+__attribute__((noinline))
+static void mix_compiled(const struct mix_rules *rules, uint64_t *dst,
+			const uint64_t (*sources)[MIX_RULES_WORDS], const uint64_t *enabled)
+{
+	mix_rules_apply(rules, dst, sources, enabled);
+}
+
+static void read_mixer(const char *name, const struct mix_rules *rules,
+			const uint8_t *wheel, const uint8_t *trim) {
+	static struct mixer mixer;
+	uint8_t report[MIXER_REPORT_MAX];
+	mixer_set_rules(&mixer, rules);
+	mixer_update_wheel(&mixer, wheel, 12);
+	mixer_update_trim(&mixer, 0, trim, 2);
+	bench_report(name, bench_ns_per_op(ITERATIONS, [&](int) {
+		uint32_t generation;
+		bench_keep(mixer_read(&mixer, report, &generation));
+		bench_keep(report);
+	}), "ns/op");
+}
+
+int main() {
+	uint64_t sources[MIX_RULES_MAX_SOURCES][MIX_RULES_WORDS] = {{0}};
+	uint64_t *wheel = sources[0];
+	uint64_t *trim = sources[1];
+	uint8_t *w = (uint8_t *)wheel;
+	uint8_t *t = (uint8_t *)trim;
+	w[0] = 0x08;
+	t[0] = 0x03;
+
+	// Check that both the loaded and the default rules reproduce mix() for
+	// every trim state.
+	struct mix_rules rules, defaults;
+	if (load_rules(&rules)) {
+		fprintf(stderr, "cannot load the mix rules\n");
+		return 1;
+	}
+	mix_rules_default(&defaults, 1);
+	uint64_t enabled[MIX_RULES_MAX_SOURCES] = { ~0ull, ~0ull };
+	for (int i = 0; i < 256; i++) {
+		uint64_t expected[MIX_RULES_WORDS], out[MIX_RULES_WORDS], out_default[MIX_RULES_WORDS];
+		t[1] = i;
+		w[1] = w[2] = w[3] = 0x55 ^ i;
+		memcpy(expected, wheel, sizeof(sources[0]));
+		memcpy(out, wheel, sizeof(sources[0]));
+		memcpy(out_default, wheel, sizeof(sources[0]));
+		mix((uint8_t *)expected, t);
+		mix_rules_apply(&rules, out, sources, enabled);
+		mix_rules_apply(&defaults, out_default, sources, enabled);
+		if (memcmp(expected, out, 12) || memcmp(expected, out_default, 12)) {
+			fprintf(stderr, "mix rules differ from mix() for trim %02x\n", i);
+			return 1;
+		}
+	}
+	// Without a trim report the wheel report passes unchanged.
+	uint64_t absent[MIX_RULES_MAX_SOURCES] = { ~0ull, 0 };
+	uint64_t out[MIX_RULES_WORDS];
+	memcpy(out, wheel, sizeof(sources[0]));
+	mix_rules_apply(&rules, out, sources, absent);
+	if (memcmp(wheel, out, 12)) {
+		fprintf(stderr, "mix rules change the report without a trim\n");
+		return 1;
+	}
+	bench_report("mix/loaded_ops", rules.n_ops, "ops");
+
+	bench_report("mix/hand_written", bench_ns_per_op(ITERATIONS, [&](int i) {
+		t[1] = i;
+		mix(w, t);
+		bench_keep(wheel);
+	}), "ns/op");
+
+	// Whole word stores, as when the trim report is loaded from the mixer.
+	bench_report("mix/compiled_rules", bench_ns_per_op(ITERATIONS, [&](int i) {
+		trim[0] = (uint64_t)(i & 0xff) << 8 | 0x03;
+		mix_compiled(&rules, wheel, sources, enabled);
+		bench_keep(wheel);
+	}), "ns/op");
+
+	// The complete read of the merged report, with and without the rules.
+	struct mix_rules empty;
+	memset(&empty, 0, sizeof(empty));
+	empty.n_sources = 2;
+	read_mixer("mix/mixer_read_no_rules", &empty, w, t);
+	read_mixer("mix/mixer_read", &rules, w, t);
+	return 0;
+}
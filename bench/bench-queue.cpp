@@ -0,0 +1,148 @@
+#include <deque>
+#include <mutex>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "../packet-queue.h"
+#include "bench.h"
+
+/*
+ * Compares the former std::deque + std::mutex hand-off with usleep() polling
+ * against packet_queue for the EP 0x81 merge point:
+ *  - latency of a report paced like the wheel (1 kHz),
+ *  - wakeups per second of an idle writer thread,
+ *  - throughput with three producers (wheel + two trims).
+ */
+
+#define LATENCY_SAMPLES		2000
+#define THROUGHPUT_PACKETS	200000
+#define PRODUCERS		3
+
+struct legacy_queue {
+	std::deque<usb_raw_transfer_io>	queue;
+	std::mutex			mutex;
+};
+
+static void legacy_push(struct legacy_queue *q, struct usb_raw_transfer_io *io) {
+	while (q->queue.size() >= 32)
+		usleep(200);
+	q->mutex.lock();
+	q->queue.push_back(*io);
+	q->mutex.unlock();
+}
+
+// One iteration of the former ep_loop_write() loop.
+static bool legacy_pop(struct legacy_queue *q, struct usb_raw_transfer_io *io) {
+	if (q->queue.size() == 0) {
+		usleep(100);
+		return false;
+	}
+	q->mutex.lock();
+	*io = q->queue.front();
+	q->queue.pop_front();
+	q->mutex.unlock();
+	return true;
+}
+
+static void ring_push(struct packet_queue *q, struct usb_raw_transfer_io *io) {
+	while (!packet_queue_push(q, io))
+		packet_queue_wait_space(q, 100);
+}
+
+static bool ring_pop(struct packet_queue *q, struct usb_raw_transfer_io *io) {
+	if (!packet_queue_wait_data(q, 100))
+		return false;
+	return packet_queue_pop(q, io);
+}
+
+static void make_report(struct usb_raw_transfer_io *io) {
+	uint64_t now = bench_now_ns();
+	io->inner.ep = 0;
+	io->inner.flags = 0;
+	io->inner.length = 12;
+	memcpy(io->data, &now, sizeof(now));
+}
+
+template <typename Q, void (*PUSH)(Q *, struct usb_raw_transfer_io *)>
+static void *paced_producer(void *arg) {
+	Q *q = (Q *)arg;
+	for (int i = 0; i < LATENCY_SAMPLES; i++) {
+		usleep(1000);
+		struct usb_raw_transfer_io io;
+		make_report(&io);
+		PUSH(q, &io);
+	}
+	return NULL;
+}
+
+template <typename Q, void (*PUSH)(Q *, struct usb_raw_transfer_io *)>
+static void *flood_producer(void *arg) {
+	Q *q = (Q *)arg;
+	struct usb_raw_transfer_io io;
+	make_report(&io);
+	for (int i = 0; i < THROUGHPUT_PACKETS / PRODUCERS; i++)
+		PUSH(q, &io);
+	return NULL;
+}
+
+template <typename Q, void (*PUSH)(Q *, struct usb_raw_transfer_io *),
+	bool (*POP)(Q *, struct usb_raw_transfer_io *)>
+static void run(const char *name, Q *q) {
+	char label[128];
+	pthread_t producers[PRODUCERS];
+	struct usb_raw_transfer_io io;
+
+	// Latency of a paced single producer.
+	std::vector<uint64_t> samples;
+	samples.reserve(LATENCY_SAMPLES);
+	pthread_create(&producers[0], 0, paced_producer<Q, PUSH>, q);
+	for (int i = 0; i < LATENCY_SAMPLES; i++) {
+		while (!POP(q, &io))
+			;
+		uint64_t sent;
+		memcpy(&sent, io.data, sizeof(sent));
+		samples.push_back(bench_now_ns() - sent);
+	}
+	pthread_join(producers[0], NULL);
+	struct bench_stats stats = bench_summarize(samples);
+	snprintf(label, sizeof(label), "%s/latency_mean", name);
+	bench_report(label, stats.mean, "ns");
+	snprintf(label, sizeof(label), "%s/latency_p99", name);
+	bench_report(label, stats.p99, "ns");
+	snprintf(label, sizeof(label), "%s/latency_max", name);
+	bench_report(label, stats.max, "ns");
+
+	// Wakeups of the writer while nothing arrives for one second.
+	struct rusage before, after;
+	getrusage(RUSAGE_THREAD, &before);
+	uint64_t deadline = bench_now_ns() + 1000000000ull;
+	while (bench_now_ns() < deadline)
+		POP(q, &io);
+	getrusage(RUSAGE_THREAD, &after);
+	snprintf(label, sizeof(label), "%s/idle_wakeups", name);
+	bench_report(label, (double)(after.ru_nvcsw - before.ru_nvcsw), "/s");
+
+	// Throughput with several producers contending.
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < PRODUCERS; i++)
+		pthread_create(&producers[i], 0, flood_producer<Q, PUSH>, q);
+	for (int i = 0; i < (THROUGHPUT_PACKETS / PRODUCERS) * PRODUCERS; i++) {
+		while (!POP(q, &io))
+			;
+	}
+	uint64_t elapsed = bench_now_ns() - start;
+	for (int i = 0; i < PRODUCERS; i++)
+		pthread_join(producers[i], NULL);
+	snprintf(label, sizeof(label), "%s/mpsc_transfer", name);
+	bench_report(label, (double)elapsed / THROUGHPUT_PACKETS, "ns/op");
+}
+
+int main() {
+	struct legacy_queue legacy;
+	run<struct legacy_queue, legacy_push, legacy_pop>("queue/deque_mutex_usleep", &legacy);
+
+	struct packet_queue *ring = packet_queue_create(PACKET_QUEUE_DEPTH, true);
+	run<struct packet_queue, ring_push, ring_pop>("queue/packet_queue", ring);
+	packet_queue_destroy(ring);
+	return 0;
+}
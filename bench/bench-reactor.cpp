@@ -0,0 +1,154 @@
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+
+#include "../packet-queue.h"
+#include "bench.h"
+
+/*
+ * Scaling of the device-side readers with the number of trim devices.
+ *
+ * Every simulated device is a timerfd firing at 1 kHz, like the wheel and
+ * a polled HID box. In thread mode each device has its own blocking reader
+ * thread (as trim_loop_read), in reactor mode one thread waits for all of
+ * them with epoll, which is what libusb_handle_events() does internally.
+ * All reports go through one multi-producer packet_queue to a consumer.
+ *
+ * Reported per N: CPU time per report, context switches per report,
+ * address space reserved for reader thread stacks and the p99 latency from
+ * expiry handling to dequeue.
+ */
+
+#define PERIOD_NS	1000000
+#define DURATION_MS	2000
+#define MAX_DEVICES	8
+
+static struct packet_queue *queue;
+static int timer_fds[MAX_DEVICES];
+static volatile bool stopping;
+
+static int make_timer() {
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	struct itimerspec spec = {
+		.it_interval = { .tv_sec = 0, .tv_nsec = PERIOD_NS },
+		.it_value = { .tv_sec = 0, .tv_nsec = PERIOD_NS },
+	};
+	timerfd_settime(fd, 0, &spec, NULL);
+	return fd;
+}
+
+static void deliver() {
+	uint64_t now = bench_now_ns();
+	struct usb_raw_transfer_io io;
+	io.inner.ep = 0x84;
+	io.inner.flags = 0;
+	io.inner.length = sizeof(now);
+	memcpy(io.data, &now, sizeof(now));
+	packet_queue_push(queue, &io);
+}
+
+static void *device_thread(void *arg) {
+	int fd = *(int *)arg;
+	while (!stopping) {
+		uint64_t expirations;
+		if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+			deliver();
+	}
+	return NULL;
+}
+
+static void *reactor_thread(void *arg) {
+	int n = *(int *)arg;
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	for (int i = 0; i < n; i++) {
+		struct epoll_event event = { .events = EPOLLIN, .data = { .fd = timer_fds[i] } };
+		epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fds[i], &event);
+	}
+	while (!stopping) {
+		struct epoll_event events[MAX_DEVICES];
+		int ready = epoll_wait(epfd, events, MAX_DEVICES, 100);
+		for (int i = 0; i < ready; i++) {
+			uint64_t expirations;
+			if (read(events[i].data.fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+				deliver();
+		}
+	}
+	close(epfd);
+	return NULL;
+}
+
+static size_t default_stack_kb() {
+	pthread_attr_t attr;
+	size_t size = 0;
+	pthread_attr_init(&attr);
+	pthread_attr_getstacksize(&attr, &size);
+	pthread_attr_destroy(&attr);
+	return size / 1024;
+}
+
+static void run(const char *mode, bool reactor, int n) {
+	char label[128];
+	pthread_t threads[MAX_DEVICES];
+	int n_threads = reactor ? 1 : n;
+
+	queue = packet_queue_create(PACKET_QUEUE_DEPTH, true);
+	stopping = false;
+	for (int i = 0; i < n; i++)
+		timer_fds[i] = make_timer();
+
+	struct rusage before, after;
+	getrusage(RUSAGE_SELF, &before);
+
+	if (reactor)
+		pthread_create(&threads[0], 0, reactor_thread, &n);
+	else
+		for (int i = 0; i < n; i++)
+			pthread_create(&threads[i], 0, device_thread, &timer_fds[i]);
+
+	std::vector<uint64_t> samples;
+	samples.reserve((size_t)n * DURATION_MS * 2);
+	uint64_t deadline = bench_now_ns() + DURATION_MS * 1000000ull;
+	while (bench_now_ns() < deadline) {
+		struct usb_raw_transfer_io io;
+		if (!packet_queue_wait_data(queue, 10) || !packet_queue_pop(queue, &io))
+			continue;
+		uint64_t sent;
+		memcpy(&sent, io.data, sizeof(sent));
+		samples.push_back(bench_now_ns() - sent);
+	}
+
+	stopping = true;
+	for (int i = 0; i < n_threads; i++)
+		pthread_join(threads[i], NULL);
+	getrusage(RUSAGE_SELF, &after);
+	for (int i = 0; i < n; i++)
+		close(timer_fds[i]);
+	packet_queue_destroy(queue);
+
+	double cpu_ns = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) * 1e9 +
+		(after.ru_utime.tv_usec - before.ru_utime.tv_usec) * 1e3 +
+		(after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1e9 +
+		(after.ru_stime.tv_usec - before.ru_stime.tv_usec) * 1e3;
+	double switches = (after.ru_nvcsw - before.ru_nvcsw) + (after.ru_nivcsw - before.ru_nivcsw);
+	size_t reports = samples.size() ? samples.size() : 1;
+	struct bench_stats stats = bench_summarize(samples);
+
+	snprintf(label, sizeof(label), "reactor/%s/n%d/cpu_per_report", mode, n);
+	bench_report(label, cpu_ns / reports, "ns");
+	snprintf(label, sizeof(label), "reactor/%s/n%d/switches_per_report", mode, n);
+	bench_report(label, switches / reports, "");
+	snprintf(label, sizeof(label), "reactor/%s/n%d/reader_stacks", mode, n);
+	bench_report(label, (double)(n_threads * default_stack_kb()), "kB");
+	snprintf(label, sizeof(label), "reactor/%s/n%d/latency_p99", mode, n);
+	bench_report(label, stats.p99, "ns");
+}
+
+int main() {
+	const int counts[] = { 1, 2, 4, 8 };
+	for (int n : counts) {
+		run("threads", false, n);
+		run("reactor", true, n);
+	}
+	return 0;
+}
@@ -0,0 +1,418 @@
+#include <atomic>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../host-raw-gadget.h"
+#include "../proxy.h"
+#include "../mixer.h"
+#include "../latency.h"
+#include "../capture.h"
+#include "../backpressure.h"
+#include "../gadget-speed.h"
+#include "../metrics.h"
+#include "replay.h"
+#include "bench.h"
+
+/*
+ * Replays a capture (see capture.h, recorded with --capture) through the
+ * endpoint threads of proxy.cpp and the mixer, with mock-raw-gadget.cpp and
+ * mock-libusb.cpp standing in for the host and the devices.
+ *
+ *	bench-replay [-s speed] [-p poll_us] [-t trims] [-r] [capture]
+ *
+ * speed scales the capture timing (1 replays in real time, 0 as fast as the
+ * proxy accepts transfers), poll_us makes IN writes wait for the next host
+ * poll like a real UDC and sets the bInterval of the endpoints to match.
+ * -r writes the wheel report on a timer as with --scheduled_reports.
+ * Without a capture file a synthetic one is used: the wheel at 1 kHz, trims
+ * at 125 Hz and force feedback at 500 Hz for 2 s.
+ *
+ * Reported per endpoint: transfers fed, written, dropped (fed but never
+ * dequeued by the writer), split by backpressure counter into superseded,
+ * expired and overflow, and coalesced (dequeued mixer frames that did not
+ * lead to a new report, force feedback commands superseded or repeated),
+ * throughput and the latency distribution from reception to the write,
+ * and with -r the ticks, those missed and how late they woke up.
+ *
+ * The data path must not allocate once the endpoints are running: heap
+ * allocations made from when the record a tenth into the capture is fed
+ * until the writers drained their queues are counted, whatever the pacing,
+ * and the replay fails if there are any.
+ */
+
+#define SYNTHETIC_DURATION_MS	2000
+#define MAX_SOURCES		(MIXER_MAX_TRIMS + 1)
+
+struct lane {
+	int				source;
+	uint8_t				endpoint;
+	std::vector<uint64_t>		timestamps;
+	std::vector<std::vector<uint8_t>> payloads;
+	size_t				next;	// only used by the lane's reader thread
+};
+
+int verbose_level = 0;
+bool please_stop_ep0 = false;
+volatile bool please_stop_eps = false;
+bool bmaxpacketsize0_must_greater_than_64 = false;
+int async_transfers = 0;
+int ffb_transfers = 0;
+bool reactor_enabled = false;
+bool latency_enabled = true;
+bool local_ep0_enabled = true;
+bool scheduled_reports = false;
+bool injection_enabled = false;
+
+std::vector<InputDevice *> replay_trims;
+
+static std::vector<struct lane> lanes;
+static uint64_t first_ns;
+static uint64_t start_ns;
+static double speed = 1.0;
+static uint64_t poll_ns;
+static std::atomic<uint64_t> written[256];
+static std::atomic<uint64_t> first_fed_ns;
+static std::atomic<uint64_t> last_write_ns;
+
+static std::atomic<bool> counting_allocations;
+static std::atomic<uint64_t> allocations;
+static size_t count_from;	// index of the fed record that starts the count
+static std::atomic<size_t> fed_records;
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+// operator new ends up here as well.
+extern "C" void *malloc(size_t size) {
+	if (counting_allocations.load(std::memory_order_relaxed))
+		allocations.fetch_add(1, std::memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size) {
+	if (counting_allocations.load(std::memory_order_relaxed))
+		allocations.fetch_add(1, std::memory_order_relaxed);
+	return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size) {
+	if (counting_allocations.load(std::memory_order_relaxed))
+		allocations.fetch_add(1, std::memory_order_relaxed);
+	return __libc_realloc(ptr, size);
+}
+
+static struct lane *find_lane(int source, uint8_t endpoint) {
+	for (size_t i = 0; i < lanes.size(); i++) {
+		if (lanes[i].source == source && lanes[i].endpoint == endpoint)
+			return &lanes[i];
+	}
+	struct lane lane;
+	lane.source = source;
+	lane.endpoint = endpoint;
+	lane.next = 0;
+	lanes.push_back(lane);
+	return &lanes.back();
+}
+
+static void sleep_until(uint64_t ns) {
+	struct timespec ts = { .tv_sec = (time_t)(ns / 1000000000ull), .tv_nsec = (long)(ns % 1000000000ull) };
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+int replay_next(int source, uint8_t endpoint, uint8_t *data, int max_length) {
+	struct lane *lane = NULL;
+	for (size_t i = 0; i < lanes.size() && !lane; i++) {
+		if (lanes[i].source == source && lanes[i].endpoint == endpoint)
+			lane = &lanes[i];
+	}
+	if (!lane || lane->next == lane->timestamps.size()) {
+		usleep(1000);
+		return -1;
+	}
+
+	// Even an unpaced replay waits for the endpoint threads to start.
+	if (speed > 0)
+		sleep_until(start_ns + (uint64_t)((lane->timestamps[lane->next] - first_ns) / speed));
+	else
+		sleep_until(start_ns);
+
+	uint64_t unset = 0;
+	first_fed_ns.compare_exchange_strong(unset, bench_now_ns(), std::memory_order_relaxed);
+
+	if (fed_records.fetch_add(1, std::memory_order_relaxed) == count_from)
+		counting_allocations.store(true, std::memory_order_relaxed);
+
+	const std::vector<uint8_t> &payload = lane->payloads[lane->next++];
+	int length = (int)payload.size() < max_length ? (int)payload.size() : max_length;
+	memcpy(data, payload.data(), length);
+	return length;
+}
+
+void replay_written(uint8_t endpoint, const uint8_t *data __attribute__((unused)),
+		int length __attribute__((unused))) {
+	if (poll_ns && (endpoint & USB_DIR_IN)) {
+		uint64_t now = bench_now_ns();
+		sleep_until((now / poll_ns + 1) * poll_ns);
+	}
+	written[endpoint].fetch_add(1, std::memory_order_relaxed);
+	last_write_ns.store(bench_now_ns(), std::memory_order_relaxed);
+}
+
+// The replay drives the endpoints directly, not ep0.
+bool replay_event(struct usb_raw_control_event *event __attribute__((unused))) {
+	return false;
+}
+
+int replay_control(const struct usb_ctrlrequest *ctrl __attribute__((unused)),
+		uint8_t *data __attribute__((unused))) {
+	return 0;
+}
+
+static void add_record(int source, uint8_t endpoint, uint64_t timestamp,
+			const uint8_t *data, int length) {
+	struct lane *lane = find_lane(source, endpoint);
+	lane->timestamps.push_back(timestamp);
+	lane->payloads.push_back(std::vector<uint8_t>(data, data + length));
+}
+
+static int load_capture(const char *path) {
+	FILE *file = capture_open(path);
+	if (!file)
+		return -1;
+
+	static uint8_t data[65536];
+	struct capture_record record;
+	while (capture_read(file, &record, data)) {
+		if (record.source != CAPTURE_SOURCE_HOST && record.source >= MAX_SOURCES)
+			continue;
+		add_record(record.source, record.endpoint, record.timestamp_ns, data, record.length);
+	}
+	fclose(file);
+	return 0;
+}
+
+static void synthesize_capture(int n_trims) {
+	for (int ms = 0; ms < SYNTHETIC_DURATION_MS; ms++) {
+		uint64_t timestamp = ms * 1000000ull;
+
+		uint8_t wheel[12] = { 0x08, 0x00, 0x00, 0x00, (uint8_t)ms, (uint8_t)(ms >> 8),
+			0xff, 0xff, 0xff, 0x00, 0x00, 0x00 };
+		add_record(0, 0x81, timestamp, wheel, sizeof(wheel));
+
+		for (int i = 0; i < n_trims; i++) {
+			if (ms % 8 == i % 8) {
+				uint8_t trim[2] = { 0x03, (uint8_t)((ms / 8) & 0x0f) };
+				add_record(1 + i, 0x84, timestamp + 300000, trim, sizeof(trim));
+			}
+		}
+
+		if (ms % 2 == 0) {
+			uint8_t ffb[7] = { 0x11, 0x08, (uint8_t)(ms >> 1), 0x80, 0x00, 0x00, 0x00 };
+			add_record(CAPTURE_SOURCE_HOST, 0x01, timestamp + 500000, ffb, sizeof(ffb));
+		}
+	}
+}
+
+// One configuration with one interface holding the endpoints seen in the
+// capture: device IN endpoints of the wheel and host OUT endpoints.
+static void setup_gadget() {
+	std::vector<uint8_t> addresses;
+	for (size_t i = 0; i < lanes.size(); i++) {
+		uint8_t address = lanes[i].source == 0 || lanes[i].source == CAPTURE_SOURCE_HOST ?
+			lanes[i].endpoint : 0x81;
+		if (std::find(addresses.begin(), addresses.end(), address) == addresses.end())
+			addresses.push_back(address);
+	}
+
+	struct raw_gadget_altsetting *alt = new struct raw_gadget_altsetting();
+	alt->interface.bNumEndpoints = addresses.size();
+	alt->endpoints = new struct raw_gadget_endpoint[addresses.size()]();
+	for (size_t i = 0; i < addresses.size(); i++) {
+		struct usb_endpoint_descriptor *ep = &alt->endpoints[i].endpoint;
+		ep->bLength = USB_DT_ENDPOINT_SIZE;
+		ep->bDescriptorType = USB_DT_ENDPOINT;
+		ep->bEndpointAddress = addresses[i];
+		ep->bmAttributes = USB_ENDPOINT_XFER_INT;
+		ep->wMaxPacketSize = 64;
+		ep->bInterval = gadget_speed_interval(addresses[i], ep->bmAttributes, 1);
+	}
+
+	struct raw_gadget_interface *interface = new struct raw_gadget_interface();
+	interface->altsettings = alt;
+	interface->num_altsettings = 1;
+	struct raw_gadget_config *config = new struct raw_gadget_config();
+	config->config.bNumInterfaces = 1;
+	config->interfaces = interface;
+	host_device_desc.configs = config;
+	host_device_desc.device.bNumConfigurations = 1;
+	host_device_desc.current_config = 0;
+}
+
+static bool queues_drained() {
+	struct raw_gadget_altsetting *alt = &host_device_desc.configs[0].interfaces[0].altsettings[0];
+	for (int i = 0; i < alt->interface.bNumEndpoints; i++) {
+		if (packet_queue_size(alt->endpoints[i].thread_info.data_queue))
+			return false;
+	}
+	return true;
+}
+
+static void report_endpoint(uint8_t endpoint, double elapsed_s) {
+	char label[128];
+	uint64_t fed = 0;
+	for (size_t i = 0; i < lanes.size(); i++) {
+		uint8_t address = lanes[i].source == 0 || lanes[i].source == CAPTURE_SOURCE_HOST ?
+			lanes[i].endpoint : 0x81;
+		if (address == endpoint)
+			fed += lanes[i].next;
+	}
+	const struct latency_histogram *queue = latency_endpoint_histogram(endpoint, LATENCY_QUEUE);
+	const struct latency_histogram *total = latency_endpoint_histogram(endpoint, LATENCY_TOTAL);
+	uint64_t dequeued = queue->count.load(std::memory_order_relaxed);
+	uint64_t sent = written[endpoint].load(std::memory_order_relaxed);
+	struct backpressure_counters *counters = backpressure_counters_for(endpoint);
+
+	snprintf(label, sizeof(label), "replay/ep%02x/fed", endpoint);
+	bench_report(label, fed, "");
+	snprintf(label, sizeof(label), "replay/ep%02x/written", endpoint);
+	bench_report(label, sent, "");
+	snprintf(label, sizeof(label), "replay/ep%02x/dropped", endpoint);
+	bench_report(label, fed > dequeued ? fed - dequeued : 0, "");
+	snprintf(label, sizeof(label), "replay/ep%02x/superseded", endpoint);
+	bench_report(label, counters->superseded.load(std::memory_order_relaxed), "");
+	snprintf(label, sizeof(label), "replay/ep%02x/expired", endpoint);
+	bench_report(label, counters->expired.load(std::memory_order_relaxed), "");
+	snprintf(label, sizeof(label), "replay/ep%02x/overflow", endpoint);
+	bench_report(label, counters->overflow.load(std::memory_order_relaxed), "");
+	snprintf(label, sizeof(label), "replay/ep%02x/coalesced", endpoint);
+	bench_report(label, dequeued > sent ? dequeued - sent : 0, "");
+	snprintf(label, sizeof(label), "replay/ep%02x/throughput", endpoint);
+	bench_report(label, sent / elapsed_s, "/s");
+	snprintf(label, sizeof(label), "replay/ep%02x/latency_p50", endpoint);
+	bench_report(label, latency_histogram_percentile(total, 50), "ns");
+	snprintf(label, sizeof(label), "replay/ep%02x/latency_p99", endpoint);
+	bench_report(label, latency_histogram_percentile(total, 99), "ns");
+	snprintf(label, sizeof(label), "replay/ep%02x/latency_p99.9", endpoint);
+	bench_report(label, latency_histogram_percentile(total, 99.9), "ns");
+	snprintf(label, sizeof(label), "replay/ep%02x/latency_max", endpoint);
+	bench_report(label, total->max.load(std::memory_order_relaxed), "ns");
+
+	const struct metrics_endpoint *metrics = metrics_endpoint(endpoint);
+	uint64_t ticks = metrics->ticks.load(std::memory_order_relaxed);
+	if (ticks == 0)
+		return;
+	const struct latency_histogram *late = latency_tick_histogram(endpoint);
+	snprintf(label, sizeof(label), "replay/ep%02x/ticks", endpoint);
+	bench_report(label, ticks, "");
+	snprintf(label, sizeof(label), "replay/ep%02x/missed_ticks", endpoint);
+	bench_report(label, metrics->missed_ticks.load(std::memory_order_relaxed), "");
+	snprintf(label, sizeof(label), "replay/ep%02x/tick_late_p50", endpoint);
+	bench_report(label, latency_histogram_percentile(late, 50), "ns");
+	snprintf(label, sizeof(label), "replay/ep%02x/tick_late_p99", endpoint);
+	bench_report(label, latency_histogram_percentile(late, 99), "ns");
+	snprintf(label, sizeof(label), "replay/ep%02x/tick_late_max", endpoint);
+	bench_report(label, late->max.load(std::memory_order_relaxed), "ns");
+}
+
+int main(int argc, char **argv) {
+	int n_trims = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:p:t:r")) != -1) {
+		switch (opt) {
+		case 's':
+			speed = atof(optarg);
+			break;
+		case 'p':
+			poll_ns = atoll(optarg) * 1000ull;
+			poll_interval_us = poll_ns / 1000;
+			break;
+		case 't':
+			n_trims = atoi(optarg);
+			break;
+		case 'r':
+			scheduled_reports = true;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s speed] [-p poll_us] [-t trims] [-r] [capture]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind < argc) {
+		if (load_capture(argv[optind]))
+			return 1;
+		n_trims = 0;
+		for (size_t i = 0; i < lanes.size(); i++) {
+			if (lanes[i].source != CAPTURE_SOURCE_HOST && lanes[i].source > n_trims)
+				n_trims = lanes[i].source;
+		}
+	}
+	else {
+		if (n_trims > MIXER_MAX_TRIMS)
+			n_trims = MIXER_MAX_TRIMS;
+		synthesize_capture(n_trims);
+	}
+
+	size_t n_records = 0;
+	first_ns = UINT64_MAX;
+	uint64_t last_ns = 0;
+	for (size_t i = 0; i < lanes.size(); i++) {
+		n_records += lanes[i].timestamps.size();
+		for (uint64_t timestamp : lanes[i].timestamps) {
+			first_ns = std::min(first_ns, timestamp);
+			last_ns = std::max(last_ns, timestamp);
+		}
+	}
+	if (n_records == 0) {
+		fprintf(stderr, "Empty capture\n");
+		return 1;
+	}
+
+	for (int i = 0; i < n_trims; i++)
+		replay_trims.push_back(new InputDevice);
+	for (int i = 0; i < MAX_SOURCES; i++)
+		mixer_set_layout(&wheel_mixer, i, NULL);
+	struct mix_rules rules;
+	mix_rules_default(&rules, n_trims);
+	mixer_set_rules(&wheel_mixer, &rules);
+	setup_gadget();
+
+	count_from = n_records / 10;
+	// Give the endpoint threads time to start before the first transfer is due.
+	start_ns = bench_now_ns() + 10000000ull;
+	process_eps(0, 0, 0, 0, &replay_trims);
+
+	bool pending = true;
+	while (pending) {
+		usleep(1000);
+		pending = false;
+		for (size_t i = 0; i < lanes.size(); i++)
+			pending |= lanes[i].next < lanes[i].timestamps.size();
+	}
+	while (!queues_drained())
+		usleep(1000);
+	usleep(50000);
+	counting_allocations.store(false, std::memory_order_relaxed);
+	uint64_t begin_ns = first_fed_ns.load(), end_ns = last_write_ns.load();
+	double elapsed_s = end_ns > begin_ns ? (end_ns - begin_ns) / 1e9 : 1e-9;
+	terminate_eps(0, 0, 0, 0);
+
+	bench_report("replay/records", n_records, "");
+	bench_report("replay/speed", speed, "x");
+	bench_report("replay/capture_span", (last_ns - first_ns) / 1e6, "ms");
+	bench_report("replay/elapsed", elapsed_s * 1e3, "ms");
+	struct raw_gadget_altsetting *alt = &host_device_desc.configs[0].interfaces[0].altsettings[0];
+	for (int i = 0; i < alt->interface.bNumEndpoints; i++)
+		report_endpoint(alt->endpoints[i].endpoint.bEndpointAddress, elapsed_s);
+
+	uint64_t steady_allocations = allocations.load();
+	bench_report("replay/steady_state_allocations", steady_allocations, "");
+	if (steady_allocations) {
+		fprintf(stderr, "The data path allocated %llu times in steady state\n",
+			(unsigned long long)steady_allocations);
+		return 1;
+	}
+	return 0;
+}
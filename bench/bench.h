@@ -0,0 +1,82 @@
+#ifndef BENCH_H
+#define BENCH_H
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+/*
+ * Minimal helpers shared by the benchmark programs under bench/.
+ * Every result is printed as one "name value unit" line and, if BENCH_JSON
+ * names a file, appended to it as one JSON object per line (make bench
+ * wraps them into a single document).
+ */
+
+#define BENCH_REPEATS	7
+
+static inline uint64_t bench_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct bench_stats {
+	double	mean;
+	double	p50;
+	double	p99;
+	double	max;
+};
+
+static inline struct bench_stats bench_summarize(std::vector<uint64_t> &samples) {
+	struct bench_stats stats = {0, 0, 0, 0};
+	if (samples.empty())
+		return stats;
+
+	std::sort(samples.begin(), samples.end());
+	double sum = 0;
+	for (uint64_t sample : samples)
+		sum += sample;
+	stats.mean = sum / samples.size();
+	stats.p50 = samples[samples.size() / 2];
+	stats.p99 = samples[samples.size() * 99 / 100];
+	stats.max = samples.back();
+	return stats;
+}
+
+static inline void bench_report(const char *name, double value, const char *unit) {
+	printf("%-48s %14.1f %s\n", name, value, unit);
+
+	const char *path = getenv("BENCH_JSON");
+	if (!path)
+		return;
+	FILE *file = fopen(path, "a");
+	if (!file)
+		return;
+	fprintf(file, "{\"name\": \"%s\", \"value\": %.3f, \"unit\": \"%s\"}\n",
+		name, value, unit);
+	fclose(file);
+}
+
+// Keep the compiler from optimizing away the benchmarked computation.
+template <typename T>
+static inline void bench_keep(T const &value) {
+	asm volatile("" : : "g"(value) : "memory");
+}
+
+// Median ns/op of BENCH_REPEATS runs of iterations calls to fn(i), which
+// keeps a single preempted run from skewing the result.
+template <typename F>
+static inline double bench_ns_per_op(int iterations, F fn) {
+	std::vector<uint64_t> runs;
+	for (int r = 0; r < BENCH_REPEATS; r++) {
+		uint64_t start = bench_now_ns();
+		for (int i = 0; i < iterations; i++)
+			fn(i);
+		runs.push_back(bench_now_ns() - start);
+	}
+	std::sort(runs.begin(), runs.end());
+	return (double)runs[BENCH_REPEATS / 2] / iterations;
+}
+#endif
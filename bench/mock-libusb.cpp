@@ -0,0 +1,161 @@
+#include <unistd.h>
+
+#include "../device-libusb.h"
+#include "../async-transfer.h"
+#include "../reactor.h"
+#include "replay.h"
+
+/*
+ * Stand-in for device-libusb.cpp, input-device.cpp and the async transfer
+ * code: the wheel and the trim devices are played by the replay driver.
+ * Reads return the captured device IN transfers, writes are handed to
+ * replay_written() and control requests are answered by replay_control().
+ * Async transfers are not supported, the replay runs the proxy with its
+ * synchronous reader threads.
+ */
+
+libusb_device_handle		*dev_handle;
+libusb_context			*context = NULL;
+libusb_hotplug_callback_handle	callback_handle = -1;
+
+struct libusb_device_descriptor		device_device_desc;
+struct libusb_config_descriptor		**device_config_desc;
+
+static int mock_receive(int source, uint8_t endpoint, uint16_t maxPacketSize,
+			uint8_t *data, int *length) {
+	*length = replay_next(source, endpoint, data, maxPacketSize);
+	return *length < 0 ? LIBUSB_ERROR_TIMEOUT : LIBUSB_SUCCESS;
+}
+
+int connect_device(int vendorId __attribute__((unused)), int productId __attribute__((unused))) {
+	return 0;
+}
+
+int prepare_device(int vendorId __attribute__((unused)), int productId __attribute__((unused))) {
+	return 0;
+}
+
+void close_device() {
+}
+
+int reopen_device(int timeout_ms __attribute__((unused))) {
+	return 0;
+}
+
+void wheel_handle_hold() {
+}
+
+void wheel_handle_drop() {
+}
+
+void reset_device() {
+}
+
+void set_configuration(int configuration __attribute__((unused))) {
+}
+
+void claim_interface(int interface __attribute__((unused))) {
+}
+
+void release_interface(int interface __attribute__((unused))) {
+}
+
+void set_interface_alt_setting(int interface __attribute__((unused)), int altsetting __attribute__((unused))) {
+}
+
+int control_request(const usb_ctrlrequest *setup_packet, int *nbytes,
+			unsigned char **dataptr, int timeout __attribute__((unused))) {
+	int length = replay_control(setup_packet, *dataptr);
+	if (length < 0)
+		return -1;
+	*nbytes = length;
+	return 0;
+}
+
+int send_data(uint8_t endpoint, uint8_t attributes __attribute__((unused)), uint8_t *dataptr,
+			int length) {
+	replay_written(endpoint, dataptr, length);
+	return length;
+}
+
+int receive_data(uint8_t endpoint, uint8_t attributes __attribute__((unused)), uint16_t maxPacketSize,
+			uint8_t *data, int *length, int timeout __attribute__((unused))) {
+	return mock_receive(0, endpoint, maxPacketSize, data, length);
+}
+
+InputDevice::InputDevice() {
+	index = 0;
+	online = true;
+	device = NULL;
+	dev_handle = NULL;
+	device_config_desc = NULL;
+}
+
+bool InputDevice::wait_online(int timeout_ms __attribute__((unused))) {
+	return true;
+}
+
+int InputDevice::receive_data(uint8_t endpoint, uint8_t attributes __attribute__((unused)),
+			uint16_t maxPacketSize, uint8_t *data, int *length,
+			int timeout __attribute__((unused))) {
+	int source = 0;
+	for (size_t i = 0; i < replay_trims.size(); i++) {
+		if (replay_trims[i] == this)
+			source = 1 + i;
+	}
+	return mock_receive(source, endpoint, maxPacketSize, data, length);
+}
+
+int async_in_start(struct async_in_stream *stream __attribute__((unused))) {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+void async_in_stop(struct async_in_stream *stream __attribute__((unused)),
+			libusb_context *ctx __attribute__((unused))) {
+}
+
+int async_in_clear_halt(struct async_in_stream *stream __attribute__((unused))) {
+	return LIBUSB_SUCCESS;
+}
+
+int async_out_start(struct async_out_stream *stream __attribute__((unused))) {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+void async_out_stop(struct async_out_stream *stream __attribute__((unused)),
+			libusb_context *ctx __attribute__((unused))) {
+}
+
+int async_out_submit(struct async_out_stream *stream __attribute__((unused)),
+			const uint8_t *data __attribute__((unused)), int length __attribute__((unused))) {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int async_out_reap(struct async_out_stream *stream __attribute__((unused)),
+			int *status __attribute__((unused)), uint64_t *completed_ns __attribute__((unused))) {
+	return -1;
+}
+
+bool async_out_available(struct async_out_stream *stream __attribute__((unused))) {
+	return true;
+}
+
+void async_out_wait(struct async_out_stream *stream __attribute__((unused)),
+			libusb_context *ctx __attribute__((unused)), int timeout_ms __attribute__((unused))) {
+}
+
+int reactor_add(struct async_in_stream *stream __attribute__((unused))) {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+void reactor_remove(struct async_in_stream *stream __attribute__((unused))) {
+}
+
+int LIBUSB_CALL libusb_handle_events_timeout_completed(libusb_context *ctx __attribute__((unused)),
+			struct timeval *tv __attribute__((unused)), int *completed __attribute__((unused))) {
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+const char * LIBUSB_CALL libusb_strerror(int errcode __attribute__((unused))) {
+	return "mock";
+}
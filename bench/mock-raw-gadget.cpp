@@ -0,0 +1,99 @@
+#include <errno.h>
+
+#include "../host-raw-gadget.h"
+#include "../capture.h"
+#include "replay.h"
+
+/*
+ * Stand-in for host-raw-gadget.cpp: the host side of the gadget is played
+ * by the replay driver. Endpoint reads return the captured host OUT
+ * transfers, endpoint writes are handed to replay_written() and ep0 events
+ * come from replay_event().
+ */
+
+#define MOCK_MAX_EPS	32
+
+struct raw_gadget_device host_device_desc;
+
+static uint8_t ep_addresses[MOCK_MAX_EPS];
+static int n_eps;
+
+int usb_raw_open() {
+	return 0;
+}
+
+void usb_raw_init(int fd __attribute__((unused)), enum usb_device_speed speed __attribute__((unused)),
+			const char *driver __attribute__((unused)), const char *device __attribute__((unused))) {
+}
+
+void usb_raw_run(int fd __attribute__((unused))) {
+}
+
+void usb_raw_event_fetch(int fd __attribute__((unused)), struct usb_raw_event *event) {
+	if (replay_event((struct usb_raw_control_event *)event))
+		return;
+	event->type = USB_RAW_EVENT_INVALID;
+	event->length = 0;
+}
+
+int usb_raw_ep0_read(int fd __attribute__((unused)), struct usb_raw_ep_io *io) {
+	return io->length;
+}
+
+int usb_raw_ep0_write(int fd __attribute__((unused)), struct usb_raw_ep_io *io) {
+	return io->length;
+}
+
+int usb_raw_ep_enable(int fd __attribute__((unused)), struct usb_endpoint_descriptor *desc) {
+	if (n_eps == MOCK_MAX_EPS)
+		return -1;
+	ep_addresses[n_eps] = desc->bEndpointAddress;
+	return n_eps++;
+}
+
+int usb_raw_ep_disable(int fd __attribute__((unused)), uint32_t num __attribute__((unused))) {
+	return 0;
+}
+
+int usb_raw_ep_read(int fd __attribute__((unused)), struct usb_raw_ep_io *io) {
+	// Like the UDC, block until the host sends something or the endpoint
+	// is shut down.
+	int length = -1;
+	while (length < 0 && !please_stop_eps)
+		length = replay_next(CAPTURE_SOURCE_HOST, ep_addresses[io->ep], io->data, io->length);
+	if (length < 0) {
+		errno = ESHUTDOWN;
+		return -1;
+	}
+	return length;
+}
+
+int usb_raw_ep_write(int fd __attribute__((unused)), struct usb_raw_ep_io *io) {
+	replay_written(ep_addresses[io->ep], io->data, io->length);
+	return io->length;
+}
+
+void usb_raw_configure(int fd __attribute__((unused))) {
+}
+
+void usb_raw_vbus_draw(int fd __attribute__((unused)), uint32_t power __attribute__((unused))) {
+}
+
+int usb_raw_eps_info(int fd __attribute__((unused)), struct usb_raw_eps_info *info __attribute__((unused))) {
+	return 0;
+}
+
+void usb_raw_ep0_stall(int fd __attribute__((unused))) {
+}
+
+void usb_raw_ep_set_halt(int fd __attribute__((unused)), int ep __attribute__((unused))) {
+}
+
+void log_control_request(struct usb_ctrlrequest *ctrl __attribute__((unused))) {
+}
+
+void log_event(struct usb_raw_event *event __attribute__((unused))) {
+}
+
+void print_eps_info(int fd __attribute__((unused))) {
+}
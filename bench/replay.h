@@ -0,0 +1,34 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+#include <stdint.h>
+#include <vector>
+
+#include "../input-device.h"
+
+struct usb_raw_control_event;
+
+/*
+ * Interface between the replay driver (bench-replay.cpp) and the stand-in
+ * raw-gadget and libusb backends (mock-raw-gadget.cpp, mock-libusb.cpp)
+ * that are linked with proxy.o instead of the real ones.
+ */
+
+// Trim i of the replay is source 1 + i.
+extern std::vector<InputDevice *> replay_trims;
+
+// Block until the next captured transfer of source on endpoint is due and
+// copy it into data. Returns its length, or -1 once the capture ran out.
+int replay_next(int source, uint8_t endpoint, uint8_t *data, int max_length);
+
+// A transfer left the proxy on endpoint (to the host for IN endpoints, to
+// the device for OUT endpoints).
+void replay_written(uint8_t endpoint, const uint8_t *data, int length);
+
+// Next event of the host on ep0. Returns false if there is none, which the
+// mock reports as an invalid event.
+bool replay_event(struct usb_raw_control_event *event);
+
+// The wheel's answer to a control request the proxy forwarded: fills data
+// and returns its length, or -1 to stall.
+int replay_control(const struct usb_ctrlrequest *ctrl, uint8_t *data);
+#endif
@@ -0,0 +1,119 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "misc.h"
+#include "latency.h"
+#include "capture.h"
+#include "rt.h"
+
+bool capture_enabled = false;
+
+static FILE *capture_file;
+static struct packet_queue *capture_queue;
+static pthread_t capture_thread;
+static volatile bool capture_stopping;
+static std::atomic<uint64_t> capture_dropped;
+
+static void write_record(struct usb_raw_transfer_io *io, struct packet_stamp *stamp) {
+	struct capture_record record;
+	record.timestamp_ns = stamp->received_ns;
+	record.endpoint = io->inner.ep;
+	record.source = stamp->source < 0 ? CAPTURE_SOURCE_HOST : stamp->source;
+	record.length = io->inner.length;
+	record.reserved = 0;
+	fwrite(&record, sizeof(record), 1, capture_file);
+	fwrite(io->data, 1, io->inner.length, capture_file);
+}
+
+static void *capture_writer(void *arg __attribute__((unused))) {
+	struct usb_raw_transfer_io io;
+	struct packet_stamp stamp;
+
+	rt_enter(RT_ROLE_LOG);
+	while (!capture_stopping) {
+		if (!packet_queue_wait_data(capture_queue, 100))
+			continue;
+		while (packet_queue_pop(capture_queue, &io, &stamp))
+			write_record(&io, &stamp);
+	}
+	while (packet_queue_pop(capture_queue, &io, &stamp))
+		write_record(&io, &stamp);
+	return NULL;
+}
+
+int capture_start(const char *path) {
+	capture_file = fopen(path, "wb");
+	if (!capture_file) {
+		perror("fopen() capture");
+		return -1;
+	}
+
+	struct capture_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+	header.version = CAPTURE_VERSION;
+	fwrite(&header, sizeof(header), 1, capture_file);
+
+	capture_queue = packet_queue_create(CAPTURE_QUEUE_DEPTH, true);
+	capture_stopping = false;
+	capture_dropped.store(0, std::memory_order_relaxed);
+	pthread_create(&capture_thread, 0, capture_writer, NULL);
+	capture_enabled = true;
+	return 0;
+}
+
+void capture_stop() {
+	if (!capture_enabled)
+		return;
+	capture_enabled = false;
+	capture_stopping = true;
+	packet_queue_wake(capture_queue);
+	pthread_join(capture_thread, NULL);
+	packet_queue_destroy(capture_queue);
+	fclose(capture_file);
+
+	uint64_t dropped = capture_dropped.load(std::memory_order_relaxed);
+	if (dropped)
+		printf("Capture dropped %llu records\n", (unsigned long long)dropped);
+}
+
+void capture_packet(uint8_t endpoint, const struct packet_stamp *stamp,
+			const uint8_t *data, int length) {
+	struct usb_raw_transfer_io io;
+	struct packet_stamp captured = *stamp;
+
+	if (length < 0 || length > (int)sizeof(io.data))
+		return;
+	if (captured.received_ns == 0)
+		captured.received_ns = latency_now();
+	io.inner.ep = endpoint;
+	io.inner.flags = 0;
+	io.inner.length = length;
+	memcpy(io.data, data, length);
+	if (!packet_queue_push(capture_queue, &io, &captured))
+		capture_dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+FILE *capture_open(const char *path) {
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		perror("fopen() capture");
+		return NULL;
+	}
+
+	struct capture_header header;
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+	    memcmp(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) ||
+	    header.version != CAPTURE_VERSION) {
+		fprintf(stderr, "%s is not a capture file\n", path);
+		fclose(file);
+		return NULL;
+	}
+	return file;
+}
+
+bool capture_read(FILE *file, struct capture_record *record, uint8_t *data) {
+	if (fread(record, sizeof(*record), 1, file) != 1)
+		return false;
+	return fread(data, 1, record->length, file) == record->length;
+}
@@ -0,0 +1,52 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+#include <stdint.h>
+#include <stdio.h>
+
+#include "packet-queue.h"
+
+#define CAPTURE_MAGIC		"G29CAPT"
+#define CAPTURE_VERSION		1
+#define CAPTURE_SOURCE_HOST	0xff
+#define CAPTURE_QUEUE_DEPTH	256
+
+/*
+ * Binary capture of the endpoint traffic entering the proxy.
+ *
+ * A capture file is a capture_header followed by capture_records, each
+ * followed by length bytes of payload. All fields are little-endian.
+ * Timestamps are CLOCK_MONOTONIC nanoseconds taken when the transfer was
+ * received. source is 0 for the wheel, 1 + i for trim i and
+ * CAPTURE_SOURCE_HOST for transfers read from the host.
+ *
+ * Endpoint threads only push into a queue and never block; a writer thread
+ * drains it to the file. Records are dropped (and counted) if the writer
+ * falls CAPTURE_QUEUE_DEPTH records behind.
+ */
+
+struct capture_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	reserved;
+};
+
+struct capture_record {
+	uint64_t	timestamp_ns;
+	uint8_t		endpoint;
+	uint8_t		source;
+	uint16_t	length;
+	uint32_t	reserved;
+};
+
+extern bool capture_enabled;
+
+int capture_start(const char *path);
+void capture_stop();
+void capture_packet(uint8_t endpoint, const struct packet_stamp *stamp,
+			const uint8_t *data, int length);
+
+// Reading side, used by the replay benchmark. capture_read() returns false
+// at the end of the file; data must hold 64 kB.
+FILE *capture_open(const char *path);
+bool capture_read(FILE *file, struct capture_record *record, uint8_t *data);
+#endif
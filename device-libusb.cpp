@@ -1,6 +1,9 @@
 #include "device-libusb.h"
+#include "discovery.h"
+#include "reattach.h"
+#include "logger.h"
+#include "gadget-speed.h"
 
-libusb_device 			**devs;
 libusb_device_handle 		*dev_handle;
 libusb_context 			*context = NULL;
 libusb_hotplug_callback_handle	callback_handle = -1;
@@ -8,7 +11,8 @@ libusb_hotplug_callback_handle	callback_handle = -1;
 struct libusb_device_descriptor		device_device_desc;
 struct libusb_config_descriptor		**device_config_desc;
 
-pthread_t hotplug_monitor_thread;
+// Held shared around every use of dev_handle and exclusively to replace it.
+static pthread_rwlock_t handle_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 int hotplug_callback(struct libusb_context *ctx __attribute__((unused)),
 			struct libusb_device *dev __attribute__((unused)),
@@ -16,19 +20,24 @@ int hotplug_callback(struct libusb_context *ctx __attribute__((unused)),
 			void *user_data __attribute__((unused))) {
 	printf("Hotplug event\n");
 
-	kill(0, SIGINT);
+	wheel_lost();
 	return 0;
 }
 
-void *hotplug_monitor(void *arg __attribute__((unused))) {
-	printf("Start hotplug_monitor thread, thread id(%d)\n", gettid());
-	while(true) {
-		usleep(100 * 1000);
-		libusb_handle_events_completed(NULL, NULL);
+static void free_descriptor() {
+	if (!device_config_desc)
+		return;
+	for (int i = 0; i < device_device_desc.bNumConfigurations; i++) {
+		if (device_config_desc[i])
+			libusb_free_config_descriptor(device_config_desc[i]);
 	}
+	delete[] device_config_desc;
+	device_config_desc = NULL;
 }
 
 int get_descriptor(libusb_device *device) {
+	free_descriptor();
+
 	int result;
 	result = libusb_get_device_descriptor(device, &device_device_desc);
 	if (result != LIBUSB_SUCCESS) {
@@ -39,7 +48,7 @@ int get_descriptor(libusb_device *device) {
 		return result;
 	}
 
-	device_config_desc = new struct libusb_config_descriptor *[device_device_desc.bNumConfigurations];
+	device_config_desc = new struct libusb_config_descriptor *[device_device_desc.bNumConfigurations]();
 	for (int i = 0; i < device_device_desc.bNumConfigurations; i++) {
 		result = libusb_get_config_descriptor(device, i, &device_config_desc[i]);
 		if (result != LIBUSB_SUCCESS) {
@@ -54,75 +63,31 @@ int get_descriptor(libusb_device *device) {
 	return LIBUSB_SUCCESS;
 }
 
-int connect_device(int vendor_id, int product_id) {
-	int result;
-	result = libusb_init(&context);
-	if (result < 0) {
-		fprintf(stderr, "Init error: %s\n", libusb_strerror((libusb_error)result));
-		return 1;
-	}
-	libusb_set_debug(context, 3);
-
-	libusb_device **list = NULL;
-	libusb_device *found = NULL;
-
-	int cnt = libusb_get_device_list(context, &list);
-	if (cnt < 0) {
-		if (verbose_level) {
-			fprintf(stderr, "Error retrieving device list: %s\n",
-					libusb_strerror((libusb_error)cnt));
-		}
-		return cnt;
-	}
-
-	while (found == NULL) {
-		cnt = libusb_get_device_list(context, &devs);
-		if (cnt < 0) {
-			fprintf(stderr, "Get Device Error: %s\n",
-					libusb_strerror((libusb_error)cnt));
-			return 1;
-		}
-		if (verbose_level)
-			printf("%d Devices in list\n", cnt);
-
-		for (int i = 0; i < cnt; i++) {
-			libusb_device *dvc = devs[i];
-			result = get_descriptor(dvc);
-			if (result != LIBUSB_SUCCESS)
-				continue;
-
-			if (device_device_desc.bDeviceClass == LIBUSB_CLASS_HUB)
-				continue;
+static int register_hotplug(int vendor_id, int product_id) {
+	if (callback_handle != -1)
+		return 0;
 
-			if (vendor_id == -1 && product_id == -1) {
-				found = dvc;
-				break;
-			}
-			else if ((vendor_id == device_device_desc.idVendor || vendor_id == LIBUSB_HOTPLUG_MATCH_ANY) &&
-				(product_id == device_device_desc.idProduct || product_id == LIBUSB_HOTPLUG_MATCH_ANY)) {
-				found = dvc;
-				break;
-			}
-		}
-
-		if (verbose_level && vendor_id != -1 && product_id != -1)
-			printf("Target device not found\n");
-		libusb_free_device_list(devs, 1);
-		sleep(1);
-	}
+	int result = libusb_hotplug_register_callback(context,
+		(libusb_hotplug_event) (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+		(libusb_hotplug_flag) 0, vendor_id, product_id,
+		LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL, &callback_handle);
 
-	result = libusb_open(found, &dev_handle);
 	if (result != LIBUSB_SUCCESS) {
-		if (verbose_level) {
-			fprintf(stderr, "Error opening device handle: %s\n",
-					libusb_strerror((libusb_error)result));
-		}
-		dev_handle = NULL;
-		libusb_free_device_list(list, 1);
+		fprintf(stderr, "Error registering callback\n");
 		return result;
 	}
+	return 0;
+}
 
-	result = libusb_set_auto_detach_kernel_driver(dev_handle, 0);
+// Set up the shared context and have the wheel discovered as it arrives.
+static int watch_device(int vendor_id, int product_id) {
+	if (discovery_start())
+		return 1;
+	return discovery_watch(vendor_id, product_id);
+}
+
+static int open_device() {
+	int result = libusb_set_auto_detach_kernel_driver(dev_handle, 0);
 	if (result != LIBUSB_SUCCESS) {
 		fprintf(stderr, "libusb_set_auto_detach_kernel_driver() failed: %s\n",
 				libusb_strerror((libusb_error)result));
@@ -162,27 +127,176 @@ int connect_device(int vendor_id, int product_id) {
 				libusb_strerror((libusb_error)result));
 		return result;
 	}
+	return LIBUSB_SUCCESS;
+}
 
-	if (callback_handle == -1) {
-		result = libusb_hotplug_register_callback(context,
-			(libusb_hotplug_event) (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
-			(libusb_hotplug_flag) 0, vendor_id, product_id,
-			LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL, &callback_handle);
+int connect_device(int vendor_id, int product_id) {
+	if (watch_device(vendor_id, product_id))
+		return 1;
 
-		if (result != LIBUSB_SUCCESS) {
-			fprintf(stderr, "Error registering callback\n");
-			libusb_exit(context);
-			return result;
+	if (verbose_level)
+		printf("Waiting for the wheel\n");
+	libusb_device *found = discovery_wait(vendor_id, product_id, -1);
+	int result = get_descriptor(found);
+	if (result == LIBUSB_SUCCESS)
+		result = libusb_open(found, &dev_handle);
+	gadget_speed_set_wheel(libusb_get_device_speed(found));
+	libusb_unref_device(found);
+	if (result != LIBUSB_SUCCESS) {
+		if (verbose_level) {
+			fprintf(stderr, "Error opening device handle: %s\n",
+					libusb_strerror((libusb_error)result));
 		}
-		pthread_create(&hotplug_monitor_thread, 0,
-			hotplug_monitor, nullptr);
+		dev_handle = NULL;
+		return result;
 	}
 
-	return 0;
+	result = open_device();
+	if (result != LIBUSB_SUCCESS) {
+		libusb_close(dev_handle);
+		dev_handle = NULL;
+		return result;
+	}
+
+	return register_hotplug(vendor_id, product_id);
+}
+
+int prepare_device(int vendor_id, int product_id) {
+	if (watch_device(vendor_id, product_id))
+		return 1;
+
+	return register_hotplug(vendor_id, product_id);
+}
+
+void wheel_handle_hold() {
+	pthread_rwlock_rdlock(&handle_lock);
+}
+
+void wheel_handle_drop() {
+	pthread_rwlock_unlock(&handle_lock);
+}
+
+// Returns true if dev_handle can be used, false (and with the lock dropped)
+// while the wheel is away.
+static bool hold_device() {
+	wheel_handle_hold();
+	if (dev_handle)
+		return true;
+	wheel_handle_drop();
+	return false;
+}
+
+static int drop_device(int result) {
+	wheel_handle_drop();
+	if (result == LIBUSB_ERROR_NO_DEVICE)
+		wheel_lost();
+	return result;
+}
+
+void close_device() {
+	pthread_rwlock_wrlock(&handle_lock);
+	if (dev_handle)
+		libusb_close(dev_handle);
+	dev_handle = NULL;
+	pthread_rwlock_unlock(&handle_lock);
+}
+
+static bool descriptor_extra_matches(const unsigned char *a, int a_length,
+			const unsigned char *b, int b_length) {
+	return a_length == b_length && (a_length == 0 || !memcmp(a, b, a_length));
+}
+
+// Compares what the host enumerated from: the configuration, interface,
+// class (HID) and endpoint descriptors.
+static bool config_matches(const struct libusb_config_descriptor *a,
+			const struct libusb_config_descriptor *b) {
+	if (a->wTotalLength != b->wTotalLength || a->bNumInterfaces != b->bNumInterfaces ||
+			a->bConfigurationValue != b->bConfigurationValue)
+		return false;
+	for (int i = 0; i < a->bNumInterfaces; i++) {
+		const struct libusb_interface *ia = &a->interface[i];
+		const struct libusb_interface *ib = &b->interface[i];
+		if (ia->num_altsetting != ib->num_altsetting)
+			return false;
+		for (int j = 0; j < ia->num_altsetting; j++) {
+			const struct libusb_interface_descriptor *da = &ia->altsetting[j];
+			const struct libusb_interface_descriptor *db = &ib->altsetting[j];
+			if (da->bInterfaceNumber != db->bInterfaceNumber ||
+					da->bAlternateSetting != db->bAlternateSetting ||
+					da->bNumEndpoints != db->bNumEndpoints ||
+					da->bInterfaceClass != db->bInterfaceClass ||
+					!descriptor_extra_matches(da->extra, da->extra_length,
+						db->extra, db->extra_length))
+				return false;
+			for (int k = 0; k < da->bNumEndpoints; k++) {
+				const struct libusb_endpoint_descriptor *ea = &da->endpoint[k];
+				const struct libusb_endpoint_descriptor *eb = &db->endpoint[k];
+				if (ea->bEndpointAddress != eb->bEndpointAddress ||
+						ea->bmAttributes != eb->bmAttributes ||
+						ea->wMaxPacketSize != eb->wMaxPacketSize ||
+						ea->bInterval != eb->bInterval)
+					return false;
+			}
+		}
+	}
+	return true;
+}
+
+static bool descriptors_match(libusb_device *device) {
+	struct libusb_device_descriptor desc;
+	if (libusb_get_device_descriptor(device, &desc) != LIBUSB_SUCCESS ||
+			memcmp(&desc, &device_device_desc, sizeof(desc)))
+		return false;
+
+	for (int i = 0; i < desc.bNumConfigurations; i++) {
+		struct libusb_config_descriptor *config;
+		if (libusb_get_config_descriptor(device, i, &config) != LIBUSB_SUCCESS)
+			return false;
+		bool matches = config_matches(config, device_config_desc[i]);
+		libusb_free_config_descriptor(config);
+		if (!matches)
+			return false;
+	}
+	return true;
+}
+
+int reopen_device(int timeout_ms) {
+	libusb_device *found = discovery_wait(device_device_desc.idVendor,
+		device_device_desc.idProduct, timeout_ms);
+	if (!found)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	int result = 1;
+	libusb_device_handle *handle = NULL;
+	if (descriptors_match(found))
+		result = libusb_open(found, &handle);
+	if (result == LIBUSB_SUCCESS)
+		gadget_speed_set_wheel(libusb_get_device_speed(found));
+	libusb_unref_device(found);
+	if (result != LIBUSB_SUCCESS)
+		return result;
+
+	// The kernel HID driver binds to the wheel again when it comes back.
+	libusb_set_auto_detach_kernel_driver(handle, 0);
+	int config = 0;
+	libusb_get_configuration(handle, &config);
+	for (int i = 0; i < device_device_desc.bNumConfigurations; i++) {
+		if (device_config_desc[i]->bConfigurationValue != config)
+			continue;
+		for (int j = 0; j < device_config_desc[i]->bNumInterfaces; j++)
+			libusb_detach_kernel_driver(handle, j);
+	}
+
+	pthread_rwlock_wrlock(&handle_lock);
+	dev_handle = handle;
+	pthread_rwlock_unlock(&handle_lock);
+	return LIBUSB_SUCCESS;
 }
 
 void reset_device() {
-	int result = libusb_reset_device(dev_handle);
+	if (!hold_device())
+		return;
+	int result = drop_device(libusb_reset_device(dev_handle));
 	if (result != LIBUSB_SUCCESS) {
 		fprintf(stderr, "Error resetting device: %s\n",
 				libusb_strerror((libusb_error)result));
@@ -190,7 +304,9 @@ void reset_device() {
 }
 
 void set_configuration(int configuration) {
-	int result = libusb_set_configuration(dev_handle, configuration);
+	if (!hold_device())
+		return;
+	int result = drop_device(libusb_set_configuration(dev_handle, configuration));
 	if (result != LIBUSB_SUCCESS) {
 		fprintf(stderr, "Error setting configuration(%d): %s\n",
 				configuration, libusb_strerror((libusb_error)result));
@@ -198,7 +314,9 @@ void set_configuration(int configuration) {
 }
 
 void claim_interface(int interface) {
-	int result = libusb_claim_interface(dev_handle, interface);
+	if (!hold_device())
+		return;
+	int result = drop_device(libusb_claim_interface(dev_handle, interface));
 	if (result != LIBUSB_SUCCESS) {
 		fprintf(stderr, "Error claiming interface(%d): %s\n",
 				interface, libusb_strerror((libusb_error)result));
@@ -206,7 +324,9 @@ void claim_interface(int interface) {
 }
 
 void release_interface(int interface) {
-	int result = libusb_release_interface(dev_handle, interface);
+	if (!hold_device())
+		return;
+	int result = drop_device(libusb_release_interface(dev_handle, interface));
 	if (result != LIBUSB_SUCCESS && result != LIBUSB_ERROR_NOT_FOUND) {
 		fprintf(stderr, "Error releasing interface(%d): %s\n",
 				interface, libusb_strerror((libusb_error)result));
@@ -214,7 +334,9 @@ void release_interface(int interface) {
 }
 
 void set_interface_alt_setting(int interface, int altsetting) {
-	int result = libusb_set_interface_alt_setting(dev_handle, interface, altsetting);
+	if (!hold_device())
+		return;
+	int result = drop_device(libusb_set_interface_alt_setting(dev_handle, interface, altsetting));
 	if (result != LIBUSB_SUCCESS) {
 		fprintf(stderr, "Error setting interface altsetting(%d, %d): %s\n",
 				interface, altsetting, libusb_strerror((libusb_error)result));
@@ -223,10 +345,12 @@ void set_interface_alt_setting(int interface, int altsetting) {
 
 int control_request(const usb_ctrlrequest *setup_packet, int *nbytes,
 			unsigned char **dataptr, int timeout) {
-	int result = libusb_control_transfer(dev_handle,
+	int result = LIBUSB_ERROR_NO_DEVICE;
+	if (hold_device())
+		result = drop_device(libusb_control_transfer(dev_handle,
 					setup_packet->bRequestType, setup_packet->bRequest,
 					setup_packet->wValue, setup_packet->wIndex, *dataptr,
-					setup_packet->wLength, timeout);
+					setup_packet->wLength, timeout));
 
 	if (result < 0) {
 		if (verbose_level) {
@@ -254,6 +378,8 @@ int send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
 
 	bool incomplete_transfer = false;
 
+	if (!hold_device())
+		return LIBUSB_ERROR_NO_DEVICE;
 	switch (attributes & USB_ENDPOINT_XFERTYPE_MASK) {
 	case USB_ENDPOINT_XFER_CONTROL:
 		fprintf(stderr, "Can't send on a control endpoint.\n");
@@ -275,8 +401,8 @@ int send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
 				if (incomplete_transfer)
 					printf("Resent Bulk transfer on EP%02x for attempt %d. length(%d), transferred(%d)\n",
 						endpoint, attempt, length, transferred);
-				if (verbose_level > 2)
-					printf("Sent %d bytes (Bulk) to EP%02x\n", transferred, endpoint);
+				if (logger_on(3))
+					logger_record(LOGGER_SENT_DEVICE, endpoint, transferred, NULL, 0);
 			}
 			if ((result == LIBUSB_ERROR_PIPE || result == LIBUSB_ERROR_TIMEOUT))
 				libusb_clear_halt(dev_handle, endpoint);
@@ -290,10 +416,11 @@ int send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
 
 		if (transferred != length)
 			fprintf(stderr, "Incomplete Interrupt transfer on EP%02x\n", endpoint);
-		if (result == LIBUSB_SUCCESS && verbose_level > 2)
-			printf("Sent %d bytes (Int) to libusb EP%02x\n", transferred, endpoint);
+		if (result == LIBUSB_SUCCESS && logger_on(3))
+			logger_record(LOGGER_SENT_DEVICE, endpoint, transferred, NULL, 0);
 		break;
 	}
+	drop_device(result);
 	if (result != LIBUSB_SUCCESS) {
 		fprintf(stderr, "Transfer error sending on EP%02x: %s\n",
 				endpoint, libusb_strerror((libusb_error)result));
@@ -302,11 +429,13 @@ int send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
 }
 
 int receive_data(uint8_t endpoint, uint8_t attributes, uint16_t maxPacketSize,
-			uint8_t **dataptr, int *length, int timeout) {
+			uint8_t *data, int *length, int timeout) {
 	int result = LIBUSB_SUCCESS;
 	timeout = 0;
 
 	int attempt = 0;
+	if (!hold_device())
+		return LIBUSB_ERROR_NO_DEVICE;
 	switch (attributes & USB_ENDPOINT_XFERTYPE_MASK) {
 	case USB_ENDPOINT_XFER_CONTROL:
 		fprintf(stderr, "Can't read on a control endpoint.\n");
@@ -316,11 +445,10 @@ int receive_data(uint8_t endpoint, uint8_t attributes, uint16_t maxPacketSize,
 			fprintf(stderr, "Isochronous(read) endpoint EP%02x unhandled.\n", endpoint);
 		break;
 	case USB_ENDPOINT_XFER_BULK:
-		*dataptr = new uint8_t[maxPacketSize * 8];
 		do {
-			result = libusb_bulk_transfer(dev_handle, endpoint, *dataptr, maxPacketSize, length, timeout);
-			if (result == LIBUSB_SUCCESS && verbose_level > 2)
-				printf("Received bulk data(%d) bytes\n", *length);
+			result = libusb_bulk_transfer(dev_handle, endpoint, data, maxPacketSize, length, timeout);
+			if (result == LIBUSB_SUCCESS && logger_on(3))
+				logger_record(LOGGER_RECEIVED_DEVICE, endpoint, *length, NULL, 0);
 			if ((result == LIBUSB_ERROR_PIPE || result == LIBUSB_ERROR_TIMEOUT))
 				libusb_clear_halt(dev_handle, endpoint);
 
@@ -328,12 +456,12 @@ int receive_data(uint8_t endpoint, uint8_t attributes, uint16_t maxPacketSize,
 		} while ((result == LIBUSB_ERROR_PIPE || result == LIBUSB_ERROR_TIMEOUT) && attempt < MAX_ATTEMPTS);
 		break;
 	case USB_ENDPOINT_XFER_INT:
-		*dataptr = new uint8_t[maxPacketSize];
-		result = libusb_interrupt_transfer(dev_handle, endpoint, *dataptr, maxPacketSize, length, timeout);
-		if (result == LIBUSB_SUCCESS && verbose_level > 2)
-			printf("Received int data(%d) bytes\n", *length);
+		result = libusb_interrupt_transfer(dev_handle, endpoint, data, maxPacketSize, length, timeout);
+		if (result == LIBUSB_SUCCESS && logger_on(3))
+			logger_record(LOGGER_RECEIVED_DEVICE, endpoint, *length, NULL, 0);
 		break;
 	}
+	drop_device(result);
 
 	if (result != LIBUSB_SUCCESS) {
 		fprintf(stderr, "Transfer error receiving on EP%02x: %s\n",
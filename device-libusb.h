@@ -4,7 +4,6 @@
 
 #define MAX_ATTEMPTS 5
 
-extern libusb_device			**devs;
 extern libusb_device_handle		*dev_handle;
 extern libusb_context			*context;
 extern libusb_hotplug_callback_handle	callback_handle;
@@ -12,9 +11,22 @@ extern libusb_hotplug_callback_handle	callback_handle;
 extern struct libusb_device_descriptor		device_device_desc;
 extern struct libusb_config_descriptor		**device_config_desc;
 
-extern pthread_t hotplug_monitor_thread;
-
+// Wait for the wheel to arrive and open it.
 int connect_device(int vendorId, int productId);
+// Set up libusb for a wheel that is opened later by the re-attach thread.
+int prepare_device(int vendorId, int productId);
+// Close the wheel once it is gone; the I/O functions below then fail with
+// LIBUSB_ERROR_NO_DEVICE, which also marks the wheel lost (see reattach.h).
+void close_device();
+// Open the wheel again once it is back, waiting up to timeout_ms for it:
+// 0 on success, 1 if its descriptors differ from the cached ones,
+// LIBUSB_ERROR_NOT_FOUND if it did not arrive, another libusb error if it
+// is not usable yet.
+int reopen_device(int timeout_ms);
+// Keep dev_handle from being replaced while it is used outside of the
+// functions below, e.g. by async transfers.
+void wheel_handle_hold();
+void wheel_handle_drop();
 void reset_device();
 void set_configuration(int configuration);
 void claim_interface(int interface);
@@ -24,5 +36,6 @@ int control_request(const usb_ctrlrequest *setup_packet, int *nbytes,
 			unsigned char **dataptr, int timeout);
 int send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
 			int length);
+// Reads into data, which must hold maxPacketSize bytes.
 int receive_data(uint8_t endpoint, uint8_t attributes, uint16_t maxPacketSize,
-			uint8_t **dataptr, int *length, int timeout);
+			uint8_t *data, int *length, int timeout);
@@ -0,0 +1,227 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "discovery.h"
+#include "device-libusb.h"
+#include "rt.h"
+
+struct present_device {
+	libusb_device	*device;
+	int		vendor_id;
+	int		product_id;
+};
+
+struct watch {
+	int				vendor_id;
+	int				product_id;
+	libusb_hotplug_callback_handle	handle;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static struct present_device present[DISCOVERY_MAX_DEVICES];
+static int n_present;
+static uint32_t generation;
+static struct watch watches[DISCOVERY_MAX_WATCHES];
+static int n_watches;
+
+static pthread_t discovery_thread;
+static volatile bool discovery_stopping;
+
+static bool id_matches(int wanted, int id) {
+	return wanted == LIBUSB_HOTPLUG_MATCH_ANY || wanted == id;
+}
+
+// Runs on the thread handling the events of the context, or on the caller of
+// libusb_hotplug_register_callback() for the devices already plugged in.
+static int LIBUSB_CALL discovery_callback(libusb_context *ctx __attribute__((unused)),
+			libusb_device *device, libusb_hotplug_event event,
+			void *user_data __attribute__((unused))) {
+	pthread_mutex_lock(&lock);
+	int i = 0;
+	while (i < n_present && present[i].device != device)
+		i++;
+
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT && i < n_present) {
+		libusb_unref_device(present[i].device);
+		present[i] = present[--n_present];
+		generation++;
+		pthread_cond_broadcast(&changed);
+	}
+	else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED && i == n_present) {
+		struct libusb_device_descriptor desc;
+		if (libusb_get_device_descriptor(device, &desc) == LIBUSB_SUCCESS &&
+				desc.bDeviceClass != LIBUSB_CLASS_HUB) {
+			if (n_present < DISCOVERY_MAX_DEVICES) {
+				present[n_present].device = libusb_ref_device(device);
+				present[n_present].vendor_id = desc.idVendor;
+				present[n_present].product_id = desc.idProduct;
+				n_present++;
+				generation++;
+				if (verbose_level)
+					printf("Device %04x:%04x arrived\n", desc.idVendor, desc.idProduct);
+				pthread_cond_broadcast(&changed);
+			}
+			else {
+				fprintf(stderr, "Too many devices, ignoring %04x:%04x\n",
+						desc.idVendor, desc.idProduct);
+			}
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+// The wheel's async transfers complete on whichever thread handles the
+// events of the context, so this one runs with the wheel's priority.
+static void *discovery_loop(void *arg __attribute__((unused))) {
+	rt_enter(RT_ROLE_WHEEL_IN);
+	printf("Start discovery thread, thread id(%d)\n", gettid());
+
+	while (!discovery_stopping) {
+		struct timeval tv = { .tv_sec = 0, .tv_usec = 100 * 1000 };
+		int result = libusb_handle_events_timeout_completed(context, &tv, NULL);
+		if (result != LIBUSB_SUCCESS && result != LIBUSB_ERROR_INTERRUPTED) {
+			fprintf(stderr, "Error handling events: %s\n",
+					libusb_strerror((libusb_error)result));
+		}
+	}
+
+	printf("End discovery thread, thread id(%d)\n", gettid());
+	return NULL;
+}
+
+int discovery_start() {
+	if (discovery_thread)
+		return 0;
+
+	if (!context) {
+		int result = libusb_init(&context);
+		if (result < 0) {
+			fprintf(stderr, "Init error: %s\n", libusb_strerror((libusb_error)result));
+			context = NULL;
+			return 1;
+		}
+		libusb_set_debug(context, 3);
+	}
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		fprintf(stderr, "libusb has no hotplug support on this platform\n");
+		return 1;
+	}
+
+	discovery_stopping = false;
+	pthread_create(&discovery_thread, 0, discovery_loop, NULL);
+	return 0;
+}
+
+void discovery_stop() {
+	for (int i = 0; i < n_watches; i++)
+		libusb_hotplug_deregister_callback(context, watches[i].handle);
+	n_watches = 0;
+
+	if (discovery_thread) {
+		discovery_stopping = true;
+		if (pthread_join(discovery_thread, NULL))
+			fprintf(stderr, "Error join discovery_thread\n");
+		discovery_thread = 0;
+	}
+
+	pthread_mutex_lock(&lock);
+	for (int i = 0; i < n_present; i++)
+		libusb_unref_device(present[i].device);
+	n_present = 0;
+	pthread_mutex_unlock(&lock);
+}
+
+int discovery_watch(int vendor_id, int product_id) {
+	for (int i = 0; i < n_watches; i++) {
+		if (watches[i].vendor_id == vendor_id && watches[i].product_id == product_id)
+			return 0;
+	}
+	if (n_watches == DISCOVERY_MAX_WATCHES) {
+		fprintf(stderr, "Too many devices to watch\n");
+		return 1;
+	}
+
+	struct watch *watch = &watches[n_watches];
+	watch->vendor_id = vendor_id;
+	watch->product_id = product_id;
+	int result = libusb_hotplug_register_callback(context,
+		(libusb_hotplug_event) (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+			LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+		LIBUSB_HOTPLUG_ENUMERATE, vendor_id, product_id,
+		LIBUSB_HOTPLUG_MATCH_ANY, discovery_callback, NULL, &watch->handle);
+	if (result != LIBUSB_SUCCESS) {
+		fprintf(stderr, "Error registering callback: %s\n",
+				libusb_strerror((libusb_error)result));
+		return 1;
+	}
+	n_watches++;
+	return 0;
+}
+
+// Returns a referenced device matching the ids from present; lock held.
+static libusb_device *find_present(int vendor_id, int product_id) {
+	for (int i = 0; i < n_present; i++) {
+		if (id_matches(vendor_id, present[i].vendor_id) &&
+				id_matches(product_id, present[i].product_id))
+			return libusb_ref_device(present[i].device);
+	}
+	return NULL;
+}
+
+static struct timespec deadline_in(int timeout_ms) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	if (timeout_ms >= 0) {
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+	return deadline;
+}
+
+libusb_device *discovery_wait(int vendor_id, int product_id, int timeout_ms) {
+	struct timespec deadline = deadline_in(timeout_ms);
+
+	pthread_mutex_lock(&lock);
+	libusb_device *device;
+	while ((device = find_present(vendor_id, product_id)) == NULL) {
+		if (timeout_ms < 0)
+			pthread_cond_wait(&changed, &lock);
+		else if (pthread_cond_timedwait(&changed, &lock, &deadline))
+			break;
+	}
+	pthread_mutex_unlock(&lock);
+	return device;
+}
+
+int discovery_list(int vendor_id, int product_id, libusb_device **devices, int max) {
+	int n = 0;
+	pthread_mutex_lock(&lock);
+	for (int i = 0; i < n_present && n < max; i++) {
+		if (id_matches(vendor_id, present[i].vendor_id) &&
+				id_matches(product_id, present[i].product_id))
+			devices[n++] = libusb_ref_device(present[i].device);
+	}
+	pthread_mutex_unlock(&lock);
+	return n;
+}
+
+uint32_t discovery_wait_change(uint32_t seen, int timeout_ms) {
+	struct timespec deadline = deadline_in(timeout_ms);
+
+	pthread_mutex_lock(&lock);
+	while (generation == seen) {
+		if (pthread_cond_timedwait(&changed, &lock, &deadline))
+			break;
+	}
+	uint32_t current = generation;
+	pthread_mutex_unlock(&lock);
+	return current;
+}
@@ -0,0 +1,45 @@
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+#include <libusb-1.0/libusb.h>
+#include <stdint.h>
+
+/*
+ * Device discovery on the shared libusb context.
+ *
+ * The wheel and the trim devices all live on one libusb context, created
+ * once by discovery_start(). discovery_watch() registers a DEVICE_ARRIVED
+ * and DEVICE_LEFT hotplug callback with LIBUSB_HOTPLUG_ENUMERATE for a
+ * vendor and product id, so devices already plugged in are reported right
+ * away and the others the moment they arrive, and the devices present on
+ * the bus are kept referenced until they leave. Nothing lists the bus in a
+ * loop anymore: connect_device(), InputDevice::connect() and the re-attach
+ * thread wait on discovery_wait() instead, and the trim attach thread on
+ * discovery_wait_change().
+ *
+ * The discovery thread handles the events of the context, which is what
+ * delivers the hotplug callbacks, including the DEVICE_LEFT ones of the
+ * wheel and the trim devices.
+ */
+
+#define DISCOVERY_MAX_DEVICES	16
+#define DISCOVERY_MAX_WATCHES	4
+
+// Create the shared context if there is none yet and start the discovery
+// thread; harmless if it already runs.
+int discovery_start();
+void discovery_stop();
+// Track the devices matching vendor_id and product_id, either of which may
+// be LIBUSB_HOTPLUG_MATCH_ANY. Hubs are never tracked.
+int discovery_watch(int vendor_id, int product_id);
+// Wait up to timeout_ms (-1 to wait for ever) for a tracked device matching
+// vendor_id and product_id to be present. Returns it with a reference the
+// caller drops with libusb_unref_device(), or NULL on timeout.
+libusb_device *discovery_wait(int vendor_id, int product_id, int timeout_ms);
+// Fill devices with at most max present devices, referenced as above;
+// returns how many.
+int discovery_list(int vendor_id, int product_id, libusb_device **devices, int max);
+// Wait up to timeout_ms for a tracked device to arrive or leave after
+// generation seen, returns the current generation; discovery_wait_change(0, 0)
+// returns it right away.
+uint32_t discovery_wait_change(uint32_t seen, int timeout_ms);
+#endif
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "ffb.h"
+
+#define FFB_CMD_DOWNLOAD	0x0
+#define FFB_CMD_DOWNLOAD_PLAY	0x1
+#define FFB_CMD_EXTENDED	0x8
+#define FFB_CMD_REFRESH		0xc
+#define FFB_CMD_DEFAULT_SPRING	0xe
+
+// What a command applies to: bits 0-3 are the force slots, bit 4 the
+// settings of the extended commands.
+#define FFB_TOUCH_SETTINGS	0x10
+#define FFB_TOUCH_ALL		0x1f
+
+struct ffb_counters ffb_counters;
+
+static int touches(const uint8_t *data, int length) {
+	if (length != FFB_COMMAND_SIZE)
+		return FFB_TOUCH_ALL;
+	if ((data[0] & 0x0f) == FFB_CMD_EXTENDED)
+		return FFB_TOUCH_SETTINGS;
+	return data[0] >> 4 ? data[0] >> 4 : FFB_TOUCH_ALL;
+}
+
+static bool sets_state(const uint8_t *data, int length) {
+	if (length != FFB_COMMAND_SIZE)
+		return false;
+	switch (data[0] & 0x0f) {
+	case FFB_CMD_DOWNLOAD:
+	case FFB_CMD_DOWNLOAD_PLAY:
+	case FFB_CMD_EXTENDED:
+	case FFB_CMD_REFRESH:
+	case FFB_CMD_DEFAULT_SPRING:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Whether b sets the same state as a, both being state setting commands.
+static bool same_key(const uint8_t *a, const uint8_t *b) {
+	return a[0] == b[0] && ((a[0] & 0x0f) != FFB_CMD_EXTENDED || a[1] == b[1]);
+}
+
+struct ffb_queue *ffb_queue_create(size_t capacity) {
+	struct ffb_queue *queue = new struct ffb_queue();
+	queue->capacity = capacity;
+	queue->buffers = new uint8_t[FFB_MAX_PENDING * capacity];
+	for (int i = 0; i < FFB_MAX_PENDING; i++)
+		queue->pending[i].data = &queue->buffers[i * capacity];
+	return queue;
+}
+
+void ffb_queue_destroy(struct ffb_queue *queue) {
+	if (!queue)
+		return;
+	delete[] queue->buffers;
+	delete queue;
+}
+
+static bool repeats_sent(const struct ffb_queue *queue, const uint8_t *data) {
+	for (int i = 0; i < queue->n_sent; i++) {
+		if (same_key(queue->sent[i], data))
+			return memcmp(queue->sent[i], data, FFB_COMMAND_SIZE) == 0;
+	}
+	return false;
+}
+
+enum ffb_push_result ffb_queue_push(struct ffb_queue *queue, const uint8_t *data, int length,
+			const struct packet_stamp *stamp, uint64_t dequeued_ns,
+			struct ffb_command *superseded) {
+	ffb_counters.commands.fetch_add(1, std::memory_order_relaxed);
+	int touch = touches(data, length);
+	bool state = sets_state(data, length);
+
+	// Only the latest pending command for the same slots may be replaced,
+	// anything queued for them after it has to see it first.
+	int i = queue->count - 1;
+	while (i >= 0) {
+		struct ffb_command *pending = &queue->pending[(queue->head + i) % FFB_MAX_PENDING];
+		if (touches(pending->data, pending->length) & touch)
+			break;
+		i--;
+	}
+
+	if (i >= 0 && state) {
+		struct ffb_command *pending = &queue->pending[(queue->head + i) % FFB_MAX_PENDING];
+		if (sets_state(pending->data, pending->length) && same_key(pending->data, data)) {
+			superseded->stamp = pending->stamp;
+			superseded->dequeued_ns = pending->dequeued_ns;
+			memcpy(pending->data, data, length);
+			pending->stamp = *stamp;
+			pending->dequeued_ns = dequeued_ns;
+			ffb_counters.coalesced.fetch_add(1, std::memory_order_relaxed);
+			return FFB_COALESCED;
+		}
+	}
+	else if (state && repeats_sent(queue, data)) {
+		ffb_counters.repeated.fetch_add(1, std::memory_order_relaxed);
+		return FFB_REPEATED;
+	}
+
+	struct ffb_command *command = &queue->pending[(queue->head + queue->count) % FFB_MAX_PENDING];
+	memcpy(command->data, data, length);
+	command->length = length;
+	command->stamp = *stamp;
+	command->dequeued_ns = dequeued_ns;
+	queue->count++;
+	return FFB_QUEUED;
+}
+
+void ffb_queue_pop(struct ffb_queue *queue) {
+	struct ffb_command *command = ffb_queue_front(queue);
+	int touch = touches(command->data, command->length);
+
+	int n = 0;
+	for (int i = 0; i < queue->n_sent; i++) {
+		if (!(touches(queue->sent[i], FFB_COMMAND_SIZE) & touch))
+			memmove(queue->sent[n++], queue->sent[i], FFB_COMMAND_SIZE);
+	}
+	queue->n_sent = n;
+	if (sets_state(command->data, command->length) && n < FFB_MAX_SENT)
+		memcpy(queue->sent[queue->n_sent++], command->data, FFB_COMMAND_SIZE);
+
+	queue->head = (queue->head + 1) % FFB_MAX_PENDING;
+	queue->count--;
+}
+
+void ffb_queue_forget(struct ffb_queue *queue) {
+	queue->n_sent = 0;
+}
+
+void ffb_print() {
+	uint64_t commands = ffb_counters.commands.load(std::memory_order_relaxed);
+	if (!commands)
+		return;
+	printf("Force feedback: %llu commands, %llu coalesced, %llu repeats dropped, "
+		"%llu failed, up to %d in flight\n", (unsigned long long)commands,
+		(unsigned long long)ffb_counters.coalesced.load(std::memory_order_relaxed),
+		(unsigned long long)ffb_counters.repeated.load(std::memory_order_relaxed),
+		(unsigned long long)ffb_counters.failed.load(std::memory_order_relaxed),
+		ffb_counters.max_in_flight.load(std::memory_order_relaxed));
+}
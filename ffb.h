@@ -0,0 +1,92 @@
+#ifndef FFB_H
+#define FFB_H
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "packet-queue.h"
+
+/*
+ * Coalescing of the force feedback commands the host sends to the wheel.
+ *
+ * The G29 takes 7 byte commands on its interrupt OUT endpoint. The high
+ * nibble of the first byte selects the force slots the command applies to
+ * and the low nibble is the command; the extended command (0x8) changes a
+ * setting picked by the second byte (range, LEDs, mode) instead of a slot.
+ *
+ * Commands wait in an ffb_queue until the endpoint takes them. The ones
+ * that only set state (download force, download and play, refresh force,
+ * set default spring and the extended ones) replace a pending command with
+ * the same first byte, and second byte for the extended ones, as long as
+ * nothing else for the same slots was queued after it, so only the latest
+ * force per slot is sent when the wheel falls behind. They are dropped if
+ * they repeat the last command sent for their slots. Play, stop and the
+ * other commands, and any packet that is not 7 bytes long, go out as they
+ * came.
+ */
+
+#define FFB_COMMAND_SIZE	7
+#define FFB_MAX_PENDING		16
+#define FFB_MAX_SENT		16
+
+struct ffb_command {
+	struct packet_stamp	stamp;
+	uint64_t		dequeued_ns;
+	int			length;
+	uint8_t			*data;
+};
+
+struct ffb_queue {
+	struct ffb_command	pending[FFB_MAX_PENDING];	// ring, oldest at head
+	int			head;
+	int			count;
+	size_t			capacity;	// payload bytes per command
+	uint8_t			*buffers;
+	// Last state setting command sent per first (and second) byte.
+	uint8_t			sent[FFB_MAX_SENT][FFB_COMMAND_SIZE];
+	int			n_sent;
+};
+
+enum ffb_push_result {
+	FFB_QUEUED,
+	FFB_COALESCED,	// replaced a pending command, returned in superseded
+	FFB_REPEATED,	// dropped, the wheel already has it
+};
+
+struct ffb_counters {
+	std::atomic<uint64_t>	commands;	// received from the host
+	std::atomic<uint64_t>	coalesced;	// replaced while pending
+	std::atomic<uint64_t>	repeated;	// dropped as a repeat
+	std::atomic<uint64_t>	failed;		// not taken by the wheel
+	std::atomic<int>	max_in_flight;
+};
+
+extern struct ffb_counters ffb_counters;
+
+struct ffb_queue *ffb_queue_create(size_t capacity);
+void ffb_queue_destroy(struct ffb_queue *queue);
+
+static inline bool ffb_queue_empty(const struct ffb_queue *queue) {
+	return queue->count == 0;
+}
+
+static inline bool ffb_queue_full(const struct ffb_queue *queue) {
+	return queue->count == FFB_MAX_PENDING;
+}
+
+// Queue a command of at most capacity bytes; the queue must not be full.
+// The stamps of a command it replaces are returned in superseded.
+enum ffb_push_result ffb_queue_push(struct ffb_queue *queue, const uint8_t *data, int length,
+			const struct packet_stamp *stamp, uint64_t dequeued_ns,
+			struct ffb_command *superseded);
+static inline struct ffb_command *ffb_queue_front(struct ffb_queue *queue) {
+	return &queue->pending[queue->head];
+}
+// Remove the front command once it is handed to the wheel, which makes it
+// the last one sent for its slots.
+void ffb_queue_pop(struct ffb_queue *queue);
+// Forget what was sent, after a transfer failed or the wheel came back, so
+// that no command is dropped as a repeat of something the wheel lacks.
+void ffb_queue_forget(struct ffb_queue *queue);
+void ffb_print();
+#endif
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "misc.h"
+#include "gadget-speed.h"
+
+#define MICROFRAME_US	125
+
+int gadget_speed_choice = USB_SPEED_HIGH;
+int wheel_speed = USB_SPEED_UNKNOWN;
+int poll_interval_us = 0;
+
+int gadget_speed_parse(const char *name) {
+	if (!strcmp(name, "full"))
+		gadget_speed_choice = USB_SPEED_FULL;
+	else if (!strcmp(name, "high"))
+		gadget_speed_choice = USB_SPEED_HIGH;
+	else if (!strcmp(name, "wheel"))
+		gadget_speed_choice = GADGET_SPEED_WHEEL;
+	else {
+		fprintf(stderr, "Invalid speed: %s\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+enum usb_device_speed gadget_speed() {
+	if (gadget_speed_choice != GADGET_SPEED_WHEEL)
+		return (enum usb_device_speed)gadget_speed_choice;
+	// raw-gadget UDCs do not go beyond high speed.
+	if (wheel_speed == USB_SPEED_UNKNOWN || wheel_speed > USB_SPEED_HIGH)
+		return USB_SPEED_HIGH;
+	return (enum usb_device_speed)wheel_speed;
+}
+
+const char *gadget_speed_name(int speed) {
+	switch (speed) {
+	case USB_SPEED_LOW:
+		return "low";
+	case USB_SPEED_FULL:
+		return "full";
+	case USB_SPEED_HIGH:
+		return "high";
+	case USB_SPEED_SUPER:
+		return "super";
+	default:
+		return "unknown";
+	}
+}
+
+void gadget_speed_set_wheel(int libusb_speed) {
+	switch (libusb_speed) {
+	case 1:	// LIBUSB_SPEED_LOW
+		wheel_speed = USB_SPEED_LOW;
+		break;
+	case 2:	// LIBUSB_SPEED_FULL
+		wheel_speed = USB_SPEED_FULL;
+		break;
+	case 3:	// LIBUSB_SPEED_HIGH
+		wheel_speed = USB_SPEED_HIGH;
+		break;
+	case 4:	// LIBUSB_SPEED_SUPER and faster
+	case 5:
+		wheel_speed = USB_SPEED_SUPER;
+		break;
+	}
+}
+
+static bool frames(int speed) {
+	return speed == USB_SPEED_LOW || speed == USB_SPEED_FULL;
+}
+
+// Polling period of an interrupt endpoint.
+static int period_us(int speed, uint8_t bInterval) {
+	if (frames(speed))
+		return (bInterval ? bInterval : 1) * 1000;
+	int exponent = bInterval < 1 ? 1 : bInterval > 16 ? 16 : bInterval;
+	return MICROFRAME_US << (exponent - 1);
+}
+
+// The longest interval not above period_us, at least the shortest one.
+static uint8_t interval_for(int speed, int period_us) {
+	if (frames(speed))
+		return period_us >= 255 * 1000 ? 255 : period_us >= 1000 ? period_us / 1000 : 1;
+	uint8_t exponent = 1;
+	while (exponent < 16 && MICROFRAME_US << exponent <= period_us)
+		exponent++;
+	return exponent;
+}
+
+// Speed a high or full speed device is described at in its other speed
+// configuration descriptors.
+static int other_speed(int speed) {
+	if (speed == USB_SPEED_HIGH)
+		return USB_SPEED_FULL;
+	if (speed == USB_SPEED_FULL)
+		return USB_SPEED_HIGH;
+	return USB_SPEED_UNKNOWN;
+}
+
+// bInterval of an endpoint of the wheel at speed from for the gadget at speed.
+static uint8_t translate_interval(int from, int speed, uint8_t bEndpointAddress,
+			uint8_t bmAttributes, uint8_t bInterval) {
+	if ((bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) != USB_ENDPOINT_XFER_INT ||
+	    speed == USB_SPEED_UNKNOWN)
+		return bInterval;
+	if (poll_interval_us > 0 && (bEndpointAddress & USB_DIR_IN))
+		return interval_for(speed, poll_interval_us);
+	if (from == USB_SPEED_UNKNOWN || frames(from) == frames(speed))
+		return bInterval;
+	return interval_for(speed, period_us(from, bInterval));
+}
+
+uint8_t gadget_speed_interval(uint8_t bEndpointAddress, uint8_t bmAttributes, uint8_t bInterval) {
+	return translate_interval(wheel_speed, gadget_speed(), bEndpointAddress, bmAttributes,
+		bInterval);
+}
+
+int gadget_speed_period_us(const struct usb_endpoint_descriptor *ep) {
+	return period_us(gadget_speed(), ep->bInterval);
+}
+
+void gadget_speed_rewrite_config(uint8_t *data, int length, bool other) {
+	// An other speed configuration describes the wheel at its other speed,
+	// and is sent for the gadget at its own other speed.
+	int from = other ? other_speed(wheel_speed) : wheel_speed;
+	int to = other ? other_speed(gadget_speed()) : gadget_speed();
+	for (int offset = 0; offset + 2 <= length; offset += data[offset]) {
+		uint8_t *desc = data + offset;
+		if (desc[0] < 2)
+			break;
+		if (desc[1] == USB_DT_ENDPOINT && desc[0] >= USB_DT_ENDPOINT_SIZE &&
+		    offset + USB_DT_ENDPOINT_SIZE <= length)
+			desc[6] = translate_interval(from, to, desc[2], desc[3], desc[6]);
+	}
+}
+
+int gadget_speed_check_device(const struct usb_device_descriptor *device) {
+	int speed = gadget_speed();
+	int problems = 0;
+	if (speed == USB_SPEED_HIGH && device->bcdUSB < 0x0200) {
+		fprintf(stderr, "bcdUSB %04x is below 2.00 at high speed\n", device->bcdUSB);
+		problems++;
+	}
+	int max_packet_size0 = device->bMaxPacketSize0;
+	if (bmaxpacketsize0_must_greater_than_64 && max_packet_size0 < 64)
+		max_packet_size0 = 64;
+	if ((speed == USB_SPEED_HIGH && max_packet_size0 != 64) ||
+	    (speed == USB_SPEED_LOW && max_packet_size0 != 8) ||
+	    (max_packet_size0 != 8 && max_packet_size0 != 16 && max_packet_size0 != 32 &&
+	     max_packet_size0 != 64)) {
+		fprintf(stderr, "bMaxPacketSize0 %d is invalid at %s speed\n", max_packet_size0,
+			gadget_speed_name(speed));
+		problems++;
+	}
+	return problems;
+}
+
+int gadget_speed_check_endpoint(const struct usb_endpoint_descriptor *ep) {
+	int speed = gadget_speed();
+	int type = usb_endpoint_type(ep);
+	int max_packet_size = __le16_to_cpu(ep->wMaxPacketSize) & USB_ENDPOINT_MAXP_MASK;
+	int problems = 0;
+
+	int limit = 0;
+	if (type == USB_ENDPOINT_XFER_INT)
+		limit = speed == USB_SPEED_LOW ? 8 : frames(speed) ? 64 : 1024;
+	else if (type == USB_ENDPOINT_XFER_BULK)
+		limit = frames(speed) ? 64 : 512;
+	else if (type == USB_ENDPOINT_XFER_ISOC)
+		limit = frames(speed) ? 1023 : 1024;
+	if (limit && (max_packet_size > limit ||
+	    (type == USB_ENDPOINT_XFER_BULK && speed == USB_SPEED_HIGH && max_packet_size != 512))) {
+		fprintf(stderr, "EP%02x: wMaxPacketSize %d is invalid at %s speed\n",
+			ep->bEndpointAddress, max_packet_size, gadget_speed_name(speed));
+		problems++;
+	}
+	if (type == USB_ENDPOINT_XFER_INT &&
+	    (ep->bInterval < 1 || (!frames(speed) && ep->bInterval > 16))) {
+		fprintf(stderr, "EP%02x: bInterval %d is invalid at %s speed\n",
+			ep->bEndpointAddress, ep->bInterval, gadget_speed_name(speed));
+		problems++;
+	}
+	return problems;
+}
@@ -0,0 +1,51 @@
+#ifndef GADGET_SPEED_H
+#define GADGET_SPEED_H
+#include <stdint.h>
+#include <linux/usb/ch9.h>
+
+/*
+ * Speed the gadget is presented at and the polling interval of its
+ * interrupt endpoints.
+ *
+ * bInterval counts milliseconds at low and full speed and is the exponent
+ * of a number of 125 us microframes at high speed, so the wheel's
+ * descriptors mean another polling period once the gadget runs at another
+ * speed than the wheel. The bInterval of interrupt endpoints is therefore
+ * translated to keep the wheel's period, or with --poll_interval_us set to
+ * the longest interval not above that many microseconds on interrupt IN
+ * endpoints, which is how often the host polls the mixed report: 1000 for
+ * 1 kHz, 125 for 8 kHz at high speed. The endpoints enabled on the UDC and
+ * the configuration descriptors ep0 sends to the host are rewritten alike,
+ * other speed configurations for the other speed of the gadget.
+ *
+ * --speed selects full or high speed, or that of the wheel ("wheel");
+ * high speed by default. The speed of the wheel is kept in the snapshot for
+ * boots without it.
+ */
+
+#define GADGET_SPEED_WHEEL	-1
+
+extern int gadget_speed_choice;		// enum usb_device_speed or GADGET_SPEED_WHEEL
+extern int wheel_speed;			// enum usb_device_speed, USB_SPEED_UNKNOWN until seen
+extern int poll_interval_us;		// 0: keep the period of the wheel
+
+int gadget_speed_parse(const char *name);
+// The speed to initialize the gadget with.
+enum usb_device_speed gadget_speed();
+const char *gadget_speed_name(int speed);
+// From the value of libusb_get_device_speed().
+void gadget_speed_set_wheel(int libusb_speed);
+
+// bInterval of the endpoint as presented to the host.
+uint8_t gadget_speed_interval(uint8_t bEndpointAddress, uint8_t bmAttributes, uint8_t bInterval);
+// Polling period of an endpoint as presented to the host, in microseconds.
+int gadget_speed_period_us(const struct usb_endpoint_descriptor *ep);
+// Rewrite the endpoint descriptors in a configuration descriptor answer, or
+// with other set in an other speed configuration descriptor answer.
+void gadget_speed_rewrite_config(uint8_t *data, int length, bool other);
+
+// Whether descriptors are valid at the gadget speed; print each problem and
+// return their number.
+int gadget_speed_check_device(const struct usb_device_descriptor *device);
+int gadget_speed_check_endpoint(const struct usb_endpoint_descriptor *ep);
+#endif
@@ -0,0 +1,44 @@
+#include <string.h>
+
+#include "latency.h"
+#include "metrics.h"
+#include "hid-idle.h"
+
+std::atomic<int> hid_idle_duration(HID_IDLE_UNSET);
+
+static uint64_t duration_ns(int duration) {
+	return duration * HID_IDLE_UNIT_MS * 1000000ull;
+}
+
+bool hid_idle_due(struct hid_idle_filter *filter, const uint8_t *report, int length) {
+	int duration = hid_idle_duration.load(std::memory_order_relaxed);
+	if (duration == HID_IDLE_UNSET) {
+		filter->length = 0;
+		return true;
+	}
+
+	uint64_t now_ns = latency_now();
+	if (length == filter->length && !memcmp(report, filter->report, length)) {
+		if (duration == 0 || now_ns - filter->sent_ns < duration_ns(duration)) {
+			metrics_add(metrics_endpoint(0x81)->idle_suppressed);
+			return false;
+		}
+		metrics_add(metrics_endpoint(0x81)->idle_repeated);
+	}
+	memcpy(filter->report, report, length);
+	filter->length = length;
+	filter->sent_ns = now_ns;
+	return true;
+}
+
+int hid_idle_timeout_ms(const struct hid_idle_filter *filter, int max_ms) {
+	int duration = hid_idle_duration.load(std::memory_order_relaxed);
+	if (duration == HID_IDLE_UNSET || duration == 0 || filter->length == 0)
+		return max_ms;
+	uint64_t due_ns = filter->sent_ns + duration_ns(duration);
+	uint64_t now_ns = latency_now();
+	if (due_ns <= now_ns)
+		return 0;
+	uint64_t ms = (due_ns - now_ns + 999999) / 1000000;
+	return ms < (uint64_t)max_ms ? (int)ms : max_ms;
+}
@@ -0,0 +1,51 @@
+#ifndef HID_IDLE_H
+#define HID_IDLE_H
+#include <atomic>
+#include <stdint.h>
+
+#include "mixer.h"
+
+/*
+ * HID idle rate (HID 1.11, 7.2.4) of the mixed report on EP81.
+ *
+ * The wheel fails SET_IDLE, so the proxy answers SET_IDLE and GET_IDLE
+ * itself and applies the idle rate to the mixed report: once the host set
+ * it, a report identical to the last one sent is suppressed, and only
+ * repeated when the idle duration (in 4 ms units) has passed since then;
+ * never with a duration of 0. The mixed report is the only input report,
+ * so the report ID of the request is not looked at. Until the host sends
+ * SET_IDLE, and again after a bus reset, every report is sent as before.
+ */
+
+#define HID_IDLE_UNSET		-1
+#define HID_IDLE_UNIT_MS	4
+
+extern std::atomic<int> hid_idle_duration;	// HID_IDLE_UNSET or 4 ms units, 0 for indefinite
+
+// What the writer of EP81 last sent.
+struct hid_idle_filter {
+	uint8_t		report[MIXER_REPORT_MAX];
+	int		length;		// 0 until a report went out with the idle rate set
+	uint64_t	sent_ns;
+};
+
+static inline void hid_idle_set(int duration) {
+	hid_idle_duration.store(duration, std::memory_order_relaxed);
+}
+
+// The answer to GET_IDLE.
+static inline uint8_t hid_idle_get() {
+	int duration = hid_idle_duration.load(std::memory_order_relaxed);
+	return duration == HID_IDLE_UNSET ? 0 : duration;
+}
+
+static inline void hid_idle_reset() {
+	hid_idle_duration.store(HID_IDLE_UNSET, std::memory_order_relaxed);
+}
+
+// Whether report goes out now; if so it becomes the last one sent. Always
+// true, without looking at the report, while the idle rate is unset.
+bool hid_idle_due(struct hid_idle_filter *filter, const uint8_t *report, int length);
+// Milliseconds until the last report sent is to be repeated, at most max_ms.
+int hid_idle_timeout_ms(const struct hid_idle_filter *filter, int max_ms);
+#endif
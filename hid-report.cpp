@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "misc.h"
+#include "hid-report.h"
+
+#define HID_ITEM_MAIN		0
+#define HID_ITEM_GLOBAL		1
+#define HID_ITEM_LOCAL		2
+
+#define HID_MAIN_INPUT		0x8
+
+#define HID_GLOBAL_USAGE_PAGE	0x0
+#define HID_GLOBAL_REPORT_SIZE	0x7
+#define HID_GLOBAL_REPORT_ID	0x8
+#define HID_GLOBAL_REPORT_COUNT	0x9
+#define HID_GLOBAL_PUSH		0xa
+#define HID_GLOBAL_POP		0xb
+
+#define HID_LOCAL_USAGE		0x0
+#define HID_LOCAL_USAGE_MIN	0x1
+#define HID_LOCAL_USAGE_MAX	0x2
+
+#define HID_INPUT_CONSTANT	0x01
+#define HID_INPUT_VARIABLE	0x02
+
+#define MAX_USAGES		64
+#define MAX_GLOBAL_STACK	4
+
+struct hid_globals {
+	uint16_t	usage_page;
+	uint32_t	report_size;
+	uint32_t	report_count;
+	int		report_id;
+};
+
+struct hid_locals {
+	int		n_usages;
+	uint32_t	usages[MAX_USAGES];
+	uint32_t	usage_min;
+	uint32_t	usage_max;
+	bool		has_range;
+};
+
+// Local usages with a 4 byte payload carry their own usage page.
+static uint32_t full_usage(const struct hid_globals *globals, uint32_t value, int size) {
+	if (size == 4)
+		return value;
+	return HID_USAGE(globals->usage_page, value);
+}
+
+// Usage of the i-th element of a variable input item. When the item has
+// fewer usages than elements, the last usage repeats.
+static uint32_t element_usage(const struct hid_locals *locals, uint32_t i) {
+	if (locals->has_range) {
+		uint32_t usage = locals->usage_min + i;
+		return usage > locals->usage_max ? locals->usage_max : usage;
+	}
+	if (locals->n_usages == 0)
+		return 0;
+	return locals->usages[(int)i < locals->n_usages ? i : locals->n_usages - 1];
+}
+
+static void add_input(struct hid_report_layout *layout, const struct hid_globals *globals,
+			const struct hid_locals *locals, uint32_t flags, uint32_t *bits) {
+	uint32_t size = globals->report_size;
+	uint32_t count = globals->report_count;
+	int report_id = globals->report_id;
+
+	if (layout->report_id == -2)
+		layout->report_id = report_id;
+	uint32_t *cursor = &bits[report_id < 0 ? 0 : report_id];
+	uint32_t header = report_id < 0 ? 0 : 8;
+
+	if (report_id == layout->report_id && !(flags & HID_INPUT_CONSTANT) && size > 0 && size <= 32) {
+		// Array items get a single entry for their first slot.
+		uint32_t n = (flags & HID_INPUT_VARIABLE) ? count : 1;
+		for (uint32_t i = 0; i < n && layout->n_fields < HID_MAX_FIELDS; i++) {
+			struct hid_field *field = &layout->fields[layout->n_fields++];
+			field->usage = element_usage(locals, i);
+			field->bit_offset = header + *cursor + i * size;
+			field->bit_size = size;
+			field->report_id = report_id < 0 ? 0 : report_id;
+		}
+	}
+	*cursor += size * count;
+}
+
+int hid_report_parse(const uint8_t *desc, int length, struct hid_report_layout *layout) {
+	struct hid_globals globals, stack[MAX_GLOBAL_STACK];
+	struct hid_locals locals;
+	int depth = 0;
+	// Input bits seen so far per report ID, 0 also used without IDs.
+	static uint32_t bits[256];
+
+	memset(layout, 0, sizeof(*layout));
+	memset(&globals, 0, sizeof(globals));
+	memset(&locals, 0, sizeof(locals));
+	memset(bits, 0, sizeof(bits));
+	globals.report_id = -1;
+	layout->report_id = -2;
+
+	int pos = 0;
+	while (pos < length) {
+		uint8_t prefix = desc[pos++];
+
+		// Long items are reserved and not used by any known device.
+		if (prefix == 0xfe) {
+			if (pos + 1 >= length)
+				return -1;
+			pos += 2 + desc[pos];
+			continue;
+		}
+
+		int size = prefix & 0x3;
+		if (size == 3)
+			size = 4;
+		int type = (prefix >> 2) & 0x3;
+		int tag = prefix >> 4;
+		if (pos + size > length)
+			return -1;
+
+		uint32_t value = 0;
+		for (int i = 0; i < size; i++)
+			value |= (uint32_t)desc[pos + i] << (8 * i);
+		pos += size;
+
+		switch (type) {
+		case HID_ITEM_MAIN:
+			if (tag == HID_MAIN_INPUT)
+				add_input(layout, &globals, &locals, value, bits);
+			memset(&locals, 0, sizeof(locals));
+			break;
+		case HID_ITEM_GLOBAL:
+			switch (tag) {
+			case HID_GLOBAL_USAGE_PAGE:
+				globals.usage_page = value;
+				break;
+			case HID_GLOBAL_REPORT_SIZE:
+				globals.report_size = value;
+				break;
+			case HID_GLOBAL_REPORT_ID:
+				if (value == 0 || value > 255)
+					return -1;
+				globals.report_id = value;
+				break;
+			case HID_GLOBAL_REPORT_COUNT:
+				globals.report_count = value;
+				break;
+			case HID_GLOBAL_PUSH:
+				if (depth == MAX_GLOBAL_STACK)
+					return -1;
+				stack[depth++] = globals;
+				break;
+			case HID_GLOBAL_POP:
+				if (depth == 0)
+					return -1;
+				globals = stack[--depth];
+				break;
+			}
+			break;
+		case HID_ITEM_LOCAL:
+			switch (tag) {
+			case HID_LOCAL_USAGE:
+				if (locals.n_usages < MAX_USAGES)
+					locals.usages[locals.n_usages++] = full_usage(&globals, value, size);
+				break;
+			case HID_LOCAL_USAGE_MIN:
+				locals.usage_min = full_usage(&globals, value, size);
+				locals.has_range = true;
+				break;
+			case HID_LOCAL_USAGE_MAX:
+				locals.usage_max = full_usage(&globals, value, size);
+				locals.has_range = true;
+				break;
+			}
+			break;
+		}
+	}
+
+	if (layout->report_id == -2) {
+		layout->report_id = -1;
+		return -1;
+	}
+	uint32_t total = bits[layout->report_id < 0 ? 0 : layout->report_id];
+	layout->input_length = (total + 7) / 8 + (layout->report_id < 0 ? 0 : 1);
+	return 0;
+}
+
+// The HID class descriptor following the interface descriptor tells the
+// length of the report descriptor.
+static int report_descriptor_length(const struct libusb_interface_descriptor *interface) {
+	const unsigned char *extra = interface->extra;
+	int pos = 0;
+	while (pos + 9 <= interface->extra_length) {
+		if (extra[pos + 1] == LIBUSB_DT_HID && extra[pos + 6] == LIBUSB_DT_REPORT)
+			return extra[pos + 7] | extra[pos + 8] << 8;
+		if (extra[pos] == 0)
+			break;
+		pos += extra[pos];
+	}
+	return HID_MAX_DESCRIPTOR;
+}
+
+int hid_report_fetch_descriptor(libusb_device_handle *handle, uint8_t endpoint, uint8_t *desc) {
+	struct libusb_config_descriptor *config;
+	int result = libusb_get_active_config_descriptor(libusb_get_device(handle), &config);
+	if (result != LIBUSB_SUCCESS) {
+		fprintf(stderr, "libusb_get_active_config_descriptor() failed: %s\n",
+				libusb_strerror((libusb_error)result));
+		return result;
+	}
+
+	int interface_number = -1, length = 0;
+	for (int i = 0; i < config->bNumInterfaces && interface_number < 0; i++) {
+		const struct libusb_interface_descriptor *interface = &config->interface[i].altsetting[0];
+		for (int j = 0; j < interface->bNumEndpoints; j++) {
+			if (interface->endpoint[j].bEndpointAddress == endpoint) {
+				interface_number = interface->bInterfaceNumber;
+				length = report_descriptor_length(interface);
+				break;
+			}
+		}
+	}
+	libusb_free_config_descriptor(config);
+	if (interface_number < 0) {
+		fprintf(stderr, "No interface owns EP%02x\n", endpoint);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	if (length > HID_MAX_DESCRIPTOR)
+		length = HID_MAX_DESCRIPTOR;
+
+	result = libusb_control_transfer(handle,
+			LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_INTERFACE,
+			LIBUSB_REQUEST_GET_DESCRIPTOR, LIBUSB_DT_REPORT << 8, interface_number,
+			desc, length, 1000);
+	if (result < 0) {
+		fprintf(stderr, "Error fetching report descriptor of interface %d: %s\n",
+				interface_number, libusb_strerror((libusb_error)result));
+	}
+	return result;
+}
+
+void hid_report_print(const struct hid_report_layout *layout) {
+	printf("Input report %d: %d bytes, %d fields\n", layout->report_id,
+		layout->input_length, layout->n_fields);
+	for (int i = 0; i < layout->n_fields; i++) {
+		const struct hid_field *field = &layout->fields[i];
+		printf("\tusage %04x:%04x at bit %d, %d bits\n", field->usage >> 16,
+			field->usage & 0xffff, field->bit_offset, field->bit_size);
+	}
+}
@@ -0,0 +1,60 @@
+#ifndef HID_REPORT_H
+#define HID_REPORT_H
+#include <libusb-1.0/libusb.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HID_MAX_FIELDS		256
+#define HID_MAX_DESCRIPTOR	4096
+
+#define HID_USAGE(page, id)	((uint32_t)(page) << 16 | (uint16_t)(id))
+#define HID_USAGE_PAGE_GENERIC	0x01
+#define HID_USAGE_PAGE_BUTTON	0x09
+
+// Class requests (HID 1.11, 7.2) and the report types in their wValue.
+#define HID_REQ_GET_REPORT	0x01
+#define HID_REQ_GET_IDLE	0x02
+#define HID_REQ_SET_IDLE	0x0a
+#define HID_REPORT_TYPE_INPUT	1
+
+/*
+ * Input fields of a device, taken from its HID report descriptor once at
+ * connect time, so that reports can be matched and addressed by usage
+ * without parsing anything per report.
+ *
+ * Only the first input report of the descriptor is described: that is the
+ * report the mixer keeps per device. Bit offsets count from the start of
+ * the report as sent on the wire, including the report ID byte.
+ */
+
+struct hid_field {
+	uint32_t	usage;		// HID_USAGE(page, id)
+	uint16_t	bit_offset;
+	uint8_t		bit_size;
+	uint8_t		report_id;
+};
+
+struct hid_report_layout {
+	int		report_id;	// -1 if the device does not use report IDs
+	int		input_length;	// bytes, 0 if no input report was found
+	int		n_fields;
+	struct hid_field fields[HID_MAX_FIELDS];
+};
+
+int hid_report_parse(const uint8_t *desc, int length, struct hid_report_layout *layout);
+
+// Fetch the report descriptor of the interface owning endpoint into desc
+// (HID_MAX_DESCRIPTOR bytes); returns its length or a libusb error.
+int hid_report_fetch_descriptor(libusb_device_handle *handle, uint8_t endpoint, uint8_t *desc);
+
+static inline const struct hid_field *hid_report_find(const struct hid_report_layout *layout,
+						uint32_t usage) {
+	for (int i = 0; i < layout->n_fields; i++) {
+		if (layout->fields[i].usage == usage)
+			return &layout->fields[i];
+	}
+	return NULL;
+}
+
+void hid_report_print(const struct hid_report_layout *layout);
+#endif
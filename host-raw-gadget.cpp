@@ -15,6 +15,7 @@
 #include <linux/types.h>
 
 #include "host-raw-gadget.h"
+#include "trace.h"
 
 struct raw_gadget_device host_device_desc;
 
@@ -101,7 +102,9 @@ int usb_raw_ep_disable(int fd, uint32_t num) {
 }
 
 int usb_raw_ep_read(int fd, struct usb_raw_ep_io *io) {
+	TRACE2(gadget_read_entry, io->ep, io->length);
 	int rv = ioctl(fd, USB_RAW_IOCTL_EP_READ, io);
+	TRACE2(gadget_read_return, io->ep, rv);
 	if (rv < 0) {
 		if (errno == EINPROGRESS) {
 			// Ignore failures caused by the test that halts endpoints.
@@ -120,7 +123,9 @@ int usb_raw_ep_read(int fd, struct usb_raw_ep_io *io) {
 }
 
 int usb_raw_ep_write(int fd, struct usb_raw_ep_io *io) {
+	TRACE2(gadget_write_entry, io->ep, io->length);
 	int rv = ioctl(fd, USB_RAW_IOCTL_EP_WRITE, io);
+	TRACE2(gadget_write_return, io->ep, rv);
 	if (rv < 0) {
 		if (errno == EINPROGRESS) {
 			// Ignore failures caused by the test that halts endpoints.
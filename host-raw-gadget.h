@@ -1,6 +1,7 @@
+#ifndef HOST_RAW_GADGET_H
+#define HOST_RAW_GADGET_H
 #include <pthread.h>
-#include <mutex>
-#include <deque>
+#include <vector>
 
 #include "misc.h"
 
@@ -119,23 +120,31 @@ struct usb_raw_transfer_io {
 
 /*----------------------------------------------------------------------*/
 
-struct thread_info {
+struct packet_queue;
+struct async_in_stream;
+struct ep_flow;
+
+// Per-endpoint state is kept on its own cache lines: reactor callbacks read
+// the thread_info of their endpoint while other endpoints are set up.
+struct alignas(64) thread_info {
 	int				fd;
 	int				ep_num;
 	struct usb_endpoint_descriptor 	endpoint;
 	std::string			transfer_type;
 	std::string			dir;
-	std::deque<usb_raw_transfer_io> *data_queue;
-	std::mutex			*data_mutex;
+	struct packet_queue		*data_queue;
+	struct ep_flow			*flow;
 	InputDevice			*trim;
+	int				trim_index;
 };
 
-struct raw_gadget_endpoint {
+struct alignas(64) raw_gadget_endpoint {
 	struct usb_endpoint_descriptor	endpoint;
 	pthread_t			thread_read;
 	pthread_t			thread_write;
-	pthread_t			trim_thread_read[2];
-	size_t				n_trim_thread_read;
+	std::vector<pthread_t>		trim_thread_read;
+	struct async_in_stream		*stream_read;
+	std::vector<struct async_in_stream *> trim_streams;
 	struct thread_info		thread_info;
 };
 
@@ -193,3 +202,4 @@ void usb_raw_ep_set_halt(int fd, int ep);
 void log_control_request(struct usb_ctrlrequest *ctrl);
 void log_event(struct usb_raw_event *event);
 void print_eps_info(int fd);
+#endif
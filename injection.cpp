@@ -0,0 +1,558 @@
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+#include <sstream>
+#include <vector>
+
+#include "injection.h"
+#include "misc.h"
+
+// The automaton stores states in 16 bits.
+#define INJECTION_MAX_STATES	65535
+
+enum control_kind {
+	CONTROL_STALL,
+	CONTROL_IGNORE,
+	CONTROL_MODIFY,
+	CONTROL_KINDS
+};
+
+struct control_rule {
+	uint8_t				bRequestType;
+	uint8_t				bRequest;
+	uint16_t			wValue;
+	uint16_t			wIndex;
+	uint16_t			wLength;
+	struct injection_matcher	*matcher;	// NULL without content patterns
+};
+
+static struct control_rule control_rules[CONTROL_KINDS][INJECTION_MAX_RULES];
+static int n_control_rules[CONTROL_KINDS];
+// Index 0 for the int rules, 1 for the bulk rules, by endpoint address.
+static struct injection_matcher *endpoint_matchers[2][256];
+
+static std::atomic<uint64_t> modified;
+static std::atomic<uint64_t> ignored;
+static std::atomic<uint64_t> stalled;
+
+/*----------------------------------------------------------------------*/
+
+// Just enough JSON for the rule file; // comments are skipped as well, the
+// README template has them.
+struct json_value {
+	enum { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT } type;
+	bool				boolean;
+	double				number;
+	std::string			string;
+	std::vector<std::string>	keys;	// of an object, parallel to items
+	std::vector<json_value>		items;
+};
+
+struct json_parser {
+	const char	*path;
+	const char	*text;
+	size_t		pos;
+	int		line;
+};
+
+static bool json_error(struct json_parser *parser, const char *message) {
+	fprintf(stderr, "%s:%d: %s\n", parser->path, parser->line, message);
+	return false;
+}
+
+static void json_skip_space(struct json_parser *parser) {
+	for (;;) {
+		char c = parser->text[parser->pos];
+		if (c == '\n')
+			parser->line++;
+		if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+			parser->pos++;
+		}
+		else if (c == '/' && parser->text[parser->pos + 1] == '/') {
+			while (parser->text[parser->pos] && parser->text[parser->pos] != '\n')
+				parser->pos++;
+		}
+		else {
+			return;
+		}
+	}
+}
+
+static bool json_string(struct json_parser *parser, std::string *out) {
+	parser->pos++;	// '"'
+	for (;;) {
+		char c = parser->text[parser->pos++];
+		if (c == '"')
+			return true;
+		if (c == '\0' || c == '\n')
+			return json_error(parser, "unterminated string");
+		if (c != '\\') {
+			*out += c;
+			continue;
+		}
+		c = parser->text[parser->pos++];
+		switch (c) {
+		case '"': case '\\': case '/': *out += c; break;
+		case 'b': *out += '\b'; break;
+		case 'f': *out += '\f'; break;
+		case 'n': *out += '\n'; break;
+		case 'r': *out += '\r'; break;
+		case 't': *out += '\t'; break;
+		case 'u': {
+			unsigned int code;
+			if (sscanf(&parser->text[parser->pos], "%4x", &code) != 1 || code > 0xff)
+				return json_error(parser, "unsupported \\u escape");
+			*out += (char)code;
+			parser->pos += 4;
+			break;
+		}
+		default:
+			return json_error(parser, "invalid escape");
+		}
+	}
+}
+
+static bool json_parse(struct json_parser *parser, struct json_value *value) {
+	json_skip_space(parser);
+	const char *p = &parser->text[parser->pos];
+	if (*p == '{' || *p == '[') {
+		bool object = *p == '{';
+		char close = object ? '}' : ']';
+		value->type = object ? json_value::OBJECT : json_value::ARRAY;
+		parser->pos++;
+		json_skip_space(parser);
+		if (parser->text[parser->pos] == close) {
+			parser->pos++;
+			return true;
+		}
+		for (;;) {
+			json_skip_space(parser);
+			if (object) {
+				std::string key;
+				if (parser->text[parser->pos] != '"')
+					return json_error(parser, "expected a key");
+				if (!json_string(parser, &key))
+					return false;
+				json_skip_space(parser);
+				if (parser->text[parser->pos++] != ':')
+					return json_error(parser, "expected ':'");
+				value->keys.push_back(key);
+			}
+			value->items.push_back(json_value());
+			if (!json_parse(parser, &value->items.back()))
+				return false;
+			json_skip_space(parser);
+			char c = parser->text[parser->pos++];
+			if (c == close)
+				return true;
+			if (c != ',')
+				return json_error(parser, object ? "expected ',' or '}'" : "expected ',' or ']'");
+		}
+	}
+	if (*p == '"') {
+		value->type = json_value::STRING;
+		return json_string(parser, &value->string);
+	}
+	if (!strncmp(p, "true", 4) || !strncmp(p, "false", 5)) {
+		value->type = json_value::BOOLEAN;
+		value->boolean = *p == 't';
+		parser->pos += value->boolean ? 4 : 5;
+		return true;
+	}
+	if (!strncmp(p, "null", 4)) {
+		value->type = json_value::NUL;
+		parser->pos += 4;
+		return true;
+	}
+	char *end;
+	value->type = json_value::NUMBER;
+	value->number = strtod(p, &end);
+	if (end == p)
+		return json_error(parser, "unexpected character");
+	parser->pos += end - p;
+	return true;
+}
+
+static const struct json_value *json_get(const struct json_value *object, const char *key) {
+	if (!object || object->type != json_value::OBJECT)
+		return NULL;
+	for (size_t i = 0; i < object->keys.size(); i++) {
+		if (object->keys[i] == key)
+			return &object->items[i];
+	}
+	return NULL;
+}
+
+/*----------------------------------------------------------------------*/
+
+struct matcher_builder {
+	std::vector<std::string>	patterns;
+	std::vector<std::string>	replacements;
+};
+
+static uint8_t *copy_bytes(const std::string &bytes) {
+	uint8_t *copy = new uint8_t[bytes.size() + 1];
+	memcpy(copy, bytes.data(), bytes.size());
+	return copy;
+}
+
+// Build the automaton: a trie of the patterns whose missing transitions are
+// filled in from the failure links, so that matching never backtracks.
+static struct injection_matcher *compile(const struct matcher_builder *builder) {
+	size_t total = 1;
+	for (size_t i = 0; i < builder->patterns.size(); i++)
+		total += builder->patterns[i].size();
+	if (builder->patterns.empty() || total > INJECTION_MAX_STATES)
+		return NULL;
+
+	struct injection_matcher *matcher = new struct injection_matcher;
+	matcher->n_patterns = builder->patterns.size();
+	matcher->patterns = new struct injection_pattern[matcher->n_patterns];
+	matcher->same_length = true;
+
+	std::vector<int> trie(total * 256, -1);
+	std::vector<int> match(total, -1);
+	int n_states = 1;
+	for (int i = 0; i < matcher->n_patterns; i++) {
+		const std::string &pattern = builder->patterns[i];
+		const std::string &replacement = builder->replacements[i];
+		matcher->patterns[i].pattern = copy_bytes(pattern);
+		matcher->patterns[i].pattern_length = pattern.size();
+		matcher->patterns[i].replacement = copy_bytes(replacement);
+		matcher->patterns[i].replacement_length = replacement.size();
+		if (pattern.size() != replacement.size())
+			matcher->same_length = false;
+
+		int state = 0;
+		for (size_t j = 0; j < pattern.size(); j++) {
+			int *child = &trie[state * 256 + (uint8_t)pattern[j]];
+			if (*child < 0)
+				*child = n_states++;
+			state = *child;
+		}
+		if (match[state] < 0)
+			match[state] = i;
+	}
+
+	matcher->n_states = n_states;
+	matcher->next = new uint16_t[n_states * 256];
+	matcher->match = new int16_t[n_states];
+	matcher->dict = new uint16_t[n_states];
+	std::vector<int> fail(n_states, 0);
+	std::vector<int> queue;
+	queue.push_back(0);
+	matcher->dict[0] = 0;
+	for (size_t head = 0; head < queue.size(); head++) {
+		int state = queue[head];
+		matcher->match[state] = match[state];
+		for (int c = 0; c < 256; c++) {
+			int child = trie[state * 256 + c];
+			int fallback = state ? matcher->next[fail[state] * 256 + c] : 0;
+			if (child < 0) {
+				matcher->next[state * 256 + c] = fallback;
+				continue;
+			}
+			matcher->next[state * 256 + c] = child;
+			fail[child] = fallback;
+			matcher->dict[child] = match[fallback] >= 0 ? fallback : matcher->dict[fallback];
+			queue.push_back(child);
+		}
+	}
+	return matcher;
+}
+
+static void free_matcher(struct injection_matcher *matcher) {
+	if (!matcher)
+		return;
+	for (int i = 0; i < matcher->n_patterns; i++) {
+		delete[] matcher->patterns[i].pattern;
+		delete[] matcher->patterns[i].replacement;
+	}
+	delete[] matcher->patterns;
+	delete[] matcher->next;
+	delete[] matcher->match;
+	delete[] matcher->dict;
+	delete matcher;
+}
+
+// Adds the content patterns of a rule, each replaced by replacement.
+static bool add_patterns(const char *path, const struct json_value *rule,
+			struct matcher_builder *builder) {
+	const struct json_value *patterns = json_get(rule, "content_pattern");
+	const struct json_value *replacement = json_get(rule, "replacement");
+	if (!patterns)
+		return true;
+	if (patterns->type != json_value::ARRAY) {
+		fprintf(stderr, "%s: content_pattern is not a list\n", path);
+		return false;
+	}
+	std::string bytes = replacement && replacement->type == json_value::STRING ?
+		hexToAscii(replacement->string) : "";
+	for (size_t i = 0; i < patterns->items.size(); i++) {
+		const struct json_value *pattern = &patterns->items[i];
+		if (pattern->type != json_value::STRING) {
+			fprintf(stderr, "%s: content_pattern holds something else than strings\n", path);
+			return false;
+		}
+		std::string pattern_bytes = hexToAscii(pattern->string);
+		if (pattern_bytes.empty() || pattern_bytes.size() > INJECTION_MAX_PACKET ||
+				bytes.size() > INJECTION_MAX_PACKET) {
+			fprintf(stderr, "%s: ignoring pattern '%s'\n", path, pattern->string.c_str());
+			continue;
+		}
+		builder->patterns.push_back(pattern_bytes);
+		builder->replacements.push_back(bytes);
+	}
+	return true;
+}
+
+static bool enabled(const struct json_value *rule) {
+	const struct json_value *enable = json_get(rule, "enable");
+	return enable && enable->type == json_value::BOOLEAN && enable->boolean;
+}
+
+// Numbers in the rule file are hex values written in decimal digits.
+static int hex_field(const struct json_value *rule, const char *key) {
+	const struct json_value *value = json_get(rule, key);
+	return value && value->type == json_value::NUMBER ? hexToDecimal((int)value->number) : 0;
+}
+
+static bool load_control(const char *path, const struct json_value *control) {
+	static const char *const kinds[CONTROL_KINDS] = { "stall", "ignore", "modify" };
+	for (int kind = 0; kind < CONTROL_KINDS; kind++) {
+		const struct json_value *rules = json_get(control, kinds[kind]);
+		if (!rules || rules->type != json_value::ARRAY)
+			continue;
+		for (size_t i = 0; i < rules->items.size(); i++) {
+			const struct json_value *rule = &rules->items[i];
+			if (!enabled(rule))
+				continue;
+			if (n_control_rules[kind] == INJECTION_MAX_RULES) {
+				fprintf(stderr, "%s: too many control %s rules\n", path, kinds[kind]);
+				return false;
+			}
+			struct matcher_builder builder;
+			if (!add_patterns(path, rule, &builder))
+				return false;
+			struct control_rule *out = &control_rules[kind][n_control_rules[kind]++];
+			out->bRequestType = hex_field(rule, "bRequestType");
+			out->bRequest = hex_field(rule, "bRequest");
+			out->wValue = hex_field(rule, "wValue");
+			out->wIndex = hex_field(rule, "wIndex");
+			out->wLength = hex_field(rule, "wLength");
+			out->matcher = compile(&builder);
+			if (!out->matcher && !builder.patterns.empty()) {
+				fprintf(stderr, "%s: control %s patterns too long\n", path, kinds[kind]);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static bool load_endpoints(const char *path, const struct json_value *rules, int type) {
+	if (!rules || rules->type != json_value::ARRAY)
+		return true;
+	static struct matcher_builder builders[256];
+	for (int address = 0; address < 256; address++)
+		builders[address] = matcher_builder();
+
+	for (size_t i = 0; i < rules->items.size(); i++) {
+		const struct json_value *rule = &rules->items[i];
+		if (!enabled(rule))
+			continue;
+		int address = hex_field(rule, "ep_address");
+		if (address <= 0 || address > 0xff) {
+			fprintf(stderr, "%s: invalid ep_address\n", path);
+			return false;
+		}
+		if (!add_patterns(path, rule, &builders[address]))
+			return false;
+	}
+	for (int address = 0; address < 256; address++) {
+		if (builders[address].patterns.empty())
+			continue;
+		endpoint_matchers[type][address] = compile(&builders[address]);
+		if (!endpoint_matchers[type][address]) {
+			fprintf(stderr, "%s: patterns for EP%02x too long\n", path, address);
+			return false;
+		}
+		if (verbose_level)
+			printf("EP%02x: %d injection patterns, %d states\n", address,
+				endpoint_matchers[type][address]->n_patterns,
+				endpoint_matchers[type][address]->n_states);
+	}
+	return true;
+}
+
+int injection_load(const char *path) {
+	std::ifstream file(path);
+	if (!file) {
+		fprintf(stderr, "Cannot open %s\n", path);
+		return 1;
+	}
+	std::stringstream text;
+	text << file.rdbuf();
+	std::string content = text.str();
+
+	struct json_value root;
+	struct json_parser parser = { path, content.c_str(), 0, 1 };
+	if (!json_parse(&parser, &root))
+		return 1;
+	if (root.type != json_value::OBJECT) {
+		fprintf(stderr, "%s: expected an object\n", path);
+		return 1;
+	}
+
+	injection_free();
+	if (!load_control(path, json_get(&root, "control")) ||
+			!load_endpoints(path, json_get(&root, "int"), 0) ||
+			!load_endpoints(path, json_get(&root, "bulk"), 1)) {
+		injection_free();
+		return 1;
+	}
+	const struct json_value *isoc = json_get(&root, "isoc");
+	if (isoc && isoc->type == json_value::ARRAY && !isoc->items.empty())
+		fprintf(stderr, "%s: isoc rules are not supported, ignoring them\n", path);
+	return 0;
+}
+
+void injection_free() {
+	for (int kind = 0; kind < CONTROL_KINDS; kind++) {
+		for (int i = 0; i < n_control_rules[kind]; i++)
+			free_matcher(control_rules[kind][i].matcher);
+		n_control_rules[kind] = 0;
+	}
+	for (int type = 0; type < 2; type++) {
+		for (int address = 0; address < 256; address++) {
+			free_matcher(endpoint_matchers[type][address]);
+			endpoint_matchers[type][address] = NULL;
+		}
+	}
+}
+
+/*----------------------------------------------------------------------*/
+
+const struct injection_matcher *injection_endpoint(const struct usb_endpoint_descriptor *ep) {
+	switch (usb_endpoint_type(ep)) {
+	case USB_ENDPOINT_XFER_INT:
+		return endpoint_matchers[0][ep->bEndpointAddress];
+	case USB_ENDPOINT_XFER_BULK:
+		return endpoint_matchers[1][ep->bEndpointAddress];
+	default:
+		return NULL;
+	}
+}
+
+bool injection_find(const struct injection_matcher *matcher, const uint8_t *data, int length) {
+	int state = 0;
+	for (int i = 0; i < length; i++) {
+		state = matcher->next[state * 256 + data[i]];
+		if (matcher->match[state] >= 0 || matcher->dict[state])
+			return true;
+	}
+	return false;
+}
+
+int injection_apply(const struct injection_matcher *matcher, uint8_t *data, int *length,
+			int capacity) {
+	// The pattern to replace starting at each byte, filled once something
+	// matched.
+	int16_t starts[INJECTION_MAX_PACKET];
+	bool found = false;
+	int state = 0;
+	for (int i = 0; i < *length; i++) {
+		state = matcher->next[state * 256 + data[i]];
+		int s = matcher->match[state] >= 0 ? state : matcher->dict[state];
+		if (!s)
+			continue;
+		if (!found) {
+			memset(starts, 0xff, *length * sizeof(starts[0]));
+			found = true;
+		}
+		for (; s; s = matcher->dict[s]) {
+			int p = matcher->match[s];
+			int start = i + 1 - matcher->patterns[p].pattern_length;
+			if (starts[start] < 0 || p < starts[start])
+				starts[start] = p;
+		}
+	}
+	if (!found)
+		return 0;
+
+	int count = 0;
+	if (matcher->same_length) {
+		for (int i = 0; i < *length; ) {
+			if (starts[i] < 0) {
+				i++;
+				continue;
+			}
+			const struct injection_pattern *p = &matcher->patterns[starts[i]];
+			memcpy(&data[i], p->replacement, p->replacement_length);
+			i += p->pattern_length;
+			count++;
+		}
+	}
+	else {
+		uint8_t out[INJECTION_MAX_PACKET];
+		int n = 0;
+		for (int i = 0; i < *length; ) {
+			const struct injection_pattern *p = starts[i] >= 0 ?
+				&matcher->patterns[starts[i]] : NULL;
+			if (p && n + p->replacement_length + *length - i - p->pattern_length <= capacity) {
+				memcpy(&out[n], p->replacement, p->replacement_length);
+				n += p->replacement_length;
+				i += p->pattern_length;
+				count++;
+			}
+			else {
+				out[n++] = data[i++];
+			}
+		}
+		memcpy(data, out, n);
+		*length = n;
+	}
+
+	if (count)
+		modified.fetch_add(1, std::memory_order_relaxed);
+	return count;
+}
+
+static bool setup_matches(const struct control_rule *rule, const struct usb_ctrlrequest *ctrl) {
+	return rule->bRequestType == ctrl->bRequestType && rule->bRequest == ctrl->bRequest &&
+		rule->wValue == ctrl->wValue && rule->wIndex == ctrl->wIndex &&
+		rule->wLength == ctrl->wLength;
+}
+
+enum usb_injection_flags injection_control(const struct usb_ctrlrequest *ctrl, uint8_t *data,
+			int *length, int capacity) {
+	static const enum usb_injection_flags flags[] = {
+		USB_INJECTION_FLAG_STALL, USB_INJECTION_FLAG_IGNORE
+	};
+	for (int kind = CONTROL_STALL; kind <= CONTROL_IGNORE; kind++) {
+		for (int i = 0; i < n_control_rules[kind]; i++) {
+			const struct control_rule *rule = &control_rules[kind][i];
+			if (setup_matches(rule, ctrl) &&
+			    (!rule->matcher || injection_find(rule->matcher, data, *length))) {
+				(kind == CONTROL_STALL ? stalled : ignored).fetch_add(1,
+					std::memory_order_relaxed);
+				return flags[kind];
+			}
+		}
+	}
+	for (int i = 0; i < n_control_rules[CONTROL_MODIFY]; i++) {
+		const struct control_rule *rule = &control_rules[CONTROL_MODIFY][i];
+		if (rule->matcher && setup_matches(rule, ctrl))
+			injection_apply(rule->matcher, data, length, capacity);
+	}
+	return USB_INJECTION_FLAG_NONE;
+}
+
+void injection_print() {
+	uint64_t m = modified.load(std::memory_order_relaxed);
+	uint64_t i = ignored.load(std::memory_order_relaxed);
+	uint64_t s = stalled.load(std::memory_order_relaxed);
+	if (m || i || s)
+		printf("Injection: %llu packets modified, %llu control requests ignored, %llu stalled\n",
+			(unsigned long long)m, (unsigned long long)i, (unsigned long long)s);
+}
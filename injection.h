@@ -0,0 +1,63 @@
+#ifndef INJECTION_H
+#define INJECTION_H
+#include <stdint.h>
+
+#include "packet-queue.h"
+
+#define INJECTION_MAX_PACKET	PACKET_QUEUE_MAX_PAYLOAD
+#define INJECTION_MAX_RULES	64
+
+/*
+ * Injection rules (--enable_injection, --injection_file), in the JSON format
+ * described in the README.
+ *
+ * The file is read once at startup. The content patterns of the int and
+ * bulk rules of an endpoint are compiled into one Aho-Corasick automaton,
+ * a full transition table over bytes with the replacement of each pattern
+ * prebuilt, so a packet is searched for all of them in a single pass of
+ * table lookups and rewritten in place, without allocating. Control rules
+ * keep their setup fields and an automaton of their own patterns.
+ *
+ * Matches are looked for in the packet as it came, so that rules can swap
+ * two values. Where matches overlap the leftmost wins, then the pattern
+ * listed first. A replacement that would not fit the buffer is skipped.
+ */
+
+struct injection_pattern {
+	uint8_t		*pattern;
+	int		pattern_length;
+	uint8_t		*replacement;
+	int		replacement_length;
+};
+
+struct injection_matcher {
+	int				n_states;
+	uint16_t			*next;		// [state * 256 + byte]
+	int16_t				*match;		// pattern ending in the state, or -1
+	uint16_t			*dict;		// next state on the suffix chain with a match
+	int				n_patterns;
+	struct injection_pattern	*patterns;
+	bool				same_length;	// no replacement changes the length
+};
+
+// Load the rule file and compile it; 0 on success.
+int injection_load(const char *path);
+void injection_free();
+
+// The matcher of the int or bulk rules of an endpoint, NULL if it has none.
+const struct injection_matcher *injection_endpoint(const struct usb_endpoint_descriptor *ep);
+// Rewrite the length bytes of data, in a buffer of capacity bytes, in place.
+// Returns the number of replacements made; length is updated.
+int injection_apply(const struct injection_matcher *matcher, uint8_t *data, int *length,
+			int capacity);
+// Whether data contains any of the patterns.
+bool injection_find(const struct injection_matcher *matcher, const uint8_t *data, int length);
+
+// The stall, ignore and then modify rules matching a control request and its
+// data stage: the data from the host for OUT requests, the answer for IN
+// requests. Rules without content patterns match on the setup fields alone.
+// Modify rules rewrite data in place as above.
+enum usb_injection_flags injection_control(const struct usb_ctrlrequest *ctrl, uint8_t *data,
+			int *length, int capacity);
+void injection_print();
+#endif
@@ -1,27 +1,19 @@
 #include "input-device.h"
+#include "discovery.h"
+#include "logger.h"
+#include "mixer.h"
+#include "proxy.h"
+#include "reattach.h"
+#include <time.h>
 #include <vector>
 
-libusb_context* InputDevice::context = NULL;
-
-int InputDevice::hotplug_callback(struct libusb_context *ctx __attribute__((unused)),
-			struct libusb_device *dev __attribute__((unused)),
-			libusb_hotplug_event envet __attribute__((unused)),
-			void *user_data __attribute__((unused)))
-{
-	printf("Hotplug event\n");
-
-	kill(0, SIGINT);
-	return 0;
-}
-
-void *InputDevice::hotplug_monitor(void *arg __attribute__((unused)))
-{
-	printf("Start hotplug_monitor thread, thread id(%d)\n", gettid());
-	while(true) {
-		usleep(100 * 1000);
-		libusb_handle_events_completed(NULL, NULL);
-	}
-}
+std::vector<InputDevice *>* InputDevice::slots = NULL;
+int InputDevice::slots_vendor_id;
+int InputDevice::slots_product_id;
+pthread_t InputDevice::attach_thread;
+volatile bool InputDevice::attach_stopping;
+pthread_mutex_t InputDevice::online_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t InputDevice::online_changed = PTHREAD_COND_INITIALIZER;
 
 int InputDevice::get_descriptor(libusb_device *device)
 {
@@ -42,7 +34,7 @@ int InputDevice::get_descriptor(libusb_device *device)
 		printf("serial=%x\n", device_device_desc.iSerialNumber);
 	}
 
-	device_config_desc = new struct libusb_config_descriptor *[device_device_desc.bNumConfigurations];
+	device_config_desc = new struct libusb_config_descriptor *[device_device_desc.bNumConfigurations]();
 	for (int i = 0; i < device_device_desc.bNumConfigurations; i++) {
 		result = libusb_get_config_descriptor(device, i, &device_config_desc[i]);
 		if (result != LIBUSB_SUCCESS) {
@@ -73,65 +65,247 @@ int InputDevice::get_descriptor(libusb_device *device)
 	return LIBUSB_SUCCESS;
 }
 
-std::vector<InputDevice *>* InputDevice::connect(int vendor_id, int product_id)
+InputDevice::InputDevice()
 {
-	int result;
-	std::vector<InputDevice *> *found = new std::vector<InputDevice *>();
+	index = 0;
+	online = false;
+	pthread_rwlock_init(&handle_lock, NULL);
+	device = NULL;
+	dev_handle = NULL;
+	device_config_desc = NULL;
+}
 
-	result = libusb_init(&context);
-	if (result < 0) {
-		fprintf(stderr, "Init error: %s\n", libusb_strerror((libusb_error)result));
-		delete found;
+std::vector<InputDevice *>* InputDevice::connect(int vendor_id, int product_id)
+{
+	if (discovery_start() || discovery_watch(vendor_id, product_id))
 		return NULL;
+
+	if (verbose_level)
+		printf("Waiting for trim devices\n");
+	libusb_unref_device(discovery_wait(vendor_id, product_id, -1));
+
+	libusb_device *list[DISCOVERY_MAX_DEVICES];
+	int cnt = discovery_list(vendor_id, product_id, list, DISCOVERY_MAX_DEVICES);
+	if (verbose_level)
+		printf("%d Devices in list\n", cnt);
+	if (cnt > MIXER_MAX_TRIMS) {
+		printf("%d trim devices, only using %d\n", cnt, MIXER_MAX_TRIMS);
+		for (int i = MIXER_MAX_TRIMS; i < cnt; i++)
+			libusb_unref_device(list[i]);
+		cnt = MIXER_MAX_TRIMS;
 	}
-	libusb_set_debug(context, 3);
 
-	libusb_device **list = NULL;
-	// libusb_device *found = NULL;
+	std::vector<InputDevice *> *found = new std::vector<InputDevice *>();
+	for (int i = 0; i < cnt; i++) {
+		InputDevice *id = new InputDevice();
+		id->index = i;
+		// The device keeps the reference taken by discovery_list(). One
+		// that cannot be opened yet is retried by the attach thread.
+		id->attach(list[i]);
+		found->push_back(id);
+	}
 
-	int cnt = libusb_get_device_list(context, &list);
-	if (cnt < 0) {
-		if (verbose_level) {
-			fprintf(stderr, "Error retrieving device list: %s\n",
-					libusb_strerror((libusb_error)cnt));
-		}
+	if (found->size() == 0) {
+		printf("Target device not found\n");
 		delete found;
 		return NULL;
 	}
 
-	if (verbose_level)
-		printf("%d Devices in list\n", cnt);
+	return found;
+}
 
-	for (int i = 0; i < cnt; i++) {
-		libusb_device *dvc = list[i];
+std::vector<InputDevice *>* InputDevice::create(int n_trims)
+{
+	std::vector<InputDevice *> *created = new std::vector<InputDevice *>();
+	for (int i = 0; i < n_trims && i < MIXER_MAX_TRIMS; i++) {
 		InputDevice *id = new InputDevice();
-		result = id->get_descriptor(dvc);
-		if (result != LIBUSB_SUCCESS) {
-			delete id;
-			continue;
+		id->index = i;
+		created->push_back(id);
+	}
+	return created;
+}
+
+// Opens device, taking over the reference to it, into this empty slot.
+int InputDevice::attach(libusb_device *device)
+{
+	pthread_rwlock_wrlock(&handle_lock);
+	int result = get_descriptor(device);
+	if (result == LIBUSB_SUCCESS)
+		result = connect_device();
+	if (result != LIBUSB_SUCCESS)
+		release();
+	pthread_rwlock_unlock(&handle_lock);
+	if (result != LIBUSB_SUCCESS)
+		return result;
+
+	pthread_mutex_lock(&online_lock);
+	online.store(true);
+	pthread_cond_broadcast(&online_changed);
+	pthread_mutex_unlock(&online_lock);
+	resume_trim(index, dev_handle);
+	return LIBUSB_SUCCESS;
+}
+
+// Closes the trim of this slot, which is marked gone.
+void InputDevice::detach()
+{
+	lost();
+	pause_trim(index);
+	pthread_rwlock_wrlock(&handle_lock);
+	release();
+	pthread_rwlock_unlock(&handle_lock);
+}
+
+void InputDevice::release()
+{
+	if (device_config_desc) {
+		for (int i = 0; i < device_device_desc.bNumConfigurations; i++) {
+			if (device_config_desc[i])
+				libusb_free_config_descriptor(device_config_desc[i]);
 		}
+		delete[] device_config_desc;
+		device_config_desc = NULL;
+	}
+	if (dev_handle)
+		libusb_close(dev_handle);
+	dev_handle = NULL;
+	if (device)
+		libusb_unref_device(device);
+	device = NULL;
+}
 
-		if (id->device_device_desc.bDeviceClass == LIBUSB_CLASS_HUB) {
-			delete id;
-			continue;
+void InputDevice::lost()
+{
+	pthread_mutex_lock(&online_lock);
+	if (online.exchange(false))
+		printf("Trim %d disconnected, waiting for a trim to take its place\n", index);
+	pthread_mutex_unlock(&online_lock);
+}
+
+bool InputDevice::wait_online(int timeout_ms)
+{
+	if (online.load())
+		return true;
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&online_lock);
+	while (!online.load()) {
+		if (pthread_cond_timedwait(&online_changed, &online_lock, &deadline))
+			break;
+	}
+	pthread_mutex_unlock(&online_lock);
+	return online.load();
+}
+
+// Returns true if dev_handle can be used, false (and with the lock dropped)
+// while the slot has no trim.
+bool InputDevice::hold()
+{
+	pthread_rwlock_rdlock(&handle_lock);
+	if (dev_handle && online.load(std::memory_order_relaxed))
+		return true;
+	pthread_rwlock_unlock(&handle_lock);
+	return false;
+}
+
+int InputDevice::drop(int result)
+{
+	pthread_rwlock_unlock(&handle_lock);
+	if (result == LIBUSB_ERROR_NO_DEVICE)
+		lost();
+	return result;
+}
+
+// Closes the trims that left, or that their reader found gone, and opens the
+// trims that arrived into the empty slots, in order. Each pass follows a
+// change reported by discovery; one that could not open a trim is retried
+// every REATTACH_POLL_MS.
+void *InputDevice::attach_loop(void *arg __attribute__((unused)))
+{
+	printf("Start trim attach thread, thread id(%d)\n", gettid());
+
+	uint32_t generation = discovery_wait_change(0, 0);
+	while (!attach_stopping) {
+		libusb_device *list[DISCOVERY_MAX_DEVICES];
+		int cnt = discovery_list(slots_vendor_id, slots_product_id, list,
+			DISCOVERY_MAX_DEVICES);
+		bool used[DISCOVERY_MAX_DEVICES] = {};
+
+		for (InputDevice *trim : *slots) {
+			if (!trim->device)
+				continue;
+			int i = 0;
+			while (i < cnt && list[i] != trim->device)
+				i++;
+			if (i < cnt && trim->online.load())
+				used[i] = true;
+			else
+				trim->detach();
 		}
 
-		if ((vendor_id == id->device_device_desc.idVendor || vendor_id == LIBUSB_HOTPLUG_MATCH_ANY) &&
-			(product_id == id->device_device_desc.idProduct || product_id == LIBUSB_HOTPLUG_MATCH_ANY)) {
-			found->push_back(id);
+		bool retry = false;
+		for (int i = 0; i < cnt; i++) {
+			if (used[i])
+				continue;
+			InputDevice *trim = NULL;
+			for (InputDevice *slot : *slots) {
+				if (!slot->device) {
+					trim = slot;
+					break;
+				}
+			}
+			if (!trim)
+				break;
+			if (trim->attach(list[i]) == LIBUSB_SUCCESS) {
+				printf("Trim %d attached\n", trim->index);
+				used[i] = true;
+			}
+			else {
+				retry = true;
+			}
 		}
+		for (int i = 0; i < cnt; i++) {
+			if (!used[i])
+				libusb_unref_device(list[i]);
+		}
+
+		if (retry)
+			usleep(REATTACH_POLL_MS * 1000);
+		generation = discovery_wait_change(generation, retry ? 0 : 100);
 	}
 
-	// libusb_free_device_list(list, 1);
+	printf("End trim attach thread, thread id(%d)\n", gettid());
+	return NULL;
+}
 
+void InputDevice::attach_start(std::vector<InputDevice *> *trims, int vendor_id, int product_id)
+{
+	if (discovery_start() || discovery_watch(vendor_id, product_id))
+		return;
+
+	slots = trims;
+	slots_vendor_id = vendor_id;
+	slots_product_id = product_id;
+	attach_stopping = false;
+	pthread_create(&attach_thread, 0, attach_loop, NULL);
+}
 
-	if (found->size() == 0) {
-		printf("Target device not found\n");
-		delete found;
-		return NULL;
-	}
+void InputDevice::attach_stop()
+{
+	if (!attach_thread)
+		return;
 
-	return found;
+	attach_stopping = true;
+	if (pthread_join(attach_thread, NULL))
+		fprintf(stderr, "Error join attach_thread\n");
+	attach_thread = 0;
 }
 
 int InputDevice::connect_device() {
@@ -144,7 +318,6 @@ int InputDevice::connect_device() {
 					libusb_strerror((libusb_error)result));
 		}
 		dev_handle = NULL;
-		// libusb_free_device_list(list, 1);
 		return result;
 	}
 
@@ -189,21 +362,6 @@ int InputDevice::connect_device() {
 		return result;
 	}
 
-	if (callback_handle == -1) {
-		result = libusb_hotplug_register_callback(context,
-			(libusb_hotplug_event) (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
-			(libusb_hotplug_flag) 0, device_device_desc.idVendor , device_device_desc.idProduct,
-			LIBUSB_HOTPLUG_MATCH_ANY, InputDevice::hotplug_callback, NULL, &callback_handle);
-
-		if (result != LIBUSB_SUCCESS) {
-			fprintf(stderr, "Error registering callback\n");
-			libusb_exit(context);
-			return result;
-		}
-		pthread_create(&hotplug_monitor_thread, 0,
-			InputDevice::hotplug_monitor, nullptr);
-	}
-
 	return 0;
 }
 
@@ -280,6 +438,8 @@ int InputDevice::send_data(uint8_t endpoint, uint8_t attributes, uint8_t *datapt
 
 	bool incomplete_transfer = false;
 
+	if (!hold())
+		return LIBUSB_ERROR_NO_DEVICE;
 	switch (attributes & USB_ENDPOINT_XFERTYPE_MASK) {
 	case USB_ENDPOINT_XFER_CONTROL:
 		fprintf(stderr, "Can't send on a control endpoint.\n");
@@ -301,8 +461,8 @@ int InputDevice::send_data(uint8_t endpoint, uint8_t attributes, uint8_t *datapt
 				if (incomplete_transfer)
 					printf("Resent Bulk transfer on EP%02x for attempt %d. length(%d), transferred(%d)\n",
 						endpoint, attempt, length, transferred);
-				if (verbose_level > 2)
-					printf("Sent %d bytes (Bulk) to EP%02x\n", transferred, endpoint);
+				if (logger_on(3))
+					logger_record(LOGGER_SENT_DEVICE, endpoint, transferred, NULL, 0);
 			}
 			if ((result == LIBUSB_ERROR_PIPE || result == LIBUSB_ERROR_TIMEOUT))
 				libusb_clear_halt(dev_handle, endpoint);
@@ -316,22 +476,25 @@ int InputDevice::send_data(uint8_t endpoint, uint8_t attributes, uint8_t *datapt
 
 		if (transferred != length)
 			fprintf(stderr, "Incomplete Interrupt transfer on EP%02x\n", endpoint);
-		if (result == LIBUSB_SUCCESS && verbose_level > 2)
-			printf("Sent %d bytes (Int) to libusb EP%02x\n", transferred, endpoint);
+		if (result == LIBUSB_SUCCESS && logger_on(3))
+			logger_record(LOGGER_SENT_DEVICE, endpoint, transferred, NULL, 0);
 		break;
 	}
 	if (result != LIBUSB_SUCCESS) {
 		fprintf(stderr, "Transfer error sending on EP%02x: %s\n",
 				endpoint, libusb_strerror((libusb_error)result));
 	}
-	return result;
+	return drop(result);
 }
 
 int InputDevice::receive_data(uint8_t endpoint, uint8_t attributes, uint16_t maxPacketSize,
-			uint8_t **dataptr, int *length, int timeout) {
+			uint8_t *data, int *length, int timeout) {
 	int result = LIBUSB_SUCCESS;
 	timeout = 0;
 
+	if (!hold())
+		return LIBUSB_ERROR_NO_DEVICE;
+
 	int attempt = 0;
 	switch (attributes & USB_ENDPOINT_XFERTYPE_MASK) {
 	case USB_ENDPOINT_XFER_CONTROL:
@@ -342,11 +505,10 @@ int InputDevice::receive_data(uint8_t endpoint, uint8_t attributes, uint16_t max
 			fprintf(stderr, "Isochronous(read) endpoint EP%02x unhandled.\n", endpoint);
 		break;
 	case USB_ENDPOINT_XFER_BULK:
-		*dataptr = new uint8_t[maxPacketSize * 8];
 		do {
-			result = libusb_bulk_transfer(dev_handle, endpoint, *dataptr, maxPacketSize, length, timeout);
-			if (result == LIBUSB_SUCCESS && verbose_level > 2)
-				printf("Received bulk data(%d) bytes\n", *length);
+			result = libusb_bulk_transfer(dev_handle, endpoint, data, maxPacketSize, length, timeout);
+			if (result == LIBUSB_SUCCESS && logger_on(3))
+				logger_record(LOGGER_RECEIVED_DEVICE, endpoint, *length, NULL, 0);
 			if ((result == LIBUSB_ERROR_PIPE || result == LIBUSB_ERROR_TIMEOUT))
 				libusb_clear_halt(dev_handle, endpoint);
 
@@ -354,10 +516,9 @@ int InputDevice::receive_data(uint8_t endpoint, uint8_t attributes, uint16_t max
 		} while ((result == LIBUSB_ERROR_PIPE || result == LIBUSB_ERROR_TIMEOUT) && attempt < ID_MAX_ATTEMPTS);
 		break;
 	case USB_ENDPOINT_XFER_INT:
-		*dataptr = new uint8_t[maxPacketSize];
-		result = libusb_interrupt_transfer(dev_handle, endpoint, *dataptr, maxPacketSize, length, timeout);
-		if (result == LIBUSB_SUCCESS && verbose_level > 2)
-			printf("Received int data(%d) bytes\n", *length);
+		result = libusb_interrupt_transfer(dev_handle, endpoint, data, maxPacketSize, length, timeout);
+		if (result == LIBUSB_SUCCESS && logger_on(3))
+			logger_record(LOGGER_RECEIVED_DEVICE, endpoint, *length, NULL, 0);
 		break;
 	}
 
@@ -366,18 +527,11 @@ int InputDevice::receive_data(uint8_t endpoint, uint8_t attributes, uint16_t max
 				endpoint, libusb_strerror((libusb_error)result));
 	}
 
-	return result;
+	return drop(result);
 }
 
 InputDevice::~InputDevice()
 {
-	delete[] device_config_desc;
-
-	if (context && callback_handle != -1) {
-		libusb_hotplug_deregister_callback(context, callback_handle);
-	}
-	if (hotplug_monitor_thread &&
-		pthread_join(hotplug_monitor_thread, NULL)) {
-		fprintf(stderr, "Error join hotplug_monitor_thread\n");
-	}
+	release();
+	pthread_rwlock_destroy(&handle_lock);
 }
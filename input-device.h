@@ -1,37 +1,69 @@
 #ifndef INPUT_DEVICE_H
 #define INPUT_DEVICE_H
+#include <atomic>
 #include <libusb-1.0/libusb.h>
+#include <pthread.h>
 #include <vector>
 #include "misc.h"
 
+/*
+ * A trim device, or rather the slot of one: the number of trims is fixed at
+ * start-up by the mix rules, and the trim attach thread opens the trims as
+ * discovery reports them arriving into the slots that have none and closes
+ * those that leave. Its reader parks while the slot is empty.
+ */
 class InputDevice
 {
-    static libusb_context			            *context;
+    static std::vector<InputDevice *>   *slots;
+    static int                          slots_vendor_id;
+    static int                          slots_product_id;
+    static pthread_t                    attach_thread;
+    static volatile bool                attach_stopping;
+    static pthread_mutex_t              online_lock;
+    static pthread_cond_t               online_changed;
 
-    libusb_device			            **devs;
+    int                                 index;
+    std::atomic<bool>                   online;
+    // Held shared around every use of dev_handle and exclusively to replace it.
+    pthread_rwlock_t                    handle_lock;
 
     libusb_device                       *device;
     libusb_device_handle	        	*dev_handle;
-    libusb_hotplug_callback_handle	    callback_handle;
 
     struct libusb_device_descriptor		device_device_desc;
     struct libusb_config_descriptor		**device_config_desc;
 
-    pthread_t hotplug_monitor_thread;
-
     const static int ID_MAX_ATTEMPTS = 5;
 
-    static int hotplug_callback(struct libusb_context *ctx __attribute__((unused)),
-			struct libusb_device *dev __attribute__((unused)),
-			libusb_hotplug_event envet __attribute__((unused)),
-			void *user_data __attribute__((unused)));
+    static void *attach_loop(void *arg);
 
-    static void *hotplug_monitor(void *arg __attribute__((unused)));
     int get_descriptor(libusb_device *device);
+    int attach(libusb_device *device);
+    void detach();
+    void release();
+    bool hold();
+    int drop(int result);
 
 public:
+    InputDevice();
     ~InputDevice();
+    // Wait for at least one device to arrive and return a slot for each of
+    // those present, opened if they could be.
     static std::vector<InputDevice *>* connect(int vendorId, int productId);
+    // Return n_trims empty slots, for trims the attach thread opens later.
+    static std::vector<InputDevice *>* create(int n_trims);
+    // Keep the slots of trims following the devices that arrive and leave.
+    static void attach_start(std::vector<InputDevice *> *trims, int vendorId, int productId);
+    static void attach_stop();
+    // Only valid while online, and for the trim attach thread to replace
+    // after pause_trim().
+    libusb_device_handle *handle() const { return dev_handle; }
+    // Mark the trim gone, e.g. after LIBUSB_ERROR_NO_DEVICE; the attach
+    // thread closes it.
+    void lost();
+    bool is_online() const { return online.load(std::memory_order_relaxed); }
+    // Wait up to timeout_ms for a trim to be attached, returns is_online().
+    bool wait_online(int timeout_ms);
     int connect_device();
     void reset_device();
     void set_configuration(int configuration);
@@ -42,7 +74,8 @@ public:
                 unsigned char **dataptr, int timeout);
     int send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
                 int length);
+    // Reads into data, which must hold maxPacketSize bytes.
     int receive_data(uint8_t endpoint, uint8_t attributes, uint16_t maxPacketSize,
-                uint8_t **dataptr, int *length, int timeout);
+                uint8_t *data, int *length, int timeout);
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,136 @@
+#include <stdio.h>
+
+#include "latency.h"
+
+static struct latency_histogram endpoint_histograms[LATENCY_ENDPOINTS][LATENCY_HOPS];
+static struct latency_histogram source_histograms[LATENCY_SOURCES][LATENCY_HOPS];
+static struct latency_histogram control_histograms[LATENCY_CONTROLS];
+static struct latency_histogram tick_histograms[LATENCY_ENDPOINTS];
+
+static const char *hop_names[LATENCY_HOPS] = { "queue", "write", "total" };
+static const char *control_names[LATENCY_CONTROLS] = { "local", "proxy" };
+
+static int bucket_index(uint64_t ns) {
+	if (ns < LATENCY_SUB_BUCKETS)
+		return ns;
+	int exponent = 63 - __builtin_clzll(ns);
+	if (exponent > LATENCY_MAX_EXPONENT)
+		return LATENCY_BUCKETS - 1;
+	return (exponent - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS +
+		((ns >> (exponent - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+static uint64_t bucket_highest(int index) {
+	if (index < LATENCY_SUB_BUCKETS)
+		return index;
+	int exponent = index / LATENCY_SUB_BUCKETS + LATENCY_SUB_BITS - 1;
+	uint64_t sub = index % LATENCY_SUB_BUCKETS;
+	uint64_t lowest = (LATENCY_SUB_BUCKETS + sub) << (exponent - LATENCY_SUB_BITS);
+	return lowest + (1ull << (exponent - LATENCY_SUB_BITS)) - 1;
+}
+
+void latency_histogram_add(struct latency_histogram *histogram, uint64_t ns) {
+	histogram->buckets[bucket_index(ns)].fetch_add(1, std::memory_order_relaxed);
+	histogram->count.fetch_add(1, std::memory_order_relaxed);
+
+	uint64_t max = histogram->max.load(std::memory_order_relaxed);
+	while (ns > max && !histogram->max.compare_exchange_weak(max, ns,
+			std::memory_order_relaxed))
+		;
+}
+
+uint64_t latency_histogram_percentile(const struct latency_histogram *histogram, double p) {
+	uint64_t count = histogram->count.load(std::memory_order_relaxed);
+	if (count == 0)
+		return 0;
+
+	uint64_t rank = (uint64_t)(p / 100.0 * count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += histogram->buckets[i].load(std::memory_order_relaxed);
+		if (seen >= rank) {
+			uint64_t value = bucket_highest(i);
+			uint64_t max = histogram->max.load(std::memory_order_relaxed);
+			return value < max ? value : max;
+		}
+	}
+	return histogram->max.load(std::memory_order_relaxed);
+}
+
+static void record_hops(struct latency_histogram *histograms, uint64_t received_ns,
+			uint64_t dequeued_ns, uint64_t written_ns) {
+	latency_histogram_add(&histograms[LATENCY_QUEUE], dequeued_ns - received_ns);
+	if (written_ns == 0)
+		return;
+	latency_histogram_add(&histograms[LATENCY_WRITE], written_ns - dequeued_ns);
+	latency_histogram_add(&histograms[LATENCY_TOTAL], written_ns - received_ns);
+}
+
+void latency_record(uint8_t endpoint, const struct packet_stamp *stamp,
+			uint64_t dequeued_ns, uint64_t written_ns) {
+	if (stamp->received_ns == 0 || dequeued_ns < stamp->received_ns)
+		return;
+
+	record_hops(endpoint_histograms[(endpoint & 0x0f) | ((endpoint & 0x80) >> 3)],
+		stamp->received_ns, dequeued_ns, written_ns);
+	if (stamp->source >= 0 && stamp->source < LATENCY_SOURCES)
+		record_hops(source_histograms[stamp->source], stamp->received_ns,
+			dequeued_ns, written_ns);
+}
+
+const struct latency_histogram *latency_endpoint_histogram(uint8_t endpoint, enum latency_hop hop) {
+	return &endpoint_histograms[(endpoint & 0x0f) | ((endpoint & 0x80) >> 3)][hop];
+}
+
+void latency_record_control(enum latency_control path, uint64_t ns) {
+	latency_histogram_add(&control_histograms[path], ns);
+}
+
+const struct latency_histogram *latency_control_histogram(enum latency_control path) {
+	return &control_histograms[path];
+}
+
+void latency_record_tick(uint8_t endpoint, uint64_t late_ns) {
+	latency_histogram_add(&tick_histograms[(endpoint & 0x0f) | ((endpoint & 0x80) >> 3)], late_ns);
+}
+
+const struct latency_histogram *latency_tick_histogram(uint8_t endpoint) {
+	return &tick_histograms[(endpoint & 0x0f) | ((endpoint & 0x80) >> 3)];
+}
+
+static void print_row(const char *name, const char *hop, const struct latency_histogram *histogram) {
+	uint64_t count = histogram->count.load(std::memory_order_relaxed);
+	if (count == 0)
+		return;
+	printf("%-8s %-6s %10.1f %10.1f %10.1f %10.1f %10llu\n", name, hop,
+		latency_histogram_percentile(histogram, 50) / 1000.0,
+		latency_histogram_percentile(histogram, 99) / 1000.0,
+		latency_histogram_percentile(histogram, 99.9) / 1000.0,
+		histogram->max.load(std::memory_order_relaxed) / 1000.0,
+		(unsigned long long)count);
+}
+
+void latency_print() {
+	char name[16];
+
+	printf("%-8s %-6s %10s %10s %10s %10s %10s\n", "latency", "hop",
+		"p50(us)", "p99(us)", "p99.9(us)", "max(us)", "count");
+	for (int i = 0; i < LATENCY_CONTROLS; i++)
+		print_row("EP00", control_names[i], &control_histograms[i]);
+	for (int i = 0; i < LATENCY_ENDPOINTS; i++) {
+		snprintf(name, sizeof(name), "EP%02x", (i & 0x0f) | ((i & 0x10) << 3));
+		for (int hop = 0; hop < LATENCY_HOPS; hop++)
+			print_row(name, hop_names[hop], &endpoint_histograms[i][hop]);
+		print_row(name, "tick", &tick_histograms[i]);
+	}
+	for (int i = 0; i < LATENCY_SOURCES; i++) {
+		if (i == 0)
+			snprintf(name, sizeof(name), "wheel");
+		else
+			snprintf(name, sizeof(name), "trim%d", i - 1);
+		for (int hop = 0; hop < LATENCY_HOPS; hop++)
+			print_row(name, hop_names[hop], &source_histograms[i][hop]);
+	}
+}
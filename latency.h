@@ -0,0 +1,82 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+#include <atomic>
+#include <stdint.h>
+#include <time.h>
+
+#include "misc.h"
+#include "packet-queue.h"
+
+/*
+ * End-to-end latency of transfers through the proxy.
+ *
+ * A transfer is stamped when it is received (libusb completed the device
+ * side IN transfer or usb_raw_ep_read() returned), again when the writer
+ * dequeues it and once more when usb_raw_ep_write()/send_data() returned
+ * or the async force feedback transfer completed.
+ * The hops go into log-linear histograms per endpoint and per source
+ * device: values below 2^LATENCY_SUB_BITS ns are exact, above that every
+ * power of two is split into 2^LATENCY_SUB_BITS buckets, which bounds the
+ * relative error to 1/2^LATENCY_SUB_BITS. Recording is a couple of relaxed
+ * atomic additions and never blocks.
+ *
+ * Writers on a timer (--scheduled_reports) also record how late each tick
+ * woke them up after its deadline, whether or not --latency is given.
+ */
+
+#define LATENCY_SUB_BITS	4
+#define LATENCY_SUB_BUCKETS	(1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_EXPONENT	36	// ~68 s
+#define LATENCY_BUCKETS		((LATENCY_MAX_EXPONENT - LATENCY_SUB_BITS + 2) * LATENCY_SUB_BUCKETS)
+
+#define LATENCY_ENDPOINTS	32	// endpoint numbers 0-15, both directions
+#define LATENCY_SOURCES		9	// the wheel plus the trims, as in the mix rules
+
+enum latency_hop {
+	LATENCY_QUEUE,		// received -> dequeued by the writer
+	LATENCY_WRITE,		// dequeued -> written to the other side
+	LATENCY_TOTAL,		// received -> written
+	LATENCY_HOPS
+};
+
+// How a control request on ep0 was answered.
+enum latency_control {
+	LATENCY_CONTROL_LOCAL,		// by the proxy
+	LATENCY_CONTROL_PROXIED,	// by the wheel
+	LATENCY_CONTROLS
+};
+
+struct latency_histogram {
+	std::atomic<uint64_t>	count;
+	std::atomic<uint64_t>	max;
+	std::atomic<uint64_t>	buckets[LATENCY_BUCKETS];
+};
+
+static inline uint64_t latency_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void latency_histogram_add(struct latency_histogram *histogram, uint64_t ns);
+// Highest value equivalent to the bucket holding the p-th percentile.
+uint64_t latency_histogram_percentile(const struct latency_histogram *histogram, double p);
+
+static inline void latency_stamp(struct packet_stamp *stamp, int source) {
+	stamp->received_ns = latency_enabled ? latency_now() : 0;
+	stamp->source = source;
+}
+
+// Record the hops of a transfer written to endpoint; written_ns is 0 if it
+// was dequeued but not written.
+void latency_record(uint8_t endpoint, const struct packet_stamp *stamp,
+			uint64_t dequeued_ns, uint64_t written_ns);
+const struct latency_histogram *latency_endpoint_histogram(uint8_t endpoint, enum latency_hop hop);
+// Record the time from fetching a control request to completing it on ep0.
+void latency_record_control(enum latency_control path, uint64_t ns);
+const struct latency_histogram *latency_control_histogram(enum latency_control path);
+// Record how late a tick of the report scheduler of endpoint woke up.
+void latency_record_tick(uint8_t endpoint, uint64_t late_ns);
+const struct latency_histogram *latency_tick_histogram(uint8_t endpoint);
+void latency_print();
+#endif
@@ -0,0 +1,241 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "misc.h"
+#include "latency.h"
+#include "logger.h"
+#include "rt.h"
+
+#define LOGGER_RING_MASK	(LOGGER_RING_DEPTH - 1)
+
+std::atomic<int> logger_level(0);
+int logger_rate = LOGGER_DEFAULT_RATE;
+
+enum ring_state {
+	RING_FREE,
+	RING_OWNED,
+	RING_RELEASED,		// its thread exited, the logger thread drains it
+};
+
+struct logger_ring {
+	alignas(64) std::atomic<uint32_t>	head;	// written by the thread
+	std::atomic<uint64_t>			dropped;
+	std::atomic<int>			state;
+	int					tid;
+	alignas(64) std::atomic<uint32_t>	tail;	// written by the logger thread
+	uint64_t				reported_dropped;
+	struct logger_record			records[LOGGER_RING_DEPTH];
+};
+
+// Static, so that neither claiming nor recording allocates; only the rings
+// actually used get their pages touched. A thread gives its ring back when
+// it exits, and the ring is claimed again once the logger thread drained it,
+// as endpoint threads come and go with every configuration and re-attach.
+static struct logger_ring rings[LOGGER_MAX_THREADS];
+static std::atomic<int> n_rings(0);
+static thread_local struct logger_ring *thread_ring;
+static thread_local bool thread_unlogged;
+static std::atomic<uint64_t> unlogged_threads;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t logger_thread;
+static volatile bool logger_stopping;
+
+static const char *const event_formats[LOGGER_EVENTS] = {
+	"read %d bytes from host",
+	"wrote %d bytes to host",
+	"enqueued %d bytes to queue",
+	"sending %d bytes",
+	"sent %d bytes to device",
+	"received %d bytes from device",
+	"queue full, dropped %d bytes",
+};
+
+// pthread key destructor: runs when a thread that claimed a ring exits.
+static void release_ring(void *ring) {
+	((struct logger_ring *)ring)->state.store(RING_RELEASED, std::memory_order_release);
+}
+
+static void create_ring_key() {
+	pthread_key_create(&ring_key, release_ring);
+}
+
+static struct logger_ring *claim_ring() {
+	struct logger_ring *ring = NULL;
+	int n = n_rings.load(std::memory_order_relaxed);
+	for (int i = 0; i < n && i < LOGGER_MAX_THREADS && !ring; i++) {
+		int state = RING_FREE;
+		if (rings[i].state.compare_exchange_strong(state, RING_OWNED,
+				std::memory_order_acquire))
+			ring = &rings[i];
+	}
+	if (!ring) {
+		int i = n_rings.fetch_add(1, std::memory_order_relaxed);
+		if (i >= LOGGER_MAX_THREADS) {
+			// Reported by the logger thread; not retried on every event.
+			thread_unlogged = true;
+			unlogged_threads.fetch_add(1, std::memory_order_relaxed);
+			return NULL;
+		}
+		ring = &rings[i];
+		ring->state.store(RING_OWNED, std::memory_order_relaxed);
+	}
+	ring->tid = gettid();
+	pthread_once(&ring_key_once, create_ring_key);
+	pthread_setspecific(ring_key, ring);
+	thread_ring = ring;
+	return ring;
+}
+
+void logger_record(enum logger_event event, uint8_t endpoint, int value,
+			const void *data, int length) {
+	struct logger_ring *ring = thread_ring;
+	if (!ring && (thread_unlogged || !(ring = claim_ring())))
+		return;
+
+	uint32_t head = ring->head.load(std::memory_order_relaxed);
+	if (head - ring->tail.load(std::memory_order_acquire) == LOGGER_RING_DEPTH) {
+		ring->dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	struct logger_record *record = &ring->records[head & LOGGER_RING_MASK];
+	record->timestamp_ns = latency_now();
+	record->event = event;
+	record->endpoint = endpoint;
+	record->value = value;
+	record->length = 0;
+	if (data && length > 0) {
+		record->length = length < LOGGER_DATA_BYTES ? length : LOGGER_DATA_BYTES;
+		memcpy(record->data, data, record->length);
+	}
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+static void print_record(const struct logger_ring *ring, const struct logger_record *record) {
+	printf("[%llu.%06llu] (%d) EP%02x: ", (unsigned long long)(record->timestamp_ns / 1000000000),
+		(unsigned long long)(record->timestamp_ns % 1000000000 / 1000), ring->tid,
+		record->endpoint);
+	printf(event_formats[record->event], record->value);
+	if (record->length) {
+		printf(":");
+		for (int i = 0; i < record->length; i++)
+			printf(" %02x", record->data[i]);
+		if (record->value > record->length)
+			printf(" ...");
+	}
+	printf("\n");
+}
+
+// Print what the rings hold, oldest first across threads, within the rate.
+static void drain(double *tokens, uint64_t *suppressed) {
+	int n = n_rings.load(std::memory_order_acquire);
+	if (n > LOGGER_MAX_THREADS)
+		n = LOGGER_MAX_THREADS;
+	uint32_t heads[LOGGER_MAX_THREADS];
+	for (int i = 0; i < n; i++)
+		heads[i] = rings[i].head.load(std::memory_order_acquire);
+
+	for (;;) {
+		struct logger_ring *oldest = NULL;
+		for (int i = 0; i < n; i++) {
+			uint32_t tail = rings[i].tail.load(std::memory_order_relaxed);
+			if (tail == heads[i])
+				continue;
+			if (!oldest || rings[i].records[tail & LOGGER_RING_MASK].timestamp_ns <
+					oldest->records[oldest->tail.load(std::memory_order_relaxed) &
+						LOGGER_RING_MASK].timestamp_ns)
+				oldest = &rings[i];
+		}
+		if (!oldest)
+			break;
+
+		uint32_t tail = oldest->tail.load(std::memory_order_relaxed);
+		if (logger_rate <= 0 || *tokens >= 1) {
+			const struct logger_record *record = &oldest->records[tail & LOGGER_RING_MASK];
+			print_record(oldest, record);
+			*tokens -= 1;
+		}
+		else {
+			(*suppressed)++;
+		}
+		oldest->tail.store(tail + 1, std::memory_order_release);
+	}
+
+	for (int i = 0; i < n; i++) {
+		uint64_t dropped = rings[i].dropped.load(std::memory_order_relaxed);
+		if (dropped != rings[i].reported_dropped) {
+			printf("Logger: thread %d dropped %llu events\n", rings[i].tid,
+				(unsigned long long)(dropped - rings[i].reported_dropped));
+			rings[i].reported_dropped = dropped;
+		}
+		// The thread stored its last head before releasing the ring.
+		if (rings[i].state.load(std::memory_order_acquire) == RING_RELEASED &&
+		    rings[i].head.load(std::memory_order_acquire) ==
+		    rings[i].tail.load(std::memory_order_relaxed))
+			rings[i].state.store(RING_FREE, std::memory_order_release);
+	}
+
+	static uint64_t reported_unlogged;
+	uint64_t unlogged = unlogged_threads.load(std::memory_order_relaxed);
+	if (unlogged != reported_unlogged) {
+		printf("Logger: no ring left for %llu more threads, their events are not logged\n",
+			(unsigned long long)(unlogged - reported_unlogged));
+		reported_unlogged = unlogged;
+	}
+}
+
+static void *logger_loop(void *arg __attribute__((unused))) {
+	rt_enter(RT_ROLE_LOG);
+
+	double tokens = logger_rate;
+	uint64_t suppressed = 0;
+	uint64_t last_ns = latency_now(), report_ns = last_ns;
+	for (;;) {
+		bool stopping = logger_stopping;
+		uint64_t now_ns = latency_now();
+		// A second worth of lines at most, refilled continuously.
+		tokens += (now_ns - last_ns) / 1e9 * logger_rate;
+		if (tokens > logger_rate)
+			tokens = logger_rate;
+		last_ns = now_ns;
+
+		drain(&tokens, &suppressed);
+		if (suppressed && (now_ns - report_ns >= 1000000000ull || stopping)) {
+			printf("Logger: %llu lines over the rate limit\n", (unsigned long long)suppressed);
+			suppressed = 0;
+			report_ns = now_ns;
+		}
+		fflush(stdout);
+		if (stopping)
+			break;
+		usleep(LOGGER_FLUSH_MS * 1000);
+	}
+	return NULL;
+}
+
+void logger_start() {
+	logger_stopping = false;
+	pthread_create(&logger_thread, 0, logger_loop, NULL);
+}
+
+void logger_stop() {
+	if (!logger_thread)
+		return;
+	logger_stopping = true;
+	if (pthread_join(logger_thread, NULL))
+		fprintf(stderr, "Error join logger_thread\n");
+	logger_thread = 0;
+}
+
+void logger_raise_level() {
+	int level = logger_level.load(std::memory_order_relaxed);
+	if (level < LOGGER_MAX_LEVEL)
+		logger_level.store(level + 1, std::memory_order_relaxed);
+}
+
+void logger_disable() {
+	logger_level.store(0, std::memory_order_relaxed);
+}
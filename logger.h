@@ -0,0 +1,69 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+#include <atomic>
+#include <stdint.h>
+
+/*
+ * Verbose logging of the data path.
+ *
+ * Endpoint, trim and libusb threads do not print their per-transfer lines
+ * themselves. Each thread records compact binary events (timestamp, event,
+ * endpoint, length and the first LOGGER_DATA_BYTES bytes) into a ring of
+ * its own, a single-producer single-consumer ring claimed from a static
+ * pool on its first event and given back when the thread exits, so
+ * recording takes no lock, never blocks and never allocates; events are
+ * dropped (and counted) when a ring is full. Threads beyond
+ * LOGGER_MAX_THREADS running at once are not logged, which is reported.
+ * The logger thread merges the rings in timestamp order every
+ * LOGGER_FLUSH_MS, formats the lines and prints at most --log_rate lines
+ * per second, counting the rest.
+ *
+ * The level starts at the -v count and can be changed while running:
+ * SIGUSR1 raises it, up to 3, and SIGUSR2 turns it off. Below the level
+ * of an event the data path only pays for an atomic load.
+ */
+
+#define LOGGER_MAX_THREADS	32
+#define LOGGER_RING_DEPTH	1024	// power of two
+#define LOGGER_DATA_BYTES	16
+#define LOGGER_FLUSH_MS		20
+#define LOGGER_DEFAULT_RATE	200	// lines per second
+#define LOGGER_MAX_LEVEL	3
+
+enum logger_event {
+	LOGGER_READ_HOST,	// value: bytes read from the host
+	LOGGER_WROTE_HOST,	// value: bytes written to the host
+	LOGGER_ENQUEUED,	// value: bytes queued for the writer of the endpoint
+	LOGGER_SENDING,		// value: bytes the writer took
+	LOGGER_SENT_DEVICE,	// value: bytes sent to a device
+	LOGGER_RECEIVED_DEVICE,	// value: bytes received from a device
+	LOGGER_DROPPED,		// value: bytes dropped, the writer's queue being full
+	LOGGER_EVENTS
+};
+
+struct logger_record {
+	uint64_t	timestamp_ns;
+	uint8_t		event;
+	uint8_t		endpoint;
+	uint16_t	length;		// of data, at most LOGGER_DATA_BYTES
+	int32_t		value;
+	uint8_t		data[LOGGER_DATA_BYTES];
+};
+
+extern std::atomic<int> logger_level;
+extern int logger_rate;
+
+static inline bool logger_on(int level) {
+	return logger_level.load(std::memory_order_relaxed) >= level;
+}
+
+// Record an event on the ring of the calling thread. The first bytes of data,
+// if not NULL, are printed with it.
+void logger_record(enum logger_event event, uint8_t endpoint, int value,
+			const void *data, int length);
+void logger_start();
+void logger_stop();
+// Async-signal-safe, for the SIGUSR1/SIGUSR2 handlers.
+void logger_raise_level();
+void logger_disable();
+#endif
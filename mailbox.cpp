@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mailbox.h"
+
+static inline struct mailbox_cell *cell_at(struct mailbox *mailbox, int index) {
+	return (struct mailbox_cell *)(mailbox->cells + index * mailbox->stride);
+}
+
+struct mailbox *mailbox_create(size_t capacity) {
+	if (capacity == 0 || capacity > PACKET_QUEUE_MAX_PAYLOAD)
+		capacity = PACKET_QUEUE_MAX_PAYLOAD;
+
+	struct mailbox *mailbox = new struct mailbox;
+	mailbox->capacity = capacity;
+	mailbox->stride = (sizeof(struct mailbox_cell) + capacity + PACKET_QUEUE_ALIGN - 1)
+		& ~(size_t)(PACKET_QUEUE_ALIGN - 1);
+	mailbox->cells = (uint8_t *)aligned_alloc(PACKET_QUEUE_ALIGN, 3 * mailbox->stride);
+	if (!mailbox->cells) {
+		perror("aligned_alloc()");
+		exit(EXIT_FAILURE);
+	}
+	mailbox->back = 0;
+	mailbox->middle.store(1, std::memory_order_relaxed);
+	mailbox->front = 2;
+	return mailbox;
+}
+
+void mailbox_destroy(struct mailbox *mailbox) {
+	free(mailbox->cells);
+	delete mailbox;
+}
+
+bool mailbox_publish(struct mailbox *mailbox, const struct packet_stamp *stamp) {
+	cell_at(mailbox, mailbox->back)->stamp = *stamp;
+	int previous = mailbox->middle.exchange(mailbox->back | MAILBOX_FRESH,
+			std::memory_order_acq_rel);
+	mailbox->back = previous & ~MAILBOX_FRESH;
+	return previous & MAILBOX_FRESH;
+}
+
+struct usb_raw_ep_io *mailbox_take(struct mailbox *mailbox, struct packet_stamp *stamp) {
+	if (!(mailbox->middle.load(std::memory_order_relaxed) & MAILBOX_FRESH))
+		return NULL;
+
+	int previous = mailbox->middle.exchange(mailbox->front, std::memory_order_acq_rel);
+	mailbox->front = previous & ~MAILBOX_FRESH;
+	struct mailbox_cell *cell = cell_at(mailbox, mailbox->front);
+	if (stamp)
+		*stamp = cell->stamp;
+	return &cell->io;
+}
@@ -0,0 +1,49 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "host-raw-gadget.h"
+#include "packet-queue.h"
+
+/*
+ * Single-producer single-consumer mailbox that only keeps the latest
+ * transfer: a triple buffer. The producer fills its back buffer in place and
+ * publishes it by swapping it with the middle one; the consumer takes the
+ * middle buffer as its front buffer if it was published since. Neither side
+ * waits or copies, and a transfer published before the previous one was
+ * taken overwrites it.
+ */
+
+struct mailbox_cell {
+	struct packet_stamp	stamp;
+	struct usb_raw_ep_io	io;	// followed by capacity bytes of payload
+};
+
+struct mailbox {
+	uint8_t			*cells;
+	size_t			stride;
+	size_t			capacity;
+	int			back;		// producer side
+	int			front;		// consumer side
+	alignas(64) std::atomic<int> middle;	// index, MAILBOX_FRESH once published
+};
+
+#define MAILBOX_FRESH	4
+
+struct mailbox *mailbox_create(size_t capacity);
+void mailbox_destroy(struct mailbox *mailbox);
+
+// The buffer the producer fills next, capacity bytes of payload.
+static inline struct usb_raw_ep_io *mailbox_back(struct mailbox *mailbox) {
+	return &((struct mailbox_cell *)(mailbox->cells + mailbox->back * mailbox->stride))->io;
+}
+
+// Publish the back buffer; returns true if it overwrote an untaken transfer.
+bool mailbox_publish(struct mailbox *mailbox, const struct packet_stamp *stamp);
+
+// The latest transfer if one was published since the last call, else NULL.
+// It stays valid until the next call.
+struct usb_raw_ep_io *mailbox_take(struct mailbox *mailbox, struct packet_stamp *stamp);
+#endif
@@ -0,0 +1,318 @@
+#include <algorithm>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "misc.h"
+#include "backpressure.h"
+#include "ffb.h"
+#include "latency.h"
+#include "metrics.h"
+#include "rt.h"
+
+#define METRICS_BUFFER_SIZE	65536
+#define METRICS_POLL_MS		200
+
+struct metrics_endpoint metrics_endpoints[METRICS_ENDPOINTS];
+struct metrics_traffic metrics_sources[METRICS_SOURCES];
+struct metrics_control metrics_control;
+
+static const char *socket_path;
+static const char *textfile_path;
+static int listen_fd = -1;
+static pthread_t metrics_thread;
+static volatile bool metrics_stopping;
+
+struct metrics_writer {
+	char	*buffer;
+	size_t	size;
+	size_t	length;
+};
+
+__attribute__((format(printf, 2, 3)))
+static void append(struct metrics_writer *w, const char *format, ...) {
+	if (w->length + 1 >= w->size)
+		return;
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(w->buffer + w->length, w->size - w->length, format, args);
+	va_end(args);
+	if (n > 0)
+		w->length = std::min(w->length + n, w->size - 1);
+}
+
+static void header(struct metrics_writer *w, const char *name, const char *type,
+			const char *help) {
+	append(w, "# HELP g29_mixer_%s %s\n# TYPE g29_mixer_%s %s\n", name, help, name, type);
+}
+
+static uint64_t load(const std::atomic<uint64_t> &counter) {
+	return counter.load(std::memory_order_relaxed);
+}
+
+static uint8_t endpoint_address(int i) {
+	return (i & 0x0f) | ((i & 0x10) << 3);
+}
+
+static bool endpoint_used(int i) {
+	const struct metrics_traffic *t = &metrics_endpoints[i].traffic;
+	return load(t->received_packets) || load(t->sent_packets) || load(t->libusb_errors) ||
+		load(metrics_endpoints[i].shutdown_errors) || load(metrics_endpoints[i].busy_errors);
+}
+
+static void source_name(int source, char *name, size_t size) {
+	if (source == 0)
+		snprintf(name, size, "wheel");
+	else
+		snprintf(name, size, "trim%d", source - 1);
+}
+
+// One line of a traffic counter per used endpoint and source.
+static void traffic_lines(struct metrics_writer *w, const char *name,
+			std::atomic<uint64_t> metrics_traffic::*counter) {
+	for (int i = 0; i < METRICS_ENDPOINTS; i++) {
+		if (endpoint_used(i))
+			append(w, "g29_mixer_%s{endpoint=\"%02x\"} %llu\n", name, endpoint_address(i),
+				(unsigned long long)load(metrics_endpoints[i].traffic.*counter));
+	}
+	for (int i = 0; i < METRICS_SOURCES; i++) {
+		const struct metrics_traffic *t = &metrics_sources[i];
+		if (!load(t->received_packets) && !load(t->sent_packets) && !load(t->libusb_errors))
+			continue;
+		char source[16];
+		source_name(i, source, sizeof(source));
+		append(w, "g29_mixer_%s{source=\"%s\"} %llu\n", name, source,
+			(unsigned long long)load(t->*counter));
+	}
+}
+
+size_t metrics_format(char *buffer, size_t size) {
+	struct metrics_writer w = { buffer, size, 0 };
+	if (size)
+		buffer[0] = '\0';
+
+	header(&w, "received_packets_total", "counter",
+		"Transfers received by the proxy, per endpoint and source device.");
+	traffic_lines(&w, "received_packets_total", &metrics_traffic::received_packets);
+	header(&w, "received_bytes_total", "counter",
+		"Bytes received by the proxy, per endpoint and source device.");
+	traffic_lines(&w, "received_bytes_total", &metrics_traffic::received_bytes);
+	header(&w, "sent_packets_total", "counter",
+		"Transfers sent by the proxy, per endpoint and destination device.");
+	traffic_lines(&w, "sent_packets_total", &metrics_traffic::sent_packets);
+	header(&w, "sent_bytes_total", "counter",
+		"Bytes sent by the proxy, per endpoint and destination device.");
+	traffic_lines(&w, "sent_bytes_total", &metrics_traffic::sent_bytes);
+	header(&w, "libusb_errors_total", "counter",
+		"Failed libusb transfers, per endpoint and device.");
+	traffic_lines(&w, "libusb_errors_total", &metrics_traffic::libusb_errors);
+
+	header(&w, "gadget_errors_total", "counter",
+		"raw-gadget endpoint transfers failed with ESHUTDOWN or EBUSY.");
+	for (int i = 0; i < METRICS_ENDPOINTS; i++) {
+		if (!endpoint_used(i))
+			continue;
+		append(&w, "g29_mixer_gadget_errors_total{endpoint=\"%02x\",error=\"eshutdown\"} %llu\n",
+			endpoint_address(i),
+			(unsigned long long)load(metrics_endpoints[i].shutdown_errors));
+		append(&w, "g29_mixer_gadget_errors_total{endpoint=\"%02x\",error=\"ebusy\"} %llu\n",
+			endpoint_address(i), (unsigned long long)load(metrics_endpoints[i].busy_errors));
+	}
+
+	header(&w, "queue_high_water", "gauge",
+		"Most transfers found queued for the writer of an endpoint.");
+	for (int i = 0; i < METRICS_ENDPOINTS; i++) {
+		if (endpoint_used(i))
+			append(&w, "g29_mixer_queue_high_water{endpoint=\"%02x\"} %llu\n",
+				endpoint_address(i),
+				(unsigned long long)load(metrics_endpoints[i].queue_high_water));
+	}
+
+	header(&w, "scheduler_ticks_total", "counter",
+		"Ticks of the report scheduler of an endpoint, and those missed because a write ran over.");
+	for (int i = 0; i < METRICS_ENDPOINTS; i++) {
+		if (!load(metrics_endpoints[i].ticks))
+			continue;
+		append(&w, "g29_mixer_scheduler_ticks_total{endpoint=\"%02x\",outcome=\"kept\"} %llu\n",
+			endpoint_address(i), (unsigned long long)load(metrics_endpoints[i].ticks));
+		append(&w, "g29_mixer_scheduler_ticks_total{endpoint=\"%02x\",outcome=\"missed\"} %llu\n",
+			endpoint_address(i), (unsigned long long)load(metrics_endpoints[i].missed_ticks));
+	}
+	header(&w, "scheduler_lateness_seconds", "gauge",
+		"How late the report scheduler of an endpoint woke up after its deadlines.");
+	for (int i = 0; i < METRICS_ENDPOINTS; i++) {
+		if (!load(metrics_endpoints[i].ticks))
+			continue;
+		const struct latency_histogram *h = latency_tick_histogram(endpoint_address(i));
+		append(&w, "g29_mixer_scheduler_lateness_seconds{endpoint=\"%02x\",quantile=\"0.5\"} %.9f\n",
+			endpoint_address(i), latency_histogram_percentile(h, 50) / 1e9);
+		append(&w, "g29_mixer_scheduler_lateness_seconds{endpoint=\"%02x\",quantile=\"0.99\"} %.9f\n",
+			endpoint_address(i), latency_histogram_percentile(h, 99) / 1e9);
+		append(&w, "g29_mixer_scheduler_lateness_seconds{endpoint=\"%02x\",quantile=\"1\"} %.9f\n",
+			endpoint_address(i), load(h->max) / 1e9);
+	}
+
+	header(&w, "idle_reports_total", "counter",
+		"Unchanged reports suppressed and repeated under the HID idle rate set by the host.");
+	append(&w, "g29_mixer_idle_reports_total{outcome=\"suppressed\"} %llu\n",
+		(unsigned long long)load(metrics_endpoint(0x81)->idle_suppressed));
+	append(&w, "g29_mixer_idle_reports_total{outcome=\"repeated\"} %llu\n",
+		(unsigned long long)load(metrics_endpoint(0x81)->idle_repeated));
+
+	header(&w, "dropped_total", "counter",
+		"Transfers dropped by the backpressure policy of an endpoint.");
+	for (int i = 0; i < METRICS_ENDPOINTS; i++) {
+		if (!endpoint_used(i))
+			continue;
+		const struct backpressure_counters *c = backpressure_counters_for(endpoint_address(i));
+		append(&w, "g29_mixer_dropped_total{endpoint=\"%02x\",reason=\"superseded\"} %llu\n",
+			endpoint_address(i), (unsigned long long)load(c->superseded));
+		append(&w, "g29_mixer_dropped_total{endpoint=\"%02x\",reason=\"expired\"} %llu\n",
+			endpoint_address(i), (unsigned long long)load(c->expired));
+		append(&w, "g29_mixer_dropped_total{endpoint=\"%02x\",reason=\"overflow\"} %llu\n",
+			endpoint_address(i), (unsigned long long)load(c->overflow));
+	}
+
+	header(&w, "ffb_commands_total", "counter",
+		"Force feedback commands from the host, and those not sent as such.");
+	append(&w, "g29_mixer_ffb_commands_total{outcome=\"received\"} %llu\n",
+		(unsigned long long)load(ffb_counters.commands));
+	append(&w, "g29_mixer_ffb_commands_total{outcome=\"coalesced\"} %llu\n",
+		(unsigned long long)load(ffb_counters.coalesced));
+	append(&w, "g29_mixer_ffb_commands_total{outcome=\"repeated\"} %llu\n",
+		(unsigned long long)load(ffb_counters.repeated));
+	append(&w, "g29_mixer_ffb_commands_total{outcome=\"failed\"} %llu\n",
+		(unsigned long long)load(ffb_counters.failed));
+
+	header(&w, "control_requests_total", "counter",
+		"Control requests on ep0 answered locally or forwarded to the wheel, and those stalled.");
+	append(&w, "g29_mixer_control_requests_total{handled=\"local\"} %llu\n",
+		(unsigned long long)load(metrics_control.local));
+	append(&w, "g29_mixer_control_requests_total{handled=\"forwarded\"} %llu\n",
+		(unsigned long long)load(metrics_control.forwarded));
+	append(&w, "g29_mixer_control_requests_total{handled=\"stalled\"} %llu\n",
+		(unsigned long long)load(metrics_control.stalled));
+
+	header(&w, "bus_events_total", "counter", "Bus resets and disconnects seen on ep0.");
+	append(&w, "g29_mixer_bus_events_total{event=\"reset\"} %llu\n",
+		(unsigned long long)load(metrics_control.resets));
+	append(&w, "g29_mixer_bus_events_total{event=\"disconnect\"} %llu\n",
+		(unsigned long long)load(metrics_control.disconnects));
+	return w.length;
+}
+
+static void write_textfile(const char *text, size_t length) {
+	char tmp_path[4096];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", textfile_path);
+	FILE *file = fopen(tmp_path, "w");
+	if (!file) {
+		perror("fopen() metrics");
+		return;
+	}
+	bool failed = fwrite(text, 1, length, file) != length;
+	if (fclose(file) || failed) {
+		perror("write() metrics");
+		unlink(tmp_path);
+		return;
+	}
+	if (rename(tmp_path, textfile_path))
+		perror("rename() metrics");
+}
+
+static void serve(int fd, const char *text, size_t length) {
+	while (length > 0) {
+		ssize_t n = send(fd, text, length, MSG_NOSIGNAL);
+		if (n <= 0)
+			break;
+		text += n;
+		length -= n;
+	}
+	close(fd);
+}
+
+static void *metrics_loop(void *arg __attribute__((unused))) {
+	rt_enter(RT_ROLE_LOG);
+	printf("Start metrics thread, thread id(%d)\n", gettid());
+
+	static char text[METRICS_BUFFER_SIZE];
+	uint64_t written_ns = 0;
+	while (!metrics_stopping) {
+		struct pollfd pfd = { listen_fd, POLLIN, 0 };
+		int ready = listen_fd >= 0 ? poll(&pfd, 1, METRICS_POLL_MS) : 0;
+		if (listen_fd < 0)
+			usleep(METRICS_POLL_MS * 1000);
+
+		if (ready > 0 && (pfd.revents & POLLIN)) {
+			int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd >= 0)
+				serve(fd, text, metrics_format(text, sizeof(text)));
+		}
+
+		uint64_t now_ns = latency_now();
+		if (textfile_path && (!written_ns ||
+				now_ns - written_ns >= METRICS_TEXTFILE_PERIOD_S * 1000000000ull)) {
+			write_textfile(text, metrics_format(text, sizeof(text)));
+			written_ns = now_ns;
+		}
+	}
+	if (textfile_path)
+		write_textfile(text, metrics_format(text, sizeof(text)));
+
+	printf("End metrics thread, thread id(%d)\n", gettid());
+	return NULL;
+}
+
+static int listen_socket(const char *path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Metrics socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket() metrics");
+		return -1;
+	}
+	// A socket left behind by an earlier run.
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 4)) {
+		perror("bind() metrics");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int metrics_start(const char *socket_file, const char *textfile) {
+	if (!socket_file && !textfile)
+		return 0;
+	if (socket_file && (listen_fd = listen_socket(socket_file)) < 0)
+		return -1;
+	socket_path = socket_file;
+	textfile_path = textfile;
+	metrics_stopping = false;
+	pthread_create(&metrics_thread, 0, metrics_loop, NULL);
+	return 0;
+}
+
+void metrics_stop() {
+	if (!metrics_thread)
+		return;
+
+	metrics_stopping = true;
+	if (pthread_join(metrics_thread, NULL))
+		fprintf(stderr, "Error join metrics_thread\n");
+	metrics_thread = 0;
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		unlink(socket_path);
+		listen_fd = -1;
+	}
+}
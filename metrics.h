@@ -0,0 +1,113 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Always-on counters of the proxy, for monitoring rigs without -v.
+ *
+ * Per endpoint: transfers and bytes received into the proxy (from the host
+ * on OUT endpoints, from the devices on IN endpoints) and sent out of it,
+ * the highest queue depth a writer found, and raw-gadget ESHUTDOWN/EBUSY
+ * and libusb errors, and the ticks of the report scheduler with those it
+ * missed and how late it woke up, and the reports suppressed and repeated
+ * under the HID idle rate. Per source device (the wheel and the trims): the same
+ * traffic and libusb errors. On ep0: control requests answered locally,
+ * forwarded to the wheel and stalled, and bus resets and disconnects.
+ * Drops are those counted by backpressure.h and ffb.h.
+ *
+ * Counting is a relaxed atomic addition. The metrics thread serves the
+ * Prometheus text format to every connection on --metrics_socket and
+ * rewrites --metrics_textfile every METRICS_TEXTFILE_PERIOD_S seconds, by
+ * renaming a temporary file, for the node_exporter textfile collector.
+ */
+
+#define METRICS_ENDPOINTS		32	// endpoint numbers 0-15, both directions
+#define METRICS_SOURCES			9	// the wheel plus the trims, as in the mix rules
+#define METRICS_TEXTFILE_PERIOD_S	10
+
+struct metrics_traffic {
+	std::atomic<uint64_t>	received_packets;
+	std::atomic<uint64_t>	received_bytes;
+	std::atomic<uint64_t>	sent_packets;
+	std::atomic<uint64_t>	sent_bytes;
+	std::atomic<uint64_t>	libusb_errors;
+};
+
+struct metrics_endpoint {
+	struct metrics_traffic	traffic;
+	std::atomic<uint64_t>	queue_high_water;
+	std::atomic<uint64_t>	shutdown_errors;
+	std::atomic<uint64_t>	busy_errors;
+	std::atomic<uint64_t>	ticks;		// of the report scheduler
+	std::atomic<uint64_t>	missed_ticks;
+	std::atomic<uint64_t>	idle_suppressed;	// see hid-idle.h
+	std::atomic<uint64_t>	idle_repeated;
+};
+
+struct metrics_control {
+	std::atomic<uint64_t>	local;
+	std::atomic<uint64_t>	forwarded;
+	std::atomic<uint64_t>	stalled;
+	std::atomic<uint64_t>	resets;
+	std::atomic<uint64_t>	disconnects;
+};
+
+extern struct metrics_endpoint metrics_endpoints[METRICS_ENDPOINTS];
+extern struct metrics_traffic metrics_sources[METRICS_SOURCES];
+extern struct metrics_control metrics_control;
+
+static inline void metrics_add(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+	counter.fetch_add(n, std::memory_order_relaxed);
+}
+
+static inline struct metrics_endpoint *metrics_endpoint(uint8_t endpoint) {
+	return &metrics_endpoints[(endpoint & 0x0f) | ((endpoint & 0x80) >> 3)];
+}
+
+// source is -1 for the host, 0 for the wheel and 1 + i for trim i.
+static inline struct metrics_traffic *metrics_source(int source) {
+	return source >= 0 && source < METRICS_SOURCES ? &metrics_sources[source] : NULL;
+}
+
+static inline void metrics_received(uint8_t endpoint, int source, int length) {
+	struct metrics_traffic *traffic[2] = { &metrics_endpoint(endpoint)->traffic, metrics_source(source) };
+	for (struct metrics_traffic *t : traffic) {
+		if (t) {
+			metrics_add(t->received_packets);
+			metrics_add(t->received_bytes, length);
+		}
+	}
+}
+
+static inline void metrics_sent(uint8_t endpoint, int source, int length) {
+	struct metrics_traffic *traffic[2] = { &metrics_endpoint(endpoint)->traffic, metrics_source(source) };
+	for (struct metrics_traffic *t : traffic) {
+		if (t) {
+			metrics_add(t->sent_packets);
+			metrics_add(t->sent_bytes, length);
+		}
+	}
+}
+
+static inline void metrics_libusb_error(uint8_t endpoint, int source) {
+	metrics_add(metrics_endpoint(endpoint)->traffic.libusb_errors);
+	if (struct metrics_traffic *t = metrics_source(source))
+		metrics_add(t->libusb_errors);
+}
+
+// Only the writer of an endpoint raises its high-water mark.
+static inline void metrics_queue_depth(uint8_t endpoint, size_t depth) {
+	std::atomic<uint64_t> &high_water = metrics_endpoint(endpoint)->queue_high_water;
+	if (depth > high_water.load(std::memory_order_relaxed))
+		high_water.store(depth, std::memory_order_relaxed);
+}
+
+// The Prometheus text format of all the counters into buffer; returns the
+// length, truncated to size - 1.
+size_t metrics_format(char *buffer, size_t size);
+// Either path may be NULL; 0 on success.
+int metrics_start(const char *socket_path, const char *textfile_path);
+void metrics_stop();
+#endif
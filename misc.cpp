@@ -2,18 +2,29 @@
 
 #include "misc.h"
 
-std::string hexToAscii(std::string input) {
-	std::string output = input;
-	size_t pos = output.find("\\x");
-	while (pos != std::string::npos) {
-		std::string substr = output.substr(pos + 2, 2);
+static int hexDigit(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
 
-		std::istringstream iss(substr);
-		iss.flags(std::ios::hex);
-		int i;
-		iss >> i;
-		output = output.replace(pos, 4, 1, char(i));
-		pos = output.find("\\x");
+// Turns every \xHH into the byte it stands for, in one pass.
+std::string hexToAscii(std::string input) {
+	std::string output;
+	output.reserve(input.size());
+	for (size_t pos = 0; pos < input.size(); pos++) {
+		if (input[pos] == '\\' && pos + 3 < input.size() && input[pos + 1] == 'x' &&
+		    hexDigit(input[pos + 2]) >= 0 && hexDigit(input[pos + 3]) >= 0) {
+			output += char(hexDigit(input[pos + 2]) << 4 | hexDigit(input[pos + 3]));
+			pos += 3;
+		}
+		else {
+			output += input[pos];
+		}
 	}
 	return output;
 }
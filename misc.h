@@ -23,5 +23,12 @@ extern bool customized_config_enabled;
 extern bool reset_device_before_proxy;
 extern bool bmaxpacketsize0_must_greater_than_64;
 
+extern int async_transfers;
+extern int ffb_transfers;
+extern bool reactor_enabled;
+extern bool latency_enabled;
+extern bool local_ep0_enabled;
+extern bool scheduled_reports;
+
 std::string hexToAscii(std::string input);
 int hexToDecimal(int input);
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "misc.h"
+#include "hid-report.h"
+#include "mix-rules.h"
+
+// Ops are collected per destination word while parsing and only flattened
+// into the grouped table by finish().
+struct mix_builder {
+	int		n_sources;
+	int		n_ops[MIX_RULES_WORDS];
+	struct mix_op	ops[MIX_RULES_WORDS][MIX_RULES_MAX_OPS];
+};
+
+static void add_bit(struct mix_builder *builder, int source, int src_bit, int dst_bit) {
+	int dst_word = dst_bit / 64;
+	uint8_t src = source * MIX_RULES_WORDS + src_bit / 64;
+	uint8_t rotate = (dst_bit - src_bit) & 63;
+	uint64_t mask = 1ull << (dst_bit % 64);
+
+	for (int i = 0; i < builder->n_ops[dst_word]; i++) {
+		struct mix_op *op = &builder->ops[dst_word][i];
+		if (op->src == src && op->rotate == rotate) {
+			op->mask |= mask;
+			return;
+		}
+	}
+
+	if (builder->n_ops[dst_word] == MIX_RULES_MAX_OPS) {
+		fprintf(stderr, "Too many mix operations, ignoring the rest\n");
+		return;
+	}
+	struct mix_op *op = &builder->ops[dst_word][builder->n_ops[dst_word]++];
+	op->mask = mask;
+	op->source = source;
+	op->src = src;
+	op->rotate = rotate;
+	op->dst_word = dst_word;
+	op->last = 0;
+	if (source + 1 > builder->n_sources)
+		builder->n_sources = source + 1;
+}
+
+static void add_rule(struct mix_builder *builder, int source, int src_bit, int dst_bit, int width) {
+	for (int i = 0; i < width; i++)
+		add_bit(builder, source, src_bit + i, dst_bit + i);
+}
+
+// Source 0 is the wheel, source 1 + i is trim i.
+static void add_trim_rule(struct mix_builder *builder, int n_trims, int src_bit, int dst_bit, int width) {
+	for (int i = 0; i < n_trims && i + 1 < MIX_RULES_MAX_SOURCES; i++)
+		add_rule(builder, 1 + i, src_bit, dst_bit, width);
+}
+
+static int finish(struct mix_builder *builder, struct mix_rules *rules) {
+	rules->n_sources = builder->n_sources;
+	rules->n_ops = 0;
+	for (int word = 0; word < MIX_RULES_WORDS; word++) {
+		int n = builder->n_ops[word];
+		if (n == 0)
+			continue;
+		if (rules->n_ops + n > MIX_RULES_MAX_OPS) {
+			fprintf(stderr, "Too many mix operations\n");
+			return -1;
+		}
+		memcpy(&rules->ops[rules->n_ops], builder->ops[word], n * sizeof(struct mix_op));
+		rules->n_ops += n;
+		rules->ops[rules->n_ops - 1].last = 1;
+	}
+	return 0;
+}
+
+void mix_rules_default(struct mix_rules *rules, int n_trims) {
+	static struct mix_builder builder;
+	memset(&builder, 0, sizeof(builder));
+	builder.n_sources = 1;
+	add_trim_rule(&builder, n_trims, 1 * 8 + 2, 1 * 8 + 1, 1);
+	add_trim_rule(&builder, n_trims, 1 * 8 + 3, 1 * 8 + 0, 1);
+	add_trim_rule(&builder, n_trims, 1 * 8 + 0, 2 * 8 + 7, 1);
+	add_trim_rule(&builder, n_trims, 1 * 8 + 1, 3 * 8 + 0, 1);
+	finish(&builder, rules);
+}
+
+// A location is either <byte>.<bit> or a usage resolved with the layout of
+// the report: button:<n> or usage:<page>:<id>. For a usage, *width is the
+// size of the field.
+static int resolve(const char *location, const struct hid_report_layout *layout,
+			int *bit, int *width) {
+	int byte, page, id;
+	char end;
+
+	if (sscanf(location, "%d.%d%c", &byte, bit, &end) == 2) {
+		if (byte < 0 || *bit < 0 || *bit > 7)
+			return -1;
+		*bit += byte * 8;
+		*width = 1;
+		return 0;
+	}
+
+	uint32_t usage;
+	if (sscanf(location, "button:%i%c", &id, &end) == 1)
+		usage = HID_USAGE(HID_USAGE_PAGE_BUTTON, id);
+	else if (sscanf(location, "usage:%i:%i%c", &page, &id, &end) == 2)
+		usage = HID_USAGE(page, id);
+	else
+		return -1;
+
+	const struct hid_field *field = layout ? hid_report_find(layout, usage) : NULL;
+	if (!field)
+		return -1;
+	*bit = field->bit_offset;
+	*width = field->bit_size;
+	return 0;
+}
+
+static int add_located_rule(struct mix_builder *builder, int source,
+			const struct hid_report_layout *const *layouts,
+			const char *src, const char *dst, int width) {
+	int src_bit, src_width, dst_bit, dst_width;
+
+	if (resolve(src, layouts[source], &src_bit, &src_width) ||
+	    resolve(dst, layouts[0], &dst_bit, &dst_width))
+		return -1;
+	if (width == 0)
+		width = src_width < dst_width ? src_width : dst_width;
+	if (src_bit + width > MIX_RULES_MAX_BYTES * 8 ||
+	    dst_bit + width > MIX_RULES_MAX_BYTES * 8)
+		return -1;
+	add_rule(builder, source, src_bit, dst_bit, width);
+	return 0;
+}
+
+int mix_rules_load(const char *path, int n_trims, const struct hid_report_layout *const *layouts,
+			struct mix_rules *rules) {
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		perror("fopen() mix rules");
+		return -1;
+	}
+
+	static struct mix_builder builder;
+	memset(&builder, 0, sizeof(builder));
+	builder.n_sources = 1;
+
+	char line[256];
+	int line_number = 0;
+	int result = 0;
+	while (fgets(line, sizeof(line), file)) {
+		line_number++;
+		char *comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		char source[16], src[32], dst[32];
+		int width = 0;
+		int fields = sscanf(line, "%15s %31s %31s %d", source, src, dst, &width);
+		if (fields <= 0)
+			continue;
+		if (fields < 3 || width < 0) {
+			fprintf(stderr, "%s:%d: invalid mix rule\n", path, line_number);
+			result = -1;
+			continue;
+		}
+
+		int first, last, trim;
+		if (strcmp(source, "wheel") == 0) {
+			first = last = 0;
+		}
+		else if (strcmp(source, "trim") == 0) {
+			first = 1;
+			last = n_trims < MIX_RULES_MAX_SOURCES - 1 ? n_trims : MIX_RULES_MAX_SOURCES - 1;
+		}
+		else if (sscanf(source, "trim%d", &trim) == 1 && trim >= 0 &&
+			 trim + 1 < MIX_RULES_MAX_SOURCES) {
+			first = last = 1 + trim;
+		}
+		else {
+			fprintf(stderr, "%s:%d: unknown source '%s'\n", path, line_number, source);
+			result = -1;
+			continue;
+		}
+
+		for (int i = first; i <= last; i++) {
+			if (add_located_rule(&builder, i, layouts, src, dst, width)) {
+				fprintf(stderr, "%s:%d: cannot map %s to %s\n", path, line_number, src, dst);
+				result = -1;
+				break;
+			}
+		}
+	}
+	fclose(file);
+
+	if (finish(&builder, rules))
+		result = -1;
+	if (verbose_level)
+		printf("Loaded %d mix operations from %s\n", rules->n_ops, path);
+	return result;
+}
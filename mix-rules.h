@@ -0,0 +1,79 @@
+#ifndef MIX_RULES_H
+#define MIX_RULES_H
+#include <stdint.h>
+
+struct hid_report_layout;
+
+#define MIX_RULES_MAX_SOURCES	9	// the wheel plus MIXER_MAX_TRIMS trims
+#define MIX_RULES_MAX_OPS	256
+#define MIX_RULES_MAX_BYTES	64
+#define MIX_RULES_WORDS		(MIX_RULES_MAX_BYTES / 8)
+
+/*
+ * Bit mapping rules that copy bit ranges of the source reports (the wheel
+ * report itself or a trim report) into the outgoing wheel report.
+ *
+ * A rule file has one rule per line, '#' starts a comment:
+ *
+ *	<source> <src> <dst> [<width>]
+ *
+ * where source is "wheel", "trimN" (Nth trim device) or "trim" (every trim
+ * device). A location is <byte>.<bit>, with bits numbered from the least
+ * significant bit, or a usage looked up in the report descriptor of the
+ * device: button:<n> or usage:<page>:<id>. The width defaults to the
+ * narrower of the two fields, or to one bit.
+ *
+ * At load time the rules are compiled into ops working on little-endian
+ * 64-bit words of the reports: bits moved by the same rotation between the
+ * same pair of words share one op, and the ops into a destination word are
+ * consecutive so that each destination word is read and written once per
+ * report. Applying the table is a single pass over the ops whose only
+ * branch besides the loop is the write of a finished destination word.
+ */
+
+struct mix_op {
+	uint64_t	mask;		// destination bits
+	uint8_t		source;
+	uint8_t		src;		// word in the block of sources, see mix_rules_apply()
+	uint8_t		rotate;		// left rotation that moves the source bits onto mask
+	uint8_t		dst_word;
+	uint8_t		last;		// the last op into dst_word
+};
+
+struct mix_rules {
+	int		n_sources;
+	int		n_ops;
+	struct mix_op	ops[MIX_RULES_MAX_OPS];
+};
+
+// The mapping of the G29 trim box: four trim buttons into wheel bytes 1-3.
+void mix_rules_default(struct mix_rules *rules, int n_trims);
+// layouts[source] may be NULL if the report descriptor is unknown, which only
+// allows byte.bit locations for that source.
+int mix_rules_load(const char *path, int n_trims, const struct hid_report_layout *const *layouts,
+			struct mix_rules *rules);
+
+static inline uint64_t mix_rotate(uint64_t word, unsigned rotate) {
+	return (word << (rotate & 63)) | (word >> (-rotate & 63));
+}
+
+// sources[i] holds the MIX_RULES_WORDS words of source i, so that word w of
+// source i is word i * MIX_RULES_WORDS + w of the block; enabled[i] is all
+// ones if source i holds a report and 0 otherwise, which turns its ops into
+// no-ops.
+static inline void mix_rules_apply(const struct mix_rules *rules, uint64_t *dst,
+			const uint64_t (*sources)[MIX_RULES_WORDS], const uint64_t *enabled) {
+	const uint64_t *words = sources[0];
+	uint64_t set = 0, clear = 0;
+	for (const struct mix_op *op = rules->ops, *end = op + rules->n_ops; op < end; op++) {
+		uint64_t mask = op->mask & enabled[op->source];
+		set |= mix_rotate(words[op->src], op->rotate) & mask;
+		clear |= mask;
+		if (op->last) {
+			dst[op->dst_word] = (dst[op->dst_word] & ~clear) | set;
+			set = 0;
+			clear = 0;
+		}
+	}
+}
+#endif
@@ -0,0 +1,113 @@
+#include <string.h>
+
+#include "mixer.h"
+#include "trace.h"
+
+struct mixer wheel_mixer;
+
+static void slot_store(struct mixer_slot *slot, const uint8_t *data, int length) {
+	uint64_t words[MIXER_REPORT_WORDS] = {0};
+	if (length > MIXER_REPORT_MAX)
+		length = MIXER_REPORT_MAX;
+	memcpy(words, data, length);
+
+	uint32_t sequence = slot->sequence.load(std::memory_order_relaxed);
+	slot->sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	slot->length.store(length, std::memory_order_relaxed);
+	for (int i = 0; i < MIXER_REPORT_WORDS; i++)
+		slot->words[i].store(words[i], std::memory_order_relaxed);
+
+	slot->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+// Copies the whole zero-padded slot into MIXER_REPORT_WORDS words.
+static int slot_load(struct mixer_slot *slot, uint64_t *words) {
+	uint32_t before, after;
+	int length;
+
+	do {
+		before = slot->sequence.load(std::memory_order_acquire);
+		while (before & 1)
+			before = slot->sequence.load(std::memory_order_acquire);
+
+		length = slot->length.load(std::memory_order_relaxed);
+		for (int i = 0; i < MIXER_REPORT_WORDS; i++)
+			words[i] = slot->words[i].load(std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		after = slot->sequence.load(std::memory_order_relaxed);
+	} while (before != after);
+
+	return length;
+}
+
+void mixer_update_wheel(struct mixer *mixer, const uint8_t *data, int length) {
+	slot_store(&mixer->wheel, data, length);
+	mixer->generation.fetch_add(1, std::memory_order_release);
+}
+
+void mixer_update_trim(struct mixer *mixer, int index, const uint8_t *data, int length) {
+	if (index < 0 || index >= MIXER_MAX_TRIMS)
+		return;
+	slot_store(&mixer->trims[index], data, length);
+	mixer->generation.fetch_add(1, std::memory_order_release);
+}
+
+void mixer_clear_trim(struct mixer *mixer, int index) {
+	uint8_t none[1] = {0};
+	mixer_update_trim(mixer, index, none, 0);
+}
+
+int mixer_read_trim(struct mixer *mixer, int index, uint8_t *out) {
+	if (index < 0 || index >= MIXER_MAX_TRIMS)
+		return 0;
+	uint64_t words[MIXER_REPORT_WORDS];
+	int length = slot_load(&mixer->trims[index], words);
+	memcpy(out, words, length);
+	return length;
+}
+
+void mixer_set_layout(struct mixer *mixer, int source, const struct hid_report_layout *layout) {
+	struct mixer_format *format = &mixer->formats[source];
+
+	if (layout && layout->input_length > 0 && layout->input_length <= MIXER_REPORT_MAX) {
+		format->length = layout->input_length;
+		format->report_id = layout->report_id;
+	}
+	else if (source == 0) {
+		format->length = 12;
+		format->report_id = 0x08;
+	}
+	else {
+		format->length = 2;
+		format->report_id = 0x03;
+	}
+}
+
+void mixer_set_rules(struct mixer *mixer, const struct mix_rules *rules) {
+	mixer->rules = *rules;
+}
+
+int mixer_read(struct mixer *mixer, uint8_t *out, uint32_t *generation) {
+	uint64_t reports[MIX_RULES_MAX_SOURCES][MIXER_REPORT_WORDS];
+	uint64_t enabled[MIX_RULES_MAX_SOURCES];
+	uint64_t merged[MIXER_REPORT_WORDS];
+
+	*generation = mixer->generation.load(std::memory_order_acquire);
+
+	int length = slot_load(&mixer->wheel, reports[0]);
+	if (length == 0)
+		return 0;
+	enabled[0] = ~0ull;
+
+	for (int i = 1; i < mixer->rules.n_sources; i++)
+		enabled[i] = slot_load(&mixer->trims[i - 1], reports[i]) > 0 ? ~0ull : 0;
+
+	memcpy(merged, reports[0], sizeof(merged));
+	mix_rules_apply(&mixer->rules, merged, reports, enabled);
+	memcpy(out, merged, length);
+	TRACE2(mixed, *generation, length);
+	return length;
+}
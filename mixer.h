@@ -0,0 +1,84 @@
+#ifndef MIXER_H
+#define MIXER_H
+#include <atomic>
+#include <stdint.h>
+
+#include "hid-report.h"
+#include "mix-rules.h"
+
+#define MIXER_MAX_TRIMS		8
+#define MIXER_REPORT_MAX	64
+#define MIXER_REPORT_WORDS	(MIXER_REPORT_MAX / 8)
+
+/*
+ * Latest wheel and trim reports, merged on demand for the wheel IN endpoint.
+ *
+ * Every source has its own seqlock protected slot with exactly one writer
+ * (its reader thread or transfer callback), so updates never wait and the
+ * IN writer always builds the report from the freshest state instead of
+ * replaying queued frames. The payload is kept in relaxed atomic words so
+ * that concurrent reads of a slot being rewritten are well defined; torn
+ * reads are detected by the sequence and retried.
+ */
+
+static_assert(MIX_RULES_MAX_SOURCES == MIXER_MAX_TRIMS + 1, "one rule source per trim");
+static_assert(MIX_RULES_MAX_BYTES == MIXER_REPORT_MAX, "rules address whole reports");
+
+struct mixer_slot {
+	alignas(64) std::atomic<uint32_t>	sequence;
+	std::atomic<uint32_t>			length;
+	std::atomic<uint64_t>			words[MIXER_REPORT_WORDS];
+};
+
+// The report kept per source: its length and, if the device uses report
+// IDs, the value of its first byte.
+struct mixer_format {
+	int	length;
+	int	report_id;
+};
+
+struct mixer {
+	struct mixer_slot	wheel;
+	struct mixer_slot	trims[MIXER_MAX_TRIMS];
+	alignas(64) std::atomic<uint32_t> generation;
+	struct mix_rules	rules;
+	// Source 0 is the wheel, source 1 + i is trim i, as in the rules.
+	struct mixer_format	formats[MIX_RULES_MAX_SOURCES];
+};
+
+extern struct mixer wheel_mixer;
+
+static inline bool mixer_is_report(const struct mixer *mixer, int source,
+				const uint8_t *data, int length) {
+	const struct mixer_format *format = &mixer->formats[source];
+	return length == format->length && (format->report_id < 0 || data[0] == format->report_id);
+}
+
+static inline bool mixer_is_wheel_report(const struct mixer *mixer, const uint8_t *data, int length) {
+	return mixer_is_report(mixer, 0, data, length);
+}
+
+static inline bool mixer_is_trim_report(const struct mixer *mixer, int index,
+				const uint8_t *data, int length) {
+	return mixer_is_report(mixer, 1 + index, data, length);
+}
+
+// Must be called before the endpoint threads start. Without a layout (the
+// report descriptor could not be read) the G29 (PS3 mode) wheel report and
+// the Arduino trim box report are assumed.
+void mixer_set_layout(struct mixer *mixer, int source, const struct hid_report_layout *layout);
+void mixer_set_rules(struct mixer *mixer, const struct mix_rules *rules);
+
+void mixer_update_wheel(struct mixer *mixer, const uint8_t *data, int length);
+void mixer_update_trim(struct mixer *mixer, int index, const uint8_t *data, int length);
+// Forget the last report of trim index once it is gone, so that its rules
+// no longer apply; like mixer_update_trim(), only from the trim's writer.
+void mixer_clear_trim(struct mixer *mixer, int index);
+// Copy the last report of trim index into out (MIXER_REPORT_MAX bytes), returns
+// its length, 0 if none arrived yet.
+int mixer_read_trim(struct mixer *mixer, int index, uint8_t *out);
+
+// Build the merged report into out. Returns its length, or 0 until the first
+// wheel report arrived. generation changes whenever any source is updated.
+int mixer_read(struct mixer *mixer, uint8_t *out, uint32_t *generation);
+#endif
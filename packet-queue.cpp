@@ -0,0 +1,224 @@
+#include <errno.h>
+#include <new>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+
+#include "packet-queue.h"
+
+static inline struct packet_queue_cell *cell_at(struct packet_queue *queue, size_t pos) {
+	return (struct packet_queue_cell *)(queue->cells + (pos & queue->mask) * queue->stride);
+}
+
+struct packet_queue *packet_queue_create(size_t depth, bool multi_producer, size_t capacity) {
+	// The ring indexes cells with a mask, so round up to a power of two.
+	size_t size = 2;
+	while (size < depth)
+		size <<= 1;
+	if (capacity == 0 || capacity > PACKET_QUEUE_MAX_PAYLOAD)
+		capacity = PACKET_QUEUE_MAX_PAYLOAD;
+
+	struct packet_queue *queue = new struct packet_queue;
+	queue->capacity = capacity;
+	queue->stride = (sizeof(struct packet_queue_cell) + capacity + PACKET_QUEUE_ALIGN - 1)
+		& ~(size_t)(PACKET_QUEUE_ALIGN - 1);
+	queue->cells = (uint8_t *)aligned_alloc(PACKET_QUEUE_ALIGN, size * queue->stride);
+	if (!queue->cells) {
+		perror("aligned_alloc()");
+		exit(EXIT_FAILURE);
+	}
+	queue->mask = size - 1;
+	for (size_t i = 0; i < size; i++) {
+		struct packet_queue_cell *cell = new (cell_at(queue, i)) struct packet_queue_cell;
+		cell->sequence.store(i, std::memory_order_relaxed);
+	}
+	queue->multi_producer = multi_producer;
+	queue->enqueue_pos.store(0, std::memory_order_relaxed);
+	queue->dequeue_pos.store(0, std::memory_order_relaxed);
+	queue->producers_waiting.store(0, std::memory_order_relaxed);
+	queue->consumer_waiting.store(0, std::memory_order_relaxed);
+
+	queue->data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	queue->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (queue->data_fd < 0 || queue->space_fd < 0) {
+		perror("eventfd()");
+		exit(EXIT_FAILURE);
+	}
+
+	return queue;
+}
+
+void packet_queue_destroy(struct packet_queue *queue) {
+	close(queue->data_fd);
+	close(queue->space_fd);
+	free(queue->cells);
+	delete queue;
+}
+
+static void signal_fd(int fd) {
+	uint64_t one = 1;
+	if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("write(eventfd)");
+}
+
+static bool wait_fd(int fd, int timeout_ms) {
+	struct pollfd pfd = { .fd = fd, .events = POLLIN, .revents = 0 };
+	int rv = poll(&pfd, 1, timeout_ms);
+	if (rv > 0) {
+		uint64_t count;
+		if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			perror("read(eventfd)");
+		return true;
+	}
+	return false;
+}
+
+static void publish(struct packet_queue *queue, struct packet_queue_cell *cell, size_t pos,
+			const struct packet_stamp *stamp) {
+	if (stamp) {
+		cell->stamp = *stamp;
+	}
+	else {
+		cell->stamp.received_ns = 0;
+		cell->stamp.source = -1;
+	}
+	cell->sequence.store(pos + 1, std::memory_order_release);
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (queue->consumer_waiting.load(std::memory_order_relaxed))
+		signal_fd(queue->data_fd);
+}
+
+bool packet_queue_push(struct packet_queue *queue, const struct usb_raw_ep_io *io,
+			const struct packet_stamp *stamp) {
+	struct packet_queue_cell *cell;
+	size_t pos = queue->enqueue_pos.load(std::memory_order_relaxed);
+
+	for (;;) {
+		cell = cell_at(queue, pos);
+		size_t sequence = cell->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+		if (diff == 0) {
+			if (!queue->multi_producer) {
+				queue->enqueue_pos.store(pos + 1, std::memory_order_relaxed);
+				break;
+			}
+			if (queue->enqueue_pos.compare_exchange_weak(pos, pos + 1,
+					std::memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0) {
+			return false;
+		}
+		else {
+			pos = queue->enqueue_pos.load(std::memory_order_relaxed);
+		}
+	}
+
+	// Only the header and the used part of the payload are copied.
+	assert(io->length <= queue->capacity);
+	memcpy(&cell->io, io, sizeof(*io) + io->length);
+	publish(queue, cell, pos, stamp);
+	return true;
+}
+
+struct usb_raw_ep_io *packet_queue_reserve(struct packet_queue *queue) {
+	size_t pos = queue->enqueue_pos.load(std::memory_order_relaxed);
+	struct packet_queue_cell *cell = cell_at(queue, pos);
+	if (cell->sequence.load(std::memory_order_acquire) != pos)
+		return NULL;
+	return &cell->io;
+}
+
+void packet_queue_commit(struct packet_queue *queue, const struct packet_stamp *stamp) {
+	size_t pos = queue->enqueue_pos.load(std::memory_order_relaxed);
+	queue->enqueue_pos.store(pos + 1, std::memory_order_relaxed);
+	publish(queue, cell_at(queue, pos), pos, stamp);
+}
+
+static bool cell_ready(struct packet_queue *queue, size_t pos) {
+	struct packet_queue_cell *cell = cell_at(queue, pos);
+	return cell->sequence.load(std::memory_order_acquire) == pos + 1;
+}
+
+static bool cell_free(struct packet_queue *queue, size_t pos) {
+	struct packet_queue_cell *cell = cell_at(queue, pos);
+	return (intptr_t)cell->sequence.load(std::memory_order_acquire) - (intptr_t)pos >= 0;
+}
+
+struct usb_raw_ep_io *packet_queue_front(struct packet_queue *queue,
+			struct packet_stamp *stamp) {
+	size_t pos = queue->dequeue_pos.load(std::memory_order_relaxed);
+	if (!cell_ready(queue, pos))
+		return NULL;
+
+	struct packet_queue_cell *cell = cell_at(queue, pos);
+	if (stamp)
+		*stamp = cell->stamp;
+	return &cell->io;
+}
+
+bool packet_queue_pop(struct packet_queue *queue, struct usb_raw_transfer_io *io,
+			struct packet_stamp *stamp) {
+	struct usb_raw_ep_io *front = packet_queue_front(queue, stamp);
+	if (!front)
+		return false;
+
+	memcpy(io, front, sizeof(*front) + front->length);
+	packet_queue_release(queue);
+	return true;
+}
+
+void packet_queue_release(struct packet_queue *queue) {
+	size_t pos = queue->dequeue_pos.load(std::memory_order_relaxed);
+	struct packet_queue_cell *cell = cell_at(queue, pos);
+	cell->sequence.store(pos + queue->mask + 1, std::memory_order_release);
+	queue->dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (queue->producers_waiting.load(std::memory_order_relaxed))
+		signal_fd(queue->space_fd);
+}
+
+bool packet_queue_wait_data(struct packet_queue *queue, int timeout_ms) {
+	size_t pos = queue->dequeue_pos.load(std::memory_order_relaxed);
+	if (cell_ready(queue, pos))
+		return true;
+
+	queue->consumer_waiting.store(1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	bool ready = cell_ready(queue, pos);
+	if (!ready) {
+		wait_fd(queue->data_fd, timeout_ms);
+		ready = cell_ready(queue, pos);
+	}
+	queue->consumer_waiting.store(0, std::memory_order_relaxed);
+	return ready;
+}
+
+bool packet_queue_wait_space(struct packet_queue *queue, int timeout_ms) {
+	if (cell_free(queue, queue->enqueue_pos.load(std::memory_order_relaxed)))
+		return true;
+
+	queue->producers_waiting.fetch_add(1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	bool space = cell_free(queue, queue->enqueue_pos.load(std::memory_order_relaxed));
+	if (!space) {
+		wait_fd(queue->space_fd, timeout_ms);
+		space = cell_free(queue, queue->enqueue_pos.load(std::memory_order_relaxed));
+	}
+	queue->producers_waiting.fetch_sub(1, std::memory_order_relaxed);
+	return space;
+}
+
+void packet_queue_wake(struct packet_queue *queue) {
+	signal_fd(queue->data_fd);
+	signal_fd(queue->space_fd);
+}
+
+size_t packet_queue_size(struct packet_queue *queue) {
+	size_t head = queue->dequeue_pos.load(std::memory_order_relaxed);
+	size_t tail = queue->enqueue_pos.load(std::memory_order_relaxed);
+	return tail > head ? tail - head : 0;
+}
@@ -0,0 +1,97 @@
+#ifndef PACKET_QUEUE_H
+#define PACKET_QUEUE_H
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "host-raw-gadget.h"
+
+#define PACKET_QUEUE_DEPTH	32
+// Largest payload of a cell, that of a struct usb_raw_transfer_io.
+#define PACKET_QUEUE_MAX_PAYLOAD	1024
+#define PACKET_QUEUE_ALIGN	64
+
+/*
+ * Bounded, preallocated ring of transfers between the endpoint threads.
+ *
+ * The ring follows the sequence-per-cell scheme of Vyukov's bounded queue:
+ * producers claim a cell by advancing enqueue_pos (with a CAS when several
+ * producers share the ring, a plain store otherwise) and publish it by
+ * bumping the cell sequence. There is exactly one consumer.
+ *
+ * Instead of polling, the consumer sleeps on an eventfd that producers only
+ * signal when the consumer announced that it is waiting, and producers that
+ * hit a full ring sleep on a second eventfd signalled by the consumer.
+ *
+ * Cells are sized for the largest packet of the endpoint (wMaxPacketSize)
+ * and aligned to cache lines: a 12 byte wheel report on a 64 byte endpoint
+ * lives in a 128 byte cell rather than next to a 1 KB buffer, and the cells
+ * of a ring fit a few KB.
+ */
+
+// Carried alongside a transfer for latency accounting, see latency.h.
+struct packet_stamp {
+	uint64_t	received_ns;
+	int		source;
+};
+
+struct packet_queue_cell {
+	std::atomic<size_t>		sequence;
+	struct packet_stamp		stamp;
+	struct usb_raw_ep_io		io;	// followed by capacity bytes of payload
+};
+
+struct packet_queue {
+	uint8_t				*cells;
+	size_t				stride;		// bytes per cell
+	size_t				capacity;	// payload bytes per cell
+	size_t				mask;
+	bool				multi_producer;
+	int				data_fd;
+	int				space_fd;
+
+	alignas(64) std::atomic<size_t>	enqueue_pos;
+	std::atomic<int>		producers_waiting;
+
+	alignas(64) std::atomic<size_t>	dequeue_pos;
+	std::atomic<int>		consumer_waiting;
+};
+
+static_assert(PACKET_QUEUE_MAX_PAYLOAD == sizeof(((struct usb_raw_transfer_io *)0)->data),
+		"cells hold at most a struct usb_raw_transfer_io");
+
+// capacity is the largest payload pushed, at most PACKET_QUEUE_MAX_PAYLOAD.
+struct packet_queue *packet_queue_create(size_t depth, bool multi_producer,
+			size_t capacity = PACKET_QUEUE_MAX_PAYLOAD);
+void packet_queue_destroy(struct packet_queue *queue);
+
+// Non-blocking; return false if the ring is full or empty respectively.
+// The optional stamp travels with the transfer. Only the used part of the
+// payload is copied.
+bool packet_queue_push(struct packet_queue *queue, const struct usb_raw_ep_io *io,
+			const struct packet_stamp *stamp = NULL);
+static inline bool packet_queue_push(struct packet_queue *queue, const struct usb_raw_transfer_io *io,
+			const struct packet_stamp *stamp = NULL) {
+	return packet_queue_push(queue, &io->inner, stamp);
+}
+bool packet_queue_pop(struct packet_queue *queue, struct usb_raw_transfer_io *io,
+			struct packet_stamp *stamp = NULL);
+
+// Zero-copy variants: a single producer fills the next free cell in place
+// and publishes it with commit (or drops it by not committing), and the
+// consumer works on the oldest cell in place until it releases it. The
+// payload of a cell holds queue->capacity bytes.
+struct usb_raw_ep_io *packet_queue_reserve(struct packet_queue *queue);
+void packet_queue_commit(struct packet_queue *queue, const struct packet_stamp *stamp = NULL);
+struct usb_raw_ep_io *packet_queue_front(struct packet_queue *queue,
+			struct packet_stamp *stamp = NULL);
+void packet_queue_release(struct packet_queue *queue);
+
+// Block until the ring is non-empty (consumer) or has a free cell (producers).
+// Return false on timeout or after packet_queue_wake().
+bool packet_queue_wait_data(struct packet_queue *queue, int timeout_ms);
+bool packet_queue_wait_space(struct packet_queue *queue, int timeout_ms);
+void packet_queue_wake(struct packet_queue *queue);
+
+size_t packet_queue_size(struct packet_queue *queue);
+#endif
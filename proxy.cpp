@@ -1,161 +1,627 @@
+#include <algorithm>
+#include <poll.h>
+#include <sys/timerfd.h>
 #include <vector>
 
 #include "host-raw-gadget.h"
 #include "device-libusb.h"
 #include "misc.h"
+#include "packet-queue.h"
+#include "async-transfer.h"
+#include "reactor.h"
+#include "mixer.h"
+#include "latency.h"
+#include "capture.h"
+#include "rt.h"
+#include "backpressure.h"
+#include "reattach.h"
+#include "snapshot.h"
+#include "hid-report.h"
+#include "ffb.h"
+#include "injection.h"
+#include "logger.h"
+#include "metrics.h"
+#include "gadget-speed.h"
+#include "hid-idle.h"
+#include "trace.h"
 
 #include "input-device.h"
 
+// Upper bound for a blocked queue wait, so that threads notice please_stop_eps.
+#define QUEUE_WAIT_TIMEOUT_MS	100
 
-void printData(struct usb_raw_transfer_io io, __u8 bEndpointAddress, std::string transfer_type, std::string dir) {
+// Transfers kept in flight per IN stream in reactor mode without --async_transfers.
+#define REACTOR_DEFAULT_TRANSFERS	2
+
+// How long before the expected host poll the scheduled report is sampled.
+#define SCHEDULER_LEAD_US	200
+
+// What ep0_answer() returns for requests it leaves to the wheel or rejects.
+#define EP0_FORWARD	-1
+#define EP0_STALL	-2
+
+
+void printData(const struct usb_raw_ep_io *io, __u8 bEndpointAddress, std::string transfer_type, std::string dir) {
 	printf("Sending data to EP%x(%s_%s):", bEndpointAddress,
 		transfer_type.c_str(), dir.c_str());
-	for (unsigned int i = 0; i < io.inner.length; i++) {
-		printf(" %02hhx", (unsigned)io.data[i]);
+	const __u8 *data = (const __u8 *)(io + 1);
+	for (unsigned int i = 0; i < io->length; i++) {
+		printf(" %02hhx", (unsigned)data[i]);
 	}
 	printf("\n");
 }
 
-void mix(unsigned char *w, unsigned char *t)
-{
-	w[1] = (w[1] & 0xfc) | ((t[1] & 0x04) >> 1) | ((t[1] & 0x08) >> 3);
-	w[2] = (w[2] & 0x7f) | ((t[1] & 0x01) << 7);
-	w[3] = (w[3] & 0xfe) | ((t[1] & 0x02) >> 1);	
+// Stamps a transfer that just arrived and records it in the capture.
+// Age-bounded endpoints need the reception time even without --latency.
+static void stamp_received(struct packet_stamp *stamp, int source, uint8_t endpoint,
+			const void *data, int length, const struct ep_flow *flow) {
+	TRACE3(received, endpoint, source, length);
+	latency_stamp(stamp, source);
+	if (!stamp->received_ns && flow->config.policy == BACKPRESSURE_AGE)
+		stamp->received_ns = latency_now();
+	if (length >= 0)
+		metrics_received(endpoint, source, length);
+	if (capture_enabled && length >= 0)
+		capture_packet(endpoint, stamp, (const uint8_t *)data, length);
 }
 
-void *ep_loop_write(void *arg) {
-	struct thread_info thread_info = *((struct thread_info*) arg);
-	int fd = thread_info.fd;
-	int ep_num = thread_info.ep_num;
-	struct usb_endpoint_descriptor ep = thread_info.endpoint;
-	std::string transfer_type = thread_info.transfer_type;
-	std::string dir = thread_info.dir;
-	std::deque<usb_raw_transfer_io> *data_queue = thread_info.data_queue;
-	std::mutex *data_mutex = thread_info.data_mutex;
+// Host to wheel force feedback. The commands drained from the queue wait in
+// pending, where those superseded are coalesced (see ffb.h), and are sent
+// with one blocking send_data() at a time or, with --ffb_transfers, on up
+// to that many async transfers completing on the discovery thread.
+struct ffb_writer {
+	struct usb_endpoint_descriptor	ep;
+	struct packet_queue		*data_queue;
+	struct ffb_queue		*pending;
+	int				n_transfers;
+	struct async_out_stream		stream;
+	bool				streaming;	// stream started, wheel handle held
+	struct ffb_command		in_flight[ASYNC_OUT_MAX_TRANSFERS];
+	uint32_t			attachments;
+};
+
+static void ffb_wake(void *user_data) {
+	packet_queue_wake((struct packet_queue *)user_data);
+}
 
-	static unsigned char wheel_data[12];
-	static unsigned char trim_data[6];
-	static bool wheel_init = false;
-	static bool trim_init = false;
+// Whether the front pending command can be sent right away.
+static bool ffb_ready(struct ffb_writer *ffb) {
+	if (ffb_queue_empty(ffb->pending))
+		return false;
+	return !ffb->streaming || async_out_available(&ffb->stream);
+}
 
-	printf("Start writing thread for EP%02x, thread id(%d)\n",
-		ep.bEndpointAddress, gettid());
+static void ffb_done(struct ffb_writer *ffb, const struct ffb_command *command,
+			bool written, uint64_t written_ns) {
+	if (written) {
+		metrics_sent(ffb->ep.bEndpointAddress, 0, command->length);
+	}
+	else {
+		ffb_counters.failed.fetch_add(1, std::memory_order_relaxed);
+		metrics_libusb_error(ffb->ep.bEndpointAddress, 0);
+		ffb_queue_forget(ffb->pending);
+	}
+	if (latency_enabled)
+		latency_record(ffb->ep.bEndpointAddress, &command->stamp, command->dequeued_ns,
+			written ? written_ns : 0);
+}
 
-	while (!please_stop_eps) {
-		assert(ep_num != -1);
-		if (data_queue->size() == 0) {
-			usleep(100);
-			continue;
-		}
+static void ffb_start_stream(struct ffb_writer *ffb) {
+	wheel_handle_hold();
+	struct async_out_stream *stream = &ffb->stream;
+	stream->dev_handle = dev_handle;
+	stream->endpoint = ffb->ep.bEndpointAddress;
+	stream->attributes = ffb->ep.bmAttributes;
+	stream->max_packet_size = ffb->ep.wMaxPacketSize & USB_ENDPOINT_MAXP_MASK;
+	stream->n_transfers = ffb->n_transfers;
+	stream->handler = ffb_wake;
+	stream->user_data = ffb->data_queue;
+
+	int result = dev_handle ? async_out_start(stream) : LIBUSB_ERROR_NO_DEVICE;
+	if (result == LIBUSB_SUCCESS) {
+		ffb->streaming = true;
+		return;
+	}
+	async_out_stop(stream, context);
+	wheel_handle_drop();
+	if (result != LIBUSB_ERROR_NO_DEVICE) {
+		fprintf(stderr, "EP%02x: no async transfers (%s), sending one at a time\n",
+			ffb->ep.bEndpointAddress, libusb_strerror((libusb_error)result));
+		ffb->n_transfers = 0;
+	}
+}
 
-		data_mutex->lock();
-		struct usb_raw_transfer_io io = data_queue->front();
-		data_queue->pop_front();
-		data_mutex->unlock();
+static void ffb_stop_stream(struct ffb_writer *ffb) {
+	if (!ffb->streaming)
+		return;
+	async_out_stop(&ffb->stream, context);
+	wheel_handle_drop();
+	ffb->streaming = false;
+}
 
-		if (verbose_level >= 2)
-			printData(io, ep.bEndpointAddress, transfer_type, dir);
+// Reap the completed transfers and send what the wheel can take now: as
+// many pending commands as there are idle transfers, or the front one.
+static void ffb_flush(struct ffb_writer *ffb) {
+	uint32_t attachments = wheel_attachments();
+	if (attachments != ffb->attachments) {
+		ffb_queue_forget(ffb->pending);
+		ffb->attachments = attachments;
+	}
 
-		int length = io.inner.length;
-		if (ep.bEndpointAddress == 0x81
-			&& io.inner.ep == 0x84
-			&& io.inner.length == 2
-			&& io.data[0] == 0x03)
-		{
-			memcpy(&trim_data, io.data, length);
-			trim_init = true;
+	if (ffb->streaming) {
+		bool lost = false;
+		int i, status;
+		uint64_t completed_ns;
+		while ((i = async_out_reap(&ffb->stream, &status, &completed_ns)) >= 0) {
+			ffb_done(ffb, &ffb->in_flight[i], status == LIBUSB_TRANSFER_COMPLETED,
+				completed_ns);
+			lost |= status == LIBUSB_TRANSFER_NO_DEVICE;
+		}
+		// The re-attach thread waits for the handle to be dropped.
+		if (lost || !wheel_online())
+			ffb_stop_stream(ffb);
+		if (lost)
+			wheel_lost();
+	}
 
-			if (verbose_level) {
-				for (int i = 0; i < length; i++) {
-					printf(" %02x", trim_data[i]);
-				}
-				printf("\n");
-			}
-
-			if (wheel_init) {
-				mix(wheel_data, trim_data);
-				io.inner.length = 12;
-				io.inner.ep = 0x00;
-				memcpy(io.data, wheel_data, 12);
-				int rv = usb_raw_ep_write(fd, (struct usb_raw_ep_io *)&io);
-				if (rv < 0 && errno == ESHUTDOWN) {
-					printf("EP%x(%s_%s): device likely reset, stopping thread\n",
-						ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
-					break;
-				} else if (rv < 0) {
-					perror("usb_raw_ep_write()");
-					exit(EXIT_FAILURE);
-				} else if (verbose_level) {
-					printf("EP%x(%s_%s): wrote %d bytes to host\n", ep.bEndpointAddress,
-						transfer_type.c_str(), dir.c_str(), rv);
-					printData(io, ep.bEndpointAddress, transfer_type, dir);
-				}
-			}
-		} else if (ep.bEndpointAddress == 0x81
-			&& io.inner.ep == 0x84)
-			// ignore here
-		{
-		} else if (ep.bEndpointAddress == 0x81 
-			&& io.inner.length == 12
-			&& io.data[0] == 0x08)
-		{
-			memcpy(&wheel_data, io.data, length);
-			wheel_init = true;
+	// Force feedback sent while the wheel is away is dropped, it would be
+	// stale by the time the wheel is re-attached.
+	if (!wheel_online()) {
+		while (!ffb_queue_empty(ffb->pending)) {
+			struct ffb_command *command = ffb_queue_front(ffb->pending);
+			ffb_queue_pop(ffb->pending);
+			ffb_done(ffb, command, false, 0);
+		}
+		return;
+	}
 
-			if (trim_init) {
-				mix(wheel_data, trim_data);
-				memcpy(io.data, &wheel_data, length);
-			}
-			int rv = usb_raw_ep_write(fd, (struct usb_raw_ep_io *)&io);
-			if (rv < 0 && errno == ESHUTDOWN) {
-				printf("EP%x(%s_%s): device likely reset, stopping thread\n",
-					ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
+	if (!ffb->streaming && ffb->n_transfers > 0 && !ffb_queue_empty(ffb->pending))
+		ffb_start_stream(ffb);
+
+	if (!ffb->streaming) {
+		if (ffb_queue_empty(ffb->pending))
+			return;
+		struct ffb_command *command = ffb_queue_front(ffb->pending);
+		int rv = send_data(ffb->ep.bEndpointAddress, ffb->ep.bmAttributes,
+				command->data, command->length);
+		ffb_queue_pop(ffb->pending);
+		ffb_done(ffb, command, rv >= 0, latency_enabled ? latency_now() : 0);
+		return;
+	}
+
+	while (!ffb_queue_empty(ffb->pending)) {
+		struct ffb_command *command = ffb_queue_front(ffb->pending);
+		int i = async_out_submit(&ffb->stream, command->data, command->length);
+		if (i == LIBUSB_ERROR_BUSY)
+			break;
+		ffb_queue_pop(ffb->pending);
+		if (i < 0) {
+			fprintf(stderr, "Error submitting transfer on EP%02x: %s\n",
+				ffb->ep.bEndpointAddress, libusb_strerror((libusb_error)i));
+			ffb_done(ffb, command, false, 0);
+			if (i == LIBUSB_ERROR_NO_DEVICE) {
+				ffb_stop_stream(ffb);
+				wheel_lost();
 				break;
 			}
-			else if (rv < 0) {
-				perror("usb_raw_ep_write()");
-				exit(EXIT_FAILURE);
+			continue;
+		}
+		ffb->in_flight[i] = *command;
+		int in_flight = ffb->stream.in_flight;
+		if (in_flight > ffb_counters.max_in_flight.load(std::memory_order_relaxed))
+			ffb_counters.max_in_flight.store(in_flight, std::memory_order_relaxed);
+	}
+}
+
+static void ffb_loop_write(struct thread_info *thread_info) {
+	struct packet_queue *data_queue = thread_info->data_queue;
+	struct ep_flow *flow = thread_info->flow;
+	bool timed = latency_enabled || flow->config.policy == BACKPRESSURE_AGE;
+
+	struct ffb_writer ffb;
+	ffb.ep = thread_info->endpoint;
+	ffb.data_queue = data_queue;
+	ffb.pending = ffb_queue_create(data_queue->capacity);
+	ffb.n_transfers = std::min(ffb_transfers, ASYNC_OUT_MAX_TRANSFERS);
+	ffb.stream.buffers = NULL;
+	ffb.streaming = false;
+	ffb.attachments = wheel_attachments();
+	const struct injection_matcher *injection =
+		injection_enabled ? injection_endpoint(&ffb.ep) : NULL;
+
+	while (!please_stop_eps) {
+		// Drain what the host sent so far before anything is sent, so that
+		// the commands superseded in the meantime are coalesced. Completed
+		// transfers wake the queue as well.
+		int timeout_ms = ffb_ready(&ffb) ? 0 : QUEUE_WAIT_TIMEOUT_MS;
+		for (int n = 0; n < PACKET_QUEUE_DEPTH && !ffb_queue_full(ffb.pending) &&
+				packet_queue_wait_data(data_queue, timeout_ms); n++) {
+			if (n == 0)
+				metrics_queue_depth(ffb.ep.bEndpointAddress, packet_queue_size(data_queue));
+			timeout_ms = 0;
+			struct packet_stamp stamp;
+			struct usb_raw_ep_io *io = packet_queue_front(data_queue, &stamp);
+			uint64_t dequeued_ns = timed ? latency_now() : 0;
+			TRACE2(dequeued, ffb.ep.bEndpointAddress, stamp.source);
+
+			if (ep_flow_expired(flow, &stamp, dequeued_ns)) {
+				flow->counters->expired.fetch_add(1, std::memory_order_relaxed);
+				if (latency_enabled)
+					latency_record(ffb.ep.bEndpointAddress, &stamp, dequeued_ns, 0);
+				packet_queue_release(data_queue);
+				continue;
 			}
-			else {
-				if (verbose_level) {
-					printf("EP%x(%s_%s): wrote %d bytes to host\n", ep.bEndpointAddress,
-						transfer_type.c_str(), dir.c_str(), rv);
-					printData(io, ep.bEndpointAddress, transfer_type, dir);
+			if (flow->mailbox) {
+				ep_flow_answer(flow);
+				io = mailbox_take(flow->mailbox, &stamp);
+				if (!io) {
+					packet_queue_release(data_queue);
+					continue;
 				}
 			}
-		} else if (ep.bEndpointAddress & USB_DIR_IN) {
-			int rv = usb_raw_ep_write(fd, (struct usb_raw_ep_io *)&io);
-			if (rv < 0 && errno == ESHUTDOWN) {
-				printf("EP%x(%s_%s): device likely reset, stopping thread\n",
-					ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
+			if (injection) {
+				int length = io->length;
+				injection_apply(injection, (uint8_t *)io->data, &length,
+					data_queue->capacity);
+				io->length = length;
+			}
+			if (logger_on(2))
+				logger_record(LOGGER_SENDING, ffb.ep.bEndpointAddress, io->length,
+					io->data, io->length);
+
+			struct ffb_command superseded;
+			switch (ffb_queue_push(ffb.pending, (const uint8_t *)io->data, io->length,
+					&stamp, dequeued_ns, &superseded)) {
+			case FFB_QUEUED:
+				break;
+			case FFB_COALESCED:
+				if (latency_enabled)
+					latency_record(ffb.ep.bEndpointAddress, &superseded.stamp,
+						superseded.dequeued_ns, 0);
+				break;
+			case FFB_REPEATED:
+				if (latency_enabled)
+					latency_record(ffb.ep.bEndpointAddress, &stamp, dequeued_ns, 0);
 				break;
 			}
-			else if (rv < 0) {
-				perror("usb_raw_ep_write()");
-				exit(EXIT_FAILURE);
+			packet_queue_release(data_queue);
+		}
+
+		if (ffb_queue_full(ffb.pending) && !ffb_ready(&ffb))
+			async_out_wait(&ffb.stream, context, QUEUE_WAIT_TIMEOUT_MS);
+		ffb_flush(&ffb);
+	}
+
+	ffb_stop_stream(&ffb);
+	ffb_queue_destroy(ffb.pending);
+}
+
+// Writes a transfer to the host on an IN endpoint. Returns 1 once written,
+// 0 if the UDC was still busy with the previous one and -1 once the gadget
+// is gone.
+static int write_to_host(const struct thread_info *thread_info, struct usb_raw_ep_io *io) {
+	uint8_t endpoint = thread_info->endpoint.bEndpointAddress;
+	int rv = usb_raw_ep_write(thread_info->fd, io);
+	if (rv < 0 && errno == ESHUTDOWN) {
+		metrics_add(metrics_endpoint(endpoint)->shutdown_errors);
+		printf("EP%x(%s_%s): device likely reset, stopping thread\n", endpoint,
+			thread_info->transfer_type.c_str(), thread_info->dir.c_str());
+		return -1;
+	}
+	else if (rv < 0 && errno == EBUSY) {
+		// Another transfer is still pending on the UDC; the report is
+		// superseded by the next one anyway.
+		metrics_add(metrics_endpoint(endpoint)->busy_errors);
+		return 0;
+	}
+	else if (rv < 0) {
+		perror("usb_raw_ep_write()");
+		exit(EXIT_FAILURE);
+	}
+	metrics_sent(endpoint, -1, rv);
+	if (logger_on(1))
+		logger_record(LOGGER_WROTE_HOST, endpoint, rv, io->data, io->length);
+	return 1;
+}
+
+// Repeats the mixed report on EP81 once the idle duration passed without a
+// new one (see hid-idle.h). Returns -1 once the gadget is gone.
+static int repeat_idle_report(const struct thread_info *thread_info, struct hid_idle_filter *idle,
+				const struct injection_matcher *injection) {
+	struct usb_raw_transfer_io report;
+	uint32_t generation;
+	int length = mixer_read(&wheel_mixer, (uint8_t *)report.data, &generation);
+	if (length == 0 || !hid_idle_due(idle, (const uint8_t *)report.data, length))
+		return 0;
+	if (injection)
+		injection_apply(injection, (uint8_t *)report.data, &length, sizeof(report.data));
+	report.inner.ep = thread_info->ep_num;
+	report.inner.flags = 0;
+	report.inner.length = length;
+	return write_to_host(thread_info, &report.inner);
+}
+
+static void arm_tick(int timer_fd, uint64_t deadline_ns, uint64_t period_ns) {
+	struct itimerspec spec;
+	spec.it_interval.tv_sec = period_ns / 1000000000;
+	spec.it_interval.tv_nsec = period_ns % 1000000000;
+	spec.it_value.tv_sec = deadline_ns / 1000000000;
+	spec.it_value.tv_nsec = deadline_ns % 1000000000;
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL)) {
+		perror("timerfd_settime()");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// The wheel IN endpoint with --scheduled_reports: a timerfd ticks at the
+// polling interval presented to the host and every tick writes the latest
+// mixed report once, changed or not, so that the report rate no longer
+// depends on how wheel and trim frames happen to arrive, unless the host set
+// an idle rate (see hid-idle.h) under which ticks with an unchanged report
+// are skipped until the idle duration passes. Frames only count
+// towards the latency of the next report; other transfers are written as
+// they are dequeued.
+// A write completes when the host polls, so the next tick is moved to
+// SCHEDULER_LEAD_US (at most half a period) before the following poll: the
+// report is sampled just in time instead of up to a period early.
+// Deadlines that passed while a write blocked are skipped and counted as
+// missed, and how late each tick woke up is recorded.
+static void scheduled_loop_write(const struct thread_info *thread_info) {
+	uint8_t endpoint = thread_info->endpoint.bEndpointAddress;
+	struct packet_queue *data_queue = thread_info->data_queue;
+	struct ep_flow *flow = thread_info->flow;
+	struct metrics_endpoint *metrics = metrics_endpoint(endpoint);
+	bool timed = latency_enabled || flow->config.policy == BACKPRESSURE_AGE;
+	const struct injection_matcher *injection =
+		injection_enabled ? injection_endpoint(&thread_info->endpoint) : NULL;
+	uint64_t period_ns = gadget_speed_period_us(&thread_info->endpoint) * 1000ull;
+
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		perror("timerfd_create()");
+		exit(EXIT_FAILURE);
+	}
+	uint64_t lead_ns = std::min((uint64_t)SCHEDULER_LEAD_US * 1000, period_ns / 2);
+	uint64_t deadline_ns = latency_now() + period_ns;
+	arm_tick(timer_fd, deadline_ns, period_ns);
+	printf("EP%02x: writing the mixed report every %llu us\n", endpoint,
+		(unsigned long long)(period_ns / 1000));
+
+	// The report is written on ticks without a frame as well, so it is
+	// built outside the queue; the queue capacity is at most the size of
+	// its data.
+	struct usb_raw_transfer_io report_io;
+	struct usb_raw_ep_io *report = &report_io.inner;
+	report->ep = thread_info->ep_num;
+	report->flags = 0;
+	struct packet_stamp stamps[PACKET_QUEUE_DEPTH];
+	uint64_t dequeued[PACKET_QUEUE_DEPTH];
+	int n_stamps = 0;
+	struct hid_idle_filter idle;
+	idle.length = 0;
+
+	while (!please_stop_eps) {
+		struct pollfd pfd = { timer_fd, POLLIN, 0 };
+		uint64_t expirations;
+		if (poll(&pfd, 1, QUEUE_WAIT_TIMEOUT_MS) <= 0 ||
+		    read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations) ||
+		    expirations == 0)
+			continue;
+		// Only the latest of the expired deadlines is kept.
+		deadline_ns += (expirations - 1) * period_ns;
+		uint64_t now_ns = latency_now();
+		latency_record_tick(endpoint, now_ns > deadline_ns ? now_ns - deadline_ns : 0);
+		deadline_ns += period_ns;
+		metrics_add(metrics->ticks);
+		if (expirations > 1)
+			metrics_add(metrics->missed_ticks, expirations - 1);
+
+		size_t depth = packet_queue_size(data_queue);
+		if (depth)
+			metrics_queue_depth(endpoint, depth);
+		bool stopped = false;
+		while (!stopped && packet_queue_wait_data(data_queue, 0)) {
+			struct packet_stamp stamp;
+			struct usb_raw_ep_io *io = packet_queue_front(data_queue, &stamp);
+			uint64_t dequeued_ns = timed ? latency_now() : 0;
+			TRACE2(dequeued, endpoint, stamp.source);
+
+			if (io->ep == 0x84 || mixer_is_wheel_report(&wheel_mixer, io->data, io->length)) {
+				if (latency_enabled && n_stamps < PACKET_QUEUE_DEPTH) {
+					stamps[n_stamps] = stamp;
+					dequeued[n_stamps++] = dequeued_ns;
+				}
+			}
+			else if (ep_flow_expired(flow, &stamp, dequeued_ns)) {
+				flow->counters->expired.fetch_add(1, std::memory_order_relaxed);
+				if (latency_enabled)
+					latency_record(endpoint, &stamp, dequeued_ns, 0);
 			}
 			else {
-				if (verbose_level) {
-					printf("EP%x(%s_%s): wrote %d bytes to host\n", ep.bEndpointAddress,
-						transfer_type.c_str(), dir.c_str(), rv);
-					printData(io, ep.bEndpointAddress, transfer_type, dir);
+				if (injection) {
+					int length = io->length;
+					injection_apply(injection, (uint8_t *)io->data, &length,
+						data_queue->capacity);
+					io->length = length;
 				}
+				int written = write_to_host(thread_info, io);
+				stopped = written < 0;
+				if (latency_enabled && !stopped)
+					latency_record(endpoint, &stamp, dequeued_ns,
+						written ? latency_now() : 0);
 			}
+			if (!stopped)
+				packet_queue_release(data_queue);
 		}
-		else {
-			int length = io.inner.length;
-			unsigned char *data = new unsigned char[length];
-			memcpy(data, io.data, length);
-			int rv = send_data(ep.bEndpointAddress, ep.bmAttributes, data, length);
-			if (rv == LIBUSB_ERROR_NO_DEVICE) {
-				printf("EP%x(%s_%s): device likely reset, stopping thread\n",
-					ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
-				break;
+		if (stopped)
+			break;
+
+		ep_flow_answer(flow);
+		uint32_t generation;
+		int length = mixer_read(&wheel_mixer, report->data, &generation);
+		if (length == 0)
+			continue;
+		if (!hid_idle_due(&idle, report->data, length)) {
+			for (int i = 0; latency_enabled && i < n_stamps; i++)
+				latency_record(endpoint, &stamps[i], dequeued[i], 0);
+			n_stamps = 0;
+			continue;
+		}
+		report->length = length;
+		if (injection) {
+			injection_apply(injection, (uint8_t *)report->data, &length, data_queue->capacity);
+			report->length = length;
+		}
+		if (logger_on(2))
+			logger_record(LOGGER_SENDING, endpoint, report->length, report->data,
+				report->length);
+		int written = write_to_host(thread_info, report);
+		if (written < 0)
+			break;
+		uint64_t written_ns = written ? latency_now() : 0;
+		for (int i = 0; latency_enabled && i < n_stamps; i++)
+			latency_record(endpoint, &stamps[i], dequeued[i], written_ns);
+		n_stamps = 0;
+		if (!written)
+			continue;
+
+		uint64_t next_ns = deadline_ns;
+		if (written_ns >= deadline_ns) {
+			uint64_t missed = (written_ns - deadline_ns) / period_ns + 1;
+			metrics_add(metrics->missed_ticks, missed);
+			next_ns += missed * period_ns;
+		}
+		// Only a write that waited longer than the lead for its poll moves
+		// the ticks later; one that completed right away keeps the cadence.
+		if (written_ns - now_ns > lead_ns)
+			next_ns = written_ns + period_ns - lead_ns;
+		// Re-arming also drops the expirations already counted as missed.
+		if (next_ns != deadline_ns) {
+			deadline_ns = next_ns;
+			arm_tick(timer_fd, deadline_ns, period_ns);
+		}
+	}
+
+	const struct latency_histogram *late = latency_tick_histogram(endpoint);
+	printf("EP%02x: %llu ticks, %llu missed, late p50 %.1f us, p99 %.1f us, max %.1f us\n",
+		endpoint, (unsigned long long)metrics->ticks.load(std::memory_order_relaxed),
+		(unsigned long long)metrics->missed_ticks.load(std::memory_order_relaxed),
+		latency_histogram_percentile(late, 50) / 1000.0,
+		latency_histogram_percentile(late, 99) / 1000.0,
+		late->max.load(std::memory_order_relaxed) / 1000.0);
+	close(timer_fd);
+}
+
+void *ep_loop_write(void *arg) {
+	struct thread_info thread_info = *((struct thread_info*) arg);
+	int ep_num = thread_info.ep_num;
+	struct usb_endpoint_descriptor ep = thread_info.endpoint;
+	struct packet_queue *data_queue = thread_info.data_queue;
+	struct ep_flow *flow = thread_info.flow;
+	bool timed = latency_enabled || flow->config.policy == BACKPRESSURE_AGE;
+
+	uint32_t last_generation = 0;
+	struct hid_idle_filter idle;
+	idle.length = 0;
+	const struct injection_matcher *injection =
+		injection_enabled ? injection_endpoint(&ep) : NULL;
+
+	rt_enter(usb_endpoint_dir_in(&ep) ? RT_ROLE_WHEEL_IN : RT_ROLE_FFB_OUT);
+	printf("Start writing thread for EP%02x, thread id(%d)\n",
+		ep.bEndpointAddress, gettid());
+
+	if (!usb_endpoint_dir_in(&ep)) {
+		ffb_loop_write(&thread_info);
+		printf("End writing thread for EP%02x, thread id(%d)\n",
+			ep.bEndpointAddress, gettid());
+		return NULL;
+	}
+	if (scheduled_reports && ep.bEndpointAddress == 0x81) {
+		scheduled_loop_write(&thread_info);
+		printf("End writing thread for EP%02x, thread id(%d)\n",
+			ep.bEndpointAddress, gettid());
+		return NULL;
+	}
+
+	while (!please_stop_eps) {
+		assert(ep_num != -1);
+		if (ep.bEndpointAddress == 0x81) {
+			if (!packet_queue_wait_data(data_queue,
+					hid_idle_timeout_ms(&idle, QUEUE_WAIT_TIMEOUT_MS))) {
+				if (repeat_idle_report(&thread_info, &idle, injection) < 0)
+					break;
+				continue;
 			}
+		}
+		else if (!packet_queue_wait_data(data_queue, QUEUE_WAIT_TIMEOUT_MS)) {
+			continue;
+		}
+		metrics_queue_depth(ep.bEndpointAddress, packet_queue_size(data_queue));
+
+		// The transfer is written straight from its cell, which is released
+		// at the end of the iteration.
+		struct packet_stamp stamp;
+		struct usb_raw_ep_io *io = packet_queue_front(data_queue, &stamp);
+		uint64_t dequeued_ns = timed ? latency_now() : 0;
+		TRACE2(dequeued, ep.bEndpointAddress, stamp.source);
+
+		if (ep_flow_expired(flow, &stamp, dequeued_ns)) {
+			flow->counters->expired.fetch_add(1, std::memory_order_relaxed);
+			if (latency_enabled)
+				latency_record(ep.bEndpointAddress, &stamp, dequeued_ns, 0);
+			packet_queue_release(data_queue);
+			continue;
+		}
+
+		if (logger_on(2))
+			logger_record(LOGGER_SENDING, ep.bEndpointAddress, io->length,
+				io->data, io->length);
+
+		// Wheel and trim frames on the wheel IN endpoint only signal that the
+		// mixer state changed; the report sent is always the latest merge,
+		// unless it is unchanged under the idle rate of the host.
+		if (ep.bEndpointAddress == 0x81
+			&& (io->ep == 0x84
+				|| mixer_is_wheel_report(&wheel_mixer, io->data, io->length)))
+		{
+			ep_flow_answer(flow);
+			uint32_t generation;
+			int length = mixer_read(&wheel_mixer, io->data, &generation);
+			if (length == 0 || generation == last_generation ||
+			    !hid_idle_due(&idle, io->data, length)) {
+				if (latency_enabled)
+					latency_record(ep.bEndpointAddress, &stamp, dequeued_ns, 0);
+				packet_queue_release(data_queue);
+				continue;
+			}
+			last_generation = generation;
+
+			io->ep = ep_num;
+			io->length = length;
+		}
+		else if (flow->mailbox) {
+			// A doorbell: the transfer to write is the newest in the mailbox.
+			ep_flow_answer(flow);
+			io = mailbox_take(flow->mailbox, &stamp);
+			if (!io) {
+				packet_queue_release(data_queue);
+				continue;
+			}
+		}
 
-			if (data)
-				delete[] data;
+		if (injection) {
+			int length = io->length;
+			injection_apply(injection, (uint8_t *)io->data, &length, data_queue->capacity);
+			io->length = length;
 		}
+
+		int written = write_to_host(&thread_info, io);
+		if (written < 0)
+			break;
+		if (latency_enabled)
+			latency_record(ep.bEndpointAddress, &stamp, dequeued_ns,
+				written ? latency_now() : 0);
+		packet_queue_release(data_queue);
 	}
 
 	printf("End writing thread for EP%02x, thread id(%d)\n",
@@ -171,60 +637,179 @@ void *trim_loop_read(void *arg)
 	// struct usb_endpoint_descriptor ep = thread_info.endpoint;
 	// std::string transfer_type = thread_info.transfer_type;
 	// std::string dir = thread_info.dir;
-	std::deque<usb_raw_transfer_io> *data_queue = thread_info.data_queue;
-	std::mutex *data_mutex = thread_info.data_mutex;
+	struct packet_queue *data_queue = thread_info.data_queue;
+	struct ep_flow *flow = thread_info.flow;
 
+	rt_enter(RT_ROLE_TRIM);
 	if (verbose_level) {
 		printf("Start reading thread fort trim device, thread id(%d)\n", gettid());
 	}
 		
-	while (!please_stop_eps) {
-		struct usb_raw_transfer_io io;
+	// The ring is shared with the wheel reader, so transfers complete into
+	// this buffer rather than into a cell held while the read blocks.
+	struct usb_raw_transfer_io io;
+	uint8_t *data = (uint8_t *)io.data;
 
-		if (data_queue->size() >= 32) {
-			usleep(200);
+	bool present = false;
+	while (!please_stop_eps) {
+		// While the slot has no trim its last report is forgotten, and the
+		// reader waits for the attach thread to open one.
+		if (!trim->wait_online(QUEUE_WAIT_TIMEOUT_MS)) {
+			if (present)
+				mixer_clear_trim(&wheel_mixer, thread_info.trim_index);
+			present = false;
 			continue;
 		}
 
-		unsigned char *data = NULL;
 		int nbytes = -1;
-		if (verbose_level > 2) {
-			printf("waiting data from trim device, thread id(%d)\n", gettid());
-		}
-		int rv = trim->receive_data(0x84, USB_ENDPOINT_XFER_INT, 64, &data, &nbytes, 0);
-		if (verbose_level > 2) {
-			printf("received data from trim device, thread id(%d)\n", gettid());
-		}
-		if (rv == LIBUSB_ERROR_NO_DEVICE) {
-			printf("EP%x(%s_%s): device likely reset, stopping thread\n", 0x84, "int", "in");
-			break;
-		}
+		int rv = trim->receive_data(0x84, USB_ENDPOINT_XFER_INT, 64, data, &nbytes, 0);
+		if (rv < 0)
+			metrics_libusb_error(0x84, 1 + thread_info.trim_index);
+		if (rv == LIBUSB_ERROR_NO_DEVICE)
+			continue;
+		struct packet_stamp stamp;
+		stamp_received(&stamp, 1 + thread_info.trim_index, 0x84, data, nbytes, flow);
+		if (logger_on(3))
+			logger_record(LOGGER_RECEIVED_DEVICE, 0x84, nbytes, NULL, 0);
+
+		if (nbytes >= 0 && mixer_is_trim_report(&wheel_mixer, thread_info.trim_index, data, nbytes)) {
+			mixer_update_trim(&wheel_mixer, thread_info.trim_index, data, nbytes);
+			present = true;
 
-		if (nbytes >= 0) {
-			memcpy(io.data, data, nbytes);
+			// The frame only rings the writer, which reads the mixer state.
 			io.inner.ep = 0x84;
 			io.inner.flags = 0;
 			io.inner.length = nbytes;
+			ep_flow_ring(flow, data_queue, &io.inner, &stamp);
 
-			data_mutex->lock();
-			data_queue->push_back(io);
-			data_mutex->unlock();
-			if (verbose_level) {
-				for (int i = 0; i < nbytes; i++) {
-					printf(" %02X", data[i]);
-				}
-				printf("\n");
-				printf("EP%x(%s_%s): enqueued %d bytes to queue\n", 0x84, "int", "in", nbytes);				
-			}
+			if (logger_on(1))
+				logger_record(LOGGER_ENQUEUED, 0x84, nbytes, data, nbytes);
 		}
-
-		if (data)
-			delete[] data;
 	}
 	printf("End reading thread for EP84, thread id(%d)\n", gettid());
 	return NULL;
 }
 
+// Hands a transfer to the writer of the endpoint of thread_info according to
+// its backpressure policy, without waiting. mixed transfers already went
+// into the mixer and only ring the writer. Returns false if it was dropped.
+static bool enqueue_transfer(struct thread_info *thread_info, const struct usb_raw_ep_io *io,
+			const struct packet_stamp *stamp, bool mixed) {
+	struct ep_flow *flow = thread_info->flow;
+
+	TRACE3(enqueued, thread_info->endpoint.bEndpointAddress, stamp->source, io->length);
+	if (mixed)
+		return ep_flow_ring(flow, thread_info->data_queue, io, stamp);
+	if (flow->mailbox) {
+		struct usb_raw_ep_io *back = mailbox_back(flow->mailbox);
+		if (back != io)
+			memcpy(back, io, sizeof(*io) + io->length);
+		mailbox_publish(flow->mailbox, stamp);
+		struct usb_raw_ep_io doorbell;
+		doorbell.ep = io->ep;
+		doorbell.flags = 0;
+		doorbell.length = 0;
+		return ep_flow_ring(flow, thread_info->data_queue, &doorbell, stamp);
+	}
+	if (packet_queue_push(thread_info->data_queue, io, stamp))
+		return true;
+	flow->counters->overflow.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+// Runs on the libusb event thread, which must not block: if the writer
+// has fallen a whole queue behind, the report is dropped.
+static void enqueue_completed(struct thread_info *thread_info, uint8_t endpoint, int ep,
+				int source, const uint8_t *data, int length, bool mixed) {
+	struct usb_raw_transfer_io io;
+	struct packet_stamp stamp;
+
+	stamp_received(&stamp, source, endpoint, data, length, thread_info->flow);
+
+	memcpy(io.data, data, length);
+	io.inner.ep = ep;
+	io.inner.flags = 0;
+	io.inner.length = length;
+
+	if (!enqueue_transfer(thread_info, &io.inner, &stamp, mixed)) {
+		if (logger_on(1))
+			logger_record(LOGGER_DROPPED, endpoint, length, NULL, 0);
+		return;
+	}
+	if (logger_on(1))
+		logger_record(LOGGER_ENQUEUED, endpoint, length, NULL, 0);
+}
+
+static void enqueue_async_in(void *user_data, const uint8_t *data, int length) {
+	struct thread_info *thread_info = (struct thread_info *)user_data;
+	bool mixed = thread_info->endpoint.bEndpointAddress == 0x81 &&
+		mixer_is_wheel_report(&wheel_mixer, data, length);
+	if (mixed)
+		mixer_update_wheel(&wheel_mixer, data, length);
+	enqueue_completed(thread_info, thread_info->endpoint.bEndpointAddress,
+		thread_info->ep_num, 0, data, length, mixed);
+}
+
+static void enqueue_trim(void *user_data, const uint8_t *data, int length) {
+	struct thread_info *thread_info = (struct thread_info *)user_data;
+	if (!mixer_is_trim_report(&wheel_mixer, thread_info->trim_index, data, length))
+		return;
+	mixer_update_trim(&wheel_mixer, thread_info->trim_index, data, length);
+	enqueue_completed(thread_info, 0x84, 0x84, 1 + thread_info->trim_index, data, length, true);
+}
+
+static void init_in_stream(struct async_in_stream *stream, libusb_device_handle *handle,
+			uint8_t endpoint, uint8_t attributes, uint16_t max_packet_size,
+			async_in_handler handler, struct thread_info *thread_info, int source) {
+	stream->dev_handle = handle;
+	stream->endpoint = endpoint;
+	stream->attributes = attributes;
+	stream->max_packet_size = max_packet_size;
+	stream->n_transfers = async_transfers > 0 ? async_transfers : REACTOR_DEFAULT_TRANSFERS;
+	stream->handler = handler;
+	stream->user_data = thread_info;
+	stream->source = source;
+	stream->transfers = NULL;
+	stream->buffers = NULL;
+}
+
+// Keeps async_transfers interrupt transfers queued on the endpoint and
+// handles their completions on this thread until the endpoint is stopped.
+// While the wheel is away the stream is stopped and restarted on the
+// re-attached handle; after any other error it is restarted shortly.
+static void ep_loop_read_async(struct thread_info *thread_info) {
+	struct usb_endpoint_descriptor *ep = &thread_info->endpoint;
+	struct async_in_stream stream;
+
+	while (!please_stop_eps) {
+		if (!wheel_wait_online(QUEUE_WAIT_TIMEOUT_MS))
+			continue;
+
+		wheel_handle_hold();
+		init_in_stream(&stream, dev_handle, ep->bEndpointAddress, ep->bmAttributes,
+			ep->wMaxPacketSize, enqueue_async_in, thread_info, 0);
+		stream.error = LIBUSB_ERROR_NO_DEVICE;
+
+		if (dev_handle && async_in_start(&stream) == LIBUSB_SUCCESS) {
+			while (!please_stop_eps && stream.error == LIBUSB_SUCCESS) {
+				struct timeval tv = { .tv_sec = 0, .tv_usec = QUEUE_WAIT_TIMEOUT_MS * 1000 };
+				libusb_handle_events_timeout_completed(context, &tv, NULL);
+			}
+		}
+		async_in_stop(&stream, context);
+		async_in_clear_halt(&stream);
+		wheel_handle_drop();
+
+		if (stream.error == LIBUSB_SUCCESS)
+			continue;
+		metrics_libusb_error(ep->bEndpointAddress, 0);
+		if (stream.error == LIBUSB_ERROR_NO_DEVICE)
+			wheel_lost();
+		else
+			usleep(ASYNC_IN_RETRY_MS * 1000);
+	}
+}
+
 void *ep_loop_read(void *arg) {
 	struct thread_info thread_info = *((struct thread_info*) arg);
 	int fd = thread_info.fd;
@@ -232,79 +817,126 @@ void *ep_loop_read(void *arg) {
 	struct usb_endpoint_descriptor ep = thread_info.endpoint;
 	std::string transfer_type = thread_info.transfer_type;
 	std::string dir = thread_info.dir;
-	std::deque<usb_raw_transfer_io> *data_queue = thread_info.data_queue;
-	std::mutex *data_mutex = thread_info.data_mutex;
+	struct packet_queue *data_queue = thread_info.data_queue;
 
+	rt_enter(usb_endpoint_dir_in(&ep) ? RT_ROLE_WHEEL_IN : RT_ROLE_FFB_OUT);
 	if (verbose_level) {
 		printf("Start reading thread for EP%02x, thread id(%d)\n",
 			ep.bEndpointAddress, gettid());
 	}
 
-	while (!please_stop_eps) {
+	bool async = (ep.bEndpointAddress & USB_DIR_IN) && async_transfers > 0 &&
+		usb_endpoint_type(&ep) == USB_ENDPOINT_XFER_INT;
+	if (async)
+		ep_loop_read_async(&thread_info);
+
+	// Transfers complete directly into the next free cell of the ring, except
+	// on the wheel IN endpoint: the trim readers share that ring, and a cell
+	// claimed for a blocking read would hold up their frames behind it.
+	// Latest endpoints complete into their mailbox and never wait.
+	struct ep_flow *flow = thread_info.flow;
+	struct mailbox *mailbox = flow->mailbox;
+	bool shared = ep.bEndpointAddress == 0x81;
+	bool lossless = flow->config.policy == BACKPRESSURE_LOSSLESS;
+	struct usb_raw_transfer_io local_io;
+	size_t capacity = mailbox ? mailbox->capacity : data_queue->capacity;
+	uint16_t max_packet_size = std::min<size_t>(ep.wMaxPacketSize, capacity);
+
+	while (!async && !please_stop_eps) {
 		assert(ep_num != -1);
-		struct usb_raw_transfer_io io;
+
+		struct usb_raw_ep_io *io;
+		if (mailbox) {
+			io = mailbox_back(mailbox);
+		}
+		else if (shared) {
+			if (lossless && !packet_queue_wait_space(data_queue, QUEUE_WAIT_TIMEOUT_MS))
+				continue;
+			io = &local_io.inner;
+		}
+		else {
+			if (!packet_queue_wait_space(data_queue, QUEUE_WAIT_TIMEOUT_MS))
+				continue;
+			io = packet_queue_reserve(data_queue);
+			if (!io)
+				continue;
+		}
 
 		if (ep.bEndpointAddress & USB_DIR_IN) {
-			unsigned char *data = NULL;
+			uint8_t *data = (uint8_t *)io->data;
 			int nbytes = -1;
 
-			if (data_queue->size() >= 32) {
-				usleep(200);
-				continue;
-			}
-
-			int rv = receive_data(ep.bEndpointAddress, ep.bmAttributes, ep.wMaxPacketSize, &data, &nbytes, 0);
+			int rv = receive_data(ep.bEndpointAddress, ep.bmAttributes, max_packet_size, data, &nbytes, 0);
+			if (rv < 0)
+				metrics_libusb_error(ep.bEndpointAddress, 0);
 			if (rv == LIBUSB_ERROR_NO_DEVICE) {
-				printf("EP%x(%s_%s): device likely reset, stopping thread\n",
-					ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
-				break;
+				// The wheel is away, see reattach.h.
+				wheel_wait_online(QUEUE_WAIT_TIMEOUT_MS);
+				continue;
 			}
+			struct packet_stamp stamp;
+			stamp_received(&stamp, 0, ep.bEndpointAddress, data, nbytes, flow);
 
 			if (nbytes >= 0) {
-				memcpy(io.data, data, nbytes);
-				io.inner.ep = ep_num;
-				io.inner.flags = 0;
-				io.inner.length = nbytes;
+				io->ep = ep_num;
+				io->flags = 0;
+				io->length = nbytes;
 
-				data_mutex->lock();
-				data_queue->push_back(io);
-				data_mutex->unlock();
-				if (verbose_level)
-					printf("EP%x(%s_%s): enqueued %d bytes to queue\n", ep.bEndpointAddress,
-							transfer_type.c_str(), dir.c_str(), nbytes);
+				bool enqueued = true;
+				if (!shared && !mailbox) {
+					packet_queue_commit(data_queue, &stamp);
+				}
+				else if (shared && mixer_is_wheel_report(&wheel_mixer, data, nbytes)) {
+					// Only a wake-up for the writer, see trim_loop_read().
+					mixer_update_wheel(&wheel_mixer, data, nbytes);
+					enqueued = enqueue_transfer(&thread_info, io, &stamp, true);
+				}
+				else if (shared && lossless) {
+					while (!packet_queue_push(data_queue, io, &stamp) && !please_stop_eps)
+						packet_queue_wait_space(data_queue, QUEUE_WAIT_TIMEOUT_MS);
+				}
+				else {
+					enqueued = enqueue_transfer(&thread_info, io, &stamp, false);
+				}
+				if (logger_on(1))
+					logger_record(enqueued ? LOGGER_ENQUEUED : LOGGER_DROPPED,
+						ep.bEndpointAddress, nbytes, NULL, 0);
 			}
-
-			if (data)
-				delete[] data;
 		}
 		else {
-			io.inner.ep = ep_num;
-			io.inner.flags = 0;
-			io.inner.length = sizeof(io.data);
+			io->ep = ep_num;
+			io->flags = 0;
+			io->length = capacity;
 
-			int rv = usb_raw_ep_read(fd, (struct usb_raw_ep_io *)&io);
+			int rv = usb_raw_ep_read(fd, io);
+			struct packet_stamp stamp;
+			stamp_received(&stamp, -1, ep.bEndpointAddress, io->data, rv, flow);
 			if (rv < 0 && errno == ESHUTDOWN) {
+				metrics_add(metrics_endpoint(ep.bEndpointAddress)->shutdown_errors);
 				printf("EP%x(%s_%s): device likely reset, stopping thread\n",
 					ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
 				break;
 			}
+			else if (rv < 0 && errno == EBUSY) {
+				metrics_add(metrics_endpoint(ep.bEndpointAddress)->busy_errors);
+				continue;
+			}
 			else if (rv < 0) {
 				perror("usb_raw_ep_read()");
 				exit(EXIT_FAILURE);
 			}
 			else {
-				if (verbose_level) {
-					printf("EP%x(%s_%s): read %d bytes from host\n", ep.bEndpointAddress,
-							transfer_type.c_str(), dir.c_str(), rv);
-				}
-				io.inner.length = rv;
-
-				data_mutex->lock();
-				data_queue->push_back(io);
-				data_mutex->unlock();
-				if (verbose_level)
-					printf("EP%x(%s_%s): enqueued %d bytes to queue\n", ep.bEndpointAddress,
-							transfer_type.c_str(), dir.c_str(), rv);
+				if (logger_on(1))
+					logger_record(LOGGER_READ_HOST, ep.bEndpointAddress, rv, NULL, 0);
+				io->length = rv;
+				bool enqueued = true;
+				if (mailbox)
+					enqueued = enqueue_transfer(&thread_info, io, &stamp, false);
+				else
+					packet_queue_commit(data_queue, &stamp);
+				if (logger_on(1))
+					logger_record(enqueued ? LOGGER_ENQUEUED : LOGGER_DROPPED,
+						ep.bEndpointAddress, rv, NULL, 0);
 			}
 		}
 	}
@@ -316,6 +948,212 @@ void *ep_loop_read(void *arg) {
 	return NULL;
 }
 
+int setup_host_usb_desc() {
+	host_device_desc.device = {
+		.bLength =		device_device_desc.bLength,
+		.bDescriptorType =	device_device_desc.bDescriptorType,
+		.bcdUSB =		device_device_desc.bcdUSB,
+		.bDeviceClass =		device_device_desc.bDeviceClass,
+		.bDeviceSubClass =	device_device_desc.bDeviceSubClass,
+		.bDeviceProtocol =	device_device_desc.bDeviceProtocol,
+		.bMaxPacketSize0 =	device_device_desc.bMaxPacketSize0,
+		.idVendor =		device_device_desc.idVendor,
+		.idProduct =		device_device_desc.idProduct,
+		.bcdDevice =		device_device_desc.bcdDevice,
+		.iManufacturer =	device_device_desc.iManufacturer,
+		.iProduct =		device_device_desc.iProduct,
+		.iSerialNumber =	device_device_desc.iSerialNumber,
+		.bNumConfigurations =	device_device_desc.bNumConfigurations,
+	};
+
+	int bNumConfigurations = device_device_desc.bNumConfigurations;
+	host_device_desc.configs = new struct raw_gadget_config[bNumConfigurations];
+	for (int i = 0; i < bNumConfigurations; i++) {
+		struct usb_config_descriptor temp_config = {
+			.bLength =		device_config_desc[i]->bLength,
+			.bDescriptorType =	device_config_desc[i]->bDescriptorType,
+			.wTotalLength =		device_config_desc[i]->wTotalLength,
+			.bNumInterfaces =	device_config_desc[i]->bNumInterfaces,
+			.bConfigurationValue =	device_config_desc[i]->bConfigurationValue,
+			.iConfiguration = 	device_config_desc[i]->iConfiguration,
+			.bmAttributes =		device_config_desc[i]->bmAttributes,
+			.bMaxPower =		device_config_desc[i]->MaxPower,
+		};
+		host_device_desc.configs[i].config = temp_config;
+
+		int bNumInterfaces = device_config_desc[i]->bNumInterfaces;
+		struct raw_gadget_interface *temp_interfaces =
+			new struct raw_gadget_interface[bNumInterfaces];
+		for (int j = 0; j < bNumInterfaces; j++) {
+			int num_altsetting = device_config_desc[i]->interface[j].num_altsetting;
+			struct raw_gadget_altsetting *temp_altsettings =
+				new struct raw_gadget_altsetting[num_altsetting];
+			for (int k = 0; k < num_altsetting; k++) {
+				const struct libusb_interface_descriptor temp_device_altsetting =
+					device_config_desc[i]->interface[j].altsetting[k];
+				struct usb_interface_descriptor temp_host_altsetting = {
+					.bLength =		temp_device_altsetting.bLength,
+					.bDescriptorType =	temp_device_altsetting.bDescriptorType,
+					.bInterfaceNumber =	temp_device_altsetting.bInterfaceNumber,
+					.bAlternateSetting =	temp_device_altsetting.bAlternateSetting,
+					.bNumEndpoints =	temp_device_altsetting.bNumEndpoints,
+					.bInterfaceClass =	temp_device_altsetting.bInterfaceClass,
+					.bInterfaceSubClass =	temp_device_altsetting.bInterfaceSubClass,
+					.bInterfaceProtocol =	temp_device_altsetting.bInterfaceProtocol,
+					.iInterface =		temp_device_altsetting.iInterface,
+				};
+				temp_altsettings[k].interface = temp_host_altsetting;
+
+				if (!temp_device_altsetting.bNumEndpoints) {
+					printf("InterfaceNumber %x AlternateSetting %x has no endpoint, skip\n",
+						temp_device_altsetting.bInterfaceNumber,
+						temp_device_altsetting.bAlternateSetting);
+					temp_altsettings[k].endpoints = NULL;
+					continue;
+				}
+
+				int bNumEndpoints = temp_device_altsetting.bNumEndpoints;
+				struct raw_gadget_endpoint *temp_endpoints =
+					new struct raw_gadget_endpoint[bNumEndpoints];
+				for (int l = 0; l < bNumEndpoints; l++) {
+					struct usb_endpoint_descriptor temp_endpoint = {
+						.bLength =		temp_device_altsetting.endpoint[l].bLength,
+						.bDescriptorType =	temp_device_altsetting.endpoint[l].bDescriptorType,
+						.bEndpointAddress =	temp_device_altsetting.endpoint[l].bEndpointAddress,
+						.bmAttributes =		temp_device_altsetting.endpoint[l].bmAttributes,
+						.wMaxPacketSize =	temp_device_altsetting.endpoint[l].wMaxPacketSize,
+						.bInterval =		gadget_speed_interval(
+							temp_device_altsetting.endpoint[l].bEndpointAddress,
+							temp_device_altsetting.endpoint[l].bmAttributes,
+							temp_device_altsetting.endpoint[l].bInterval),
+						.bRefresh =		temp_device_altsetting.endpoint[l].bRefresh,
+						.bSynchAddress = 	temp_device_altsetting.endpoint[l].bSynchAddress,
+					};
+					temp_endpoints[l].endpoint = temp_endpoint;
+					temp_endpoints[l].thread_read = 0;
+					temp_endpoints[l].thread_write = 0;
+					temp_endpoints[l].stream_read = NULL;
+					temp_endpoints[l].thread_info = thread_info();
+					temp_endpoints[l].thread_info.ep_num = -1;
+				}
+				temp_altsettings[k].endpoints = temp_endpoints;
+			}
+			temp_interfaces[j].altsettings = temp_altsettings;
+			temp_interfaces[j].num_altsettings = device_config_desc[i]->interface[j].num_altsetting;
+			temp_interfaces[j].current_altsetting = 0;
+
+		}
+		host_device_desc.configs[i].interfaces = temp_interfaces;
+	}
+
+	host_device_desc.current_config = 0;
+
+	return 0;
+}
+
+static struct raw_gadget_altsetting *find_altsetting(struct raw_gadget_config *config,
+			int interface_number, int alternate_setting) {
+	for (int i = 0; i < config->config.bNumInterfaces; i++) {
+		struct raw_gadget_interface *iface = &config->interfaces[i];
+		for (int j = 0; j < iface->num_altsettings; j++) {
+			struct usb_interface_descriptor *desc = &iface->altsettings[j].interface;
+			if (desc->bInterfaceNumber == interface_number &&
+			    desc->bAlternateSetting == alternate_setting)
+				return &iface->altsettings[j];
+		}
+	}
+	return NULL;
+}
+
+int check_host_usb_desc() {
+	int problems = gadget_speed_check_device(&host_device_desc.device);
+	for (int i = 0; i < host_device_desc.device.bNumConfigurations; i++) {
+		struct raw_gadget_config *config = &host_device_desc.configs[i];
+		for (int j = 0; j < config->config.bNumInterfaces; j++) {
+			struct raw_gadget_interface *iface = &config->interfaces[j];
+			for (int k = 0; k < iface->num_altsettings; k++) {
+				struct raw_gadget_altsetting *alt = &iface->altsettings[k];
+				for (int l = 0; alt->endpoints && l < alt->interface.bNumEndpoints; l++)
+					problems += gadget_speed_check_endpoint(&alt->endpoints[l].endpoint);
+			}
+		}
+
+		// What ep0 answers, from the cache and rewritten like any answer.
+		struct usb_ctrlrequest ctrl;
+		ctrl.bRequestType = USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE;
+		ctrl.bRequest = USB_REQ_GET_DESCRIPTOR;
+		ctrl.wValue = USB_DT_CONFIG << 8 | i;
+		ctrl.wIndex = 0;
+		ctrl.wLength = SNAPSHOT_MAX_CONTROL;
+		uint8_t data[SNAPSHOT_MAX_CONTROL];
+		int length = snapshot_find_control(&ctrl, data);
+		if (length < 0)
+			continue;
+		gadget_speed_rewrite_config(data, length, false);
+
+		struct raw_gadget_altsetting *alt = NULL;
+		for (int offset = 0; offset + 2 <= length && data[offset] >= 2; offset += data[offset]) {
+			const uint8_t *desc = data + offset;
+			if (offset + desc[0] > length)
+				break;
+			if (desc[1] == USB_DT_INTERFACE && desc[0] >= USB_DT_INTERFACE_SIZE)
+				alt = find_altsetting(config, desc[2], desc[3]);
+			if (desc[1] != USB_DT_ENDPOINT || desc[0] < USB_DT_ENDPOINT_SIZE || !alt)
+				continue;
+			const struct usb_endpoint_descriptor *enabled = NULL;
+			for (int l = 0; alt->endpoints && l < alt->interface.bNumEndpoints; l++) {
+				if (alt->endpoints[l].endpoint.bEndpointAddress == desc[2])
+					enabled = &alt->endpoints[l].endpoint;
+			}
+			uint16_t max_packet_size = desc[4] | desc[5] << 8;
+			if (!enabled || enabled->bmAttributes != desc[3] ||
+			    enabled->wMaxPacketSize != max_packet_size || enabled->bInterval != desc[6]) {
+				fprintf(stderr, "EP%02x: configuration %d describes it unlike the gadget\n",
+					desc[2], i);
+				problems++;
+			}
+		}
+	}
+	return problems;
+}
+
+void free_host_usb_desc() {
+	for (int i = 0; i < host_device_desc.device.bNumConfigurations; i++) {
+		struct raw_gadget_config *config = &host_device_desc.configs[i];
+		for (int j = 0; j < config->config.bNumInterfaces; j++) {
+			struct raw_gadget_interface *iface = &config->interfaces[j];
+			for (int k = 0; k < iface->num_altsettings; k++) {
+				if (iface->altsettings[k].endpoints)
+					delete[] iface->altsettings[k].endpoints;
+			}
+			delete[] iface->altsettings;
+		}
+		delete[] config->interfaces;
+	}
+	delete[] host_device_desc.configs;
+	host_device_desc.configs = NULL;
+}
+
+// Configuration changes from ep0 and the re-attach of the wheel are
+// serialized by eps_lock.
+static pthread_mutex_t eps_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool set_configuration_done_once = false;
+
+// Reads the device side of an endpoint through its reactor stream, if it has
+// one that starts, and with a reader thread otherwise.
+static void start_ep_read(struct raw_gadget_endpoint *ep) {
+	if (ep->stream_read) {
+		if (reactor_add(ep->stream_read) == LIBUSB_SUCCESS)
+			return;
+		fprintf(stderr, "EP%02x: reactor stream failed, using a reader thread\n",
+			ep->endpoint.bEndpointAddress);
+		reactor_remove(ep->stream_read);
+		delete ep->stream_read;
+		ep->stream_read = NULL;
+	}
+	pthread_create(&ep->thread_read, 0, ep_loop_read, (void *)&ep->thread_info);
+}
+
 void process_eps(int fd, int config, int interface, int altsetting, std::vector<InputDevice*> *trims)
 {
 	struct raw_gadget_altsetting *alt = &host_device_desc.configs[config]
@@ -333,8 +1171,16 @@ void process_eps(int fd, int config, int interface, int altsetting, std::vector<
 
 		ep->thread_info.fd = fd;
 		ep->thread_info.endpoint = ep->endpoint;
-		ep->thread_info.data_queue = new std::deque<usb_raw_transfer_io>;
-		ep->thread_info.data_mutex = new std::mutex;
+		// Trim readers share the wheel IN endpoint queue with its own reader.
+		// Its cells also carry the trim frames of up to 64 bytes.
+		size_t capacity = ep->endpoint.wMaxPacketSize & USB_ENDPOINT_MAXP_MASK;
+		if (ep->endpoint.bEndpointAddress == 0x81)
+			capacity = std::max<size_t>(capacity, 64);
+		ep->thread_info.data_queue = packet_queue_create(PACKET_QUEUE_DEPTH,
+			ep->endpoint.bEndpointAddress == 0x81, capacity);
+		// The trim readers' copies of thread_info share the flow.
+		ep->thread_info.flow = ep_flow_create(&ep->endpoint, capacity,
+			ep->endpoint.bEndpointAddress == 0x81);
 
 		switch (usb_endpoint_type(&ep->endpoint)) {
 		case USB_ENDPOINT_XFER_ISOC:
@@ -365,21 +1211,41 @@ void process_eps(int fd, int config, int interface, int altsetting, std::vector<
 		if (verbose_level)
 			printf("Creating thread for EP%02x\n",
 				ep->thread_info.endpoint.bEndpointAddress);
-		pthread_create(&ep->thread_read, 0,
-			ep_loop_read, (void *)&ep->thread_info);
+		if (reactor_enabled && usb_endpoint_dir_in(&ep->endpoint)) {
+			ep->stream_read = new struct async_in_stream;
+			init_in_stream(ep->stream_read, dev_handle, ep->endpoint.bEndpointAddress,
+				ep->endpoint.bmAttributes, ep->endpoint.wMaxPacketSize,
+				enqueue_async_in, &ep->thread_info, 0);
+		}
+		// A reactor stream is started by resume_eps() if the wheel is away.
+		if (!ep->stream_read || wheel_online())
+			start_ep_read(ep);
 		pthread_create(&ep->thread_write, 0,
 			ep_loop_write, (void *)&ep->thread_info);
 
 		if (ep->thread_info.endpoint.bEndpointAddress == 0x81)
 		{
-			size_t n = trims->size();
-			ep->n_trim_thread_read = n;
-			for (size_t i = 0; i < n; i++) {
+			for (size_t i = 0; i < trims->size(); i++) {
 				InputDevice *trim = trims->at(i);
-				struct thread_info *ti = new struct thread_info;
-				memcpy(ti, &ep->thread_info, sizeof(thread_info));
+				struct thread_info *ti = new struct thread_info(ep->thread_info);
 				ti->trim = trim;
-				pthread_create(&ep->trim_thread_read[i], 0, trim_loop_read, (void*)ti);
+				ti->trim_index = i;
+				if (reactor_enabled) {
+					struct async_in_stream *stream = new struct async_in_stream;
+					init_in_stream(stream, trim->handle(), 0x84, USB_ENDPOINT_XFER_INT,
+						64, enqueue_trim, ti, 1 + ti->trim_index);
+					// Started by resume_trim() once a trim is attached.
+					if (!trim->is_online() || reactor_add(stream) == LIBUSB_SUCCESS) {
+						ep->trim_streams.push_back(stream);
+						continue;
+					}
+					fprintf(stderr, "Trim %zu: reactor stream failed, using a reader thread\n", i);
+					reactor_remove(stream);
+					delete stream;
+				}
+				pthread_t thread;
+				pthread_create(&thread, 0, trim_loop_read, (void*)ti);
+				ep->trim_thread_read.push_back(thread);
 			}
 		}
 	}
@@ -399,36 +1265,298 @@ void terminate_eps(int fd, int config, int interface, int altsetting)
 	for (int i = 0; i < alt->interface.bNumEndpoints; i++) {
 		struct raw_gadget_endpoint *ep = &alt->endpoints[i];
 
+		if (ep->thread_info.data_queue)
+			packet_queue_wake(ep->thread_info.data_queue);
+
+		if (ep->stream_read) {
+			reactor_remove(ep->stream_read);
+			delete ep->stream_read;
+			ep->stream_read = NULL;
+		}
+		for (size_t i = 0; i < ep->trim_streams.size(); i++) {
+			reactor_remove(ep->trim_streams[i]);
+			delete (struct thread_info *)ep->trim_streams[i]->user_data;
+			delete ep->trim_streams[i];
+		}
+		ep->trim_streams.clear();
+
 		if (ep->thread_read && pthread_join(ep->thread_read, NULL)) {
 			fprintf(stderr, "Error join thread_read\n");
 		}
 		if (ep->thread_write && pthread_join(ep->thread_write, NULL)) {
 			fprintf(stderr, "Error join thread_write\n");
 		}
-		for (size_t i = 0; i < ep->n_trim_thread_read; i++) {
-			if (ep->trim_thread_read[i] && pthread_join(ep->trim_thread_read[i], NULL)) {
+		for (size_t i = 0; i < ep->trim_thread_read.size(); i++) {
+			if (pthread_join(ep->trim_thread_read[i], NULL)) {
 				fprintf(stderr, "Error join trim_thread_read\n");
 			}
 		}
 		ep->thread_read = 0;
 		ep->thread_write = 0;
-		for (size_t i = 0; i < ep->n_trim_thread_read; i++)
-			ep->trim_thread_read[i] = 0;
-		ep->n_trim_thread_read = 0;
+		ep->trim_thread_read.clear();
 
 		usb_raw_ep_disable(fd, ep->thread_info.ep_num);
 		ep->thread_info.ep_num = -1;
 
-		delete ep->thread_info.data_queue;
-		delete ep->thread_info.data_mutex;
+		packet_queue_destroy(ep->thread_info.data_queue);
+		ep->thread_info.data_queue = NULL;
+		ep_flow_destroy(ep->thread_info.flow);
+		ep->thread_info.flow = NULL;
 	}
 
 	please_stop_eps = false;
 }
 
+// The wheel streams of the reactor are bound to its handle; stop them
+// before it is closed.
+void pause_eps() {
+	pthread_mutex_lock(&eps_lock);
+	if (set_configuration_done_once) {
+		struct raw_gadget_config *config = &host_device_desc.configs[host_device_desc.current_config];
+		for (int i = 0; i < config->config.bNumInterfaces; i++) {
+			struct raw_gadget_interface *iface = &config->interfaces[i];
+			struct raw_gadget_altsetting *alt = &iface->altsettings[iface->current_altsetting];
+			for (int j = 0; j < alt->interface.bNumEndpoints; j++) {
+				if (alt->endpoints[j].stream_read)
+					reactor_remove(alt->endpoints[j].stream_read);
+				// The force feedback writer drops its transfers on the
+				// handle once it sees the wheel gone.
+				if (alt->endpoints[j].thread_info.data_queue)
+					packet_queue_wake(alt->endpoints[j].thread_info.data_queue);
+			}
+		}
+	}
+	pthread_mutex_unlock(&eps_lock);
+}
+
+// Bring the re-attached wheel to the configuration, interfaces and alternate
+// settings the host selected and restart the reactor streams.
+void resume_eps() {
+	pthread_mutex_lock(&eps_lock);
+	if (set_configuration_done_once) {
+		struct raw_gadget_config *config = &host_device_desc.configs[host_device_desc.current_config];
+		set_configuration(config->config.bConfigurationValue);
+		for (int i = 0; i < config->config.bNumInterfaces; i++) {
+			struct raw_gadget_interface *iface = &config->interfaces[i];
+			struct raw_gadget_altsetting *alt = &iface->altsettings[iface->current_altsetting];
+			claim_interface(alt->interface.bInterfaceNumber);
+			if (iface->current_altsetting != 0)
+				set_interface_alt_setting(alt->interface.bInterfaceNumber,
+					alt->interface.bAlternateSetting);
+			for (int j = 0; j < alt->interface.bNumEndpoints; j++) {
+				struct raw_gadget_endpoint *ep = &alt->endpoints[j];
+				if (ep->stream_read) {
+					ep->stream_read->dev_handle = dev_handle;
+					start_ep_read(ep);
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&eps_lock);
+}
+
+// Returns the reactor stream of trim index on the current configuration, if
+// it has one; eps_lock held.
+static struct async_in_stream *find_trim_stream(int index) {
+	if (!set_configuration_done_once)
+		return NULL;
+	struct raw_gadget_config *config = &host_device_desc.configs[host_device_desc.current_config];
+	for (int i = 0; i < config->config.bNumInterfaces; i++) {
+		struct raw_gadget_interface *iface = &config->interfaces[i];
+		struct raw_gadget_altsetting *alt = &iface->altsettings[iface->current_altsetting];
+		for (int j = 0; j < alt->interface.bNumEndpoints; j++) {
+			std::vector<struct async_in_stream *> &streams = alt->endpoints[j].trim_streams;
+			for (size_t k = 0; k < streams.size(); k++) {
+				if (streams[k]->source == 1 + index)
+					return streams[k];
+			}
+		}
+	}
+	return NULL;
+}
+
+// A trim's reactor stream is bound to its handle; stop it before the handle
+// is closed and forget the trim's last report. A reader thread does the
+// latter itself, being the only writer of the slot.
+void pause_trim(int index) {
+	pthread_mutex_lock(&eps_lock);
+	struct async_in_stream *stream = find_trim_stream(index);
+	if (stream) {
+		reactor_remove(stream);
+		mixer_clear_trim(&wheel_mixer, index);
+	}
+	pthread_mutex_unlock(&eps_lock);
+}
+
+// Restart the reactor stream of trim index on the handle of the trim just
+// attached to its slot.
+void resume_trim(int index, libusb_device_handle *handle) {
+	pthread_mutex_lock(&eps_lock);
+	struct async_in_stream *stream = find_trim_stream(index);
+	if (stream) {
+		reactor_remove(stream);
+		stream->dev_handle = handle;
+		if (reactor_add(stream) != LIBUSB_SUCCESS)
+			fprintf(stderr, "Trim %d: reactor stream failed to restart\n", index);
+	}
+	pthread_mutex_unlock(&eps_lock);
+}
+
+// Standard requests that set state ep0_answer() reports back, besides the
+// configuration and alternate settings: remote wakeup and endpoint halts.
+static bool remote_wakeup;
+static uint32_t halted_eps;	// bit (address & 0x0f) | (IN ? 0x10 : 0)
+
+static void track_feature(const struct usb_ctrlrequest *ctrl) {
+	if ((ctrl->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD ||
+	    (ctrl->bRequest != USB_REQ_SET_FEATURE && ctrl->bRequest != USB_REQ_CLEAR_FEATURE))
+		return;
+
+	bool set = ctrl->bRequest == USB_REQ_SET_FEATURE;
+	uint8_t recipient = ctrl->bRequestType & USB_RECIP_MASK;
+	if (recipient == USB_RECIP_DEVICE && ctrl->wValue == USB_DEVICE_REMOTE_WAKEUP)
+		remote_wakeup = set;
+	else if (recipient == USB_RECIP_ENDPOINT && ctrl->wValue == USB_ENDPOINT_HALT) {
+		uint32_t bit = 1u << ((ctrl->wIndex & 0x0f) | ((ctrl->wIndex & USB_DIR_IN) >> 3));
+		halted_eps = set ? halted_eps | bit : halted_eps & ~bit;
+	}
+}
+
+// Index of the interface numbered interface_number in the current
+// configuration, -1 if there is none.
+static int find_interface(int interface_number) {
+	struct raw_gadget_config *config = &host_device_desc.configs[host_device_desc.current_config];
+	for (int i = 0; i < config->config.bNumInterfaces; i++) {
+		if (config->interfaces[i].altsettings[0].interface.bInterfaceNumber == interface_number)
+			return i;
+	}
+	return -1;
+}
+
+// Whether the current altsetting of interface i has the endpoint address.
+static bool interface_has_ep(int i, uint8_t address) {
+	struct raw_gadget_interface *iface =
+		&host_device_desc.configs[host_device_desc.current_config].interfaces[i];
+	struct raw_gadget_altsetting *alt = &iface->altsettings[iface->current_altsetting];
+	for (int j = 0; j < alt->interface.bNumEndpoints; j++) {
+		if (alt->endpoints[j].endpoint.bEndpointAddress == address)
+			return true;
+	}
+	return false;
+}
+
+// Answers the IN control requests whose answer the proxy knows without a
+// round trip to the wheel: descriptors from the control cache (see
+// snapshot.h), the status, configuration and alternate settings the host
+// set, HID GET_REPORT of the input report from the mixed state and GET_IDLE
+// from the idle rate the proxy keeps (see hid-idle.h). Writes
+// the answer to data and returns its length, or EP0_FORWARD for requests
+// only the wheel can answer, such as vendor requests and feature reports.
+// With --proxy_ep0 only descriptor requests are answered, and only while the
+// wheel is away.
+static int ep0_answer(const struct usb_ctrlrequest *ctrl, uint8_t *data) {
+	uint8_t type = ctrl->bRequestType & USB_TYPE_MASK;
+	uint8_t recipient = ctrl->bRequestType & USB_RECIP_MASK;
+
+	if (type == USB_TYPE_STANDARD && ctrl->bRequest == USB_REQ_GET_DESCRIPTOR) {
+		if (local_ep0_enabled || !wheel_online()) {
+			int length = snapshot_find_control(ctrl, data);
+			if (length >= 0)
+				return length;
+			if (!wheel_online())
+				return EP0_STALL;
+		}
+		return EP0_FORWARD;
+	}
+	// SET_IDLE is never forwarded, so neither is GET_IDLE.
+	if (type == USB_TYPE_CLASS && recipient == USB_RECIP_INTERFACE &&
+	    ctrl->bRequest == HID_REQ_GET_IDLE) {
+		if (ctrl->wLength < 1)
+			return EP0_STALL;
+		data[0] = hid_idle_get();
+		return 1;
+	}
+	if (!local_ep0_enabled)
+		return EP0_FORWARD;
+
+	if (type == USB_TYPE_STANDARD) {
+		struct raw_gadget_config *config =
+			&host_device_desc.configs[host_device_desc.current_config];
+		switch (ctrl->bRequest) {
+		case USB_REQ_GET_STATUS: {
+			if (ctrl->wLength < 2)
+				return EP0_FORWARD;
+			uint16_t status = 0;
+			if (recipient == USB_RECIP_DEVICE) {
+				if (config->config.bmAttributes & USB_CONFIG_ATT_SELFPOWER)
+					status |= 1 << USB_DEVICE_SELF_POWERED;
+				if (remote_wakeup)
+					status |= 1 << USB_DEVICE_REMOTE_WAKEUP;
+			}
+			else if (recipient == USB_RECIP_ENDPOINT) {
+				uint8_t endpoint = ctrl->wIndex;
+				if (halted_eps & (1u << ((endpoint & 0x0f) | ((endpoint & USB_DIR_IN) >> 3))))
+					status |= 1 << USB_ENDPOINT_HALT;
+			}
+			else if (recipient != USB_RECIP_INTERFACE) {
+				return EP0_FORWARD;
+			}
+			data[0] = status & 0xff;
+			data[1] = status >> 8;
+			return 2;
+		}
+		case USB_REQ_GET_CONFIGURATION:
+			if (ctrl->wLength < 1)
+				return EP0_FORWARD;
+			data[0] = set_configuration_done_once ? config->config.bConfigurationValue : 0;
+			return 1;
+		case USB_REQ_GET_INTERFACE: {
+			int i = find_interface(ctrl->wIndex);
+			if (ctrl->wLength < 1 || !set_configuration_done_once || i < 0)
+				return EP0_FORWARD;
+			struct raw_gadget_interface *iface = &config->interfaces[i];
+			data[0] = iface->altsettings[iface->current_altsetting].interface.bAlternateSetting;
+			return 1;
+		}
+		}
+		return EP0_FORWARD;
+	}
+
+	// The input report is what the host polls EP81 for: the mixed report.
+	if (type == USB_TYPE_CLASS && recipient == USB_RECIP_INTERFACE &&
+	    ctrl->bRequest == HID_REQ_GET_REPORT && (ctrl->wValue >> 8) == HID_REPORT_TYPE_INPUT) {
+		int i = find_interface(ctrl->wIndex);
+		if (!set_configuration_done_once || i < 0 || !interface_has_ep(i, 0x81))
+			return EP0_FORWARD;
+
+		uint8_t report[MIXER_REPORT_MAX];
+		uint32_t generation;
+		int length = mixer_read(&wheel_mixer, report, &generation);
+		uint8_t report_id = ctrl->wValue & 0xff;
+		if (length == 0 || (report_id && report[0] != report_id))
+			return EP0_FORWARD;
+		length = std::min<int>(length, ctrl->wLength);
+		memcpy(data, report, length);
+		return length;
+	}
+	return EP0_FORWARD;
+}
+
+static void ep0_stall(int fd) {
+	metrics_add(metrics_control.stalled);
+	usb_raw_ep0_stall(fd);
+}
+
+static int ep0_read(int fd, struct usb_raw_transfer_io *io) {
+	int rv = usb_raw_ep0_read(fd, (struct usb_raw_ep_io *)io);
+	if (rv < 0 && errno == EBUSY)
+		metrics_add(metrics_endpoint(0)->busy_errors);
+	return rv;
+}
+
 void ep0_loop(int fd, std::vector<InputDevice *> *trims) {
-	bool set_configuration_done_once = false;
 
+	rt_enter(RT_ROLE_EP0);
 	if (verbose_level) {
 		printf("Start for EP0, thread id(%d)\n", gettid());
 	}
@@ -436,12 +1564,21 @@ void ep0_loop(int fd, std::vector<InputDevice *> *trims) {
 	if (verbose_level)
 		print_eps_info(fd);
 
+	// Enumeration runs from a connect or reset (or the first request) to
+	// SET_CONFIGURATION.
+	bool enumerating = true;
+	uint64_t enumeration_ns = 0;
+	int enumeration_requests = 0, enumeration_proxied = 0;
+
 	while (!please_stop_ep0) {
 		struct usb_raw_control_event event;
 		event.inner.type = 0;
 		event.inner.length = sizeof(event.ctrl);
 
 		usb_raw_event_fetch(fd, (struct usb_raw_event *)&event);
+		uint64_t fetched_ns = latency_now();
+		TRACE6(ep0_event, event.inner.type, event.ctrl.bRequestType, event.ctrl.bRequest,
+			event.ctrl.wValue, event.ctrl.wIndex, event.ctrl.wLength);
 		if (verbose_level)
 			log_event((struct usb_raw_event *)&event);
 
@@ -452,13 +1589,26 @@ void ep0_loop(int fd, std::vector<InputDevice *> *trims) {
 
 		// Normally, we would only need to check for USB_RAW_EVENT_RESET to handle a reset event.
 		// However, dwc2 is buggy and it reports a disconnect event instead of a reset.
+		if (event.inner.type == USB_RAW_EVENT_CONNECT || event.inner.type == USB_RAW_EVENT_RESET ||
+		    event.inner.type == USB_RAW_EVENT_DISCONNECT) {
+			enumerating = true;
+			enumeration_ns = fetched_ns;
+			enumeration_requests = enumeration_proxied = 0;
+		}
+
 		if (event.inner.type == USB_RAW_EVENT_RESET || event.inner.type == USB_RAW_EVENT_DISCONNECT) {
+			metrics_add(event.inner.type == USB_RAW_EVENT_RESET ?
+				metrics_control.resets : metrics_control.disconnects);
 			printf("Resetting device\n");
+			remote_wakeup = false;
+			halted_eps = 0;
+			hid_idle_reset();
 			// Normally, we would need to stop endpoint threads first and only then
 			// reset the device. However, libusb does not allow interrupting queued
 			// requests submitted via sync I/O. Thus, we reset the proxied device to
 			// force libusb to interrupt the requests and allow the endpoint threads
 			// to exit on please_stop_eps checks.
+			pthread_mutex_lock(&eps_lock);
 			if (set_configuration_done_once)
 				please_stop_eps = true;
 			reset_device();
@@ -478,6 +1628,7 @@ void ep0_loop(int fd, std::vector<InputDevice *> *trims) {
 				host_device_desc.current_config = 0;
 				set_configuration_done_once = false;
 			}
+			pthread_mutex_unlock(&eps_lock);
 			continue;
 		}
 
@@ -489,15 +1640,54 @@ void ep0_loop(int fd, std::vector<InputDevice *> *trims) {
 		io.inner.flags = 0;
 		io.inner.length = event.ctrl.wLength;
 
+		// Control data goes to and from the device straight out of io.
+		if (event.ctrl.wLength > sizeof(io.data)) {
+			printf("[Warning] Stalling control request, wLength(%d) is too long\n",
+				event.ctrl.wLength);
+			ep0_stall(fd);
+			continue;
+		}
+
 		int nbytes = 0;
 		int result = 0;
-		unsigned char *control_data = new unsigned char[event.ctrl.wLength];
+		unsigned char *control_data = (unsigned char *)io.data;
+		if (enumerating && !enumeration_ns)
+			enumeration_ns = fetched_ns;
+		bool proxied = false, configured = false;
 
 		int rv = -1;
 		if (event.ctrl.bRequestType & USB_DIR_IN) {
-			result = control_request(&event.ctrl, &nbytes, &control_data, 1000);
+			nbytes = ep0_answer(&event.ctrl, control_data);
+			if (nbytes == EP0_FORWARD) {
+				proxied = true;
+				result = control_request(&event.ctrl, &nbytes, &control_data, 1000);
+				if (result == 0 && (event.ctrl.bRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD &&
+				    event.ctrl.bRequest == USB_REQ_GET_DESCRIPTOR)
+					snapshot_record_control(&event.ctrl, control_data, nbytes);
+			}
+			else {
+				result = nbytes < 0 ? -1 : 0;
+			}
+			if (result == 0 && (event.ctrl.bRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD &&
+			    event.ctrl.bRequest == USB_REQ_GET_DESCRIPTOR &&
+			    ((event.ctrl.wValue >> 8) == USB_DT_CONFIG ||
+			     (event.ctrl.wValue >> 8) == USB_DT_OTHER_SPEED_CONFIG))
+				gadget_speed_rewrite_config(control_data, nbytes,
+					(event.ctrl.wValue >> 8) == USB_DT_OTHER_SPEED_CONFIG);
+			if (result == 0 && injection_enabled) {
+				switch (injection_control(&event.ctrl, control_data, &nbytes,
+						sizeof(io.data))) {
+				case USB_INJECTION_FLAG_STALL:
+					result = -1;
+					break;
+				case USB_INJECTION_FLAG_IGNORE:
+					nbytes = 0;
+					break;
+				default:
+					break;
+				}
+			}
 			if (result == 0) {
-				memcpy(&io.data[0], control_data, nbytes);
 				io.inner.length = nbytes;
 
 				// Some UDCs require bMaxPacketSize0 to be at least 64.
@@ -514,14 +1704,14 @@ void ep0_loop(int fd, std::vector<InputDevice *> *trims) {
 				}
 
 				if (verbose_level >= 2)
-					printData(io, 0x00, "control", "in");
+					printData((struct usb_raw_ep_io *)&io, 0x00, "control", "in");
 
 				rv = usb_raw_ep0_write(fd, (struct usb_raw_ep_io *)&io);
 				if (verbose_level)
 					printf("ep0: transferred %d bytes (in)\n", rv);
 			}
 			else {
-				usb_raw_ep0_stall(fd);
+				ep0_stall(fd);
 			}
 		}
 		else {
@@ -541,6 +1731,7 @@ void ep0_loop(int fd, std::vector<InputDevice *> *trims) {
 
 				struct raw_gadget_config *config = &host_device_desc.configs[desired_config];
 
+				pthread_mutex_lock(&eps_lock);
 				if (set_configuration_done_once) { // Need to stop all threads for eps and cleanup
 					printf("Changing configuration\n");
 					for (int i = 0; i < config->config.bNumInterfaces; i++) {
@@ -567,9 +1758,13 @@ void ep0_loop(int fd, std::vector<InputDevice *> *trims) {
 				}
 
 				set_configuration_done_once = true;
+				halted_eps = 0;
+				pthread_mutex_unlock(&eps_lock);
 
 				// Ack request after spawning endpoint threads.
-				rv = usb_raw_ep0_read(fd, (struct usb_raw_ep_io *)&io);
+				rv = ep0_read(fd, &io);
+				proxied = true;
+				configured = true;
 			}
 			else if ((event.ctrl.bRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD &&
 					event.ctrl.bRequest == USB_REQ_SET_INTERFACE) {
@@ -605,6 +1800,7 @@ void ep0_loop(int fd, std::vector<InputDevice *> *trims) {
 
 				struct raw_gadget_altsetting *alt = &iface->altsettings[desired_altsetting];
 
+				pthread_mutex_lock(&eps_lock);
 				if (desired_altsetting == iface->current_altsetting) {
 					printf("Interface/altsetting already set\n");
 					// But lets propagate the request to the device.
@@ -622,39 +1818,79 @@ void ep0_loop(int fd, std::vector<InputDevice *> *trims) {
 					iface->current_altsetting = desired_altsetting;
 					usleep(10000); // Give threads time to spawn.
 				}
+				halted_eps = 0;
+				pthread_mutex_unlock(&eps_lock);
 
 				// Ack request after spawning endpoint threads.
-				rv = usb_raw_ep0_read(fd, (struct usb_raw_ep_io *)&io);
+				rv = ep0_read(fd, &io);
+				proxied = true;
 			}
 			else {
 				// Retrieve data for sending request to proxied device.
-				rv = usb_raw_ep0_read(fd, (struct usb_raw_ep_io *)&io);
-
-				memcpy(control_data, io.data, event.ctrl.wLength);
+				rv = ep0_read(fd, &io);
 
 				if (verbose_level >= 2)
-					printData(io, 0x00, "control", "out");
-
-				if (event.ctrl.bRequestType == 0x21 && event.ctrl.bRequest == 0x0a) {
-					// This SET_IDLE requests somehow fail so just ignore here
-					continue;
-				}
-				result = control_request(&event.ctrl, &nbytes, &control_data, 1000);
-				if (result == 0) {
-					if (verbose_level)
-						printf("ep0: transferred %d bytes (out)\n", rv);
+					printData((struct usb_raw_ep_io *)&io, 0x00, "control", "out");
+
+				if ((event.ctrl.bRequestType & USB_TYPE_MASK) == USB_TYPE_CLASS &&
+				    event.ctrl.bRequest == HID_REQ_SET_IDLE) {
+					// The wheel fails SET_IDLE; the proxy applies the idle
+					// rate to the mixed report itself.
+					int i = find_interface(event.ctrl.wIndex);
+					if (i >= 0 && interface_has_ep(i, 0x81))
+						hid_idle_set(event.ctrl.wValue >> 8);
 				}
 				else {
-					usb_raw_ep0_stall(fd);
+					enum usb_injection_flags injection = USB_INJECTION_FLAG_NONE;
+					// A modify rule may change the length of the data stage,
+					// which the request sent to the wheel then announces.
+					struct usb_ctrlrequest ctrl = event.ctrl;
+					int length = rv > 0 ? rv : 0;
+					if (injection_enabled) {
+						injection = injection_control(&event.ctrl, control_data, &length,
+							sizeof(io.data));
+						if (length != (rv > 0 ? rv : 0))
+							ctrl.wLength = length;
+					}
+					if (injection == USB_INJECTION_FLAG_STALL) {
+						ep0_stall(fd);
+					}
+					else if (injection == USB_INJECTION_FLAG_NONE) {
+						proxied = true;
+						result = control_request(&ctrl, &nbytes, &control_data, 1000);
+						if (result == 0) {
+							track_feature(&event.ctrl);
+							if (verbose_level)
+								printf("ep0: transferred %d bytes (out)\n", length);
+						}
+						else {
+							ep0_stall(fd);
+						}
+					}
 				}
 			}
 		}
 
-		delete[] control_data;
+		if (enumerating) {
+			enumeration_requests++;
+			enumeration_proxied += proxied;
+		}
+		if (enumerating && configured) {
+			printf("Enumerated in %.1f ms, %d of %d control requests proxied\n",
+				(latency_now() - enumeration_ns) / 1e6, enumeration_proxied,
+				enumeration_requests);
+			enumerating = false;
+		}
+		TRACE3(ep0_done, event.ctrl.bRequestType, event.ctrl.bRequest, proxied);
+		metrics_add(proxied ? metrics_control.forwarded : metrics_control.local);
+		if (latency_enabled)
+			latency_record_control(proxied ? LATENCY_CONTROL_PROXIED : LATENCY_CONTROL_LOCAL,
+				latency_now() - fetched_ns);
 	}
 
 	struct raw_gadget_config *config = &host_device_desc.configs[host_device_desc.current_config];
 
+	pthread_mutex_lock(&eps_lock);
 	for (int i = 0; i < config->config.bNumInterfaces; i++) {
 		struct raw_gadget_interface *iface = &config->interfaces[i];
 		int interface_num = iface->altsettings[iface->current_altsetting]
@@ -663,6 +1899,8 @@ void ep0_loop(int fd, std::vector<InputDevice *> *trims) {
 				iface->current_altsetting);
 		release_interface(interface_num);
 	}
+	set_configuration_done_once = false;
+	pthread_mutex_unlock(&eps_lock);
 
 	printf("End for EP0, thread id(%d)\n", gettid());
 }
@@ -1,4 +1,19 @@
 #include "input-device.h"
 #include <vector>
 
+// Mirror the descriptors of the proxied device for the gadget.
+int setup_host_usb_desc();
+void free_host_usb_desc();
+// Check the gadget descriptors and the cached configuration descriptors, as
+// ep0 sends them, against each other and the gadget speed; returns the number
+// of problems, each printed.
+int check_host_usb_desc();
+void process_eps(int fd, int config, int interface, int altsetting, std::vector<InputDevice*> *trims);
+void terminate_eps(int fd, int config, int interface, int altsetting);
+// Around the re-attach of the wheel, see reattach.h.
+void pause_eps();
+void resume_eps();
+// Around the attachment of a trim to slot index, see input-device.h.
+void pause_trim(int index);
+void resume_trim(int index, libusb_device_handle *handle);
 void ep0_loop(int fd, std::vector<InputDevice *> *trims);
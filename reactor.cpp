@@ -0,0 +1,116 @@
+#include <pthread.h>
+#include <vector>
+
+#include "reactor.h"
+#include "latency.h"
+#include "metrics.h"
+#include "rt.h"
+
+// A stream that failed is stopped and started again after
+// ASYNC_IN_RETRY_MS. One whose device is gone stays stopped until its owner
+// removes it and adds it again on the handle of the device that came back.
+struct reactor_stream {
+	struct async_in_stream	*stream;
+	uint64_t		retry_ns;	// 0 while it runs
+};
+
+static libusb_context *reactor_context;
+static pthread_t reactor_thread;
+static volatile bool reactor_stopping;
+static pthread_mutex_t reactor_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<struct reactor_stream> reactor_streams;
+
+// Called with reactor_lock held, outside of event handling so that the halt
+// of a stalled endpoint can be cleared. Returns whether a restart is due.
+static bool reactor_check(struct reactor_stream *entry, uint64_t now) {
+	struct async_in_stream *stream = entry->stream;
+
+	if (entry->retry_ns == 0) {
+		if (stream->error == LIBUSB_SUCCESS)
+			return false;
+		metrics_libusb_error(stream->endpoint, stream->source);
+		async_in_stop(stream, reactor_context);
+		async_in_clear_halt(stream);
+		if (stream->error == LIBUSB_ERROR_NO_DEVICE) {
+			entry->retry_ns = UINT64_MAX;
+			return false;
+		}
+		fprintf(stderr, "EP%02x: stream failed: %s, restarting\n", stream->endpoint,
+				libusb_strerror((libusb_error)stream->error));
+		entry->retry_ns = now + ASYNC_IN_RETRY_MS * 1000000ull;
+		return true;
+	}
+	if (entry->retry_ns == UINT64_MAX)
+		return false;
+	if (now < entry->retry_ns)
+		return true;
+
+	// A failure to start shows up in error at the next check.
+	entry->retry_ns = 0;
+	async_in_start(stream);
+	return false;
+}
+
+static void *reactor_loop(void *arg __attribute__((unused))) {
+	rt_enter(RT_ROLE_WHEEL_IN);
+	printf("Start reactor thread, thread id(%d)\n", gettid());
+
+	bool retrying = false;
+	while (!reactor_stopping) {
+		struct timeval tv = { .tv_sec = 0, .tv_usec = 100 * 1000 };
+		if (retrying)
+			tv.tv_usec = ASYNC_IN_RETRY_MS * 1000;
+		int result = libusb_handle_events_timeout_completed(reactor_context, &tv, NULL);
+		if (result != LIBUSB_SUCCESS && result != LIBUSB_ERROR_INTERRUPTED) {
+			fprintf(stderr, "Error handling events: %s\n",
+					libusb_strerror((libusb_error)result));
+		}
+
+		pthread_mutex_lock(&reactor_lock);
+		uint64_t now = latency_now();
+		retrying = false;
+		for (size_t i = 0; i < reactor_streams.size(); i++)
+			retrying |= reactor_check(&reactor_streams[i], now);
+		pthread_mutex_unlock(&reactor_lock);
+	}
+
+	printf("End reactor thread, thread id(%d)\n", gettid());
+	return NULL;
+}
+
+void reactor_start(libusb_context *ctx) {
+	reactor_context = ctx;
+	reactor_stopping = false;
+	pthread_create(&reactor_thread, 0, reactor_loop, NULL);
+}
+
+void reactor_stop() {
+	if (!reactor_thread)
+		return;
+
+	reactor_stopping = true;
+	if (pthread_join(reactor_thread, NULL))
+		fprintf(stderr, "Error join reactor_thread\n");
+	reactor_thread = 0;
+}
+
+int reactor_add(struct async_in_stream *stream) {
+	pthread_mutex_lock(&reactor_lock);
+	int result = async_in_start(stream);
+	if (result == LIBUSB_SUCCESS)
+		reactor_streams.push_back({ stream, 0 });
+	pthread_mutex_unlock(&reactor_lock);
+	return result;
+}
+
+void reactor_remove(struct async_in_stream *stream) {
+	pthread_mutex_lock(&reactor_lock);
+	for (size_t i = 0; i < reactor_streams.size(); i++) {
+		if (reactor_streams[i].stream == stream) {
+			reactor_streams.erase(reactor_streams.begin() + i);
+			break;
+		}
+	}
+	async_in_stop(stream, reactor_context);
+	pthread_mutex_unlock(&reactor_lock);
+}
@@ -0,0 +1,21 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+#include <libusb-1.0/libusb.h>
+
+#include "async-transfer.h"
+
+/*
+ * Reactor mode: instead of one blocking reader thread per device-side IN
+ * endpoint and per trim device, a single thread handles libusb events for
+ * all of them and the completions of their async_in_streams feed the
+ * endpoint queues directly. The reactor thread counts the errors of the
+ * streams and restarts those that failed, clearing the halt of stalled
+ * endpoints; a stream whose device is gone waits for reactor_remove() and
+ * reactor_add() on the handle of the device once it is back.
+ */
+
+void reactor_start(libusb_context *ctx);
+void reactor_stop();
+int reactor_add(struct async_in_stream *stream);
+void reactor_remove(struct async_in_stream *stream);
+#endif
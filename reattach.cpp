@@ -0,0 +1,129 @@
+#include <atomic>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "reattach.h"
+#include "device-libusb.h"
+#include "proxy.h"
+#include "snapshot.h"
+
+static std::atomic<bool> online(true);
+static std::atomic<uint32_t> attachments;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static pthread_t reattach_thread;
+static volatile bool reattach_stopping;
+
+static uint64_t monotonic_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Waits on changed for up to timeout_ms until online equals wanted; lock held.
+static bool wait_for(bool wanted, int timeout_ms) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	while (online.load() != wanted) {
+		if (pthread_cond_timedwait(&changed, &lock, &deadline))
+			break;
+	}
+	return online.load() == wanted;
+}
+
+static void *reattach_loop(void *arg __attribute__((unused))) {
+	printf("Start reattach thread, thread id(%d)\n", gettid());
+
+	while (!reattach_stopping) {
+		pthread_mutex_lock(&lock);
+		bool lost = wait_for(false, 100);
+		pthread_mutex_unlock(&lock);
+		if (!lost)
+			continue;
+
+		uint64_t start_ms = monotonic_ms();
+		pause_eps();
+		close_device();
+
+		int result = -1;
+		while (!reattach_stopping) {
+			result = reopen_device(REATTACH_POLL_MS);
+			if (result >= 0)
+				break;
+			// Still listed, but not usable yet (or already gone again).
+			if (result != LIBUSB_ERROR_NOT_FOUND)
+				usleep(REATTACH_POLL_MS * 1000);
+		}
+		if (reattach_stopping)
+			break;
+		if (result > 0) {
+			// The host enumerated something else, let it start over
+			// without the snapshot.
+			printf("Wheel came back different, restarting\n");
+			snapshot_discard();
+			kill(0, SIGINT);
+			break;
+		}
+
+		resume_eps();
+		pthread_mutex_lock(&lock);
+		attachments++;
+		online.store(true);
+		pthread_cond_broadcast(&changed);
+		pthread_mutex_unlock(&lock);
+		printf("Wheel re-attached in %llu ms\n",
+			(unsigned long long)(monotonic_ms() - start_ms));
+	}
+
+	printf("End reattach thread, thread id(%d)\n", gettid());
+	return NULL;
+}
+
+void reattach_start() {
+	reattach_stopping = false;
+	pthread_create(&reattach_thread, 0, reattach_loop, NULL);
+}
+
+void reattach_stop() {
+	if (!reattach_thread)
+		return;
+
+	reattach_stopping = true;
+	if (pthread_join(reattach_thread, NULL))
+		fprintf(stderr, "Error join reattach_thread\n");
+	reattach_thread = 0;
+}
+
+void wheel_lost() {
+	pthread_mutex_lock(&lock);
+	if (online.exchange(false)) {
+		printf("Wheel disconnected, waiting for it to come back\n");
+		pthread_cond_broadcast(&changed);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+bool wheel_online() {
+	return online.load(std::memory_order_relaxed);
+}
+
+bool wheel_wait_online(int timeout_ms) {
+	if (online.load())
+		return true;
+	pthread_mutex_lock(&lock);
+	bool result = wait_for(true, timeout_ms);
+	pthread_mutex_unlock(&lock);
+	return result;
+}
+
+uint32_t wheel_attachments() {
+	return attachments.load(std::memory_order_relaxed);
+}
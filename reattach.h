@@ -0,0 +1,33 @@
+#ifndef REATTACH_H
+#define REATTACH_H
+#include <stdint.h>
+
+/*
+ * Hot re-attach of the wheel.
+ *
+ * When the wheel goes away (hotplug DEVICE_LEFT or a transfer failing with
+ * LIBUSB_ERROR_NO_DEVICE) the gadget side stays up: the endpoint threads
+ * park in wheel_wait_online() and the host only sees NAKs. The re-attach
+ * thread closes the wheel handle, waits for the wheel to arrive again (see
+ * discovery.h) and reopens it without the reset and the settle delay of
+ * connect_device(), retrying every REATTACH_POLL_MS while it is not usable.
+ * If its descriptors still match those the host enumerated, the current
+ * configuration, interfaces and alternate settings are restored on it and
+ * the endpoints resume; otherwise the proxy is restarted as before so that
+ * the host enumerates the new device.
+ */
+
+#define REATTACH_POLL_MS	50
+
+void reattach_start();
+void reattach_stop();
+
+// Mark the wheel gone and wake the re-attach thread; harmless if it already is.
+void wheel_lost();
+bool wheel_online();
+// Wait up to timeout_ms for the wheel to be online, returns wheel_online().
+bool wheel_wait_online(int timeout_ms);
+// Counts the re-attachments, so that state kept about the wheel can be
+// dropped when it comes back.
+uint32_t wheel_attachments();
+#endif
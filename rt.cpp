@@ -0,0 +1,179 @@
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "rt.h"
+
+bool rt_enabled = false;
+
+struct rt_role_config {
+	const char	*name;
+	int		priority;	// SCHED_FIFO priority, 0 for SCHED_OTHER
+	cpu_set_t	cpus;		// empty: the CPUs of the process
+};
+
+static struct rt_role_config roles[RT_ROLES] = {
+	{ "wheel", 80, {} },
+	{ "ffb", 70, {} },
+	{ "trim", 75, {} },
+	{ "ep0", 60, {} },
+	{ "log", 0, {} },
+};
+
+// The CPU set the process started with, saved by rt_setup() before any
+// thread is pinned.
+static cpu_set_t process_cpus;
+
+static int parse_cpus(const char *spec, cpu_set_t *cpus) {
+	CPU_ZERO(cpus);
+	while (*spec) {
+		char *end;
+		long cpu = strtol(spec, &end, 10);
+		if (end == spec || cpu < 0 || cpu >= RT_MAX_CPUS)
+			return -1;
+		CPU_SET(cpu, cpus);
+		if (*end == '+')
+			end++;
+		else if (*end)
+			return -1;
+		spec = end;
+	}
+	return 0;
+}
+
+int rt_parse_roles(const char *spec) {
+	char buffer[256];
+	if (strlen(spec) >= sizeof(buffer)) {
+		fprintf(stderr, "Real-time roles too long: %s\n", spec);
+		return -1;
+	}
+	strcpy(buffer, spec);
+
+	char *saveptr;
+	for (char *item = strtok_r(buffer, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+		char *value = strchr(item, '=');
+		if (!value)
+			goto invalid;
+		*value++ = '\0';
+
+		struct rt_role_config *role = NULL;
+		for (int i = 0; i < RT_ROLES; i++) {
+			if (!strcmp(roles[i].name, item))
+				role = &roles[i];
+		}
+		if (!role)
+			goto invalid;
+
+		char *cpus = strchr(value, '@');
+		if (cpus)
+			*cpus++ = '\0';
+		char *end;
+		long priority = strtol(value, &end, 10);
+		if (end == value || *end || priority < 0 || priority > sched_get_priority_max(SCHED_FIFO))
+			goto invalid;
+		role->priority = priority;
+		if (cpus && parse_cpus(cpus, &role->cpus))
+			goto invalid;
+	}
+	return 0;
+
+invalid:
+	fprintf(stderr, "Invalid real-time roles: %s\n", spec);
+	return -1;
+}
+
+int rt_setup() {
+	if (!rt_enabled)
+		return 0;
+
+	if (sched_getaffinity(0, sizeof(process_cpus), &process_cpus)) {
+		perror("sched_getaffinity()");
+		CPU_ZERO(&process_cpus);
+	}
+
+	// Keep freed heap memory and large allocations in the locked heap.
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		perror("mlockall()");
+		return -1;
+	}
+
+	char *heap = (char *)malloc(RT_HEAP_PREFAULT);
+	if (heap) {
+		long page = sysconf(_SC_PAGESIZE);
+		for (int i = 0; i < RT_HEAP_PREFAULT; i += page)
+			((volatile char *)heap)[i] = 0;
+		free(heap);
+	}
+
+	// Default glibc stacks are 8 MB, which mlockall() would lock per thread.
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, RT_STACK_SIZE);
+	int result = pthread_setattr_default_np(&attr);
+	pthread_attr_destroy(&attr);
+	if (result) {
+		fprintf(stderr, "pthread_setattr_default_np() failed: %s\n", strerror(result));
+		return -1;
+	}
+	return 0;
+}
+
+static void __attribute__((noinline)) prefault_stack() {
+	char stack[RT_STACK_PREFAULT];
+	memset(stack, 0, sizeof(stack));
+	asm volatile("" : : "r"(stack) : "memory");
+}
+
+void rt_enter(enum rt_role role) {
+	if (!rt_enabled)
+		return;
+
+	// Threads inherit the policy and CPU set of the thread that created them,
+	// e.g. the endpoint threads those of ep0, so both are always set.
+	const struct rt_role_config *config = &roles[role];
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = config->priority;
+	int policy = config->priority > 0 ? SCHED_FIFO : SCHED_OTHER;
+	int result = pthread_setschedparam(pthread_self(), policy, &param);
+	if (result)
+		fprintf(stderr, "Error setting %s %d for %s thread(%d): %s\n",
+			policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_OTHER",
+			config->priority, config->name, gettid(), strerror(result));
+
+	const cpu_set_t *cpus = CPU_COUNT(&config->cpus) > 0 ? &config->cpus : &process_cpus;
+	if (CPU_COUNT(cpus) > 0) {
+		result = pthread_setaffinity_np(pthread_self(), sizeof(*cpus), cpus);
+		if (result)
+			fprintf(stderr, "Error pinning %s thread(%d): %s\n",
+				config->name, gettid(), strerror(result));
+	}
+	prefault_stack();
+}
+
+void rt_print() {
+	for (int i = 0; i < RT_ROLES; i++) {
+		printf("Real-time role %s: ", roles[i].name);
+		if (roles[i].priority > 0)
+			printf("SCHED_FIFO %d", roles[i].priority);
+		else
+			printf("SCHED_OTHER");
+		if (CPU_COUNT(&roles[i].cpus) > 0) {
+			printf(", CPUs");
+			for (int cpu = 0; cpu < RT_MAX_CPUS; cpu++) {
+				if (CPU_ISSET(cpu, &roles[i].cpus))
+					printf(" %d", cpu);
+			}
+		}
+		printf("\n");
+	}
+}
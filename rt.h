@@ -0,0 +1,47 @@
+#ifndef RT_H
+#define RT_H
+
+/*
+ * Real-time mode.
+ *
+ * With --realtime every thread of the proxy switches itself to the
+ * SCHED_FIFO priority and the CPU set of its role when it starts, so that
+ * wheel reports are not delayed by whatever else runs on the Pi. The
+ * process memory is locked and pre-faulted up front, thread stacks are
+ * pre-faulted by rt_enter(), and the glibc heap is kept from returning
+ * memory to the kernel, so no page fault is taken in the middle of a
+ * transfer. CPUs are meant to be reserved with isolcpus= on the kernel
+ * command line.
+ *
+ * Roles are configured with --rt_roles, a comma separated list of
+ * role=priority[@cpu[+cpu...]], e.g. "wheel=80@2,ffb=70@2,trim=75@3,log=0@0".
+ * Priority 0 runs the role under SCHED_OTHER, and a role without CPUs runs
+ * on the CPUs the process started with.
+ */
+
+enum rt_role {
+	RT_ROLE_WHEEL_IN,	// wheel IN reads and writes to the host, the reactor
+	RT_ROLE_FFB_OUT,	// host OUT reads (force feedback) and writes to the wheel
+	RT_ROLE_TRIM,		// trim device reads
+	RT_ROLE_EP0,		// control requests
+	RT_ROLE_LOG,		// capture and other writers to disk
+	RT_ROLES
+};
+
+#define RT_MAX_CPUS		64
+// Stack size of the threads created in real-time mode; all of it is locked.
+#define RT_STACK_SIZE		(256 * 1024)
+// Stack and heap touched up front so that their pages are resident.
+#define RT_STACK_PREFAULT	(64 * 1024)
+#define RT_HEAP_PREFAULT	(4 * 1024 * 1024)
+
+extern bool rt_enabled;
+
+// Parse a --rt_roles specification, returns -1 on a malformed one.
+int rt_parse_roles(const char *spec);
+// Lock and pre-fault the process memory; call before creating threads.
+int rt_setup();
+// Apply the policy of role to the calling thread.
+void rt_enter(enum rt_role role);
+void rt_print();
+#endif
@@ -0,0 +1,606 @@
+#include <algorithm>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "snapshot.h"
+#include "device-libusb.h"
+#include "gadget-speed.h"
+#include "rt.h"
+
+struct control_entry {
+	struct usb_ctrlrequest	setup;
+	int			length;
+	uint8_t			data[SNAPSHOT_MAX_CONTROL];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// Serializes writing and removing the file, taken before lock.
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct control_entry controls[SNAPSHOT_MAX_CONTROLS];
+static int n_controls;
+static uint8_t trims[MIXER_MAX_TRIMS][MIXER_REPORT_MAX];
+static int trim_lengths[MIXER_MAX_TRIMS];
+static uint8_t trim_layouts[MIXER_MAX_TRIMS][SNAPSHOT_MAX_CONTROL];
+static int trim_layout_lengths[MIXER_MAX_TRIMS];
+static int n_loaded_trims;
+static int saved_speed = USB_SPEED_UNKNOWN;
+static bool dirty;
+
+static const char *snapshot_path;
+static int snapshot_trims;
+static pthread_t saver_thread;
+static volatile bool saver_stopping;
+
+static bool same_request(const struct usb_ctrlrequest *a, const struct usb_ctrlrequest *b) {
+	return a->bRequestType == b->bRequestType && a->bRequest == b->bRequest &&
+		a->wValue == b->wValue && a->wIndex == b->wIndex;
+}
+
+static struct control_entry *find_entry(const struct usb_ctrlrequest *ctrl) {
+	for (int i = 0; i < n_controls; i++) {
+		if (same_request(&controls[i].setup, ctrl))
+			return &controls[i];
+	}
+	return NULL;
+}
+
+static const struct control_entry *find_descriptor(uint8_t request_type, uint16_t value,
+			uint16_t index) {
+	struct usb_ctrlrequest ctrl;
+	ctrl.bRequestType = request_type;
+	ctrl.bRequest = USB_REQ_GET_DESCRIPTOR;
+	ctrl.wValue = value;
+	ctrl.wIndex = index;
+	ctrl.wLength = 0;
+	return find_entry(&ctrl);
+}
+
+int snapshot_load(const char *path) {
+	snapshot_path = path;
+
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return -1;
+
+	struct snapshot_header header;
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+	    memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) ||
+	    header.version != SNAPSHOT_VERSION) {
+		fprintf(stderr, "%s is not a snapshot file\n", path);
+		fclose(file);
+		return -1;
+	}
+
+	pthread_mutex_lock(&lock);
+	n_controls = 0;
+	n_loaded_trims = header.n_trims;
+	int result = 0;
+	for (int i = 0; i < header.n_records && result == 0; i++) {
+		struct snapshot_record record;
+		uint8_t data[SNAPSHOT_MAX_CONTROL];
+		if (fread(&record, sizeof(record), 1, file) != 1 ||
+		    record.length > sizeof(data) ||
+		    fread(data, 1, record.length, file) != record.length) {
+			result = -1;
+		}
+		else if (record.type == SNAPSHOT_CONTROL && n_controls < SNAPSHOT_MAX_CONTROLS) {
+			struct control_entry *entry = &controls[n_controls++];
+			entry->setup = record.setup;
+			entry->length = record.length;
+			memcpy(entry->data, data, record.length);
+		}
+		else if (record.type == SNAPSHOT_TRIM && record.index < MIXER_MAX_TRIMS &&
+			 record.length <= MIXER_REPORT_MAX) {
+			trim_lengths[record.index] = record.length;
+			memcpy(trims[record.index], data, record.length);
+		}
+		else if (record.type == SNAPSHOT_TRIM_LAYOUT && record.index < MIXER_MAX_TRIMS) {
+			trim_layout_lengths[record.index] = record.length;
+			memcpy(trim_layouts[record.index], data, record.length);
+		}
+		else if (record.type == SNAPSHOT_SPEED) {
+			saved_speed = record.index;
+			if (wheel_speed == USB_SPEED_UNKNOWN)
+				wheel_speed = record.index;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	fclose(file);
+
+	if (result)
+		fprintf(stderr, "%s is truncated\n", path);
+	return result;
+}
+
+void snapshot_discard() {
+	pthread_mutex_lock(&file_lock);
+	pthread_mutex_lock(&lock);
+	n_controls = 0;
+	if (snapshot_path && unlink(snapshot_path) && errno != ENOENT)
+		perror("unlink() snapshot");
+	pthread_mutex_unlock(&lock);
+	pthread_mutex_unlock(&file_lock);
+}
+
+// Builds what libusb_get_config_descriptor() would return for raw: interface
+// and endpoint descriptors, with the class descriptors following each of
+// them as its extra bytes. raw must outlive the result.
+static struct libusb_config_descriptor *parse_config(const uint8_t *raw, int length) {
+	if (length < USB_DT_CONFIG_SIZE || raw[1] != USB_DT_CONFIG)
+		return NULL;
+
+	struct parsed_altsetting {
+		struct libusb_interface_descriptor			desc;
+		std::vector<struct libusb_endpoint_descriptor>	endpoints;
+	};
+	std::vector<std::vector<struct parsed_altsetting>> interfaces;
+	std::vector<int> interface_numbers;
+	struct parsed_altsetting *current = NULL;
+	const unsigned char **extra = NULL;
+	int *extra_length = NULL;
+
+	struct libusb_config_descriptor *config = new struct libusb_config_descriptor();
+	config->bLength = raw[0];
+	config->bDescriptorType = raw[1];
+	config->wTotalLength = raw[2] | raw[3] << 8;
+	config->bNumInterfaces = raw[4];
+	config->bConfigurationValue = raw[5];
+	config->iConfiguration = raw[6];
+	config->bmAttributes = raw[7];
+	config->MaxPower = raw[8];
+	extra = &config->extra;
+	extra_length = &config->extra_length;
+
+	for (int offset = raw[0]; offset + 2 <= length; offset += raw[offset]) {
+		const uint8_t *desc = raw + offset;
+		if (desc[0] < 2 || offset + desc[0] > length)
+			break;
+
+		if (desc[1] == USB_DT_INTERFACE && desc[0] >= USB_DT_INTERFACE_SIZE) {
+			size_t i = 0;
+			while (i < interface_numbers.size() && interface_numbers[i] != desc[2])
+				i++;
+			if (i == interface_numbers.size()) {
+				interface_numbers.push_back(desc[2]);
+				interfaces.emplace_back();
+			}
+			interfaces[i].emplace_back();
+			current = &interfaces[i].back();
+			struct libusb_interface_descriptor *alt = &current->desc;
+			memset(alt, 0, sizeof(*alt));
+			alt->bLength = desc[0];
+			alt->bDescriptorType = desc[1];
+			alt->bInterfaceNumber = desc[2];
+			alt->bAlternateSetting = desc[3];
+			alt->bNumEndpoints = desc[4];
+			alt->bInterfaceClass = desc[5];
+			alt->bInterfaceSubClass = desc[6];
+			alt->bInterfaceProtocol = desc[7];
+			alt->iInterface = desc[8];
+			extra = &alt->extra;
+			extra_length = &alt->extra_length;
+		}
+		else if (desc[1] == USB_DT_ENDPOINT && desc[0] >= USB_DT_ENDPOINT_SIZE && current) {
+			std::vector<struct libusb_endpoint_descriptor> *endpoints = &current->endpoints;
+			endpoints->emplace_back();
+			struct libusb_endpoint_descriptor *ep = &endpoints->back();
+			memset(ep, 0, sizeof(*ep));
+			ep->bLength = desc[0];
+			ep->bDescriptorType = desc[1];
+			ep->bEndpointAddress = desc[2];
+			ep->bmAttributes = desc[3];
+			ep->wMaxPacketSize = desc[4] | desc[5] << 8;
+			ep->bInterval = desc[6];
+			if (desc[0] >= USB_DT_ENDPOINT_AUDIO_SIZE) {
+				ep->bRefresh = desc[7];
+				ep->bSynchAddress = desc[8];
+			}
+			extra = &ep->extra;
+			extra_length = &ep->extra_length;
+		}
+		else {
+			// Class descriptors directly follow each other.
+			if (!*extra)
+				*extra = desc;
+			*extra_length += desc[0];
+		}
+	}
+
+	if ((int)interfaces.size() != config->bNumInterfaces) {
+		fprintf(stderr, "Snapshot configuration %d is malformed\n", config->bConfigurationValue);
+		delete config;
+		return NULL;
+	}
+
+	struct libusb_interface *interface = new struct libusb_interface[interfaces.size()]();
+	for (size_t i = 0; i < interfaces.size(); i++) {
+		struct libusb_interface_descriptor *alts =
+			new struct libusb_interface_descriptor[interfaces[i].size()];
+		for (size_t j = 0; j < interfaces[i].size(); j++) {
+			struct parsed_altsetting *parsed = &interfaces[i][j];
+			alts[j] = parsed->desc;
+			alts[j].bNumEndpoints = parsed->endpoints.size();
+			struct libusb_endpoint_descriptor *endpoints =
+				new struct libusb_endpoint_descriptor[parsed->endpoints.size()];
+			std::copy(parsed->endpoints.begin(), parsed->endpoints.end(), endpoints);
+			alts[j].endpoint = endpoints;
+		}
+		interface[i].altsetting = alts;
+		interface[i].num_altsetting = interfaces[i].size();
+	}
+	config->interface = interface;
+	return config;
+}
+
+int snapshot_restore_descriptors() {
+	pthread_mutex_lock(&lock);
+	int result = -1;
+	const struct control_entry *device = find_descriptor(USB_DIR_IN, USB_DT_DEVICE << 8, 0);
+	if (device && device->length >= USB_DT_DEVICE_SIZE) {
+		memcpy(&device_device_desc, device->data, USB_DT_DEVICE_SIZE);
+		device_config_desc = new struct libusb_config_descriptor *[device_device_desc.bNumConfigurations];
+		result = 0;
+		for (int i = 0; i < device_device_desc.bNumConfigurations && result == 0; i++) {
+			const struct control_entry *entry = find_descriptor(USB_DIR_IN, USB_DT_CONFIG << 8 | i, 0);
+			device_config_desc[i] = NULL;
+			if (entry && entry->length >= 4 && entry->length == (entry->data[2] | entry->data[3] << 8)) {
+				// Referenced by the extra bytes of the parsed descriptor.
+				uint8_t *raw = new uint8_t[entry->length];
+				memcpy(raw, entry->data, entry->length);
+				device_config_desc[i] = parse_config(raw, entry->length);
+			}
+			if (!device_config_desc[i])
+				result = -1;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return result;
+}
+
+int snapshot_report_descriptor(uint8_t endpoint, uint8_t *desc) {
+	if (!device_config_desc || !device_config_desc[0])
+		return -1;
+
+	int interface_number = -1;
+	const struct libusb_config_descriptor *config = device_config_desc[0];
+	for (int i = 0; i < config->bNumInterfaces && interface_number < 0; i++) {
+		const struct libusb_interface_descriptor *interface = &config->interface[i].altsetting[0];
+		for (int j = 0; j < interface->bNumEndpoints; j++) {
+			if (interface->endpoint[j].bEndpointAddress == endpoint)
+				interface_number = interface->bInterfaceNumber;
+		}
+	}
+	if (interface_number < 0)
+		return -1;
+
+	pthread_mutex_lock(&lock);
+	int length = -1;
+	const struct control_entry *entry = find_descriptor(USB_DIR_IN | USB_RECIP_INTERFACE,
+		HID_DT_REPORT << 8, interface_number);
+	if (entry) {
+		length = entry->length;
+		memcpy(desc, entry->data, length);
+	}
+	pthread_mutex_unlock(&lock);
+	return length;
+}
+
+int snapshot_trim_count() {
+	return n_loaded_trims;
+}
+
+void snapshot_record_trim_layout(int index, const uint8_t *desc, int length) {
+	if (index < 0 || index >= MIXER_MAX_TRIMS || length <= 0 || length > SNAPSHOT_MAX_CONTROL)
+		return;
+
+	pthread_mutex_lock(&lock);
+	if (length != trim_layout_lengths[index] || memcmp(desc, trim_layouts[index], length)) {
+		trim_layout_lengths[index] = length;
+		memcpy(trim_layouts[index], desc, length);
+		dirty = true;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+int snapshot_trim_layout(int index, uint8_t *desc) {
+	if (index < 0 || index >= MIXER_MAX_TRIMS)
+		return -1;
+
+	pthread_mutex_lock(&lock);
+	int length = trim_layout_lengths[index];
+	memcpy(desc, trim_layouts[index], length);
+	pthread_mutex_unlock(&lock);
+	return length > 0 ? length : -1;
+}
+
+void snapshot_restore_trims(struct mixer *mixer, int n_trims) {
+	for (int i = 0; i < n_trims && i < MIXER_MAX_TRIMS; i++) {
+		if (trim_lengths[i] > 0)
+			mixer_update_trim(mixer, i, trims[i], trim_lengths[i]);
+	}
+}
+
+void snapshot_record_control(const struct usb_ctrlrequest *ctrl, const uint8_t *data, int length) {
+	if (length <= 0 || length > SNAPSHOT_MAX_CONTROL)
+		return;
+
+	pthread_mutex_lock(&lock);
+	struct control_entry *entry = find_entry(ctrl);
+	if (!entry && n_controls < SNAPSHOT_MAX_CONTROLS) {
+		entry = &controls[n_controls++];
+		entry->setup = *ctrl;
+		entry->length = 0;
+	}
+	// Keep the longest response: hosts read some descriptors in two steps.
+	if (entry && (length > entry->length ||
+		      (length == entry->length && memcmp(entry->data, data, length)))) {
+		entry->length = length;
+		memcpy(entry->data, data, length);
+		dirty = true;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+int snapshot_find_control(const struct usb_ctrlrequest *ctrl, uint8_t *data) {
+	pthread_mutex_lock(&lock);
+	int length = -1;
+	const struct control_entry *entry = find_entry(ctrl);
+	if (entry) {
+		length = std::min<int>(entry->length, ctrl->wLength);
+		memcpy(data, entry->data, length);
+	}
+	pthread_mutex_unlock(&lock);
+	return length;
+}
+
+// Reads a descriptor from the wheel and keeps it, returns its length or -1.
+static int fetch_descriptor(uint8_t request_type, uint16_t value, uint16_t index,
+			uint16_t length, uint8_t *data) {
+	struct usb_ctrlrequest ctrl;
+	ctrl.bRequestType = request_type;
+	ctrl.bRequest = USB_REQ_GET_DESCRIPTOR;
+	ctrl.wValue = value;
+	ctrl.wIndex = index;
+	ctrl.wLength = std::min<int>(length, SNAPSHOT_MAX_CONTROL);
+
+	int nbytes = 0;
+	if (control_request(&ctrl, &nbytes, &data, 1000))
+		return -1;
+	snapshot_record_control(&ctrl, data, nbytes);
+	return nbytes;
+}
+
+// Fetches the report descriptors listed in the HID descriptor found in the
+// extra bytes of an interface.
+static void fetch_report_descriptors(const struct libusb_interface_descriptor *interface,
+			uint8_t *data) {
+	const unsigned char *extra = interface->extra;
+	for (int i = 0; i + 1 < interface->extra_length && extra[i] >= 2; i += extra[i]) {
+		if (extra[i + 1] != HID_DT_HID || i + 6 > interface->extra_length)
+			continue;
+		int n_descriptors = extra[i + 5];
+		for (int j = 0; j < n_descriptors && i + 9 + 3 * j <= interface->extra_length; j++) {
+			const unsigned char *desc = &extra[i + 6 + 3 * j];
+			if (desc[0] == HID_DT_REPORT)
+				fetch_descriptor(USB_DIR_IN | USB_RECIP_INTERFACE, HID_DT_REPORT << 8 | j,
+					interface->bInterfaceNumber, desc[1] | desc[2] << 8, data);
+		}
+	}
+}
+
+void snapshot_fetch_descriptors() {
+	const uint8_t request_type = USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE;
+	uint8_t data[SNAPSHOT_MAX_CONTROL];
+	std::vector<uint8_t> strings = { device_device_desc.iManufacturer,
+		device_device_desc.iProduct, device_device_desc.iSerialNumber };
+
+	fetch_descriptor(request_type, USB_DT_DEVICE << 8, 0, USB_DT_DEVICE_SIZE, data);
+	for (int i = 0; i < device_device_desc.bNumConfigurations; i++) {
+		const struct libusb_config_descriptor *config = device_config_desc[i];
+		fetch_descriptor(request_type, USB_DT_CONFIG << 8 | i, 0, config->wTotalLength, data);
+		strings.push_back(config->iConfiguration);
+		for (int j = 0; j < config->bNumInterfaces; j++) {
+			for (int k = 0; k < config->interface[j].num_altsetting; k++) {
+				const struct libusb_interface_descriptor *interface =
+					&config->interface[j].altsetting[k];
+				strings.push_back(interface->iInterface);
+				if (interface->bInterfaceClass == LIBUSB_CLASS_HID)
+					fetch_report_descriptors(interface, data);
+			}
+		}
+	}
+
+	// Hosts read strings with wLength 255 in every language the device lists.
+	uint8_t langids[SNAPSHOT_MAX_CONTROL];
+	int length = fetch_descriptor(request_type, USB_DT_STRING << 8, 0, 255, langids);
+	std::sort(strings.begin(), strings.end());
+	strings.erase(std::unique(strings.begin(), strings.end()), strings.end());
+	for (int i = 2; i + 1 < length; i += 2) {
+		uint16_t langid = langids[i] | langids[i + 1] << 8;
+		for (uint8_t index : strings) {
+			if (index)
+				fetch_descriptor(request_type, USB_DT_STRING << 8 | index, langid, 255, data);
+		}
+	}
+
+	pthread_mutex_lock(&lock);
+	printf("Cached %d descriptors of the wheel\n", n_controls);
+	pthread_mutex_unlock(&lock);
+}
+
+// Picks up trim reports that changed since the last save; lock held.
+static void update_trims() {
+	for (int i = 0; i < snapshot_trims; i++) {
+		uint8_t report[MIXER_REPORT_MAX];
+		int length = mixer_read_trim(&wheel_mixer, i, report);
+		if (length > 0 && (length != trim_lengths[i] || memcmp(report, trims[i], length))) {
+			trim_lengths[i] = length;
+			memcpy(trims[i], report, length);
+			dirty = true;
+		}
+	}
+}
+
+// Everything a snapshot file can hold.
+#define SNAPSHOT_MAX_SIZE	(sizeof(struct snapshot_header) + \
+	SNAPSHOT_MAX_CONTROLS * (sizeof(struct snapshot_record) + SNAPSHOT_MAX_CONTROL) + \
+	MIXER_MAX_TRIMS * (sizeof(struct snapshot_record) + MIXER_REPORT_MAX) + \
+	MIXER_MAX_TRIMS * (sizeof(struct snapshot_record) + SNAPSHOT_MAX_CONTROL) + \
+	sizeof(struct snapshot_record))
+
+static void append(uint8_t *image, size_t *size, const void *data, size_t length) {
+	memcpy(image + *size, data, length);
+	*size += length;
+}
+
+// Lays the snapshot out in image; lock held.
+static size_t serialize(uint8_t *image) {
+	size_t size = 0;
+	struct snapshot_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	header.version = SNAPSHOT_VERSION;
+	header.n_trims = snapshot_trims;
+	header.n_records = n_controls + (wheel_speed != USB_SPEED_UNKNOWN);
+	for (int i = 0; i < snapshot_trims; i++) {
+		if (trim_lengths[i] > 0)
+			header.n_records++;
+		if (trim_layout_lengths[i] > 0)
+			header.n_records++;
+	}
+	append(image, &size, &header, sizeof(header));
+
+	if (wheel_speed != USB_SPEED_UNKNOWN) {
+		struct snapshot_record record;
+		memset(&record, 0, sizeof(record));
+		record.type = SNAPSHOT_SPEED;
+		record.index = wheel_speed;
+		append(image, &size, &record, sizeof(record));
+		saved_speed = wheel_speed;
+	}
+
+	for (int i = 0; i < n_controls; i++) {
+		struct snapshot_record record;
+		memset(&record, 0, sizeof(record));
+		record.type = SNAPSHOT_CONTROL;
+		record.length = controls[i].length;
+		record.setup = controls[i].setup;
+		append(image, &size, &record, sizeof(record));
+		append(image, &size, controls[i].data, controls[i].length);
+	}
+	for (int i = 0; i < snapshot_trims; i++) {
+		if (trim_lengths[i] == 0)
+			continue;
+		struct snapshot_record record;
+		memset(&record, 0, sizeof(record));
+		record.type = SNAPSHOT_TRIM;
+		record.index = i;
+		record.length = trim_lengths[i];
+		append(image, &size, &record, sizeof(record));
+		append(image, &size, trims[i], trim_lengths[i]);
+	}
+	for (int i = 0; i < snapshot_trims; i++) {
+		if (trim_layout_lengths[i] == 0)
+			continue;
+		struct snapshot_record record;
+		memset(&record, 0, sizeof(record));
+		record.type = SNAPSHOT_TRIM_LAYOUT;
+		record.index = i;
+		record.length = trim_layout_lengths[i];
+		append(image, &size, &record, sizeof(record));
+		append(image, &size, trim_layouts[i], trim_layout_lengths[i]);
+	}
+	return size;
+}
+
+// Written to a temporary file first, so that a power cut leaves either
+// snapshot intact.
+static bool save(const uint8_t *image, size_t size) {
+	char tmp_path[4096];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", snapshot_path);
+	FILE *file = fopen(tmp_path, "wb");
+	if (!file) {
+		perror("fopen() snapshot");
+		return false;
+	}
+
+	bool failed = fwrite(image, 1, size, file) != size || fflush(file) ||
+		fsync(fileno(file));
+	if (fclose(file) || failed) {
+		perror("write() snapshot");
+		unlink(tmp_path);
+		return false;
+	}
+	if (rename(tmp_path, snapshot_path)) {
+		perror("rename() snapshot");
+		return false;
+	}
+	return true;
+}
+
+// The file is written without the lock, which ep0 takes to answer from the
+// cache: an fsync() on an SD card can take tens of milliseconds.
+static void save_if_changed(bool with_trims) {
+	static uint8_t image[SNAPSHOT_MAX_SIZE];
+	size_t size = 0;
+
+	pthread_mutex_lock(&file_lock);
+	pthread_mutex_lock(&lock);
+	if (with_trims)
+		update_trims();
+	if (wheel_speed != saved_speed)
+		dirty = true;
+	if (dirty && n_controls > 0) {
+		size = serialize(image);
+		dirty = false;
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (size && !save(image, size)) {
+		pthread_mutex_lock(&lock);
+		dirty = true;
+		pthread_mutex_unlock(&lock);
+	}
+	pthread_mutex_unlock(&file_lock);
+}
+
+static void *saver_loop(void *arg __attribute__((unused))) {
+	rt_enter(RT_ROLE_LOG);
+	printf("Start snapshot thread, thread id(%d)\n", gettid());
+
+	int since_trims = 0;
+	while (!saver_stopping) {
+		for (int waited = 0; waited < SNAPSHOT_SAVE_INTERVAL_MS && !saver_stopping; waited += 100)
+			usleep(100 * 1000);
+		since_trims += SNAPSHOT_SAVE_INTERVAL_MS;
+		bool with_trims = saver_stopping || since_trims >= SNAPSHOT_TRIM_SAVE_INTERVAL_MS;
+		if (with_trims)
+			since_trims = 0;
+		save_if_changed(with_trims);
+	}
+
+	printf("End snapshot thread, thread id(%d)\n", gettid());
+	return NULL;
+}
+
+void snapshot_start(const char *path, int n_trims) {
+	snapshot_path = path;
+	snapshot_trims = std::min(n_trims, MIXER_MAX_TRIMS);
+	saver_stopping = false;
+	pthread_create(&saver_thread, 0, saver_loop, NULL);
+}
+
+void snapshot_stop() {
+	if (!saver_thread)
+		return;
+
+	saver_stopping = true;
+	if (pthread_join(saver_thread, NULL))
+		fprintf(stderr, "Error join saver_thread\n");
+	saver_thread = 0;
+}
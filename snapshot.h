@@ -0,0 +1,95 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include <stdint.h>
+#include <linux/usb/ch9.h>
+
+#include "mixer.h"
+
+#define SNAPSHOT_MAGIC		"G29SNAP"
+#define SNAPSHOT_VERSION	1
+#define SNAPSHOT_MAX_CONTROLS	64
+#define SNAPSHOT_MAX_CONTROL	1024
+#define SNAPSHOT_SAVE_INTERVAL_MS	5000
+#define SNAPSHOT_TRIM_SAVE_INTERVAL_MS	(5 * 60 * 1000)
+#define HID_DT_HID		0x21
+#define HID_DT_REPORT		0x22
+
+/*
+ * Persistent snapshot of what the host needs to enumerate the wheel.
+ *
+ * The responses of the wheel to the standard GET_DESCRIPTOR requests of the
+ * host (device, configuration, string and HID report descriptors) are kept
+ * as ep0 proxies them, together with the report descriptor and the last
+ * report of every trim device, and written to the --snapshot file.
+ * Descriptors change about once and are saved within
+ * SNAPSHOT_SAVE_INTERVAL_MS; trims change with every press, so their state
+ * is picked up at most every SNAPSHOT_TRIM_SAVE_INTERVAL_MS and on a clean
+ * stop, which keeps the SD card from being rewritten all the time while
+ * driving. On the next boot the gadget is built from the snapshot and
+ * presented to the host right away, ep0 answers GET_DESCRIPTOR from it
+ * while the wheel is not attached yet, and the wheel is opened in the
+ * background like a re-attach (see reattach.h), which also checks it
+ * against the snapshot. The trims are mixed with the layouts saved and
+ * opened as they arrive (see input-device.h).
+ *
+ * A snapshot file is a snapshot_header followed by n_records
+ * snapshot_records, each followed by length bytes of payload. All fields
+ * are little-endian.
+ */
+
+struct snapshot_header {
+	char		magic[8];
+	uint32_t	version;
+	uint16_t	n_records;
+	uint16_t	n_trims;
+};
+
+enum snapshot_record_type {
+	SNAPSHOT_CONTROL = 1,	// setup is the request, the payload its response
+	SNAPSHOT_TRIM = 2,	// index is the trim, the payload its last report
+	SNAPSHOT_SPEED = 3,	// index is the speed of the wheel, no payload
+	SNAPSHOT_TRIM_LAYOUT = 4,	// index is the trim, the payload its report descriptor
+};
+
+struct snapshot_record {
+	uint8_t			type;
+	uint8_t			index;
+	uint16_t		length;
+	struct usb_ctrlrequest	setup;
+};
+
+// Read a snapshot file; returns -1 if it is missing or unusable.
+int snapshot_load(const char *path);
+// Remove the snapshot file, e.g. once the wheel no longer matches it.
+void snapshot_discard();
+
+// Fill device_device_desc and device_config_desc from the snapshot, so that
+// the gadget can be set up without the wheel. Returns -1 if the snapshot
+// lacks the device or a configuration descriptor.
+int snapshot_restore_descriptors();
+// Copy the cached HID report descriptor of the interface owning endpoint
+// into desc (SNAPSHOT_MAX_CONTROL bytes); returns its length or -1.
+int snapshot_report_descriptor(uint8_t endpoint, uint8_t *desc);
+int snapshot_trim_count();
+// Keep the report descriptor of trim index, or copy it into desc
+// (SNAPSHOT_MAX_CONTROL bytes) and return its length, -1 if there is none.
+void snapshot_record_trim_layout(int index, const uint8_t *desc, int length);
+int snapshot_trim_layout(int index, uint8_t *desc);
+void snapshot_restore_trims(struct mixer *mixer, int n_trims);
+
+// Read the descriptors a host asks for while enumerating (device,
+// configurations, strings and HID report descriptors) from the wheel into
+// the cache, so that ep0 can answer them without a round trip.
+void snapshot_fetch_descriptors();
+// Keep the response of the wheel to a standard GET_DESCRIPTOR request.
+void snapshot_record_control(const struct usb_ctrlrequest *ctrl, const uint8_t *data, int length);
+// Copy the cached response to ctrl into data (wLength bytes at most).
+// Returns its length, or -1 if it was never seen.
+int snapshot_find_control(const struct usb_ctrlrequest *ctrl, uint8_t *data);
+
+// Save the snapshot to path every SNAPSHOT_SAVE_INTERVAL_MS if it changed,
+// with the trims of every SNAPSHOT_TRIM_SAVE_INTERVAL_MS, and once more with
+// the current trims on stop.
+void snapshot_start(const char *path, int n_trims);
+void snapshot_stop();
+#endif
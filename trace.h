@@ -0,0 +1,51 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * USDT probes (provider g29_mixer) on the hops of the data path, for
+ * bpftrace and perf on a live rig; the scripts in trace/ use them.
+ *
+ *	received(endpoint, source, length)	a transfer came in: receive_data(),
+ *						InputDevice::receive_data(), an async or
+ *						reactor transfer, or usb_raw_ep_read()
+ *	enqueued(endpoint, source, length)	offered to the writer of endpoint, before
+ *						its backpressure policy
+ *	dequeued(endpoint, source)		taken from the queue by the writer
+ *	mixed(generation, length)		mixer_read() built a report
+ *	gadget_read_entry(ep, length)		usb_raw_ep_read(), ep the raw-gadget
+ *	gadget_read_return(ep, rv)		endpoint handle
+ *	gadget_write_entry(ep, length)		usb_raw_ep_write()
+ *	gadget_write_return(ep, rv)
+ *	ep0_event(type, bRequestType, bRequest, wValue, wIndex, wLength)
+ *						every event ep0_loop() fetches
+ *	ep0_done(bRequestType, bRequest, proxied)
+ *						a control request was completed
+ *
+ * source is -1 for the host, 0 for the wheel and 1 + i for trim i, as in
+ * the mix rules. Readers and writers run one thread per endpoint, so hops
+ * on one thread pair up by tid, and across threads by endpoint address.
+ *
+ * A probe is a single nop until a tracer attaches. The probes are built in
+ * when <sys/sdt.h> (systemtap-sdt-dev) is installed, and compile to nothing
+ * otherwise or with -DNO_TRACE.
+ */
+
+#if defined(__has_include) && !defined(NO_TRACE)
+#if __has_include(<sys/sdt.h>)
+#define TRACE_ENABLED
+#endif
+#endif
+
+#ifdef TRACE_ENABLED
+#include <sys/sdt.h>
+
+#define TRACE2(name, a, b)		DTRACE_PROBE2(g29_mixer, name, a, b)
+#define TRACE3(name, a, b, c)		DTRACE_PROBE3(g29_mixer, name, a, b, c)
+#define TRACE6(name, a, b, c, d, e, f)	DTRACE_PROBE6(g29_mixer, name, a, b, c, d, e, f)
+#else
+#define TRACE2(name, a, b)		do { (void)(a); (void)(b); } while (0)
+#define TRACE3(name, a, b, c)		do { (void)(a); (void)(b); (void)(c); } while (0)
+#define TRACE6(name, a, b, c, d, e, f)	\
+	do { (void)(a); (void)(b); (void)(c); (void)(d); (void)(e); (void)(f); } while (0)
+#endif
+#endif
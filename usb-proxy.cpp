@@ -1,6 +1,21 @@
 #include "host-raw-gadget.h"
 #include "device-libusb.h"
 #include "proxy.h"
+#include "reactor.h"
+#include "hid-report.h"
+#include "mixer.h"
+#include "latency.h"
+#include "capture.h"
+#include "rt.h"
+#include "backpressure.h"
+#include "reattach.h"
+#include "snapshot.h"
+#include "discovery.h"
+#include "ffb.h"
+#include "injection.h"
+#include "logger.h"
+#include "metrics.h"
+#include "gadget-speed.h"
 #include "misc.h"
 
 #include "input-device.h"
@@ -13,6 +28,15 @@ volatile bool please_stop_eps = false; // Use volatile to mark as atomic.
 bool reset_device_before_proxy = true;
 bool bmaxpacketsize0_must_greater_than_64 = true;
 
+int async_transfers = 0;
+int ffb_transfers = 0;
+bool reactor_enabled = false;
+bool latency_enabled = false;
+bool local_ep0_enabled = true;
+bool scheduled_reports = false;
+bool injection_enabled = false;
+std::string injection_file = "injection.json";
+
 void usage() {
 	printf("Usage:\n");
 	printf("\t-h/--help: print this help message\n");
@@ -21,10 +45,44 @@ void usage() {
 	printf("\t--driver: use specific driver\n");
 	printf("\t--vendor_id: use specific vendor_id of USB device\n");
 	printf("\t--product_id: use specific product_id of USB device\n");
+	printf("\t--async_transfers: keep N interrupt IN transfers in flight per wheel endpoint\n");
+	printf("\t--reactor: handle all device-side IN transfers on a single event thread\n");
+	printf("\t--mix_rules: map trim bits into the wheel report with rules from a file\n");
+	printf("\t--latency: measure latencies through the proxy and print them on exit\n");
+	printf("\t--capture: record the endpoint traffic into a capture file\n");
+	printf("\t--realtime: run threads with SCHED_FIFO priorities and locked memory\n");
+	printf("\t--rt_roles: priorities and CPUs per thread role, implies --realtime\n");
+	printf("\t--backpressure: what each endpoint drops when its writer falls behind\n");
+	printf("\t--snapshot: keep the descriptors in a file and present them at boot\n");
+	printf("\t--proxy_ep0: forward control requests to the wheel instead of answering from cache\n");
+	printf("\t--ffb_transfers: keep up to N force feedback transfers in flight to the wheel\n");
+	printf("\t--enable_injection: enable the injection feature\n");
+	printf("\t--injection_file: specify the file that contains injection rules\n");
+	printf("\t--log_rate: print at most N verbose data path lines per second, 0 for no limit\n");
+	printf("\t--metrics_socket: serve counters in the Prometheus text format on a Unix socket\n");
+	printf("\t--metrics_textfile: write the counters to a file for the node_exporter textfile collector\n");
+	printf("\t--speed: present the gadget at full or high speed, or that of the wheel\n");
+	printf("\t--poll_interval_us: have the host poll interrupt IN endpoints every N microseconds\n");
+	printf("\t--scheduled_reports: write the mixed wheel report once per polling interval\n");
 	printf("* If `device` not specified, `usb-proxy` will use `dummy_udc.0` as default device.\n");
 	printf("* If `driver` not specified, `usb-proxy` will use `dummy_udc` as default driver.\n");
 	printf("* If both `vendor_id` and `product_id` not specified, `usb-proxy` will connect\n");
 	printf("  the first USB device it can find.\n");
+	printf("* If `async_transfers` is 0 (default), wheel endpoints are read with one blocking\n");
+	printf("  transfer at a time.\n");
+	printf("* If `ffb_transfers` is 0 (default), force feedback is sent with one blocking\n");
+	printf("  transfer at a time. Either way superseded commands are coalesced.\n");
+	printf("* `rt_roles` is a list of role=priority[@cpu[+cpu...]] with the roles wheel,\n");
+	printf("  ffb, trim, ep0 and log, e.g. `wheel=80@2,ffb=70@2,trim=75@3,log=0@0`.\n");
+	printf("* `backpressure` is a list of endpoint=policy with the policies latest,\n");
+	printf("  age[:max_age_us] and lossless, e.g. `81=latest,01=age:20000,02=lossless`.\n");
+	printf("  Interrupt IN endpoints default to latest, the others to lossless.\n");
+	printf("* If `injection_file` not specified, `usb-proxy` will use `injection.json` as default.\n");
+	printf("* If `speed` not specified, the gadget runs at high speed. The bInterval of interrupt\n");
+	printf("  endpoints keeps the polling period of the wheel unless `poll_interval_us` is given.\n");
+	printf("* With `scheduled_reports`, EP81 sends the latest mixed report on a timer at its\n");
+	printf("  bInterval, whether it changed or not, instead of one report per wheel or trim frame.\n");
+	printf("* SIGUSR1 raises the verbosity of the data path lines by one, SIGUSR2 turns them off.\n");
 	exit(1);
 }
 
@@ -46,121 +104,35 @@ void handle_signal(int signum) {
 		please_stop_ep0 = true;
 		please_stop_eps = true;
 		break;
+	case SIGUSR1:
+		logger_raise_level();
+		break;
+	case SIGUSR2:
+		logger_disable();
+		break;
 	}
 }
 
-int setup_host_usb_desc() {
-	host_device_desc.device = {
-		.bLength =		device_device_desc.bLength,
-		.bDescriptorType =	device_device_desc.bDescriptorType,
-		.bcdUSB =		device_device_desc.bcdUSB,
-		.bDeviceClass =		device_device_desc.bDeviceClass,
-		.bDeviceSubClass =	device_device_desc.bDeviceSubClass,
-		.bDeviceProtocol =	device_device_desc.bDeviceProtocol,
-		.bMaxPacketSize0 =	device_device_desc.bMaxPacketSize0,
-		.idVendor =		device_device_desc.idVendor,
-		.idProduct =		device_device_desc.idProduct,
-		.bcdDevice =		device_device_desc.bcdDevice,
-		.iManufacturer =	device_device_desc.iManufacturer,
-		.iProduct =		device_device_desc.iProduct,
-		.iSerialNumber =	device_device_desc.iSerialNumber,
-		.bNumConfigurations =	device_device_desc.bNumConfigurations,
-	};
-
-	int bNumConfigurations = device_device_desc.bNumConfigurations;
-	host_device_desc.configs = new struct raw_gadget_config[bNumConfigurations];
-	for (int i = 0; i < bNumConfigurations; i++) {
-		struct usb_config_descriptor temp_config = {
-			.bLength =		device_config_desc[i]->bLength,
-			.bDescriptorType =	device_config_desc[i]->bDescriptorType,
-			.wTotalLength =		device_config_desc[i]->wTotalLength,
-			.bNumInterfaces =	device_config_desc[i]->bNumInterfaces,
-			.bConfigurationValue =	device_config_desc[i]->bConfigurationValue,
-			.iConfiguration = 	device_config_desc[i]->iConfiguration,
-			.bmAttributes =		device_config_desc[i]->bmAttributes,
-			.bMaxPower =		device_config_desc[i]->MaxPower,
-		};
-		host_device_desc.configs[i].config = temp_config;
-
-		int bNumInterfaces = device_config_desc[i]->bNumInterfaces;
-		struct raw_gadget_interface *temp_interfaces =
-			new struct raw_gadget_interface[bNumInterfaces];
-		for (int j = 0; j < bNumInterfaces; j++) {
-			int num_altsetting = device_config_desc[i]->interface[j].num_altsetting;
-			struct raw_gadget_altsetting *temp_altsettings =
-				new struct raw_gadget_altsetting[num_altsetting];
-			for (int k = 0; k < num_altsetting; k++) {
-				const struct libusb_interface_descriptor temp_device_altsetting =
-					device_config_desc[i]->interface[j].altsetting[k];
-				struct usb_interface_descriptor temp_host_altsetting = {
-					.bLength =		temp_device_altsetting.bLength,
-					.bDescriptorType =	temp_device_altsetting.bDescriptorType,
-					.bInterfaceNumber =	temp_device_altsetting.bInterfaceNumber,
-					.bAlternateSetting =	temp_device_altsetting.bAlternateSetting,
-					.bNumEndpoints =	temp_device_altsetting.bNumEndpoints,
-					.bInterfaceClass =	temp_device_altsetting.bInterfaceClass,
-					.bInterfaceSubClass =	temp_device_altsetting.bInterfaceSubClass,
-					.bInterfaceProtocol =	temp_device_altsetting.bInterfaceProtocol,
-					.iInterface =		temp_device_altsetting.iInterface,
-				};
-				temp_altsettings[k].interface = temp_host_altsetting;
-
-				if (!temp_device_altsetting.bNumEndpoints) {
-					printf("InterfaceNumber %x AlternateSetting %x has no endpoint, skip\n",
-						temp_device_altsetting.bInterfaceNumber,
-						temp_device_altsetting.bAlternateSetting);
-					temp_altsettings[k].endpoints = NULL;
-					continue;
-				}
-
-				int bNumEndpoints = temp_device_altsetting.bNumEndpoints;
-				struct raw_gadget_endpoint *temp_endpoints =
-					new struct raw_gadget_endpoint[bNumEndpoints];
-				for (int l = 0; l < bNumEndpoints; l++) {
-					struct usb_endpoint_descriptor temp_endpoint = {
-						.bLength =		temp_device_altsetting.endpoint[l].bLength,
-						.bDescriptorType =	temp_device_altsetting.endpoint[l].bDescriptorType,
-						.bEndpointAddress =	temp_device_altsetting.endpoint[l].bEndpointAddress,
-						.bmAttributes =		temp_device_altsetting.endpoint[l].bmAttributes,
-						.wMaxPacketSize =	temp_device_altsetting.endpoint[l].wMaxPacketSize,
-						.bInterval =		temp_device_altsetting.endpoint[l].bInterval,
-						.bRefresh =		temp_device_altsetting.endpoint[l].bRefresh,
-						.bSynchAddress = 	temp_device_altsetting.endpoint[l].bSynchAddress,
-					};
-					temp_endpoints[l].endpoint = temp_endpoint;
-					temp_endpoints[l].thread_read = 0;
-					temp_endpoints[l].thread_write = 0;
-					memset((void *)&temp_endpoints[l].thread_info, 0,
-						sizeof(temp_endpoints[l].thread_info));
-					temp_endpoints[l].thread_info.ep_num = -1;
-				}
-				temp_altsettings[k].endpoints = temp_endpoints;
-			}
-			temp_interfaces[j].altsettings = temp_altsettings;
-			temp_interfaces[j].num_altsettings = device_config_desc[i]->interface[j].num_altsetting;
-			temp_interfaces[j].current_altsetting = 0;
-
-		}
-		host_device_desc.configs[i].interfaces = temp_interfaces;
-	}
-
-	host_device_desc.current_config = 0;
-
-	return 0;
-}
-
 int main(int argc, char **argv)
 {
 	const char *device = "fe980000.usb";
 	const char *driver = "fe980000.usb";
 	int vendor_id = 0x046d; // Logitech
 	int product_id = 0xc24f; // G29 [PS3]
+	const char *mix_rules_file = NULL;
+	const char *capture_path = NULL;
+	const char *snapshot_path = NULL;
+	const char *metrics_socket = NULL;
+	const char *metrics_textfile = NULL;
+	bool speed_override = false;
 
 	struct sigaction action;
 	memset(&action, 0, sizeof(struct sigaction));
 	action.sa_handler = handle_signal;
 	sigaction(SIGTERM, &action, NULL);
 	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGUSR1, &action, NULL);
+	sigaction(SIGUSR2, &action, NULL);
 
 	int opt, lopt, loidx;
 	const char *optstring = "hv";
@@ -171,6 +143,25 @@ int main(int argc, char **argv)
 		{"driver", required_argument, &lopt, 4},
 		{"vendor_id", required_argument, &lopt, 5},
 		{"product_id", required_argument, &lopt, 6},
+		{"async_transfers", required_argument, &lopt, 7},
+		{"reactor", no_argument, &lopt, 8},
+		{"mix_rules", required_argument, &lopt, 9},
+		{"latency", no_argument, &lopt, 10},
+		{"capture", required_argument, &lopt, 11},
+		{"realtime", no_argument, &lopt, 12},
+		{"rt_roles", required_argument, &lopt, 13},
+		{"backpressure", required_argument, &lopt, 14},
+		{"snapshot", required_argument, &lopt, 15},
+		{"proxy_ep0", no_argument, &lopt, 16},
+		{"ffb_transfers", required_argument, &lopt, 17},
+		{"enable_injection", no_argument, &lopt, 18},
+		{"injection_file", required_argument, &lopt, 19},
+		{"log_rate", required_argument, &lopt, 20},
+		{"metrics_socket", required_argument, &lopt, 21},
+		{"metrics_textfile", required_argument, &lopt, 22},
+		{"speed", required_argument, &lopt, 23},
+		{"poll_interval_us", required_argument, &lopt, 24},
+		{"scheduled_reports", no_argument, &lopt, 25},
 		{0, 0, 0, 0}
 	};
 	while ((opt = getopt_long(argc, argv, optstring, long_options, &loidx)) != -1) {
@@ -201,64 +192,218 @@ int main(int argc, char **argv)
 		case 6:
 			product_id = std::stoul(optarg, nullptr, 16);
 			break;
+		case 7:
+			async_transfers = atoi(optarg);
+			break;
+		case 8:
+			reactor_enabled = true;
+			break;
+		case 9:
+			mix_rules_file = optarg;
+			break;
+		case 10:
+			latency_enabled = true;
+			break;
+		case 11:
+			capture_path = optarg;
+			break;
+		case 12:
+			rt_enabled = true;
+			break;
+		case 13:
+			if (rt_parse_roles(optarg))
+				return 1;
+			rt_enabled = true;
+			break;
+		case 14:
+			if (backpressure_parse(optarg))
+				return 1;
+			break;
+		case 15:
+			snapshot_path = optarg;
+			break;
+		case 16:
+			local_ep0_enabled = false;
+			break;
+		case 17:
+			ffb_transfers = atoi(optarg);
+			break;
+		case 18:
+			injection_enabled = true;
+			break;
+		case 19:
+			injection_file = optarg;
+			break;
+		case 20:
+			logger_rate = atoi(optarg);
+			break;
+		case 21:
+			metrics_socket = optarg;
+			break;
+		case 22:
+			metrics_textfile = optarg;
+			break;
+		case 23:
+			if (gadget_speed_parse(optarg))
+				return 1;
+			speed_override = true;
+			break;
+		case 24:
+			poll_interval_us = atoi(optarg);
+			speed_override = true;
+			break;
+		case 25:
+			scheduled_reports = true;
+			break;
 		default:
 			usage();
 			return 1;
 		}
 	}
 
-	while (connect_device(vendor_id, product_id)) {
-		sleep(1);
+	if (injection_enabled && injection_load(injection_file.c_str()))
+		return 1;
+	logger_level = verbose_level < LOGGER_MAX_LEVEL ? verbose_level : LOGGER_MAX_LEVEL;
+
+	if (rt_enabled) {
+		if (rt_setup())
+			return 1;
+		if (verbose_level)
+			rt_print();
+	}
+
+	// With a snapshot the gadget is presented to the host right away and
+	// the wheel is opened by the re-attach thread once it is up.
+	bool pre_enumerate = snapshot_path && snapshot_load(snapshot_path) == 0 &&
+		snapshot_restore_descriptors() == 0;
+	if (pre_enumerate) {
+		if (prepare_device(vendor_id, product_id))
+			return 1;
+		printf("Presenting the wheel from %s\n", snapshot_path);
+		wheel_lost();
+	}
+	else {
+		while (connect_device(vendor_id, product_id)) {
+			sleep(1);
+		}
+		printf("Wheel Device opened successfully\n");
+		snapshot_fetch_descriptors();
 	}
-	printf("Wheel Device opened successfully\n");
+	reattach_start();
 
-	std::vector<InputDevice *> *trims = NULL;
-	while (trims == NULL) {
-		trims = InputDevice::connect(0x2341, 0x8037);
-		sleep(1);
+	// Presenting the gadget does not wait for the trims either: as many as
+	// the snapshot had are mixed with the layouts it kept, and opened by the
+	// attach thread as they arrive.
+	std::vector<InputDevice *> *trims;
+	if (pre_enumerate) {
+		trims = InputDevice::create(snapshot_trim_count());
+		printf("Expecting %ld trim devices\n", trims->size());
 	}
-	printf("Found %ld trim devices\n", trims->size());
-	for (size_t i = 0; i < trims->size(); i++) {
-		trims->at(i)->connect_device();
+	else {
+		while ((trims = InputDevice::connect(0x2341, 0x8037)) == NULL) {
+			sleep(1);
+		}
+		printf("Found %ld trim devices\n", trims->size());
 	}
-	printf("Trim Device opened successfully\n");
+
+	// Source 0 is the wheel, source 1 + i is trim i.
+	static struct hid_report_layout layouts[MIX_RULES_MAX_SOURCES];
+	const struct hid_report_layout *known_layouts[MIX_RULES_MAX_SOURCES] = {};
+	for (int i = 0; i < MIX_RULES_MAX_SOURCES; i++) {
+		bool present = i == 0 || i - 1 < (int)trims->size();
+		if (i == 0) {
+			// Read with the other descriptors of the wheel, or from the
+			// snapshot.
+			static uint8_t desc[SNAPSHOT_MAX_CONTROL];
+			int length = snapshot_report_descriptor(0x81, desc);
+			if (length > 0 && hid_report_parse(desc, length, &layouts[i]) == 0)
+				known_layouts[i] = &layouts[i];
+		}
+		else if (present) {
+			static uint8_t desc[HID_MAX_DESCRIPTOR];
+			int length = -1;
+			if (pre_enumerate)
+				length = snapshot_trim_layout(i - 1, desc);
+			else if (trims->at(i - 1)->is_online())
+				length = hid_report_fetch_descriptor(trims->at(i - 1)->handle(), 0x84, desc);
+			if (length > 0 && hid_report_parse(desc, length, &layouts[i]) == 0) {
+				known_layouts[i] = &layouts[i];
+				snapshot_record_trim_layout(i - 1, desc, length);
+				if (verbose_level >= 2)
+					hid_report_print(&layouts[i]);
+			}
+		}
+		if (present && !known_layouts[i])
+			printf("Report descriptor of source %d unavailable, assuming the default layout\n", i);
+		mixer_set_layout(&wheel_mixer, i, known_layouts[i]);
+	}
+
+	struct mix_rules rules;
+	if (mix_rules_file) {
+		if (mix_rules_load(mix_rules_file, trims->size(), known_layouts, &rules)) {
+			fprintf(stderr, "Failed to load mix rules from %s\n", mix_rules_file);
+			return 1;
+		}
+	}
+	else {
+		mix_rules_default(&rules, trims->size());
+	}
+	mixer_set_rules(&wheel_mixer, &rules);
+	if (snapshot_path) {
+		if (snapshot_trim_count() == (int)trims->size())
+			snapshot_restore_trims(&wheel_mixer, trims->size());
+		snapshot_start(snapshot_path, trims->size());
+	}
+
+	InputDevice::attach_start(trims, 0x2341, 0x8037);
+
+	if (reactor_enabled)
+		reactor_start(context);
 
 	setup_host_usb_desc();
 	printf("Setup USB config successfully\n");
+	printf("Presenting the gadget at %s speed, the wheel runs at %s speed\n",
+		gadget_speed_name(gadget_speed()), gadget_speed_name(wheel_speed));
+	if (check_host_usb_desc() && speed_override) {
+		fprintf(stderr, "Descriptors invalid at %s speed\n", gadget_speed_name(gadget_speed()));
+		return 1;
+	}
 
 	int fd = usb_raw_open();
-	usb_raw_init(fd, USB_SPEED_HIGH, driver, device);
+	usb_raw_init(fd, gadget_speed(), driver, device);
 	sleep(1);
 	usb_raw_run(fd);
 
+	if (capture_path && capture_start(capture_path))
+		return 1;
+	logger_start();
+	if (metrics_start(metrics_socket, metrics_textfile))
+		return 1;
+
 	ep0_loop(fd, trims);
 
 	close(fd);
+	reattach_stop();
+	InputDevice::attach_stop();
+	snapshot_stop();
+	reactor_stop();
+	capture_stop();
+	logger_stop();
+	metrics_stop();
+	if (latency_enabled)
+		latency_print();
+	backpressure_print();
+	ffb_print();
+	injection_print();
+	injection_free();
 
-	int bNumConfigurations = device_device_desc.bNumConfigurations;
-	for (int i = 0; i < bNumConfigurations; i++) {
-		int bNumInterfaces = device_config_desc[i]->bNumInterfaces;
-		for (int j = 0; j < bNumInterfaces; j++) {
-			int num_altsetting = device_config_desc[i]->interface[j].num_altsetting;
-			for (int k = 0; k < num_altsetting; k++) {
-				if (host_device_desc.configs[i].interfaces[j].altsettings[k].endpoints) {
-					delete[] host_device_desc.configs[i].interfaces[j].altsettings[k].endpoints;
-				}
-			}
-			delete[] host_device_desc.configs[i].interfaces[j].altsettings;
-		}
-		delete[] host_device_desc.configs[i].interfaces;
-	}
-	delete[] host_device_desc.configs;
+	free_host_usb_desc();
 	delete[] device_config_desc;
 
 	if (context && callback_handle != -1) {
 		libusb_hotplug_deregister_callback(context, callback_handle);
 	}
-	if (hotplug_monitor_thread &&
-		pthread_join(hotplug_monitor_thread, NULL)) {
-		fprintf(stderr, "Error join hotplug_monitor_thread\n");
-	}
+	discovery_stop();
 
 	return 0;
 }